@@ -0,0 +1,244 @@
+/*
+ *  acquire.c
+ *    Data-ready gated and one-shot acquisition with sample ages
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "acquire.h"
+#include "clock.h"
+#include "metrics.h"
+
+#define HTS221_DA 0x3  // H_DA and T_DA
+
+struct acquire {
+  struct sensehat *sh;
+  struct acquire_config cfg;
+  int down;  // powered down, the image has to be uploaded again
+  __u64 p_next;  // earliest the next conversion can be ready, 0 if unknown
+  __u64 h_next;
+  struct acquire_stats stats;
+};
+
+static void sleep_ns( __u64 ns ) {
+  struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+  while ( clock_nanosleep( CLOCK_MONOTONIC, 0, &ts, &ts ) == EINTR );
+}
+
+static void sleep_until( __u64 t ) {
+  struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+
+  while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+          EINTR );
+}
+
+struct acquire *acquire_new( struct sensehat *sh,
+                             const struct acquire_config *cfg ) {
+  static const struct acquire_config defaults = ACQUIRE_CONFIG_DEFAULT;
+  struct acquire *acq;
+
+  if ( cfg != NULL &&
+       (cfg->poll_min == 0 || cfg->poll_max < cfg->poll_min) ) {
+    errno = EINVAL;
+    return NULL;
+  }
+  acq = calloc( 1, sizeof(struct acquire) );
+  if ( acq == NULL ) return NULL;
+  acq->sh = sh;
+  acq->cfg = cfg != NULL ? *cfg : defaults;
+  return acq;
+}
+
+/* Read status and outputs of the pending devices, one transaction each, and
+   copy over the ones with new data. Returns those as a mask. */
+static int poll_once( struct acquire *acq, int pending,
+                      struct sensehat_sample *s ) {
+  struct sensehat_sample in;
+  int rc, fresh = 0;
+
+  if ( pending == ACQUIRE_ALL ) rc = sensehat_sample( acq->sh, &in );
+  else if ( pending == ACQUIRE_PRESSURE )
+    rc = sensehat_sample_pressure( acq->sh, &in );
+  else rc = sensehat_sample_humidity( acq->sh, &in );
+  if ( rc == -1 ) return -1;
+  acq->stats.polls++;
+
+  if ( (pending & ACQUIRE_PRESSURE) &&
+       LPS25H_STATUS_REG_P_DA_ef( in.lps25h_status ) ) {
+    s->p_raw = in.p_raw;
+    s->pressure = in.pressure;
+    s->lps25h_status = in.lps25h_status;
+    fresh |= ACQUIRE_PRESSURE;
+  }
+  if ( (pending & ACQUIRE_HUMIDITY) &&
+       (in.hts221_status & HTS221_DA) == HTS221_DA ) {
+    s->h_raw = in.h_raw;
+    s->t_raw = in.t_raw;
+    s->temperature = in.temperature;
+    s->humidity = in.humidity;
+    s->hts221_status = in.hts221_status;
+    fresh |= ACQUIRE_HUMIDITY;
+  }
+  if ( fresh != pending ) {
+    acq->stats.stale++;
+    metrics_count( METRICS_STALE, 1 );
+  }
+  return fresh;
+}
+
+/* Poll until nothing is pending, backing off between polls. p_since and
+   h_since bound the ready time of data found by the first poll. */
+static int poll_until( struct acquire *acq, struct sensehat_reading *r,
+                       int pending, __u64 p_since, __u64 h_since,
+                       __u64 deadline ) {
+  __u64 wait = acq->cfg.poll_min, t, now;
+  int fresh;
+
+  for (;;) {
+    t = clock_ns( CLOCK_MONOTONIC );
+    fresh = poll_once( acq, pending, &r->s );
+    if ( fresh == -1 ) return -1;
+    if ( fresh & ACQUIRE_PRESSURE ) r->p_time = p_since;
+    if ( fresh & ACQUIRE_HUMIDITY ) r->h_time = h_since;
+    pending &= ~fresh;
+    if ( pending == 0 ) return 0;
+
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( now >= deadline ) {
+      acq->stats.timeouts++;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    // whatever turns up next became ready after this poll
+    p_since = h_since = t;
+    sleep_ns( wait < deadline - now ? wait : deadline - now );
+    wait = wait * 2 < acq->cfg.poll_max ? wait * 2 : acq->cfg.poll_max;
+  }
+}
+
+int acquire_next( struct acquire *acq, struct sensehat_reading *r, int want ) {
+  const struct sensehat_config *cfg = sensehat_config( acq->sh );
+  __u64 p_period = sensehat_lps25h_period_ns( cfg->lps25h_odr );
+  __u64 h_period = sensehat_hts221_period_ns( cfg->hts221_odr );
+  __u64 now, next;
+
+  if ( (want & ACQUIRE_ALL) == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ( acq->down ) {
+    if ( sensehat_set_image( acq->sh, sensehat_image( acq->sh ) ) == -1 )
+      return -1;
+    acq->down = 0;
+    acq->p_next = acq->h_next = 0;
+  }
+
+  // skip the polls that cannot find anything yet
+  next = want & ACQUIRE_PRESSURE ? acq->p_next : ~0ULL;
+  if ( (want & ACQUIRE_HUMIDITY) && acq->h_next < next ) next = acq->h_next;
+  if ( next > clock_ns( CLOCK_MONOTONIC ) ) sleep_until( next );
+
+  // data waiting on the first poll is the latest conversion of a device
+  // that runs continuously, so it is at most one period old. With ODR 0
+  // its age is unknown.
+  now = clock_ns( CLOCK_MONOTONIC );
+  if ( poll_until( acq, r, want & ACQUIRE_ALL,
+                   p_period && now > p_period ? now - p_period : 0,
+                   h_period && now > h_period ? now - h_period : 0,
+                   now + acq->cfg.timeout ) == -1 )
+    return -1;
+  if ( p_period && (want & ACQUIRE_PRESSURE) )
+    acq->p_next = r->p_time + p_period;
+  if ( h_period && (want & ACQUIRE_HUMIDITY) )
+    acq->h_next = r->h_time + h_period;
+  acq->stats.samples++;
+  return 0;
+}
+
+/* Write the control registers of both devices, then read the outputs to
+   clear data available bits left from before, so that the next poll only
+   sees conversions that come after the write. The writes share one
+   transaction, the reads take one per device, see i2c_bus.h. */
+static int control( struct acquire *acq, __u8 *lps_ctrl, __u16 lps_len,
+                    __u8 *hts_ctrl, __u16 hts_len ) {
+  struct i2c_bus *bus = sensehat_bus( acq->sh );
+  __u8 lps[4], hts[5];
+  struct i2c_msg msgs[2] = {
+    { LPS25H_SAD, 0, lps_len, lps_ctrl },
+    { HTS221_SAD, 0, hts_len, hts_ctrl },
+  };
+
+  if ( i2c_bus_transfer( bus, msgs, 2 ) == -1 ) return -1;
+  acq->down = 1;
+  if ( i2c_bus_read( bus, LPS25H_SAD, LPS25H_STATUS_REG | LPS25H_reg_auto,
+                     lps, sizeof(lps) ) == -1 ||
+       i2c_bus_read( bus, HTS221_SAD, HTS221_STATUS_REG | HTS221_reg_auto,
+                     hts, sizeof(hts) ) == -1 )
+    return -1;
+  return 0;
+}
+
+static int power_down( struct acquire *acq ) {
+  __u8 lps[2] = { LPS25H_CTRL_REG1, LPS25H_CTRL_REG1_BDU_if(1) };
+  __u8 hts[2] = { HTS221_CTRL_REG1, HTS221_CTRL_REG1_BDU_if(1) };
+
+  return control( acq, lps, sizeof(lps), hts, sizeof(hts) );
+}
+
+/* CTRL_REG1 and CTRL_REG2 are adjacent on both devices: power up with ODR
+   0 and set ONE_SHOT in one write each */
+static int trigger( struct acquire *acq ) {
+  __u8 lps[3] = {
+    LPS25H_CTRL_REG1 | LPS25H_reg_auto,
+    LPS25H_CTRL_REG1_PD_if(1) | LPS25H_CTRL_REG1_BDU_if(1),
+    LPS25H_CTRL_REG2_ONE_SHOT_if(1)
+  };
+  __u8 hts[3] = {
+    HTS221_CTRL_REG1 | HTS221_reg_auto,
+    HTS221_CTRL_REG1_PD_if(1) | HTS221_CTRL_REG1_BDU_if(1),
+    HTS221_CTRL_REG2_ONE_SHOT_if(1)
+  };
+
+  if ( control( acq, lps, sizeof(lps), hts, sizeof(hts) ) == -1 ) return -1;
+  acq->stats.oneshots++;
+  return 0;
+}
+
+int acquire_oneshot( struct acquire *acq, struct sensehat_reading *r,
+                     __u64 deadline ) {
+  __u64 t0 = clock_ns( CLOCK_MONOTONIC );
+  int rc, err;
+
+  if ( trigger( acq ) == -1 ) return -1;
+  rc = poll_until( acq, r, ACQUIRE_ALL, t0, t0, deadline );
+  err = errno;
+  if ( power_down( acq ) == -1 && rc == 0 ) return -1;
+  acq->stats.powered += clock_ns( CLOCK_MONOTONIC ) - t0;
+  if ( rc == -1 ) {
+    errno = err;
+    return -1;
+  }
+  acq->stats.samples++;
+  return 0;
+}
+
+int acquire_power_down( struct acquire *acq ) {
+  return power_down( acq );
+}
+
+void acquire_stats( struct acquire *acq, struct acquire_stats *stats ) {
+  memcpy( stats, &acq->stats, sizeof(struct acquire_stats) );
+}
+
+void acquire_free( struct acquire *acq ) {
+  free( acq );
+}
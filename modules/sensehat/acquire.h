@@ -0,0 +1,94 @@
+/*
+ *  acquire.h
+ *    Data-ready gated and one-shot acquisition with sample ages
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  sensehat_sample() returns whatever is in the output registers, which may
+ *  be the same conversion as last time or, right after power up, nothing
+ *  at all. Both functions here look at the data available bits (P_DA on the
+ *  LPS25H, H_DA and T_DA on the HTS221) read in the same transaction as the
+ *  outputs, and only hand out data that is new. Block data update is set in
+ *  every image, so the outputs never mix two conversions.
+ *
+ *  acquire_next() is for the continuous modes set up by the image. It polls
+ *  with exponential backoff from cfg.poll_min up to cfg.poll_max, and gives
+ *  up with ETIMEDOUT after cfg.timeout.
+ *
+ *  acquire_oneshot() leaves both devices powered down between calls. Each
+ *  call powers them up with ODR 0, sets ONE_SHOT, polls until both have
+ *  converted or the deadline passes, and powers them down again. The next
+ *  acquire_next() uploads the image again first.
+ *
+ *  Each reading carries the earliest instant its data could have become
+ *  ready, so the age derived from it is an upper bound:
+ *   - the previous poll that still saw no data,
+ *   - the one-shot trigger, when the first poll found the conversion done,
+ *   - one output period before the poll, when data was already waiting.
+ */
+#ifndef _ACQUIRE_H_
+#define _ACQUIRE_H_
+
+#include <asm/types.h>
+
+#include "sensehat.h"
+
+#define ACQUIRE_PRESSURE 1  // LPS25H
+#define ACQUIRE_HUMIDITY 2  // HTS221, humidity and temperature
+#define ACQUIRE_ALL      (ACQUIRE_PRESSURE | ACQUIRE_HUMIDITY)
+
+struct acquire_config {
+  __u64 poll_min;  // ns before the first retry
+  __u64 poll_max;  // ns between retries at most
+  __u64 timeout;   // ns acquire_next() waits for new data
+};
+
+#define ACQUIRE_CONFIG_DEFAULT { 1000000ULL, 16000000ULL, 2000000000ULL }
+
+struct sensehat_reading {
+  struct sensehat_sample s;
+  __u64 p_time;  // CLOCK_MONOTONIC ns, pressure ready no earlier than
+  __u64 h_time;  // the same for humidity and temperature
+};
+
+struct acquire_stats {
+  unsigned long samples;   // readings handed out
+  unsigned long polls;     // status and data reads
+  unsigned long stale;     // of those, reads still short of new data
+  unsigned long oneshots;  // one-shot conversions triggered
+  unsigned long timeouts;
+  __u64 powered;           // ns spent powered up for one-shots
+};
+
+struct acquire;
+
+/* cfg may be NULL for the defaults. The handle does not own sh. */
+struct acquire *acquire_new( struct sensehat *sh,
+                             const struct acquire_config *cfg );
+
+/* Wait for new data from the devices in want (ACQUIRE_*). Fields of the
+   devices not in want are left as they were. */
+int acquire_next( struct acquire *acq, struct sensehat_reading *r, int want );
+
+/* Trigger a one-shot conversion of both devices and wait for it until the
+   CLOCK_MONOTONIC deadline, -1 and ETIMEDOUT after it */
+int acquire_oneshot( struct acquire *acq, struct sensehat_reading *r,
+                     __u64 deadline );
+
+/* Power both devices down until the next call, e.g. before a long idle */
+int acquire_power_down( struct acquire *acq );
+
+void acquire_stats( struct acquire *acq, struct acquire_stats *stats );
+void acquire_free( struct acquire *acq );
+
+/* Age in ns at now of the older of the two conversions in the reading */
+static inline __u64 sensehat_reading_age( const struct sensehat_reading *r,
+                                          __u64 now ) {
+  __u64 t = r->p_time < r->h_time ? r->p_time : r->h_time;
+
+  return now > t ? now - t : 0;
+}
+
+#endif /* _ACQUIRE_H_ */
@@ -0,0 +1,332 @@
+/*
+ *  adapt.c
+ *    Runtime choice of averaging and output data rates from measured noise,
+ *    latency demands and a current budget
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "adapt.h"
+
+/* Typical figures from the datasheets, rounded. The noise is the RMS of a
+   single internal measurement: LPS25H 0.01 mbar at 512 averages, HTS221
+   0.007 deg C at 16 and 0.03 rH at 32. Current is the powered down floor
+   plus a charge per conversion and per internal measurement (LPS25H 4 uA
+   at 1 Hz and 8 averages up to 25 uA at 512, HTS221 2 uA at 1 Hz with
+   16 + 32). */
+#define LPS_P_NOISE  0.226   // mbar
+#define HTS_T_NOISE  0.028   // deg C
+#define HTS_H_NOISE  0.17    // rH
+#define LPS_IDLE_UA  0.5
+#define LPS_CONV_UAS 3.17    // uA s per conversion
+#define LPS_MEAS_UAS 0.0417  // uA s per internal measurement
+#define HTS_IDLE_UA  0.5
+#define HTS_MEAS_UAS 0.031
+#define LPS_MEAS_NS  70000ULL
+#define HTS_MEAS_NS  100000ULL
+
+/* How far one window of measurements may move the datasheet figure */
+#define SCALE_MIN 0.25
+#define SCALE_MAX 4.0
+
+/* Only save current when it is worth a transaction and a new estimate */
+#define SAVING 0.9
+
+struct estimate {
+  unsigned long n;      // new samples since the last reset
+  double x1, x2;        // the previous two
+  double d2sum;         // sum of squared second differences
+  unsigned long nd2;
+  double mean, m2;      // Welford, for the signal deviation
+};
+
+struct adapt {
+  struct adapt_config cfg;
+  struct sensehat_config cur;
+  __u64 demand[ADAPT_DEVICES];
+  double scale[ADAPT_CHANNELS];   // measured noise over the datasheet's
+  int scaled[ADAPT_CHANNELS];
+  struct estimate est[ADAPT_CHANNELS];
+  float measured[ADAPT_CHANNELS];
+  float signal[ADAPT_CHANNELS];
+  int pending;                    // a window completed or a demand changed
+  unsigned long changes;
+};
+
+/* How well one device's settings meet the budgets, excess is the sum of
+   the relative amounts by which they are missed */
+struct fit {
+  double latency;   // excess over the demand
+  double noise;     // excess over the budgets of the device's channels
+  double current;   // uA
+};
+
+static const int device_of[ADAPT_CHANNELS] = {
+  [ADAPT_PRESSURE] = ADAPT_LPS25H,
+  [ADAPT_TEMPERATURE] = ADAPT_HTS221,
+  [ADAPT_HUMIDITY] = ADAPT_HTS221,
+};
+
+static double model_noise( const struct sensehat_config *c, int ch ) {
+  switch ( ch ) {
+    case ADAPT_PRESSURE:
+      return LPS_P_NOISE / sqrt( 8 << (2 * c->lps25h_avgp) );
+    case ADAPT_TEMPERATURE:
+      return HTS_T_NOISE / sqrt( 2 << c->hts221_avgt );
+    default:
+      return HTS_H_NOISE / sqrt( 4 << c->hts221_avgh );
+  }
+}
+
+static __u64 conversion_ns( const struct sensehat_config *c, int dev ) {
+  if ( dev == ADAPT_LPS25H )
+    return (8ULL << (2 * c->lps25h_avgp)) * LPS_MEAS_NS;
+  return ((2ULL << c->hts221_avgt) + (4ULL << c->hts221_avgh)) * HTS_MEAS_NS;
+}
+
+static __u64 period_ns( const struct sensehat_config *c, int dev ) {
+  return dev == ADAPT_LPS25H ? sensehat_lps25h_period_ns( c->lps25h_odr )
+                             : sensehat_hts221_period_ns( c->hts221_odr );
+}
+
+static double current_ua( const struct sensehat_config *c, int dev ) {
+  double hz = 1e9 / period_ns( c, dev );
+
+  if ( dev == ADAPT_LPS25H )
+    return LPS_IDLE_UA + hz * (LPS_CONV_UAS + LPS_MEAS_UAS *
+                               (8 << (2 * c->lps25h_avgp)));
+  return HTS_IDLE_UA + hz * HTS_MEAS_UAS *
+         ((2 << c->hts221_avgt) + (4 << c->hts221_avgh));
+}
+
+static double expected_noise( struct adapt *a, const struct sensehat_config *c,
+                              int ch ) {
+  return a->scale[ch] * model_noise( c, ch );
+}
+
+static void fit( struct adapt *a, const struct sensehat_config *c, int dev,
+                 struct fit *f ) {
+  __u64 latency = period_ns( c, dev ) + conversion_ns( c, dev );
+  double excess;
+
+  excess = (double) latency / a->demand[dev] - 1.0;
+  f->latency = excess > 0 ? excess : 0;
+  f->noise = 0;
+  for (int ch = 0; ch < ADAPT_CHANNELS; ch++) {
+    if ( device_of[ch] != dev ) continue;
+    excess = expected_noise( a, c, ch ) / a->cfg.noise[ch] - 1.0;
+    if ( excess > 0 ) f->noise += excess;
+  }
+  f->current = current_ua( c, dev );
+}
+
+/* Lexicographic on latency, noise and current excess, then current */
+static int better( struct adapt *a, const struct fit *x, const struct fit *y,
+                   double saving ) {
+  double cx = x->current / a->cfg.current - 1.0;
+  double cy = y->current / a->cfg.current - 1.0;
+
+  if ( cx < 0 ) cx = 0;
+  if ( cy < 0 ) cy = 0;
+  if ( x->latency != y->latency ) return x->latency < y->latency;
+  if ( x->noise != y->noise ) return x->noise < y->noise;
+  if ( cx != cy ) return cx < cy;
+  return x->current < saving * y->current;
+}
+
+static void joint( const struct fit *lps, const struct fit *hts,
+                   struct fit *f ) {
+  f->latency = lps->latency + hts->latency;
+  f->noise = lps->noise + hts->noise;
+  f->current = lps->current + hts->current;
+}
+
+/* 16 LPS25H settings against 192 HTS221 ones. The devices only interact
+   through the current budget, so each is fitted once and the pairs are
+   combined. A conversion has to finish within its output period. */
+static void choose( struct adapt *a, struct sensehat_config *best ) {
+  struct sensehat_config lps[16], hts[192];
+  struct fit lfit[16], hfit[192], f, fbest;
+  int nl = 0, nh = 0, have = 0;
+  struct sensehat_config c = a->cur;
+
+  for (c.lps25h_odr = 1; c.lps25h_odr <= LPS25H_ODR_MAX; c.lps25h_odr++)
+    for (c.lps25h_avgp = 0; c.lps25h_avgp <= LPS25H_AVGP_MAX; c.lps25h_avgp++)
+      if ( conversion_ns( &c, ADAPT_LPS25H ) < period_ns( &c, ADAPT_LPS25H ) ) {
+        lps[nl] = c;
+        fit( a, &c, ADAPT_LPS25H, &lfit[nl++] );
+      }
+  c = a->cur;
+  for (c.hts221_odr = 1; c.hts221_odr <= HTS221_ODR_MAX; c.hts221_odr++)
+    for (c.hts221_avgt = 0; c.hts221_avgt <= HTS221_AVGT_MAX; c.hts221_avgt++)
+      for (c.hts221_avgh = 0; c.hts221_avgh <= HTS221_AVGH_MAX;
+           c.hts221_avgh++)
+        if ( conversion_ns( &c, ADAPT_HTS221 ) <
+             period_ns( &c, ADAPT_HTS221 ) ) {
+          hts[nh] = c;
+          fit( a, &c, ADAPT_HTS221, &hfit[nh++] );
+        }
+
+  for (int i = 0; i < nl; i++) {
+    for (int j = 0; j < nh; j++) {
+      joint( &lfit[i], &hfit[j], &f );
+      if ( have && !better( a, &f, &fbest, 1.0 ) ) continue;
+      fbest = f;
+      best->lps25h_odr = lps[i].lps25h_odr;
+      best->lps25h_avgp = lps[i].lps25h_avgp;
+      best->hts221_odr = hts[j].hts221_odr;
+      best->hts221_avgt = hts[j].hts221_avgt;
+      best->hts221_avgh = hts[j].hts221_avgh;
+      have = 1;
+    }
+  }
+}
+
+static void reset_estimate( struct adapt *a, int dev ) {
+  for (int ch = 0; ch < ADAPT_CHANNELS; ch++)
+    if ( device_of[ch] == dev )
+      memset( &a->est[ch], 0, sizeof(struct estimate) );
+}
+
+struct adapt *adapt_new( const struct adapt_config *cfg,
+                         const struct sensehat_config *initial ) {
+  static const struct adapt_config defaults = ADAPT_CONFIG_DEFAULT;
+  struct adapt *a;
+
+  a = calloc( 1, sizeof(struct adapt) );
+  if ( a == NULL ) return NULL;
+  a->cfg = cfg != NULL ? *cfg : defaults;
+  a->cur = *initial;
+  for (int ch = 0; ch < ADAPT_CHANNELS; ch++) {
+    a->scale[ch] = 1.0;
+    if ( !(a->cfg.noise[ch] > 0) ) goto invalid;
+  }
+  for (int dev = 0; dev < ADAPT_DEVICES; dev++) {
+    a->demand[dev] = a->cfg.latency[dev];
+    if ( a->demand[dev] == 0 || period_ns( initial, dev ) == 0 ) goto invalid;
+  }
+  if ( !(a->cfg.current > 0) || a->cfg.window < 2 ) goto invalid;
+  // settle on the model before anything is measured
+  a->pending = 1;
+  return a;
+
+invalid:
+  free( a );
+  errno = EINVAL;
+  return NULL;
+}
+
+void adapt_demand( struct adapt *a, int device, __u64 latency ) {
+  if ( device < 0 || device >= ADAPT_DEVICES ) return;
+  if ( latency == 0 ) latency = a->cfg.latency[device];
+  if ( latency != a->demand[device] ) a->pending = 1;
+  a->demand[device] = latency;
+}
+
+static void window_done( struct adapt *a, int ch ) {
+  struct estimate *e = &a->est[ch];
+  double measured = sqrt( e->d2sum / (6.0 * e->nd2) );
+  double ratio = measured / model_noise( &a->cur, ch );
+
+  if ( ratio < SCALE_MIN ) ratio = SCALE_MIN;
+  if ( ratio > SCALE_MAX ) ratio = SCALE_MAX;
+  a->scale[ch] = a->scaled[ch] ? 0.75 * a->scale[ch] + 0.25 * ratio : ratio;
+  a->scaled[ch] = 1;
+  a->measured[ch] = (float) measured;
+  a->signal[ch] = (float) sqrt( e->m2 / (e->n - 1) );
+  memset( e, 0, sizeof(struct estimate) );
+  a->pending = 1;
+}
+
+/* A second difference of white noise has variance 6 sigma^2 */
+static void estimate_add( struct adapt *a, int ch, double x ) {
+  struct estimate *e = &a->est[ch];
+  double d;
+
+  if ( e->n >= 2 ) {
+    d = x - 2 * e->x1 + e->x2;
+    e->d2sum += d * d;
+    e->nd2++;
+  }
+  e->x2 = e->x1;
+  e->x1 = x;
+  e->n++;
+  d = x - e->mean;
+  e->mean += d / e->n;
+  e->m2 += d * (x - e->mean);
+  if ( e->nd2 >= a->cfg.window ) window_done( a, ch );
+}
+
+void adapt_add( struct adapt *a, const struct sensehat_sample *s, int fresh ) {
+  if ( fresh & (1 << ADAPT_LPS25H) )
+    estimate_add( a, ADAPT_PRESSURE, s->pressure );
+  if ( fresh & (1 << ADAPT_HTS221) ) {
+    estimate_add( a, ADAPT_TEMPERATURE, s->temperature );
+    estimate_add( a, ADAPT_HUMIDITY, s->humidity );
+  }
+}
+
+int adapt_update( struct adapt *a, struct sensehat *sh ) {
+  struct sensehat_config best = a->cur;
+  struct sensehat_image img;
+  struct fit lf, hf, fcur, fbest;
+
+  if ( !a->pending ) return 0;
+  a->pending = 0;
+
+  choose( a, &best );
+  fit( a, &a->cur, ADAPT_LPS25H, &lf );
+  fit( a, &a->cur, ADAPT_HTS221, &hf );
+  joint( &lf, &hf, &fcur );
+  fit( a, &best, ADAPT_LPS25H, &lf );
+  fit( a, &best, ADAPT_HTS221, &hf );
+  joint( &lf, &hf, &fbest );
+  if ( memcmp( &best, &a->cur, sizeof(best) ) == 0 ||
+       !better( a, &fbest, &fcur, SAVING ) )
+    return 0;
+
+  if ( sensehat_image_build( &img, &best ) == -1 ||
+       sensehat_set_image( sh, &img ) == -1 )
+    return -1;
+  if ( best.lps25h_odr != a->cur.lps25h_odr ||
+       best.lps25h_avgp != a->cur.lps25h_avgp )
+    reset_estimate( a, ADAPT_LPS25H );
+  if ( best.hts221_odr != a->cur.hts221_odr ||
+       best.hts221_avgt != a->cur.hts221_avgt ||
+       best.hts221_avgh != a->cur.hts221_avgh )
+    reset_estimate( a, ADAPT_HTS221 );
+  a->cur = best;
+  a->changes++;
+  return 1;
+}
+
+void adapt_report( struct adapt *a, struct adapt_report *r ) {
+  memset( r, 0, sizeof(struct adapt_report) );
+  r->cfg = a->cur;
+  for (int ch = 0; ch < ADAPT_CHANNELS; ch++) {
+    double noise = expected_noise( a, &a->cur, ch );
+
+    r->noise[ch] = (float) noise;
+    r->measured[ch] = a->measured[ch];
+    r->signal[ch] = a->signal[ch];
+    if ( noise > a->cfg.noise[ch] ) r->over |= ADAPT_OVER_NOISE;
+  }
+  for (int dev = 0; dev < ADAPT_DEVICES; dev++) {
+    r->latency[dev] = period_ns( &a->cur, dev ) + conversion_ns( &a->cur, dev );
+    r->demand[dev] = a->demand[dev];
+    r->current += current_ua( &a->cur, dev );
+    if ( r->latency[dev] > r->demand[dev] ) r->over |= ADAPT_OVER_LATENCY;
+  }
+  if ( r->current > a->cfg.current ) r->over |= ADAPT_OVER_CURRENT;
+  r->changes = a->changes;
+}
+
+void adapt_free( struct adapt *a ) {
+  free( a );
+}
@@ -0,0 +1,102 @@
+/*
+ *  adapt.h
+ *    Runtime choice of averaging and output data rates from measured noise,
+ *    latency demands and a current budget
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The controller keeps a model of each device:
+ *   - noise falls with the square root of the internal averages;
+ *   - current grows with the output rate times the averages;
+ *   - the latency from a change to a reading that shows it is one output
+ *     period plus the conversion time.
+ *  The figures come from the typical values in the datasheets. The noise
+ *  figure is corrected per channel with what is measured on the running
+ *  device: the second differences of consecutive new samples cancel any
+ *  linear trend, so a slowly moving signal is not mistaken for noise.
+ *
+ *  adapt_update() picks the settings that meet the constraints below,
+ *  each taking precedence over the ones after it:
+ *   1. the latency demands,
+ *   2. the noise budgets,
+ *   3. the current budget.
+ *  Among the settings that meet all three it takes the one with the lowest
+ *  current. When no setting meets them all it takes the one that misses by
+ *  the least, and the report flags the budgets that are missed. A change
+ *  that only saves current is made if it saves at least a tenth, so noise
+ *  estimates near a boundary do not flip the settings back and forth.
+ *
+ *  The new settings are uploaded with sensehat_set_image(), which writes
+ *  RES_CONF, AV_CONF and CTRL_REG1 in one transaction.
+ */
+#ifndef _ADAPT_H_
+#define _ADAPT_H_
+
+#include <asm/types.h>
+
+#include "sensehat.h"
+
+enum {
+  ADAPT_PRESSURE,
+  ADAPT_TEMPERATURE,
+  ADAPT_HUMIDITY,
+  ADAPT_CHANNELS
+};
+
+enum {
+  ADAPT_LPS25H,   // pressure
+  ADAPT_HTS221,   // temperature and humidity
+  ADAPT_DEVICES
+};
+
+#define ADAPT_OVER_LATENCY 1
+#define ADAPT_OVER_NOISE   2
+#define ADAPT_OVER_CURRENT 4
+
+struct adapt_config {
+  float noise[ADAPT_CHANNELS];   // RMS budgets: mbar, deg C, rH
+  double current;                // uA budget for both devices together
+  __u64 latency[ADAPT_DEVICES];  // ns, until adapt_demand() says otherwise
+  unsigned long window;          // new samples per noise estimate
+};
+
+#define ADAPT_CONFIG_DEFAULT { { 0.02f, 0.02f, 0.1f }, 30.0, \
+                               { 2000000000ULL, 2000000000ULL }, 32 }
+
+struct adapt_report {
+  struct sensehat_config cfg;      // settings in use
+  float noise[ADAPT_CHANNELS];     // expected RMS noise with them
+  float measured[ADAPT_CHANNELS];  // RMS noise over the last window, or 0
+  float signal[ADAPT_CHANNELS];    // standard deviation over the window
+  __u64 latency[ADAPT_DEVICES];    // ns, output period plus conversion
+  __u64 demand[ADAPT_DEVICES];     // ns, latency asked for
+  double current;                  // estimated uA of both devices
+  int over;                        // ADAPT_OVER_* for budgets missed
+  unsigned long changes;           // times the settings were changed
+};
+
+struct adapt;
+
+/* cfg may be NULL for the defaults, initial is the configuration the
+   devices run with now, e.g. sensehat_config() */
+struct adapt *adapt_new( const struct adapt_config *cfg,
+                         const struct sensehat_config *initial );
+
+/* Latency a consumer needs from a device, in ns */
+void adapt_demand( struct adapt *a, int device, __u64 latency );
+
+/* Feed a sample. fresh has bit ADAPT_LPS25H and/or ADAPT_HTS221 set for
+   the devices whose part of the sample is a new conversion. */
+void adapt_add( struct adapt *a, const struct sensehat_sample *s, int fresh );
+
+/* Decide once a noise window is complete or a demand changed, and upload
+   new settings if they are better. Returns 1 if the settings changed, 0
+   if not, -1 and errno if the upload failed. */
+int adapt_update( struct adapt *a, struct sensehat *sh );
+
+void adapt_report( struct adapt *a, struct adapt_report *r );
+void adapt_free( struct adapt *a );
+
+#endif /* _ADAPT_H_ */
@@ -0,0 +1,99 @@
+/*
+ *  alloc_count.c
+ *    Debug counter of heap allocations, to check that a daemon allocates
+ *    nothing once it is running
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "alloc_count.h"
+
+// the allocator of glibc under the names it keeps for this
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+extern void __libc_free( void *ptr );
+extern void *__libc_memalign( size_t alignment, size_t size );
+extern void *__libc_valloc( size_t size );
+extern void *__libc_pvalloc( size_t size );
+
+static unsigned long allocs, frees;
+static int forbidden;
+
+static void count( void ) {
+  __atomic_add_fetch( &allocs, 1, __ATOMIC_RELAXED );
+  if ( __atomic_load_n( &forbidden, __ATOMIC_RELAXED ) ) abort();
+}
+
+void *malloc( size_t size ) {
+  count();
+  return __libc_malloc( size );
+}
+
+void *calloc( size_t n, size_t size ) {
+  count();
+  return __libc_calloc( n, size );
+}
+
+void *realloc( void *ptr, size_t size ) {
+  count();
+  return __libc_realloc( ptr, size );
+}
+
+/* The aligned ones too, e.g. the sample pool and the ingest workers are
+   allocated with posix_memalign() */
+int posix_memalign( void **memptr, size_t alignment, size_t size ) {
+  int err = errno;
+  void *p;
+
+  if ( alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+       alignment % sizeof(void *) != 0 )
+    return EINVAL;
+  count();
+  p = __libc_memalign( alignment, size );
+  if ( p == NULL ) {
+    errno = err;
+    return ENOMEM;
+  }
+  *memptr = p;
+  return 0;
+}
+
+void *aligned_alloc( size_t alignment, size_t size ) {
+  count();
+  return __libc_memalign( alignment, size );
+}
+
+void *memalign( size_t alignment, size_t size ) {
+  count();
+  return __libc_memalign( alignment, size );
+}
+
+void *valloc( size_t size ) {
+  count();
+  return __libc_valloc( size );
+}
+
+void *pvalloc( size_t size ) {
+  count();
+  return __libc_pvalloc( size );
+}
+
+void free( void *ptr ) {
+  if ( ptr != NULL ) __atomic_add_fetch( &frees, 1, __ATOMIC_RELAXED );
+  __libc_free( ptr );
+}
+
+void alloc_stats( struct alloc_stats *st ) {
+  st->allocs = __atomic_load_n( &allocs, __ATOMIC_RELAXED );
+  st->frees = __atomic_load_n( &frees, __ATOMIC_RELAXED );
+}
+
+void alloc_forbid( int forbid ) {
+  __atomic_store_n( &forbidden, forbid, __ATOMIC_RELAXED );
+}
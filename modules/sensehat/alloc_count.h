@@ -0,0 +1,35 @@
+/*
+ *  alloc_count.h
+ *    Debug counter of heap allocations, to check that a daemon allocates
+ *    nothing once it is running
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  alloc_count.c defines malloc(), calloc(), realloc(), the memalign
+ *  family and free() and passes them on to those of glibc, counting as it
+ *  goes. The C library calls them through the same symbols, so the
+ *  allocations it makes for the program, e.g. for getaddrinfo() or the
+ *  buffer of a FILE, are counted too. mmap() is not.
+ *
+ *  It is kept out of libsensehat.a, where it would be pulled in by the
+ *  first member calling malloc(), and is linked only into what asks for
+ *  it: bench/bench_soak, and sensehatd when built with -DALLOC_CHECK, e.g.
+ *    make clean all CFLAGS="-g -O2 -Wall -DALLOC_CHECK"
+ */
+#ifndef _ALLOC_COUNT_H_
+#define _ALLOC_COUNT_H_
+
+struct alloc_stats {
+  unsigned long allocs;  // malloc, calloc and realloc calls
+  unsigned long frees;   // free calls on other than NULL
+};
+
+void alloc_stats( struct alloc_stats *st );
+
+/* While forbidden, any allocation abort()s, so the core dump shows the
+   caller that made it */
+void alloc_forbid( int forbid );
+
+#endif /* _ALLOC_COUNT_H_ */
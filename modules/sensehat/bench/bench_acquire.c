@@ -0,0 +1,138 @@
+/*
+ *  bench_acquire.c
+ *    Freshness of data-ready gated reads against plain sensehat_sample()
+ *    calls at twice the ODR, and latency, bus cost and powered time of
+ *    one-shot readings on the simulated sense-hat. The simulated
+ *    environment changes with every conversion, so a repeated raw value is
+ *    a stale read.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "clock.h"
+#include "i2c_sim.h"
+#include "frame_pacer.h"
+#include "acquire.h"
+
+#define NSAMPLES  40
+#define NONESHOTS 20
+#define TRIGGER_HZ 10.0
+
+static void drifting_env( void *arg, __u64 now, struct i2c_sim_env *env ) {
+  double ms = now / 1e6;
+
+  env->pressure = 1000.0 + (ms - (__u64) (ms / 1e5) * 1e5) * 1e-3;
+  env->temperature = 20.0 + (ms - (__u64) (ms / 1e4) * 1e4) * 1e-3;
+  env->humidity = 40.0 + (ms - (__u64) (ms / 1e4) * 1e4) * 1e-3;
+}
+
+static int same( const struct sensehat_sample *a,
+                 const struct sensehat_sample *b ) {
+  return a->p_raw == b->p_raw || a->h_raw == b->h_raw;
+}
+
+int main( void ) {
+  struct sensehat_sample prev = { 0 }, s;
+  struct sensehat_reading r;
+  struct acquire_stats st;
+  struct frame_pacer fp;
+  struct acquire *acq;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  unsigned long naive_stale = 0, gated_stale = 0, late = 0, xfers;
+  __u64 age, age_max = 0, age_sum = 0, lat, lat_max = 0, lat_sum = 0, t0;
+  double elapsed;
+  int rc;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) return 1;
+  i2c_sim_set_env_fn( bus, drifting_env, NULL );
+  sh = sensehat_open( bus, NULL );
+  acq = sh != NULL ? acquire_new( sh, NULL ) : NULL;
+  if ( acq == NULL ) {
+    perror( "open" );
+    return 1;
+  }
+
+  // what the old loops do: read whatever is there, here at twice the ODR
+  frame_pacer_init( &fp, 25.0 );
+  for (int i = 0; i < NSAMPLES; i++) {
+    frame_pacer_wait( &fp );
+    sensehat_sample( sh, &s );
+    if ( i > 0 && same( &s, &prev ) ) naive_stale++;
+    prev = s;
+  }
+
+  // gated on data available
+  i2c_bus_reset_stats( bus );
+  for (int i = 0; i < NSAMPLES; i++) {
+    if ( acquire_next( acq, &r, ACQUIRE_ALL ) == -1 ) {
+      perror( "acquire_next" );
+      return 1;
+    }
+    age = sensehat_reading_age( &r, clock_ns( CLOCK_MONOTONIC ) );
+    age_sum += age;
+    if ( age > age_max ) age_max = age;
+    if ( same( &r.s, &prev ) ) gated_stale++;
+    prev = r.s;
+  }
+  acquire_stats( acq, &st );
+  printf( "continuous, ODR 12.5 Hz, %d samples each\n", NSAMPLES );
+  printf( "  plain reads at 25 Hz   %lu stale\n", naive_stale );
+  printf( "  data-ready gated       %lu stale, %.1f polls/sample, "
+          "age bound mean %.1f max %.1f ms\n", gated_stale,
+          (double) st.polls / st.samples, age_sum / 1e6 / NSAMPLES,
+          age_max / 1e6 );
+
+  // one-shot readings at trigger times, powered down in between
+  i2c_bus_reset_stats( bus );
+  frame_pacer_init( &fp, TRIGGER_HZ );
+  age_sum = age_max = 0;
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NONESHOTS; i++) {
+    __u64 start;
+
+    frame_pacer_wait( &fp );
+    start = clock_ns( CLOCK_MONOTONIC );
+    if ( acquire_oneshot( acq, &r, start + 100000000ULL ) == -1 ) {
+      perror( "acquire_oneshot" );
+      return 1;
+    }
+    lat = clock_ns( CLOCK_MONOTONIC ) - start;
+    lat_sum += lat;
+    if ( lat > lat_max ) lat_max = lat;
+    age = sensehat_reading_age( &r, clock_ns( CLOCK_MONOTONIC ) );
+    if ( age > age_max ) age_max = age;
+    if ( same( &r.s, &prev ) ) gated_stale++;
+    prev = r.s;
+  }
+  elapsed = clock_ns( CLOCK_MONOTONIC ) - t0;
+  xfers = bus->transfers;
+  acquire_stats( acq, &st );
+  printf( "one-shot, %d triggers at %.0f Hz\n", NONESHOTS, TRIGGER_HZ );
+  printf( "  latency mean %.1f max %.1f ms, age bound max %.1f ms\n",
+          lat_sum / 1e6 / NONESHOTS, lat_max / 1e6, age_max / 1e6 );
+  printf( "  %.1f transactions/reading, powered %.0f%% of the time\n",
+          (double) xfers / NONESHOTS, 100.0 * st.powered / elapsed );
+
+  // a deadline shorter than the conversion fails and leaves it powered down
+  rc = acquire_oneshot( acq, &r, clock_ns( CLOCK_MONOTONIC ) + 5000000ULL );
+  if ( rc == 0 || errno != ETIMEDOUT ) late++;
+  printf( "  5 ms deadline: %s\n", rc == -1 ? "timed out" : "met" );
+
+  // back to continuous mode
+  if ( acquire_next( acq, &r, ACQUIRE_ALL ) == -1 ) late++;
+  else if ( same( &r.s, &prev ) ) gated_stale++;
+  printf( "stale readings handed out: %lu\n", gated_stale );
+
+  acquire_free( acq );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return gated_stale == 0 && late == 0 ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+/*
+ *  bench_adapt.c
+ *    The adaptive controller on the simulated sense-hat, on a virtual
+ *    clock. The simulated devices are noisier than the datasheet figures
+ *    the controller starts from. A consumer asks for fast pressure for a
+ *    while, then goes away again. For each phase the bench shows the
+ *    settings chosen, the expected and measured noise, the actual error
+ *    against the simulated environment, the latency and the estimated
+ *    current, next to the fixed settings of the default image. Settings
+ *    are LPS25H ODR/AVGP and HTS221 ODR/AVGT/AVGH.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "LPS25H.h"
+#include "i2c_sim.h"
+#include "adapt.h"
+
+#define PHASE_NS (600 * 1000000000ULL)  // 10 min of virtual time
+
+static __u64 vclock = 1000000000ULL;
+
+static __u64 virtual_clock( void *arg ) {
+  return vclock;
+}
+
+/* Slow swings, small next to the noise within a window */
+static void truth( __u64 now, struct i2c_sim_env *env ) {
+  double t = now / 1e9;
+
+  env->pressure = 1013.25 + 2 * sin( t / 3000 );
+  env->temperature = 18 + 3 * sin( t / 5000 );
+  env->humidity = 55 + 10 * cos( t / 4000 );
+}
+
+static void sim_env( void *arg, __u64 now, struct i2c_sim_env *env ) {
+  truth( now, env );
+}
+
+struct phase {
+  const char *name;
+  __u64 p_demand;  // 0 for the configured default
+};
+
+struct error {
+  double sq[ADAPT_CHANNELS];
+  unsigned long n[ADAPT_CHANNELS];
+};
+
+static void add_error( struct error *e, int ch, double got, double want ) {
+  e->sq[ch] += (got - want) * (got - want);
+  e->n[ch]++;
+}
+
+static void print_row( const char *name, const struct adapt_report *r,
+                       const struct error *e ) {
+  printf( "%-14s %d/%d %d/%d/%d", name, r->cfg.lps25h_odr, r->cfg.lps25h_avgp,
+          r->cfg.hts221_odr, r->cfg.hts221_avgt, r->cfg.hts221_avgh );
+  for (int ch = 0; ch < ADAPT_CHANNELS; ch++)
+    printf( " %7.4f/%7.4f/%7.4f", r->noise[ch], r->measured[ch],
+            e->n[ch] ? sqrt( e->sq[ch] / e->n[ch] ) : 0.0 );
+  printf( " %6.0f/%-6.0f %7.1f%s%s%s\n", r->latency[ADAPT_LPS25H] / 1e6,
+          r->latency[ADAPT_HTS221] / 1e6, r->current,
+          r->over & ADAPT_OVER_LATENCY ? " over latency" : "",
+          r->over & ADAPT_OVER_NOISE ? " over noise" : "",
+          r->over & ADAPT_OVER_CURRENT ? " over current" : "" );
+}
+
+int main( void ) {
+  static const struct phase phases[] = {
+    { "idle", 0 },
+    { "fast pressure", 100000000ULL },
+    { "idle again", 0 },
+  };
+  // 1.5 times the single measurement noise the controller assumes
+  struct i2c_sim_env noise = { 0.34f, 0.042f, 0.25f };
+  struct adapt_report rep;
+  struct adapt *a;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  __u64 lps_next, hts_next, end;
+  int rc = 0;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) return 1;
+  i2c_sim_set_clock( bus, virtual_clock, NULL );
+  i2c_sim_set_env_fn( bus, sim_env, NULL );
+  i2c_sim_set_noise( bus, &noise );
+  sh = sensehat_open( bus, NULL );
+  a = sh != NULL ? adapt_new( NULL, sensehat_config( sh ) ) : NULL;
+  if ( a == NULL ) {
+    perror( "open" );
+    return 1;
+  }
+
+  printf( "%-14s %-9s %-23s %-23s %-23s %-13s %7s\n", "phase",
+          "settings", "mbar expect/meas/act", "degC expect/meas/act",
+          "rH expect/meas/act", "latency ms", "uA" );
+  adapt_report( a, &rep );
+  rep.over = 0;
+  print_row( "default image", &rep, &(struct error) { { 0 } } );
+
+  lps_next = vclock;
+  hts_next = vclock;
+  for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+    struct error err = { { 0 } };
+
+    adapt_demand( a, ADAPT_LPS25H, phases[p].p_demand );
+    end = vclock + PHASE_NS;
+    while ( vclock < end ) {
+      const struct sensehat_config *cfg = sensehat_config( sh );
+      struct i2c_sim_env want;
+      struct sensehat_sample s;
+      int fresh = 0;
+
+      vclock = lps_next < hts_next ? lps_next : hts_next;
+      truth( vclock, &want );
+      // read just after the conversion so that it is always there
+      vclock += 1000;
+      if ( vclock >= lps_next ) {
+        if ( sensehat_sample_pressure( sh, &s ) == -1 ) goto fail;
+        if ( LPS25H_STATUS_REG_P_DA_ef( s.lps25h_status ) ) {
+          fresh |= 1 << ADAPT_LPS25H;
+          add_error( &err, ADAPT_PRESSURE, s.pressure, want.pressure );
+        }
+        lps_next += sensehat_lps25h_period_ns( cfg->lps25h_odr );
+      }
+      if ( vclock >= hts_next ) {
+        if ( sensehat_sample_humidity( sh, &s ) == -1 ) goto fail;
+        if ( (s.hts221_status & 3) == 3 ) {
+          fresh |= 1 << ADAPT_HTS221;
+          add_error( &err, ADAPT_TEMPERATURE, s.temperature,
+                     want.temperature );
+          add_error( &err, ADAPT_HUMIDITY, s.humidity, want.humidity );
+        }
+        hts_next += sensehat_hts221_period_ns( cfg->hts221_odr );
+      }
+      adapt_add( a, &s, fresh );
+
+      switch ( adapt_update( a, sh ) ) {
+        case -1:
+          goto fail;
+        case 1:
+          // the conversion grid restarts with the upload
+          lps_next = vclock + sensehat_lps25h_period_ns( cfg->lps25h_odr );
+          hts_next = vclock + sensehat_hts221_period_ns( cfg->hts221_odr );
+          memset( &err, 0, sizeof(err) );
+          break;
+      }
+    }
+    adapt_report( a, &rep );
+    print_row( phases[p].name, &rep, &err );
+    // current gives way to latency, the other two have to hold
+    if ( rep.over & (ADAPT_OVER_LATENCY | ADAPT_OVER_NOISE) ) rc = 1;
+  }
+  printf( "settings changed %lu times\n", rep.changes );
+
+  adapt_free( a );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return rc;
+
+fail:
+  perror( "bench_adapt" );
+  return 1;
+}
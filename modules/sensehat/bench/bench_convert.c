@@ -0,0 +1,150 @@
+/*
+ *  bench_convert.c
+ *    Accuracy and throughput of the fixed-point batch conversion kernels
+ *    against the float formula from show_readings()
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "clock.h"
+#include "convert.h"
+
+#define NSAMPLES (1 << 20)
+#define ROUNDS   20
+
+/* Calibration blocks from the simulated HTS221 and a real sense-hat */
+static const __u8 blocks[][HTS221_CAL_SIZE] = {
+  { 0x28, 0xa0, 0x78, 0x18, 0x00, 0x04, 0x48, 0xf4,
+    0x00, 0x00, 0x28, 0x23, 0xc8, 0x00, 0x70, 0x03 },
+  { 0x32, 0x8c, 0x9e, 0x1f, 0x00, 0x85, 0xf3, 0xff,
+    0x00, 0x00, 0x2e, 0xd3, 0xfe, 0xff, 0xa3, 0x02 },
+};
+
+struct float_cal {
+  __s16 H0_T0_OUT, H1_T0_OUT, T0_OUT, T1_OUT;
+  float H0_rH, H1_rH, T0_degC, T1_degC;
+};
+
+static void float_cal_init( struct float_cal *f, const __u8 *cal ) {
+  f->T0_degC = (float) ((((__u16) cal[5] & 0x3) << 8) | cal[2]) / 8.0f;
+  f->T1_degC = (float) ((((__u16) cal[5] & 0xc) << 6) | cal[3]) / 8.0f;
+  f->H0_T0_OUT = (__s16) (cal[6] | (cal[7] << 8));
+  f->H1_T0_OUT = (__s16) (cal[10] | (cal[11] << 8));
+  f->T0_OUT = (__s16) (cal[12] | (cal[13] << 8));
+  f->T1_OUT = (__s16) (cal[14] | (cal[15] << 8));
+  f->H0_rH = (float) cal[0] / 2.0f;
+  f->H1_rH = (float) cal[1] / 2.0f;
+}
+
+/* The per sample formulas of tests/sensehat_sensor_test.c */
+static void float_convert( const struct float_cal *f, const __s16 *t_raw,
+                           const __s16 *h_raw, const __s32 *p_raw, float *t,
+                           float *h, float *p, size_t n ) {
+  for (size_t i = 0; i < n; i++) {
+    p[i] = (float) (p_raw[i]) / 4096.0f;
+    t[i] = f->T0_degC + (((float) (t_raw[i]) - f->T0_OUT) /
+           (f->T1_OUT - f->T0_OUT)) * (f->T1_degC - f->T0_degC);
+    h[i] = f->H0_rH + (((float) (h_raw[i]) - f->H0_T0_OUT) /
+           (f->H1_T0_OUT - f->H0_T0_OUT)) * (f->H1_rH - f->H0_rH);
+  }
+}
+
+/* Largest difference in milli-units against an exact double reference */
+static double max_error( const __s32 *fixed, const float *flt, size_t n,
+                         double *float_err, const double *exact ) {
+  double err = 0.0;
+
+  *float_err = 0.0;
+  for (size_t i = 0; i < n; i++) {
+    double e = fabs( fixed[i] - exact[i] );
+    double fe = fabs( flt[i] * 1000.0 - exact[i] );
+
+    if ( e > err ) err = e;
+    if ( fe > *float_err ) *float_err = fe;
+  }
+  return err;
+}
+
+int main( void ) {
+  __s16 *t_raw = malloc( NSAMPLES * sizeof(__s16) );
+  __s16 *h_raw = malloc( NSAMPLES * sizeof(__s16) );
+  __s32 *p_raw = malloc( NSAMPLES * sizeof(__s32) );
+  __s32 *t_fix = malloc( NSAMPLES * sizeof(__s32) );
+  __s32 *h_fix = malloc( NSAMPLES * sizeof(__s32) );
+  __s32 *p_fix = malloc( NSAMPLES * sizeof(__s32) );
+  float *t_flt = malloc( NSAMPLES * sizeof(float) );
+  float *h_flt = malloc( NSAMPLES * sizeof(float) );
+  float *p_flt = malloc( NSAMPLES * sizeof(float) );
+  double *exact = malloc( NSAMPLES * sizeof(double) );
+
+  if ( !t_raw || !h_raw || !p_raw || !t_fix || !h_fix || !p_fix ||
+       !t_flt || !h_flt || !p_flt || !exact ) {
+    perror( "malloc" );
+    return 1;
+  }
+
+  srand( 1 );
+  for (size_t i = 0; i < NSAMPLES; i++) {
+    t_raw[i] = (__s16) (rand() & 0xffff);
+    h_raw[i] = (__s16) (rand() & 0xffff);
+    p_raw[i] = 260 * 4096 + rand() % (1000 * 4096);
+  }
+
+  printf( "kernels: %s, %d samples x %d rounds\n", convert_isa, NSAMPLES,
+          ROUNDS );
+  for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+    struct hts221_calib cal;
+    struct float_cal fcal;
+    double t0, float_ns, fixed_ns, terr, herr, perr, tferr, hferr, pferr;
+
+    if ( hts221_calib_init( &cal, blocks[b] ) == -1 ) {
+      perror( "hts221_calib_init" );
+      return 1;
+    }
+    float_cal_init( &fcal, blocks[b] );
+
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    for (int r = 0; r < ROUNDS; r++)
+      float_convert( &fcal, t_raw, h_raw, p_raw, t_flt, h_flt, p_flt,
+                     NSAMPLES );
+    float_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) /
+               ((double) ROUNDS * NSAMPLES);
+
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    for (int r = 0; r < ROUNDS; r++) {
+      hts221_convert_temperature( &cal, t_raw, t_fix, NSAMPLES );
+      hts221_convert_humidity( &cal, h_raw, h_fix, NSAMPLES );
+      lps25h_convert_pressure( p_raw, p_fix, NSAMPLES );
+    }
+    fixed_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) /
+               ((double) ROUNDS * NSAMPLES);
+
+    // exact references evaluated in double precision
+    for (size_t i = 0; i < NSAMPLES; i++)
+      exact[i] = 1000.0 * (fcal.T0_degC + ((double) t_raw[i] - fcal.T0_OUT) /
+                 (fcal.T1_OUT - fcal.T0_OUT) * (fcal.T1_degC - fcal.T0_degC));
+    terr = max_error( t_fix, t_flt, NSAMPLES, &tferr, exact );
+    for (size_t i = 0; i < NSAMPLES; i++)
+      exact[i] = 1000.0 * (fcal.H0_rH + ((double) h_raw[i] - fcal.H0_T0_OUT) /
+                 (fcal.H1_T0_OUT - fcal.H0_T0_OUT) * (fcal.H1_rH - fcal.H0_rH));
+    herr = max_error( h_fix, h_flt, NSAMPLES, &hferr, exact );
+    for (size_t i = 0; i < NSAMPLES; i++)
+      exact[i] = p_raw[i] * 1000.0 / 4096.0;
+    perr = max_error( p_fix, p_flt, NSAMPLES, &pferr, exact );
+
+    printf( "block %zu: shift t=%d h=%d\n", b, cal.t_shift, cal.h_shift );
+    printf( "  max error vs exact  fixed: %.2f mdegC %.2f m%%rH %.2f ubar\n",
+            terr, herr, perr );
+    printf( "                      float: %.2f mdegC %.2f m%%rH %.2f ubar\n",
+            tferr, hferr, pferr );
+    printf( "  ns per sample (3 channels)  float: %.2f  fixed: %.2f  "
+            "speedup: %.1fx\n", float_ns, fixed_ns, float_ns / fixed_ns );
+  }
+  return 0;
+}
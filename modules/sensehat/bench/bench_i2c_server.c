@@ -0,0 +1,251 @@
+/*
+ *  bench_i2c_server.c
+ *    Many clients reading the sense-hat registers at once, each with its
+ *    own handle on the bus, compared with going through the bus-owner
+ *    server. The simulated bus takes the wire time of a 400 kHz bus, and
+ *    the direct clients share it under a lock as i2c-dev clients share the
+ *    adapter. The clients mix three kinds of reads: status and output of
+ *    both devices, the pressure output alone, and humidity and temperature
+ *    as two reads. Then one paced high priority client, like sensehatd,
+ *    runs next to the busy normal ones, against the same client at normal
+ *    priority.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "i2c_server.h"
+
+#define SOCKET      "/tmp/bench_i2c_server.sock"
+#define BITRATE     400000
+#define RUN_NS      1000000000ULL
+#define MAX_CLIENTS 64
+#define MAX_LAT     100000
+#define PACED_NS    10000000ULL  // 100 Hz
+
+struct client {
+  pthread_t thread;
+  struct i2c_bus *bus;  // own connection, or the shared sim bus
+  int kind;
+  __u64 period;         // 0 for as fast as possible
+  unsigned long done;
+  unsigned long failed;
+  unsigned long nlat;
+  __u64 lat[MAX_LAT];
+};
+
+static pthread_mutex_t adapter = PTHREAD_MUTEX_INITIALIZER;
+static int direct;
+static volatile int running;
+
+static int one_read( struct client *c ) {
+  __u8 lps_status = LPS25H_STATUS_REG | LPS25H_reg_auto;
+  __u8 lps_press = LPS25H_PRESS_POUT | LPS25H_reg_auto;
+  __u8 hts_status = HTS221_STATUS_REG | HTS221_reg_auto;
+  __u8 hts_h = HTS221_HUMIDITY_OUT | HTS221_reg_auto;
+  __u8 hts_t = HTS221_TEMP_OUT | HTS221_reg_auto;
+  __u8 lps[4], hts[5], h[2], t[2];
+  struct i2c_msg msgs[4];
+  int n, rc;
+
+  switch ( c->kind ) {
+    case 0:
+      i2c_msg_read_reg( msgs, LPS25H_SAD, &lps_status, lps, 4 );
+      i2c_msg_read_reg( msgs + 2, HTS221_SAD, &hts_status, hts, 5 );
+      n = 4;
+      break;
+    case 1:
+      i2c_msg_read_reg( msgs, LPS25H_SAD, &lps_press, lps, 3 );
+      n = 2;
+      break;
+    default:
+      i2c_msg_read_reg( msgs, HTS221_SAD, &hts_h, h, 2 );
+      i2c_msg_read_reg( msgs + 2, HTS221_SAD, &hts_t, t, 2 );
+      n = 4;
+      break;
+  }
+  if ( !direct ) return i2c_bus_transfer( c->bus, msgs, n );
+
+  // the adapter takes one read per transaction, the server splits them
+  for (int i = 0; i < n; i += 2) {
+    pthread_mutex_lock( &adapter );
+    rc = i2c_bus_transfer( c->bus, msgs + i, 2 );
+    pthread_mutex_unlock( &adapter );
+    if ( rc == -1 ) return -1;
+  }
+  return 0;
+}
+
+static void *client_loop( void *arg ) {
+  struct client *c = arg;
+  __u64 next = clock_ns( CLOCK_MONOTONIC ), t0;
+
+  while ( running ) {
+    if ( c->period ) {
+      struct timespec ts;
+
+      next += c->period;
+      ts.tv_sec = next / 1000000000ULL;
+      ts.tv_nsec = next % 1000000000ULL;
+      clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+    }
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    if ( one_read( c ) == -1 ) {
+      c->failed++;
+      continue;
+    }
+    if ( c->nlat < MAX_LAT )
+      c->lat[c->nlat++] = clock_ns( CLOCK_MONOTONIC ) - t0;
+    c->done++;
+  }
+  return NULL;
+}
+
+static void *server_loop( void *arg ) {
+  i2c_server_run( arg );
+  return NULL;
+}
+
+static int cmp_u64( const void *a, const void *b ) {
+  __u64 x = *(const __u64 *) a, y = *(const __u64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* p50 and p99 in us over the clients [first, last) */
+static void percentiles( struct client *c, int first, int last,
+                         double *p50, double *p99 ) {
+  unsigned long n = 0;
+  __u64 *all;
+
+  for (int i = first; i < last; i++) n += c[i].nlat;
+  *p50 = *p99 = 0.0;
+  all = malloc( (n ? n : 1) * sizeof(__u64) );
+  if ( all == NULL || n == 0 ) {
+    free( all );
+    return;
+  }
+  n = 0;
+  for (int i = first; i < last; i++) {
+    memcpy( all + n, c[i].lat, c[i].nlat * sizeof(__u64) );
+    n += c[i].nlat;
+  }
+  qsort( all, n, sizeof(__u64), cmp_u64 );
+  *p50 = all[n / 2] / 1e3;
+  *p99 = all[n * 99 / 100] / 1e3;
+  free( all );
+}
+
+/* nclients busy clients plus, if paced_prio is not -1, one paced client at
+   that priority. Returns the bus of the run for its counters. */
+static struct i2c_bus *run( struct client *c, int nclients, int paced_prio,
+                            struct i2c_server_stats *st ) {
+  struct i2c_server *srv = NULL;
+  pthread_t server;
+  struct i2c_bus *bus;
+  int total = nclients + (paced_prio != -1);
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) return NULL;
+  i2c_sim_set_bitrate( bus, BITRATE );
+  if ( !direct ) {
+    srv = i2c_server_new( bus, SOCKET, NULL );
+    if ( srv == NULL ) return NULL;
+    pthread_create( &server, NULL, server_loop, srv );
+  }
+
+  running = 1;
+  for (int i = 0; i < total; i++) {
+    memset( &c[i], 0, offsetof(struct client, lat) );
+    c[i].kind = i < nclients ? i % 3 : 0;
+    c[i].period = i < nclients ? 0 : PACED_NS;
+    c[i].bus = direct ? bus :
+      i2c_server_connect( SOCKET, i < nclients ? I2C_SERVER_PRIO_NORMAL :
+                          paced_prio );
+    if ( c[i].bus == NULL ) return NULL;
+  }
+  i2c_bus_reset_stats( bus );
+  for (int i = 0; i < total; i++)
+    pthread_create( &c[i].thread, NULL, client_loop, &c[i] );
+  clock_nanosleep( CLOCK_MONOTONIC, 0, &(struct timespec) {
+                   RUN_NS / 1000000000ULL, RUN_NS % 1000000000ULL }, NULL );
+  running = 0;
+  for (int i = 0; i < total; i++) {
+    pthread_join( c[i].thread, NULL );
+    if ( !direct ) i2c_bus_close( c[i].bus );
+  }
+
+  memset( st, 0, sizeof(*st) );
+  if ( !direct ) {
+    i2c_server_stop( srv );
+    pthread_join( server, NULL );
+    i2c_server_stats( srv, st );
+    i2c_server_free( srv );
+  }
+  return bus;
+}
+
+int main( void ) {
+  static const int counts[] = { 1, 4, 16, 64 };
+  struct i2c_server_stats st;
+  struct client *c;
+  struct i2c_bus *bus;
+  double p50, p99;
+
+  c = calloc( MAX_CLIENTS + 1, sizeof(struct client) );
+  if ( c == NULL ) return 1;
+
+  printf( "%-7s %7s %9s %9s %9s %8s %8s %8s\n", "clients", "mode",
+          "reads/s", "bus tx/s", "bus B/s", "merged", "p50 us", "p99 us" );
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    for (direct = 1; direct >= 0; direct--) {
+      unsigned long done = 0, failed = 0;
+
+      bus = run( c, counts[i], -1, &st );
+      if ( bus == NULL ) {
+        perror( "run" );
+        return 1;
+      }
+      for (int j = 0; j < counts[i]; j++) {
+        done += c[j].done;
+        failed += c[j].failed;
+      }
+      percentiles( c, 0, counts[i], &p50, &p99 );
+      printf( "%-7d %7s %9.0f %9.0f %9.0f %7.0f%% %8.0f %8.0f", counts[i],
+              direct ? "direct" : "i2cd", done * 1e9 / RUN_NS,
+              bus->transfers * 1e9 / RUN_NS, bus->bytes * 1e9 / RUN_NS,
+              st.reads ? 100.0 * (st.reads - st.bursts) / st.reads : 0.0,
+              p50, p99 );
+      printf( failed ? " %lu failed\n" : "\n", failed );
+      i2c_bus_close( bus );
+    }
+  }
+
+  printf( "\n16 busy clients and one at 100 Hz, through i2cd\n" );
+  direct = 0;
+  for (int prio = I2C_SERVER_PRIO_NORMAL; prio < I2C_SERVER_PRIOS; prio++) {
+    bus = run( c, 16, prio, &st );
+    if ( bus == NULL ) {
+      perror( "run" );
+      return 1;
+    }
+    percentiles( c, 16, 17, &p50, &p99 );
+    printf( "paced client at %s priority: p50 %.0f us, p99 %.0f us\n",
+            prio == I2C_SERVER_PRIO_HIGH ? "high" : "normal", p50, p99 );
+    i2c_bus_close( bus );
+  }
+
+  free( c );
+  return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ *  bench_ingest.c
+ *    Load generator for the ingest server: N simulated feeders send their
+ *    sample links to it at once, as fast as they can and then paced like
+ *    real ones, and the server's rate, latency and memory per connection
+ *    are reported for each N
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_ingest [-w workers] [-r rate]
+ *    -w  workers of the server, one per online CPU by default
+ *    -r  samples per second of each paced feeder, PACED_RATE by default
+ *
+ *  The server runs in this process, the feeders in a child, all over a
+ *  Unix stream socket; over TCP the server's side of the work is the same.
+ *  flood: every feeder sends FLOOD_RECORDS / N samples in full frames,
+ *  one feeder after another as their sockets take them, which is what the
+ *  server sustains. paced: every feeder sends a sample at rate for
+ *  PACED_S, each in a frame of its own, and the latency is from the
+ *  queueing of a sample to the end of its callback in the server, see
+ *  ingest.h. Its percentiles are the upper edges of power-of-two buckets.
+ *  The feeders stamp their samples with the monotonic clock, as far off
+ *  the wall clock as that of a Pi without an RTC before NTP, so the
+ *  latency shows whether the server trusts the clocks of its feeders.
+ *
+ *  Memory per connection is the arena reserved for a slot and what the
+ *  server's resident set grew by with all N connected and sending, per
+ *  connection. The kernel's socket buffers come on top of both.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "clock.h"
+#include "ingest.h"
+
+#define FLOOD_RECORDS 400000
+#define PACED_RATE    100
+#define PACED_S       2
+#define TICK_NS       1000000ULL
+
+static const int feeders[] = { 10, 100, 500 };
+
+struct result {
+  struct ingest_stats st;
+  double wall;    // s from the go to the last record received
+  double cpu;     // ns of the server process in that time
+  long rss;       // bytes the server grew by
+};
+
+static double cpu_ns( void ) {
+  struct rusage ru;
+
+  getrusage( RUSAGE_SELF, &ru );
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+static long rss_bytes( void ) {
+  long pages = 0, resident = 0;
+  FILE *fp = fopen( "/proc/self/statm", "r" );
+
+  if ( fp == NULL ) return 0;
+  if ( fscanf( fp, "%ld %ld", &pages, &resident ) != 2 ) resident = 0;
+  fclose( fp );
+  return resident * sysconf( _SC_PAGESIZE );
+}
+
+static void on_frame( void *arg, unsigned int feeder,
+                      const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+}
+
+static void *serve( void *arg ) {
+  if ( ingest_run( arg ) == -1 ) perror( "ingest_run" );
+  return NULL;
+}
+
+static int connect_to( const char *path ) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  int fd;
+
+  strcpy( sa.sun_path, path );
+  fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd != -1 && connect( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+static void wait_out( int fd ) {
+  struct pollfd pfd = { fd, POLLOUT, 0 };
+
+  while ( poll( &pfd, 1, -1 ) == -1 && errno == EINTR );
+}
+
+/* Push one sample, stamped now on a clock far from the server's, and send
+   what is due */
+static void feed( struct sample_link *l, int fd, int block, __u64 mono ) {
+  struct sample_link_rec rec = { .timestamp = mono };
+
+  rec.s.p_raw = 4150000;
+  sample_link_push( l, &rec, mono );
+  while ( sample_link_send( l, mono ) == 0 && block ) wait_out( fd );
+}
+
+/* The feeders: connect all n, say so, wait for the go, send, say so and
+   hold the connections until told to close */
+static void feeders_main( const char *path, int n, int paced, int rate,
+                          int in, int out ) {
+  struct sample_link_config flood = { 64, 0, 4096 };
+  struct sample_link_config one = { 1, 0, 256 };
+  struct sample_link **l = calloc( n, sizeof(*l) );
+  int *fd = calloc( n, sizeof(int) );
+  __u64 *next = calloc( n, sizeof(__u64) );
+  __u64 start, now, period;
+  long left = (long) n * rate * PACED_S;
+  char c = 0;
+
+  if ( l == NULL || fd == NULL || next == NULL ) _exit( 1 );
+  for (int i = 0; i < n; i++) {
+    fd[i] = connect_to( path );
+    l[i] = sample_link_new( paced ? &one : &flood );
+    if ( fd[i] == -1 || l[i] == NULL ) _exit( 1 );
+    sample_link_attach( l[i], fd[i] );
+  }
+  if ( write( out, &c, 1 ) != 1 || read( in, &c, 1 ) != 1 ) _exit( 1 );
+
+  if ( !paced ) {
+    for (int i = 0; i < n; i++)
+      for (int k = 0; k < FLOOD_RECORDS / n; k++)
+        feed( l[i], fd[i], (k + 1) % 64 == 0, clock_ns( CLOCK_MONOTONIC ) );
+    for (int i = 0; i < n; i++)
+      while ( sample_link_send( l[i], ~0ULL >> 1 ) == 0 ) wait_out( fd[i] );
+  } else {
+    // feeder i is first due at i / n of a period, checked every tick
+    period = 1000000000ULL / rate;
+    start = clock_ns( CLOCK_MONOTONIC );
+    for (int i = 0; i < n; i++) next[i] = start + period * i / n;
+    for (__u64 tick = start; left > 0; tick += TICK_NS) {
+      struct timespec ts = { tick / 1000000000ULL, tick % 1000000000ULL };
+
+      while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+              EINTR );
+      now = clock_ns( CLOCK_MONOTONIC );
+      for (int i = 0; i < n; i++)
+        while ( next[i] <= now && next[i] < start + PACED_S * 1000000000ULL ) {
+          feed( l[i], fd[i], 0, now );
+          next[i] += period;
+          left--;
+        }
+    }
+  }
+  if ( write( out, &c, 1 ) != 1 || read( in, &c, 1 ) != 1 ) _exit( 1 );
+  _exit( 0 );
+}
+
+static int run( unsigned int workers, int n, int paced, int rate,
+                struct result *res ) {
+  struct ingest_config cfg = { workers, 512 };
+  char path[64];
+  struct ingest *ing;
+  pthread_t thread;
+  int up[2], down[2], status;
+  unsigned long expect;
+  long rss;
+  pid_t pid;
+  char c = 0;
+  __u64 t0;
+
+  snprintf( path, sizeof(path), "/tmp/bench_ingest.%d", (int) getpid() );
+  ing = ingest_new( NULL, path, &cfg, on_frame, NULL );
+  if ( ing == NULL ) return -1;
+  if ( pthread_create( &thread, NULL, serve, ing ) != 0 ) return -1;
+  if ( pipe( up ) == -1 || pipe( down ) == -1 ) return -1;
+  rss = rss_bytes();
+  pid = fork();
+  if ( pid == -1 ) return -1;
+  if ( pid == 0 ) feeders_main( path, n, paced, rate, down[0], up[1] );
+
+  if ( read( up[0], &c, 1 ) != 1 ) return -1;
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  res->cpu = cpu_ns();
+  if ( write( down[1], &c, 1 ) != 1 || read( up[0], &c, 1 ) != 1 )
+    return -1;
+  // the feeders are done, wait for the server to catch up
+  expect = paced ? (unsigned long) n * rate * PACED_S :
+           (unsigned long) (FLOOD_RECORDS / n) * n;
+  do {
+    ingest_stats( ing, -1, &res->st );
+    if ( res->st.records + res->st.lost >= expect ) break;
+    usleep( 100 );
+  } while ( clock_ns( CLOCK_MONOTONIC ) - t0 < 30000000000ULL );
+  res->wall = (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e9;
+  res->cpu = cpu_ns() - res->cpu;
+  res->rss = rss_bytes() - rss;
+
+  if ( write( down[1], &c, 1 ) != 1 ) return -1;
+  waitpid( pid, &status, 0 );
+  // all connections closed before the counts are final
+  do ingest_stats( ing, -1, &res->st );
+  while ( res->st.closed < res->st.conns );
+  ingest_stop( ing );
+  pthread_join( thread, NULL );
+  ingest_stats( ing, -1, &res->st );
+  ingest_free( ing );
+  for (int i = 0; i < 2; i++) {
+    close( up[i] );
+    close( down[i] );
+  }
+  if ( res->st.records + res->st.lost != expect || res->st.conns != (unsigned
+       long) n )
+    fprintf( stderr, "  MISMATCH: %lu of %lu records, %lu lost, %lu of %d "
+             "connections\n", res->st.records, expect, res->st.lost,
+             res->st.conns, n );
+  return 0;
+}
+
+int main( int argc, char **argv ) {
+  unsigned int workers = 0;
+  int rate = PACED_RATE, opt;
+  struct result flood, paced;
+
+  while ( (opt = getopt( argc, argv, "w:r:" )) != -1 ) {
+    switch ( opt ) {
+      case 'w': workers = atoi( optarg ); break;
+      case 'r': rate = atoi( optarg ); break;
+      default:
+        fprintf( stderr, "usage: %s [-w workers] [-r rate]\n", argv[0] );
+        return 1;
+    }
+  }
+  if ( workers == 0 ) workers = sysconf( _SC_NPROCESSORS_ONLN );
+  signal( SIGPIPE, SIG_IGN );
+
+  printf( "%u workers, paced feeders at %d Hz, %zu bytes of arena per "
+          "slot\n", workers, rate, ingest_slot_size() );
+  printf( "%8s %12s %9s %8s %9s %9s %9s %10s\n", "feeders", "flood rec/s",
+          "ns/rec", "paced/s", "p50 us", "p99 us", "max us", "rss/conn" );
+  for (size_t i = 0; i < sizeof(feeders) / sizeof(feeders[0]); i++) {
+    int n = feeders[i];
+
+    if ( run( workers, n, 0, rate, &flood ) == -1 ||
+         run( workers, n, 1, rate, &paced ) == -1 ) {
+      perror( "bench_ingest" );
+      return 1;
+    }
+    printf( "%8d %12.0f %9.0f %8.0f %9llu %9llu %9llu %10ld\n", n,
+            flood.st.records / flood.wall, flood.cpu / flood.st.records,
+            paced.st.records / paced.wall,
+            (unsigned long long) ingest_percentile( &paced.st, 0.5 ) / 1000,
+            (unsigned long long) ingest_percentile( &paced.st, 0.99 ) / 1000,
+            (unsigned long long) ingest_percentile( &paced.st, 1.0 ) / 1000,
+            paced.rss / n );
+  }
+  return 0;
+}
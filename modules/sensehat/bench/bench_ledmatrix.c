@@ -0,0 +1,168 @@
+/*
+ *  bench_ledmatrix.c
+ *    Frames per second and CPU use of the LED matrix renderer against a
+ *    framebuffer backed by an ordinary file, compared with the per-pixel
+ *    RGB888 conversion of tests/sensehat_rgbmatrix_test.c
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_ledmatrix [framebuffer]  (default a file in /tmp)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "clock.h"
+#include "ledmatrix.h"
+#include "frame_pacer.h"
+
+#define NFRAMES  2000000
+#define PACED_HZ 500
+#define PACED_S  2
+
+static __u8 colors[64][3];
+static __u8 idx[64];
+
+static double cpu_ns( void ) {
+  struct rusage ru;
+
+  getrusage( RUSAGE_SELF, &ru );
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+/* display_pixels() from the test: convert and store pixel by pixel */
+static void legacy_frame( struct fb_t *fb ) {
+  for (size_t i = 0; i < 64; i++) {
+    __u16 r = (colors[idx[i]][0] >> 3) & 0x1F;
+    __u16 g = (colors[idx[i]][1] >> 2) & 0x3F;
+    __u16 b = (colors[idx[i]][2] >> 3) & 0x1F;
+    fb->pixel[i/8][i%8] = (r << 11) + (g << 5) + b;
+  }
+}
+
+/* change = how many pixels differ from the previous frame */
+static void next_frame( unsigned long n, int change ) {
+  for (int i = 0; i < change; i++) {
+    __u8 *p = &idx[(n + i) & 63];
+    *p = (*p + 1) & 63;
+  }
+}
+
+static void report( const char *path, unsigned long frames, double wall,
+                    double cpu ) {
+  printf( "%-16s%14.0f%12.1f%10.1f\n", path, frames / (wall * 1e-9),
+          wall / frames, 100.0 * cpu / wall );
+}
+
+int main( int argc, char **argv ) {
+  char tmp[] = "/tmp/bench_ledmatrix.XXXXXX";
+  const char *path = argc > 1 ? argv[1] : NULL;
+  static const int changes[] = { 0, 1, 64 };
+  struct led_palette pal;
+  struct ledmatrix *lm;
+  struct ledmatrix_stats st;
+  struct frame_pacer fp;
+  struct fb_t *fb;
+  double t0, c0;
+  char name[32];
+  int fd;
+
+  if ( path == NULL ) {
+    fd = mkstemp( tmp );
+    if ( fd == -1 ) {
+      perror( "mkstemp" );
+      return 1;
+    }
+    close( fd );
+    path = tmp;
+  }
+
+  for (int i = 0; i < 64; i++) {
+    colors[i][0] = i * 4;
+    colors[i][1] = 255 - i * 4;
+    colors[i][2] = (i * 37) & 0xff;
+    idx[i] = i;
+  }
+  led_palette_init( &pal, (const __u8 (*)[3]) colors, 64 );
+
+  lm = ledmatrix_open( path );
+  if ( lm == NULL ) {
+    perror( "ledmatrix_open" );
+    return 1;
+  }
+  // the legacy path writes straight into its own mapping of the file
+  fd = open( path, O_RDWR );
+  fb = fd == -1 ? MAP_FAILED : mmap( NULL, sizeof(struct fb_t),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED,
+                                     fd, 0 );
+  if ( fb == MAP_FAILED ) {
+    perror( path );
+    return 1;
+  }
+  close( fd );
+
+  printf( "%-16s%14s%12s%10s\n", "path", "frames/s", "ns/frame", "cpu %" );
+  for (size_t c = 0; c < sizeof(changes) / sizeof(changes[0]); c++) {
+    snprintf( name, sizeof(name), "legacy/%d", changes[c] );
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    c0 = cpu_ns();
+    for (unsigned long n = 0; n < NFRAMES; n++) {
+      next_frame( n, changes[c] );
+      legacy_frame( fb );
+      __asm__ __volatile__( "" ::: "memory" );
+    }
+    report( name, NFRAMES, clock_ns( CLOCK_MONOTONIC ) - t0, cpu_ns() - c0 );
+
+    snprintf( name, sizeof(name), "commit/%d", changes[c] );
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    c0 = cpu_ns();
+    for (unsigned long n = 0; n < NFRAMES; n++) {
+      next_frame( n, changes[c] );
+      ledmatrix_draw_indexed( lm, &pal, idx );
+      ledmatrix_commit( lm );
+    }
+    report( name, NFRAMES, clock_ns( CLOCK_MONOTONIC ) - t0, cpu_ns() - c0 );
+  }
+  ledmatrix_stats( lm, &st );
+  printf( "commits %lu skipped %lu\n", st.commits, st.skipped );
+
+  // holding a steady frame rate with one pixel changing: the test's fixed
+  // usleep() after each frame against absolute deadlines
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  c0 = cpu_ns();
+  for (unsigned long n = 0; n < PACED_HZ * PACED_S; n++) {
+    next_frame( n, 1 );
+    ledmatrix_draw_indexed( lm, &pal, idx );
+    ledmatrix_commit( lm );
+    usleep( 1000000 / PACED_HZ );
+  }
+  report( "usleep", PACED_HZ * PACED_S, clock_ns( CLOCK_MONOTONIC ) - t0,
+          cpu_ns() - c0 );
+
+  frame_pacer_init( &fp, PACED_HZ );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  c0 = cpu_ns();
+  for (unsigned long n = 0; n < PACED_HZ * PACED_S; n++) {
+    next_frame( n, 1 );
+    ledmatrix_draw_indexed( lm, &pal, idx );
+    ledmatrix_commit( lm );
+    frame_pacer_wait( &fp );
+  }
+  snprintf( name, sizeof(name), "paced/%dHz", PACED_HZ );
+  report( name, PACED_HZ * PACED_S, clock_ns( CLOCK_MONOTONIC ) - t0,
+          cpu_ns() - c0 );
+  printf( "missed deadlines %lu\n", fp.missed );
+
+  munmap( fb, sizeof(struct fb_t) );
+  ledmatrix_close( lm );
+  if ( path == tmp ) unlink( tmp );
+  return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ *  bench_link.c
+ *    Samples per second and CPU per sample of the slave to master link over
+ *    TCP on loopback, one frame per sample against batched frames, and what
+ *    the loss policy does while the master stops reading for a while
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The sender is this process, the receiver a child, so each side's CPU
+ *  time is its own. Both sides get the same single core here, so the
+ *  throughput is that of the two of them together.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "clock.h"
+#include "sample_link.h"
+
+#define NSAMPLES  200000
+#define STALL_N   20000
+#define STALL_MS  300
+#define STALL_BUF 16384  // socket buffers while stalled
+
+struct rx_result {
+  struct sample_link_rx_stats st;
+  double cpu;   // ns
+  __u64 check;  // sum of the pressure readings received
+};
+
+static double cpu_ns( void ) {
+  struct rusage ru;
+
+  getrusage( RUSAGE_SELF, &ru );
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+static void wait_fd( int fd, short events ) {
+  struct pollfd pfd = { fd, events, 0 };
+
+  while ( poll( &pfd, 1, -1 ) == -1 && errno == EINTR );
+}
+
+static void on_frame( void *arg, const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+  __u64 *check = arg;
+
+  for (int i = 0; i < hdr->count; i++) *check += rec[i].s.p_raw;
+}
+
+/* The master: read until the sender closes, report through the pipe */
+static void receiver( int lfd, int out, int stall_ms ) {
+  struct sample_link_rx *rx;
+  struct rx_result res = { .check = 0 };
+  int fd, rc;
+
+  fd = accept( lfd, NULL, NULL );
+  rx = fd == -1 ? NULL : sample_link_rx_new( fd );
+  if ( rx == NULL ) _exit( 1 );
+  if ( stall_ms > 0 ) usleep( stall_ms * 1000 );
+  res.cpu = cpu_ns();
+  for (;;) {
+    rc = sample_link_recv( rx, on_frame, &res.check );
+    if ( rc == -1 ) break;
+    if ( rc == 0 ) wait_fd( fd, POLLIN );
+  }
+  if ( errno != ECONNRESET ) perror( "sample_link_recv" );
+  res.cpu = cpu_ns() - res.cpu;
+  sample_link_rx_stats( rx, &res.st );
+  if ( write( out, &res, sizeof(res) ) != sizeof(res) ) _exit( 1 );
+  _exit( 0 );
+}
+
+/* Socket buffers of buf bytes, 0 for the defaults. Small ones stand in for
+   a slow link, the loopback defaults would swallow the whole stall. */
+static int set_buf( int fd, int opt, int buf ) {
+  if ( fd == -1 || buf == 0 ) return fd;
+  return setsockopt( fd, SOL_SOCKET, opt, &buf, sizeof(buf) ) == -1 ? -1 : fd;
+}
+
+static int listen_any( int *port, int buf ) {
+  struct sockaddr_in sa = { .sin_family = AF_INET };
+  socklen_t len = sizeof(sa);
+  int fd;
+
+  sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  fd = set_buf( socket( AF_INET, SOCK_STREAM, 0 ), SO_RCVBUF, buf );
+  if ( fd == -1 || bind( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ||
+       listen( fd, 1 ) == -1 ||
+       getsockname( fd, (struct sockaddr *) &sa, &len ) == -1 )
+    return -1;
+  *port = ntohs( sa.sin_port );
+  return fd;
+}
+
+static int connect_to( int port, int buf ) {
+  struct sockaddr_in sa = { .sin_family = AF_INET };
+  int fd;
+
+  sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  sa.sin_port = htons( port );
+  fd = set_buf( socket( AF_INET, SOCK_STREAM, 0 ), SO_SNDBUF, buf );
+  if ( fd != -1 && connect( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+/* Push n samples as fast as they go. With wait set a full socket is
+   waited out, otherwise the queue takes the strain. */
+static int run( const char *name, const struct sample_link_config *cfg,
+                int n, int wait, int stall_ms ) {
+  struct sample_link_stats st;
+  struct sample_link_rec rec;
+  struct sample_link *l;
+  struct rx_result res;
+  double cpu, wall;
+  int pfd[2], lfd, fd, port, status;
+  __u64 t0, sent_check = 0;
+  pid_t pid;
+
+  lfd = listen_any( &port, stall_ms > 0 ? STALL_BUF : 0 );
+  if ( lfd == -1 || pipe( pfd ) == -1 ) return -1;
+  pid = fork();
+  if ( pid == -1 ) return -1;
+  if ( pid == 0 ) receiver( lfd, pfd[1], stall_ms );
+  close( lfd );
+
+  fd = connect_to( port, stall_ms > 0 ? STALL_BUF : 0 );
+  l = sample_link_new( cfg );
+  if ( fd == -1 || l == NULL ) return -1;
+  sample_link_attach( l, fd );
+  memset( &rec, 0, sizeof(rec) );
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  cpu = cpu_ns();
+  for (int i = 0; i < n; i++) {
+    __u64 now = clock_ns( CLOCK_MONOTONIC );
+
+    rec.timestamp = now;
+    rec.s.p_raw = 4150000 + i;
+    sample_link_push( l, &rec, now );
+    while ( sample_link_send( l, now ) == 0 && wait ) wait_fd( fd, POLLOUT );
+  }
+  // whatever is left goes out as if the linger had passed
+  while ( sample_link_send( l, ~0ULL >> 1 ) == 0 ) wait_fd( fd, POLLOUT );
+  cpu = cpu_ns() - cpu;
+  close( fd );
+
+  if ( read( pfd[0], &res, sizeof(res) ) != sizeof(res) ) return -1;
+  waitpid( pid, &status, 0 );
+  wall = (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e9;
+  close( pfd[0] );
+  close( pfd[1] );
+  sample_link_stats( l, &st );
+  sample_link_free( l );
+
+  for (int i = 0; i < n; i++) sent_check += 4150000 + i;
+  printf( "%-10s%10.0f%8.1f%8.3f%8.3f%9.0f%9.0f%6.0f%%\n", name,
+          res.st.records / wall, (double) res.st.records / res.st.frames,
+          (double) st.sends / n, (double) res.st.reads / n, cpu / n,
+          res.cpu / n, 100.0 * cpu / (wall * 1e9) );
+  if ( stall_ms > 0 )
+    printf( "  %d pushed: %lu received, %lu lost (%lu dropped, %lu "
+            "refused), %lu blocked sends, %s\n", n, res.st.records,
+            res.st.lost, st.dropped, st.refused, st.blocked,
+            res.st.records + res.st.lost == (unsigned long) n ?
+            "all accounted for" : "MISMATCH" );
+  else if ( res.check != sent_check || res.st.records != (unsigned long) n )
+    printf( "  MISMATCH: %lu of %d records received\n", res.st.records, n );
+  return 0;
+}
+
+int main( void ) {
+  struct sample_link_config per_sample = { 1, 0, 4096 };
+  struct sample_link_config batched = SAMPLE_LINK_CONFIG_DEFAULT;
+  struct sample_link_config small = { 64, 1000000000ULL, 1024 };
+
+  printf( "%-10s%10s%8s%8s%8s%9s%9s%7s\n", "mode", "samples/s", "per fr",
+          "sends", "reads", "tx ns", "rx ns", "tx cpu" );
+  if ( run( "per-sample", &per_sample, NSAMPLES, 1, 0 ) == -1 ||
+       run( "batched", &batched, NSAMPLES, 1, 0 ) == -1 ) {
+    perror( "bench_link" );
+    return 1;
+  }
+  printf( "master stalled for %d ms, a queue of %zu:\n", STALL_MS,
+          small.queue );
+  if ( run( "stalled", &small, STALL_N, 0, STALL_MS ) == -1 ) {
+    perror( "bench_link" );
+    return 1;
+  }
+  return 0;
+}
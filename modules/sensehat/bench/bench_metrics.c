@@ -0,0 +1,144 @@
+/*
+ *  bench_metrics.c
+ *    What recording costs. Each recording call on its own, with metrics off
+ *    and on, from 1..N threads at once; a sample read from the simulated
+ *    sense-hat with recording off and on; and the writers again while a
+ *    scraper exports the segment as fast as it can. The simulated bus takes
+ *    no time, so the relative cost per sample is far above what it is next
+ *    to a real i2c transaction of a few hundred microseconds.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "clock.h"
+#include "i2c_sim.h"
+#include "metrics.h"
+#include "sensehat.h"
+
+#define NAME        "/bench_metrics"
+#define NCALLS      2000000
+#define NSAMPLES    200000
+#define MAX_THREADS 4
+
+static volatile int scraping;
+
+struct writer {
+  pthread_t thread;
+  double ns;  // per call
+};
+
+/* The recording around the LPS25H transaction of a sample, without the
+   transaction. Timed in thread CPU time, so that threads sharing a core do
+   not count each other. */
+static void *i2c_loop( void *arg ) {
+  struct writer *w = arg;
+  __u8 reg = 0xa7, buf[4];
+  struct i2c_msg msgs[2];
+  double t0 = clock_ns( CLOCK_THREAD_CPUTIME_ID );
+
+  i2c_msg_read_reg( msgs, 0x5c, &reg, buf, 4 );
+  for (int i = 0; i < NCALLS; i++)
+    metrics_i2c( msgs, 2, 2, metrics_start() );
+  w->ns = (clock_ns( CLOCK_THREAD_CPUTIME_ID ) - t0) / NCALLS;
+  return NULL;
+}
+
+static void *scrape_loop( void *arg ) {
+  unsigned long *n = arg;
+  FILE *null = fopen( "/dev/null", "w" );
+
+  while ( scraping && null != NULL ) {
+    metrics_export( NAME, null );
+    (*n)++;
+  }
+  if ( null != NULL ) fclose( null );
+  return NULL;
+}
+
+/* Mean ns per metrics_i2c() call over nthreads threads */
+static double writers( int nthreads ) {
+  struct writer w[MAX_THREADS];
+  double sum = 0.0;
+
+  for (int i = 0; i < nthreads; i++)
+    pthread_create( &w[i].thread, NULL, i2c_loop, &w[i] );
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join( w[i].thread, NULL );
+    sum += w[i].ns;
+  }
+  return sum / nthreads;
+}
+
+static double samples( struct sensehat *sh ) {
+  struct sensehat_sample s;
+  double t0 = clock_ns( CLOCK_MONOTONIC );
+
+  for (int i = 0; i < NSAMPLES; i++) sensehat_sample( sh, &s );
+  return (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+}
+
+int main( void ) {
+  double off, on, t0;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  unsigned long scrapes = 0;
+  pthread_t scraper;
+
+  bus = i2c_sim_open();
+  sh = bus != NULL ? sensehat_open( bus, NULL ) : NULL;
+  if ( sh == NULL ) {
+    perror( "sensehat_open" );
+    return 1;
+  }
+
+  // before metrics_open() nothing is recorded or timed
+  off = samples( sh );
+  printf( "metrics off: i2c hooks %.1f ns/transaction\n", writers( 1 ) );
+
+  shm_unlink( NAME );
+  if ( metrics_open( NAME, "bench" ) == -1 ) {
+    perror( NAME );
+    return 1;
+  }
+  on = samples( sh );
+  printf( "metrics on:  i2c hooks" );
+  for (int n = 1; n <= MAX_THREADS; n *= 2)
+    printf( "  %d thread%s %.1f", n, n > 1 ? "s" : "", writers( n ) );
+  printf( " ns/transaction\n" );
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NCALLS; i++) metrics_count( METRICS_STALE, 1 );
+  printf( "             metrics_count %.1f ns",
+          (clock_ns( CLOCK_MONOTONIC ) - t0) / NCALLS );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NCALLS; i++)
+    metrics_observe( METRICS_SAMPLE_LATENCY, i * 1000ULL );
+  printf( ", metrics_observe %.1f ns\n",
+          (clock_ns( CLOCK_MONOTONIC ) - t0) / NCALLS );
+
+  printf( "sensehat_sample on the sim: %.0f ns off, %.0f ns on "
+          "(+%.0f ns, %.1f%%)\n", off, on, on - off,
+          100.0 * (on - off) / off );
+
+  scraping = 1;
+  pthread_create( &scraper, NULL, scrape_loop, &scrapes );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  on = writers( 2 );
+  t0 = clock_ns( CLOCK_MONOTONIC ) - t0;
+  scraping = 0;
+  pthread_join( scraper, NULL );
+  printf( "2 threads while scraping: %.1f ns/transaction, %.0f scrapes/s "
+          "(%.0f us each)\n", on, scrapes * 1e9 / t0, t0 / 1e3 / scrapes );
+
+  shm_unlink( NAME );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
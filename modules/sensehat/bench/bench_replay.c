@@ -0,0 +1,209 @@
+/*
+ *  bench_replay.c
+ *    The acquisition, conversion and storage pipeline of sensehatd driven
+ *    by a replayed bus trace: once as recorded, then looping at 100 times
+ *    the recorded pace and as fast as it goes. The last is the ceiling of
+ *    the pipeline on this machine with the bus taken out.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_replay [trace]
+ *    Without a trace, one is recorded first from the simulated sense-hat
+ *    at 400 kHz, with noise and drifting readings, for RECORD_SAMPLES
+ *    periods of PERIOD_NS. Record one from a feeder with sensehatd -w.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "i2c_trace.h"
+#include "sensehat.h"
+#include "ts_store.h"
+#include "rollup.h"
+
+#define RECORD_SAMPLES 50
+#define PERIOD_NS      80000000ULL
+#define FAST_PASSES    25
+#define ASAP_PASSES    2000
+
+struct result {
+  unsigned long samples;  // fresh samples stored
+  double wall;            // s
+  struct i2c_trace_stats st;
+};
+
+static void drift( void *arg, __u64 now, struct i2c_sim_env *env ) {
+  double t = now / 1e9;
+
+  env->pressure = 1013.25f + 2.0f * sin( t / 3.0 );
+  env->temperature = 12.0f + sin( t / 5.0 );
+  env->humidity = 70.0f + 5.0f * cos( t / 4.0 );
+}
+
+/* Read the sim at the pace sensehatd would, with the trace recording */
+static int record( const char *path ) {
+  struct i2c_sim_env rms = { 0.02f, 0.05f, 0.3f };
+  struct i2c_bus *sim, *bus;
+  struct sensehat_sample s;
+  struct sensehat *sh;
+  struct timespec ts;
+  __u64 next;
+
+  sim = i2c_sim_open();
+  if ( sim == NULL ) return -1;
+  i2c_sim_set_bitrate( sim, 400000 );
+  i2c_sim_set_noise( sim, &rms );
+  i2c_sim_set_env_fn( sim, drift, NULL );
+  bus = i2c_trace_record( sim, path );
+  if ( bus == NULL ) {
+    i2c_bus_close( sim );
+    return -1;
+  }
+  sh = sensehat_open( bus, NULL );
+  if ( sh == NULL ) {
+    i2c_bus_close( bus );
+    return -1;
+  }
+  next = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < RECORD_SAMPLES; i++) {
+    next += PERIOD_NS;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+            EINTR );
+    sensehat_sample( sh, &s );
+  }
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
+
+/* Everything sensehatd does with a fresh sample but publish it */
+static void store( struct ts_store *st, struct rollup *r,
+                   const struct sensehat_sample *s ) {
+  float v[ROLLUP_CHANNELS] = {
+    [ROLLUP_PRESSURE] = s->pressure,
+    [ROLLUP_TEMPERATURE] = s->temperature,
+    [ROLLUP_HUMIDITY] = s->humidity,
+  };
+  struct ts_sample rec = {
+    .timestamp = clock_ns( CLOCK_REALTIME ),
+    .p_raw = s->p_raw,
+    .h_raw = s->h_raw,
+    .t_raw = s->t_raw,
+    .lps25h_status = s->lps25h_status,
+    .hts221_status = s->hts221_status,
+  };
+
+  ts_store_append( st, &rec );
+  rollup_add( r, rec.timestamp, v );
+}
+
+static void discard( void *arg, const struct rollup_bucket *b ) {
+}
+
+/* Replay path at speed until its end, or for passes passes if looping */
+static int run( const char *path, const char *dir, double speed,
+                unsigned long passes, struct result *res ) {
+  struct i2c_trace_config cfg = { speed, passes > 1 };
+  struct sensehat_sample s;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  struct ts_store *st;
+  struct rollup *r;
+  __u64 t0;
+
+  memset( res, 0, sizeof(*res) );
+  bus = i2c_trace_replay( path, &cfg );
+  if ( bus == NULL ) return -1;
+  st = ts_store_open( dir, NULL );
+  r = rollup_new( NULL, discard, NULL );
+  if ( st == NULL || r == NULL ) return -1;
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  sh = sensehat_open( bus, NULL );
+  if ( sh == NULL ) return -1;
+  while ( res->st.loops < passes ) {
+    if ( sensehat_sample( sh, &s ) == -1 ) {
+      if ( errno == ENODATA ) break;
+      continue;
+    }
+    if ( LPS25H_STATUS_REG_P_DA_ef( s.lps25h_status ) ||
+         (s.hts221_status & 3) == 3 ) {
+      store( st, r, &s );
+      res->samples++;
+    }
+    i2c_trace_stats( bus, &res->st );
+  }
+  res->wall = (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e9;
+  i2c_trace_stats( bus, &res->st );
+
+  rollup_flush( r );
+  rollup_free( r );
+  ts_store_close( st );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
+
+static void report( const char *mode, const struct result *res,
+                    double base ) {
+  double rate = res->samples / res->wall;
+
+  printf( "%-6s %7lu samples in %6.2f s, %9.0f samples/s, %7.1fx recorded "
+          "pace, behind max %6llu us, %lu skipped, %lu unmatched\n", mode,
+          res->samples, res->wall, rate, rate / base,
+          (unsigned long long) res->st.behind_max / 1000, res->st.skipped,
+          res->st.unmatched );
+}
+
+int main( int argc, char **argv ) {
+  char tmp[] = "/tmp/bench_replay.XXXXXX";
+  char trace[64], cmd[128];
+  const char *path = argc > 1 ? argv[1] : NULL;
+  struct result one, fast, asap;
+  double base;
+  int rc = 0;
+
+  if ( mkdtemp( tmp ) == NULL ) {
+    perror( "mkdtemp" );
+    return 1;
+  }
+  if ( path == NULL ) {
+    snprintf( trace, sizeof(trace), "%s/trace", tmp );
+    printf( "recording %.1f s from the sim\n",
+            RECORD_SAMPLES * PERIOD_NS / 1e9 );
+    if ( record( trace ) == -1 ) {
+      perror( "record" );
+      return 1;
+    }
+    path = trace;
+  }
+
+  if ( run( path, tmp, 1.0, 1, &one ) == -1 ||
+       run( path, tmp, 100.0, FAST_PASSES, &fast ) == -1 ||
+       run( path, tmp, I2C_TRACE_ASAP, ASAP_PASSES, &asap ) == -1 ) {
+    perror( path );
+    rc = 1;
+  } else {
+    base = one.samples / one.wall;
+    report( "1x", &one, base );
+    report( "100x", &fast, base );
+    report( "asap", &asap, base );
+    printf( "pipeline: %.0f ns per stored sample\n",
+            asap.wall * 1e9 / asap.samples );
+  }
+
+  snprintf( cmd, sizeof(cmd), "rm -rf '%s'", tmp );
+  if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", tmp );
+  return rc;
+}
@@ -0,0 +1,178 @@
+/*
+ *  bench_rollup.c
+ *    Two hours of 1 kHz samples through the rollup stage, with samples out
+ *    of order, single samples missing and a 30 s outage. Reports the cost
+ *    per sample and of the rolling range queries, checks every 1 min bucket
+ *    against a straightforward recomputation, and compares with
+ *    recomputing an hour of 1 min rollups from raw samples per request.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "clock.h"
+#include "rollup.h"
+
+#define RATE_HZ   1000
+#define NSAMPLES  (2 * 3600 * RATE_HZ)
+#define PERIOD_NS (1000000000ULL / RATE_HZ)
+#define T_START   1500000000000000000ULL
+#define MINUTES   (NSAMPLES / RATE_HZ / 60 + 2)
+#define MINUTE_NS 60000000000ULL
+#define MINUTE(ts) (((ts) - (T_START - T_START % MINUTE_NS)) / MINUTE_NS)
+#define OUTAGE    (3000 * RATE_HZ)  // 30 s without samples from 50 min
+
+struct naive {
+  unsigned long count;
+  long double sum[ROLLUP_CHANNELS];
+  long double sq[ROLLUP_CHANNELS];
+  float min[ROLLUP_CHANNELS];
+  float max[ROLLUP_CHANNELS];
+};
+
+static struct rollup_bucket minutes[MINUTES];
+static int nminutes;
+
+/* Returns 0 for samples that never arrive */
+static int make_sample( unsigned long i, __u64 *ts, float v[3] ) {
+  double t = (double) i / RATE_HZ;
+
+  if ( i % 997 == 500 ) return 0;
+  if ( i >= OUTAGE && i < OUTAGE + 30 * RATE_HZ ) return 0;
+  *ts = T_START + i * PERIOD_NS;
+  v[ROLLUP_PRESSURE] = 1013.25 + 3 * sin( t / 600 ) + (i * 31 % 17) * 0.01;
+  v[ROLLUP_TEMPERATURE] = 15 + 5 * sin( t / 1800 ) + (i * 7 % 11) * 0.02;
+  v[ROLLUP_HUMIDITY] = 60 + 20 * cos( t / 900 ) + (i * 13 % 5) * 0.1;
+  return 1;
+}
+
+static void on_bucket( void *arg, const struct rollup_bucket *b ) {
+  unsigned long *emitted = arg;
+
+  emitted[b->level]++;
+  if ( b->level == ROLLUP_1M && nminutes < MINUTES ) minutes[nminutes++] = *b;
+}
+
+int main( void ) {
+  unsigned long emitted[ROLLUP_LEVELS] = { 0 };
+  static struct naive naive[MINUTES];
+  struct rollup_stats stats;
+  struct rollup_range range;
+  struct rollup *r;
+  double t0, gen_ns, add_ns, range_ns, scan_ns;
+  volatile float sink = 0;
+  float *raw;
+  unsigned long bad = 0, nranges = 0;
+  float v[3];
+  __u64 ts;
+
+  r = rollup_new( NULL, on_bucket, emitted );
+  if ( r == NULL ) {
+    perror( "rollup_new" );
+    return 1;
+  }
+
+  // the generator's own cost is taken off the timings below
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (unsigned long i = 0; i < NSAMPLES; i++)
+    if ( make_sample( i, &ts, v ) ) sink += v[0];
+  gen_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (unsigned long i = 0; i < NSAMPLES; i++) {
+    unsigned long j = i;
+
+    // every 100th pair of samples arrives swapped
+    if ( i % 100 == 10 ) j = i + 1;
+    else if ( i % 100 == 11 ) j = i - 1;
+    if ( make_sample( j, &ts, v ) ) rollup_add( r, ts, v );
+  }
+  rollup_flush( r );
+  add_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES - gen_ns;
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int n = 0; n < 100000; n++) {
+    for (int k = 0; k < ROLLUP_LEVELS; k++)
+      if ( rollup_range( r, k, &range ) == 0 ) nranges++;
+  }
+  range_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / nranges;
+  rollup_stats( r, &stats );
+
+  // the straightforward way, per minute with long double sums
+  for (unsigned long i = 0; i < NSAMPLES; i++) {
+    struct naive *m;
+
+    if ( !make_sample( i, &ts, v ) ) continue;
+    m = &naive[MINUTE( ts )];
+    for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+      m->sum[c] += v[c];
+      m->sq[c] += (long double) v[c] * v[c];
+      if ( m->count == 0 || v[c] < m->min[c] ) m->min[c] = v[c];
+      if ( m->count == 0 || v[c] > m->max[c] ) m->max[c] = v[c];
+    }
+    m->count++;
+  }
+  for (int b = 0; b < nminutes; b++) {
+    const struct rollup_bucket *rb = &minutes[b];
+    struct naive *m = &naive[MINUTE( rb->start )];
+
+    if ( m->count != rb->count ) {
+      bad++;
+      continue;
+    }
+    for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+      long double mean = m->sum[c] / m->count;
+      long double var = (m->sq[c] - m->sum[c] * mean) / (m->count - 1);
+
+      if ( fabsl( mean - rb->ch[c].mean ) > 1e-9 * fabsl( mean ) ||
+           fabsl( var - rollup_variance( &rb->ch[c] ) ) > 1e-6 * var + 1e-9 ||
+           m->min[c] != rb->ch[c].min || m->max[c] != rb->ch[c].max )
+        bad++;
+    }
+  }
+
+  // what the server does today: an hour of raw samples from history,
+  // reduced to 1 min rollups on every request
+  raw = malloc( 3600 * RATE_HZ * sizeof(float) );
+  if ( raw == NULL ) {
+    perror( "malloc" );
+    return 1;
+  }
+  for (unsigned long i = 0; i < 3600 * RATE_HZ; i++)
+    raw[i] = make_sample( i, &ts, v ) ? v[ROLLUP_PRESSURE] : NAN;
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int m = 0; m < 60; m++) {
+    double sum = 0, sq = 0, lo = INFINITY, hi = -INFINITY;
+    unsigned long n = 0;
+
+    for (unsigned long i = m * 60 * RATE_HZ; i < (m + 1) * 60 * RATE_HZ; i++) {
+      if ( isnan( raw[i] ) ) continue;
+      sum += raw[i];
+      sq += raw[i] * raw[i];
+      if ( raw[i] < lo ) lo = raw[i];
+      if ( raw[i] > hi ) hi = raw[i];
+      n++;
+    }
+    sink += sum / n + sq + lo + hi;
+  }
+  scan_ns = clock_ns( CLOCK_MONOTONIC ) - t0;
+  free( raw );
+
+  printf( "input %d Hz, %lu samples, %lu reordered, %lu late, %lu evicted\n",
+          RATE_HZ, stats.samples, stats.reordered, stats.late, stats.evicted );
+  printf( "buckets 1s %lu 1m %lu 1h %lu 1d %lu\n", emitted[ROLLUP_1S],
+          emitted[ROLLUP_1M], emitted[ROLLUP_1H], emitted[ROLLUP_1D] );
+  printf( "%-28s%12.1f\n", "ns/sample (all levels)", add_ns );
+  printf( "%-28s%12.1f\n", "ns/rolling range", range_ns );
+  printf( "%-28s%12.2f\n", "ms/hour recomputed from raw", scan_ns / 1e6 );
+  printf( "1 min buckets checked %d, mismatched %lu\n", nminutes, bad );
+
+  rollup_free( r );
+  return bad == 0 ? 0 : 1;
+}
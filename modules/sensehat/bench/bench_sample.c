@@ -0,0 +1,95 @@
+/*
+ *  bench_sample.c
+ *    Syscalls and time per sample on the simulated sense-hat bus, comparing
+ *    the write()/read() sequence of tests/sensehat_sensor_test.c with the
+ *    combined I2C_RDWR transactions issued by sensehat_sample(), one per
+ *    device
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "sensehat.h"
+
+#define NSAMPLES 200000
+
+static unsigned long slave_switches;
+
+/* One message per transfer stands in for one write() or read() syscall */
+static void legacy_xfer( struct i2c_bus *bus, __u16 addr, __u8 reg,
+                         __u8 *buf, __u16 len ) {
+  struct i2c_msg msg = { addr, 0, 1, &reg };
+
+  i2c_bus_transfer( bus, &msg, 1 );
+  msg.flags = I2C_M_RD;
+  msg.len = len;
+  msg.buf = buf;
+  i2c_bus_transfer( bus, &msg, 1 );
+}
+
+static void legacy_sample( struct i2c_bus *bus ) {
+  __u8 buf[3];
+
+  slave_switches++;  // ioctl( i2c, I2C_SLAVE, LPS25H_SAD )
+  legacy_xfer( bus, LPS25H_SAD, LPS25H_STATUS_REG, buf, 2 );
+  legacy_xfer( bus, LPS25H_SAD, LPS25H_FIFO_STATUS, buf, 2 );
+  legacy_xfer( bus, LPS25H_SAD, LPS25H_PRESS_POUT | LPS25H_reg_auto, buf, 3 );
+  slave_switches++;  // ioctl( i2c, I2C_SLAVE, HTS221_SAD )
+  legacy_xfer( bus, HTS221_SAD, HTS221_STATUS_REG, buf, 2 );
+  legacy_xfer( bus, HTS221_SAD, HTS221_HUMIDITY_OUT | HTS221_reg_auto, buf, 2 );
+  legacy_xfer( bus, HTS221_SAD, HTS221_TEMP_OUT | HTS221_reg_auto, buf, 2 );
+}
+
+int main( void ) {
+  struct i2c_bus *bus;
+  struct sensehat *sh;
+  struct sensehat_sample s;
+  double t0, legacy_ns, combined_ns;
+  double legacy_calls, combined_calls;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) {
+    perror( "i2c_sim_open" );
+    return 1;
+  }
+  sh = sensehat_open( bus, NULL );
+  if ( sh == NULL ) {
+    perror( "sensehat_open" );
+    return 1;
+  }
+
+  i2c_bus_reset_stats( bus );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NSAMPLES; i++) legacy_sample( bus );
+  legacy_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+  legacy_calls = (double) (bus->transfers + slave_switches) / NSAMPLES;
+
+  i2c_bus_reset_stats( bus );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NSAMPLES; i++) {
+    if ( sensehat_sample( sh, &s ) == -1 ) {
+      perror( "sensehat_sample" );
+      return 1;
+    }
+  }
+  combined_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+  combined_calls = (double) bus->transfers / NSAMPLES;
+
+  printf( "%-10s%12s%12s\n", "path", "syscalls", "ns/sample" );
+  printf( "%-10s%12.1f%12.0f\n", "legacy", legacy_calls, legacy_ns );
+  printf( "%-10s%12.1f%12.0f\n", "combined", combined_calls, combined_ns );
+  printf( "last sample: %.2f mbar %.2f deg C %.2f rH\n",
+          s.pressure, s.temperature, s.humidity );
+
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ *  bench_sched.c
+ *    Wakeups, bus transactions and scheduling delay on the simulated
+ *    sense-hat with the LPS25H at 25 Hz and the HTS221 at 7 Hz. The old
+ *    loop paced at the faster rate and read both devices every time; the
+ *    scheduler runs each device at its own rate, with and without slack to
+ *    coalesce deadlines that fall close together.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_sched [seconds per run]  (default 3)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "frame_pacer.h"
+#include "sched.h"
+#include "sensehat.h"
+
+#define LPS_ODR 4  // 25 Hz
+#define HTS_ODR 2  // 7 Hz
+
+struct result {
+  double wakeups;       // per second
+  double transfers;     // per second
+  double useless;       // reads per second that found no new data
+  double delay_mean;    // us from deadline to read
+  double delay_max;
+  double cpu;           // ms of cpu time per second
+};
+
+static double cpu_ms( void ) {
+  struct rusage ru;
+
+  getrusage( RUSAGE_SELF, &ru );
+  return ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 +
+         ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+}
+
+static struct sensehat *open_sim( struct i2c_bus **bus ) {
+  static const struct sensehat_config cfg = {
+    .lps25h_odr = LPS_ODR, .lps25h_avgp = 3,
+    .hts221_odr = HTS_ODR, .hts221_avgt = 3, .hts221_avgh = 3
+  };
+  struct sensehat *sh;
+
+  *bus = i2c_sim_open();
+  if ( *bus == NULL ) return NULL;
+  sh = sensehat_open( *bus, &cfg );
+  if ( sh != NULL ) i2c_bus_reset_stats( *bus );
+  return sh;
+}
+
+static void count_useless( const struct sensehat_sample *s, int lps, int hts,
+                           unsigned long *useless ) {
+  if ( lps && !LPS25H_STATUS_REG_P_DA_ef( s->lps25h_status ) ) (*useless)++;
+  if ( hts && !(s->hts221_status & 0x02) ) (*useless)++;
+}
+
+static int run_paced( double seconds, struct result *res ) {
+  struct sensehat_sample s;
+  struct frame_pacer fp;
+  struct i2c_bus *bus;
+  struct sensehat *sh;
+  unsigned long useless = 0, frames;
+  __u64 delay, delay_sum = 0, delay_max = 0;
+  double cpu0;
+
+  sh = open_sim( &bus );
+  if ( sh == NULL ) return -1;
+  frame_pacer_init( &fp, 25.0 );
+  frames = (unsigned long) (seconds * 25);
+  cpu0 = cpu_ms();
+  for (unsigned long i = 0; i < frames; i++) {
+    frame_pacer_wait( &fp );
+    delay = clock_ns( CLOCK_MONOTONIC ) - (fp.next - fp.period);
+    delay_sum += delay;
+    if ( delay > delay_max ) delay_max = delay;
+    sensehat_sample( sh, &s );
+    count_useless( &s, 1, 1, &useless );
+  }
+  res->wakeups = 25.0;
+  res->transfers = bus->transfers / seconds;
+  res->useless = useless / seconds;
+  res->delay_mean = delay_sum / 1e3 / frames;
+  res->delay_max = delay_max / 1e3;
+  res->cpu = (cpu_ms() - cpu0) / seconds;
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
+
+static int run_sched( double seconds, __u64 slack, struct result *res ) {
+  struct sched_stats st;
+  struct sensehat_sample s;
+  struct i2c_bus *bus;
+  struct sensehat *sh;
+  struct sched *sched;
+  unsigned long useless = 0, runs = 0;
+  __u64 delay_sum = 0, delay_max = 0;
+  double cpu0;
+  int lps, hts, due;
+
+  sh = open_sim( &bus );
+  if ( sh == NULL ) return -1;
+  sched = sched_new( slack );
+  if ( sched == NULL ) return -1;
+  lps = sched_add( sched, sensehat_lps25h_period_ns( LPS_ODR ) );
+  hts = sched_add( sched, sensehat_hts221_period_ns( HTS_ODR ) );
+  cpu0 = cpu_ms();
+  for (;;) {
+    due = sched_wait( sched );
+    if ( due <= 0 ) continue;
+    if ( due == ((1 << lps) | (1 << hts)) )
+      sensehat_sample( sh, &s );
+    else if ( due == 1 << lps )
+      sensehat_sample_pressure( sh, &s );
+    else
+      sensehat_sample_humidity( sh, &s );
+    count_useless( &s, due & 1 << lps, due & 1 << hts, &useless );
+    sched_stats( sched, &st );
+    if ( st.elapsed >= seconds * 1e9 ) break;
+  }
+  res->cpu = (cpu_ms() - cpu0) / seconds;
+
+  for (int i = 0; i < st.ntasks; i++) {
+    runs += st.task[i].runs;
+    delay_sum += st.task[i].delay_sum;
+    if ( st.task[i].delay_max > delay_max ) delay_max = st.task[i].delay_max;
+  }
+  res->wakeups = sched_wakeup_rate( &st );
+  res->transfers = bus->transfers * 1e9 / st.elapsed;
+  res->useless = useless * 1e9 / st.elapsed;
+  res->delay_mean = runs ? delay_sum / 1e3 / runs : 0;
+  res->delay_max = delay_max / 1e3;
+  sched_free( sched );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
+
+static void print( const char *name, const struct result *r ) {
+  printf( "%-22s%10.2f%10.2f%10.2f%12.0f%12.0f%10.3f\n", name, r->wakeups,
+          r->transfers, r->useless, r->delay_mean, r->delay_max, r->cpu );
+}
+
+int main( int argc, char **argv ) {
+  double seconds = argc > 1 ? atof( argv[1] ) : 3.0;
+  struct result r;
+
+  if ( !(seconds > 0) ) {
+    fprintf( stderr, "usage: %s [seconds per run]\n", argv[0] );
+    return 1;
+  }
+  printf( "%-22s%10s%10s%10s%12s%12s%10s\n", "loop", "wakeup/s", "xfer/s",
+          "stale/s", "delay us", "max us", "cpu ms/s" );
+  if ( run_paced( seconds, &r ) == -1 ) goto fail;
+  print( "paced 25 Hz, both", &r );
+  if ( run_sched( seconds, 0, &r ) == -1 ) goto fail;
+  print( "sched, no slack", &r );
+  if ( run_sched( seconds, 10000000ULL, &r ) == -1 ) goto fail;
+  print( "sched, 10 ms slack", &r );
+  if ( run_sched( seconds, 40000000ULL, &r ) == -1 ) goto fail;
+  print( "sched, 40 ms slack", &r );
+  return 0;
+
+fail:
+  perror( "bench_sched" );
+  return 1;
+}
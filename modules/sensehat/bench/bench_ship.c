@@ -0,0 +1,420 @@
+/*
+ *  bench_ship.c
+ *    MB/s and CPU of the archive shipper over TCP on loopback, with the cap,
+ *    across a cut link, for files closed while it runs, and against rsync
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_ship [-d dir]
+ *    -d  make the archive and the server's directories in dir, /tmp by
+ *        default
+ *
+ *  The shipper is this process, the server a child, so each side's CPU
+ *  time is its own. rsync runs the way it is run by hand, the server end
+ *  started through --rsh as ssh would, here without ssh itself so neither
+ *  side pays for encryption. It is skipped if there is no rsync.
+ *
+ *  In the live run the files are written by a thread of this process, so
+ *  its tx cpu includes the writing.
+ *
+ *  Every file received is compared with the one sent. After the cut the
+ *  shipper has to resend what was in flight, no more; after the restart
+ *  the manifest has to tell it that everything was shipped already.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "clock.h"
+#include "ship.h"
+
+#define FILES      8
+#define FILE_MB    16
+#define CAP_MB     32
+#define CUT_MB     40
+#define LIVE_FILES 10
+#define LIVE_MB    4
+#define LIVE_MS    200
+
+struct rx_result {
+  struct ship_rx_stats st;
+  double cpu;  // ns
+};
+
+struct live {
+  const char *dir;
+  __u64 closed[LIVE_FILES];
+};
+
+static double cpu_ns( int who ) {
+  struct rusage ru;
+
+  getrusage( who, &ru );
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+static void wait_fd( int fd, short events ) {
+  struct pollfd pfd = { fd, events, 0 };
+
+  while ( poll( &pfd, 1, -1 ) == -1 && errno == EINTR );
+}
+
+/* A file of mb MiB that does not compress, as a recording would not */
+static int make_file( const char *dir, const char *name, int mb, __u64 *x,
+                      __u64 *closed ) {
+  static __u64 buf[8192];
+  char path[256];
+  int fd, rc = 0;
+
+  snprintf( path, sizeof(path), "%s/%s", dir, name );
+  fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd == -1 ) return -1;
+  for (int i = 0; i < mb * 16 && rc == 0; i++) {
+    for (int j = 0; j < 8192; j++) {
+      *x ^= *x << 13;
+      *x ^= *x >> 7;
+      *x ^= *x << 17;
+      buf[j] = *x;
+    }
+    if ( write( fd, buf, sizeof(buf) ) != sizeof(buf) ) rc = -1;
+  }
+  // taken before the close the shipper wakes up on
+  if ( closed != NULL )
+    __atomic_store_n( closed, clock_ns( CLOCK_MONOTONIC ), __ATOMIC_RELEASE );
+  close( fd );
+  return rc;
+}
+
+/* Number of the files of src missing from dst or differing */
+static int compare( const char *src, const char *dst, int n,
+                    const char *fmt ) {
+  static char a[65536], b[65536];
+  char name[64], path[256];
+  int fa, fb, bad = 0;
+  ssize_t na, nb;
+
+  for (int i = 0; i < n; i++) {
+    snprintf( name, sizeof(name), fmt, i );
+    snprintf( path, sizeof(path), "%s/%s", src, name );
+    fa = open( path, O_RDONLY );
+    snprintf( path, sizeof(path), "%s/%s", dst, name );
+    fb = open( path, O_RDONLY );
+    if ( fa == -1 || fb == -1 ) {
+      bad++;
+      if ( fa != -1 ) close( fa );
+      if ( fb != -1 ) close( fb );
+      continue;
+    }
+    do {
+      na = read( fa, a, sizeof(a) );
+      nb = read( fb, b, sizeof(b) );
+      if ( na != nb || (na > 0 && memcmp( a, b, na ) != 0) ) {
+        bad++;
+        break;
+      }
+    } while ( na > 0 );
+    close( fa );
+    close( fb );
+  }
+  return bad;
+}
+
+/* The server: every connection, the first cut after cut bytes, reported
+   through the pipe as it ends */
+static void receiver( int lfd, const char *dir, long long cut, int out ) {
+  struct ship_rx *rx;
+  struct rx_result res;
+  long long got;
+  long n;
+  int fd;
+
+  while ( (fd = accept( lfd, NULL, NULL )) != -1 ) {
+    rx = ship_rx_new( dir, fd );
+    if ( rx == NULL ) _exit( 1 );
+    res.cpu = cpu_ns( RUSAGE_SELF );
+    got = 0;
+    for (;;) {
+      n = ship_rx_recv( rx );
+      if ( n == -1 ) break;
+      got += n;
+      if ( cut > 0 && got >= cut ) {
+        cut = 0;
+        break;
+      }
+      if ( n == 0 ) wait_fd( fd, POLLIN );
+    }
+    res.cpu = cpu_ns( RUSAGE_SELF ) - res.cpu;
+    ship_rx_stats( rx, &res.st );
+    if ( write( out, &res, sizeof(res) ) != sizeof(res) ) _exit( 1 );
+    ship_rx_free( rx );
+    close( fd );
+  }
+  _exit( 0 );
+}
+
+static int listen_any( int *port ) {
+  struct sockaddr_in sa = { .sin_family = AF_INET };
+  socklen_t len = sizeof(sa);
+  int fd;
+
+  sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( fd == -1 || bind( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ||
+       listen( fd, 1 ) == -1 ||
+       getsockname( fd, (struct sockaddr *) &sa, &len ) == -1 )
+    return -1;
+  *port = ntohs( sa.sin_port );
+  return fd;
+}
+
+static int connect_to( int port ) {
+  struct sockaddr_in sa = { .sin_family = AF_INET };
+  int fd;
+
+  sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  sa.sin_port = htons( port );
+  fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+  if ( fd != -1 && connect( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 &&
+       errno != EINPROGRESS ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+static void *writer( void *arg ) {
+  struct live *l = arg;
+  __u64 x = 88172645463325252ULL;
+  char name[32];
+
+  for (int i = 0; i < LIVE_FILES; i++) {
+    usleep( LIVE_MS * 1000 );
+    snprintf( name, sizeof(name), "live%03d.ts", i );
+    if ( make_file( l->dir, name, LIVE_MB, &x, &l->closed[i] ) == -1 )
+      perror( name );
+  }
+  return NULL;
+}
+
+/* Ship the archive src into dst until files are shipped, connecting again
+   whenever the link fails. With l set the files are written meanwhile and
+   lat gets the time from the close of each to its last ack. */
+static int run( const char *name, const char *src, const char *dst,
+                const char *manifest, const struct ship_config *cfg,
+                long long cut, int files, struct live *l, __u64 *lat ) {
+  struct ship_stats st;
+  struct rx_result res, rx = { { 0 }, 0 };
+  struct pollfd pfd[2];
+  struct ship *s;
+  pthread_t thread;
+  double cpu, wall;
+  int pipefd[2], lfd, fd, port, conns = 1, timeout, status;
+  __u64 t0, now, due;
+  pid_t pid;
+
+  lfd = listen_any( &port );
+  if ( lfd == -1 || pipe( pipefd ) == -1 ) return -1;
+  pid = fork();
+  if ( pid == -1 ) return -1;
+  if ( pid == 0 ) receiver( lfd, dst, cut, pipefd[1] );
+  close( lfd );
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  cpu = cpu_ns( RUSAGE_SELF );
+  s = ship_new( src, manifest, cfg );
+  fd = connect_to( port );
+  if ( s == NULL || fd == -1 ) return -1;
+  if ( l != NULL && pthread_create( &thread, NULL, writer, l ) != 0 )
+    return -1;
+  ship_attach( s, fd );
+  for (;;) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( ship_send( s, now ) == -1 ) {
+      if ( errno != ECONNRESET && errno != EPIPE ) return -1;
+      close( fd );
+      fd = connect_to( port );
+      if ( fd == -1 ) return -1;
+      ship_attach( s, fd );
+      conns++;
+      continue;
+    }
+    ship_stats( s, &st );
+    if ( l != NULL && lat != NULL )
+      for (unsigned long i = 0; i < st.files; i++)
+        if ( lat[i] == 0 )
+          lat[i] = now - __atomic_load_n( &l->closed[i], __ATOMIC_ACQUIRE );
+    if ( st.files >= (unsigned long) files && st.pending == 0 ) break;
+
+    due = ship_due( s );
+    timeout = due == 0 ? -1 : due <= now ? 0 :
+              (int) ((due - now + 999999) / 1000000);
+    pfd[0] = (struct pollfd) { ship_fd( s ), POLLIN, 0 };
+    pfd[1] = (struct pollfd) { fd, ship_events( s ), 0 };
+    poll( pfd, 2, timeout );
+    if ( (pfd[0].revents & POLLIN) && ship_handle( s ) == -1 ) return -1;
+  }
+  cpu = cpu_ns( RUSAGE_SELF ) - cpu;
+  wall = (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e9;
+  if ( l != NULL ) pthread_join( thread, NULL );
+  close( fd );
+
+  for (int i = 0; i < conns; i++) {
+    if ( read( pipefd[0], &res, sizeof(res) ) != sizeof(res) ) return -1;
+    rx.st.files += res.st.files;
+    rx.st.resumed += res.st.resumed;
+    rx.st.bytes += res.st.bytes;
+    rx.cpu += res.cpu;
+  }
+  kill( pid, SIGTERM );
+  waitpid( pid, &status, 0 );
+  close( pipefd[0] );
+  close( pipefd[1] );
+  ship_free( s );
+
+  printf( "%-9s%9.1f%9.1f%8.1f%%%8.1f%%%8lu%8lu%10.1f\n", name,
+          st.bytes / wall / 1e6, wall, 100.0 * cpu / (wall * 1e9),
+          100.0 * rx.cpu / (wall * 1e9), st.files, st.resumed,
+          st.bytes / 1e6 );
+  if ( st.failures > 0 || conns > 1 )
+    printf( "  %d connections, %lu failures, %lu files received, %lu "
+            "resumed\n", conns, st.failures, rx.st.files, rx.st.resumed );
+  return 0;
+}
+
+/* rsync as it is run by hand, its ssh a shell that runs the server end */
+static int run_rsync( const char *base, const char *src, const char *dst ) {
+  char rsh[300], cmd[1024];
+  double cpu, wall;
+  __u64 t0;
+  FILE *f;
+
+  if ( system( "command -v rsync > /dev/null" ) != 0 ) {
+    printf( "%-9s not installed, skipped\n", "rsync" );
+    return 0;
+  }
+  snprintf( rsh, sizeof(rsh), "%s/rsh", base );
+  f = fopen( rsh, "w" );
+  if ( f == NULL ) return -1;
+  fprintf( f, "#!/bin/sh\nshift\nexec \"$@\"\n" );
+  fclose( f );
+  chmod( rsh, 0755 );
+  snprintf( cmd, sizeof(cmd), "rsync -a --rsh=%s %s/ localhost:%s/", rsh,
+            src, dst );
+
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  cpu = cpu_ns( RUSAGE_CHILDREN );
+  if ( system( cmd ) != 0 ) return -1;
+  cpu = cpu_ns( RUSAGE_CHILDREN ) - cpu;
+  wall = (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e9;
+  // both ends are children, their CPU is counted together
+  printf( "%-9s%9.1f%9.1f%17.1f%%%16s%10.1f\n", "rsync",
+          FILES * FILE_MB * 1048576.0 / wall / 1e6, wall,
+          100.0 * cpu / (wall * 1e9), "", FILES * FILE_MB * 1048576.0 / 1e6 );
+  return 0;
+}
+
+static int cmp( const void *a, const void *b ) {
+  __u64 x = *(const __u64 *) a, y = *(const __u64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+int main( int argc, char **argv ) {
+  static const char *dirs[] = { "archive", "live", "ship", "capped", "cut",
+                                "shiplive", "rsync" };
+  enum { SRC, LIVE, SHIP, CAPPED, CUT, SHIPLIVE, RSYNC, DIRS };
+  struct ship_config cfg = SHIP_CONFIG_DEFAULT;
+  struct ship_config capped = SHIP_CONFIG_DEFAULT;
+  const char *parent = "/tmp";
+  char base[256], dir[DIRS][300], man[4][300], name[32], cmd[512];
+  static __u64 lat[LIVE_FILES];
+  struct live l;
+  struct ship_stats st;
+  struct ship *s;
+  __u64 x = 88172645463325252ULL, t0;
+  int opt, rc = 1, bad;
+
+  while ( (opt = getopt( argc, argv, "d:" )) != -1 ) {
+    switch ( opt ) {
+      case 'd': parent = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-d dir]\n", argv[0] );
+        return 1;
+    }
+  }
+  snprintf( base, sizeof(base), "%s/bench_ship.XXXXXX", parent );
+  if ( mkdtemp( base ) == NULL ) {
+    perror( base );
+    return 1;
+  }
+  for (int i = 0; i < DIRS; i++) {
+    snprintf( dir[i], sizeof(dir[i]), "%s/%s", base, dirs[i] );
+    if ( mkdir( dir[i], 0755 ) == -1 ) goto out;
+  }
+  for (int i = 0; i < 4; i++)
+    snprintf( man[i], sizeof(man[i]), "%s/%d.manifest", base, i );
+  for (int i = 0; i < FILES; i++) {
+    snprintf( name, sizeof(name), "rec%03d.ts", i );
+    if ( make_file( dir[SRC], name, FILE_MB, &x, NULL ) == -1 ) goto out;
+  }
+
+  printf( "%d files of %d MiB, cap %d MB/s, cut after %d MiB\n", FILES,
+          FILE_MB, CAP_MB, CUT_MB );
+  printf( "%-9s%9s%9s%9s%9s%8s%8s%10s\n", "mode", "MB/s", "s", "tx cpu",
+          "rx cpu", "files", "resumed", "MB sent" );
+  capped.rate = CAP_MB * 1000000ULL;
+  l.dir = dir[LIVE];
+  memset( l.closed, 0, sizeof(l.closed) );
+  if ( run( "ship", dir[SRC], dir[SHIP], man[0], &cfg, 0, FILES, NULL,
+            NULL ) == -1 ||
+       run( "capped", dir[SRC], dir[CAPPED], man[1], &capped, 0, FILES,
+            NULL, NULL ) == -1 ||
+       run( "cut", dir[SRC], dir[CUT], man[2], &cfg, CUT_MB * 1048576LL,
+            FILES, NULL, NULL ) == -1 ||
+       run( "live", dir[LIVE], dir[SHIPLIVE], man[3], &cfg, 0, LIVE_FILES,
+            &l, lat ) == -1 ||
+       run_rsync( base, dir[SRC], dir[RSYNC] ) == -1 )
+    goto out;
+
+  qsort( lat, LIVE_FILES, sizeof(*lat), cmp );
+  printf( "live: a %d MiB file every %d ms, close to shipped p50 %.1f max "
+          "%.1f ms\n", LIVE_MB, LIVE_MS, lat[LIVE_FILES / 2] / 1e6,
+          lat[LIVE_FILES - 1] / 1e6 );
+
+  // a restart finds everything shipped in the manifest
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  s = ship_new( dir[SRC], man[0], &cfg );
+  if ( s == NULL ) goto out;
+  ship_stats( s, &st );
+  printf( "restart: %lu of %d files pending after %.0f us\n", st.pending,
+          FILES, (clock_ns( CLOCK_MONOTONIC ) - t0) / 1e3 );
+  ship_free( s );
+
+  bad = compare( dir[SRC], dir[SHIP], FILES, "rec%03d.ts" ) +
+        compare( dir[SRC], dir[CAPPED], FILES, "rec%03d.ts" ) +
+        compare( dir[SRC], dir[CUT], FILES, "rec%03d.ts" ) +
+        compare( dir[LIVE], dir[SHIPLIVE], LIVE_FILES, "live%03d.ts" );
+  printf( "received files: %s\n", bad == 0 ? "identical" : "MISMATCH" );
+  rc = bad == 0 && st.pending == 0 ? 0 : 1;
+
+out:
+  if ( rc != 0 && errno != 0 ) perror( "bench_ship" );
+  snprintf( cmd, sizeof(cmd), "rm -rf '%s'", base );
+  if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", base );
+  return rc;
+}
@@ -0,0 +1,158 @@
+/*
+ *  bench_shm.c
+ *    Cost of reading the latest sample from shared memory with 1..N reader
+ *    threads while the writer publishes as fast as it can, compared with
+ *    reading the simulated bus directly. Every snapshot is checked for
+ *    tearing: the writer keeps all fields of a sample derived from one
+ *    counter.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "clock.h"
+#include "i2c_sim.h"
+#include "sample_shm.h"
+#include "sensehat.h"
+
+#define NAME     "/bench_shm"
+#define NREADS   2000000
+#define MAX_READERS 4
+
+static volatile int writing = 1;
+static long write_interval;  // ns between publications, 0 for flat out
+static struct sample_shm *writer;
+
+struct reader {
+  pthread_t thread;
+  unsigned long torn;
+  unsigned long busy;  // EAGAIN returns
+  double ns;
+};
+
+static void *write_loop( void *arg ) {
+  struct sensehat_sample s = { 0 };
+  __u32 n = 0;
+
+  while ( writing ) {
+    n++;
+    s.p_raw = n;
+    s.h_raw = (__s16) n;
+    s.t_raw = (__s16) ~n;
+    s.lps25h_status = n & 0xff;
+    s.hts221_status = ~n & 0xff;
+    s.pressure = n;
+    s.temperature = -(float) n;
+    s.humidity = n & 0xffff;
+    sample_shm_publish( writer, &s, n );
+    if ( write_interval ) {
+      struct timespec ts = { 0, write_interval };
+      nanosleep( &ts, NULL );
+    }
+  }
+  return NULL;
+}
+
+static void *read_loop( void *arg ) {
+  struct reader *r = arg;
+  struct sample_shm_data d;
+  struct sample_shm *shm;
+  __u32 n;
+  double t0;
+
+  shm = sample_shm_attach( NAME );
+  if ( shm == NULL ) {
+    perror( "sample_shm_attach" );
+    exit( 1 );
+  }
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NREADS; i++) {
+    if ( sample_shm_read( shm, &d ) == -1 ) {
+      if ( errno != EAGAIN && errno != ENODATA ) {
+        perror( "sample_shm_read" );
+        exit( 1 );
+      }
+      r->busy++;
+      continue;
+    }
+    n = d.sample.p_raw;
+    if ( d.timestamp != n || d.sample.h_raw != (__s16) n ||
+         d.sample.t_raw != (__s16) ~n || d.sample.lps25h_status != (n & 0xff) ||
+         d.sample.hts221_status != (~n & 0xff) ||
+         d.sample.temperature != -(float) n )
+      r->torn++;
+  }
+  r->ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NREADS;
+  sample_shm_close( shm, 0 );
+  return NULL;
+}
+
+/* Start a writer publishing every interval ns and read with 1..N threads */
+static void run( long interval ) {
+  struct reader readers[MAX_READERS];
+  pthread_t wt;
+
+  write_interval = interval;
+  writing = 1;
+  pthread_create( &wt, NULL, write_loop, NULL );
+  for (int n = 1; n <= MAX_READERS; n *= 2) {
+    unsigned long torn = 0, busy = 0;
+    double ns = 0;
+
+    for (int i = 0; i < n; i++) {
+      readers[i] = (struct reader) { 0 };
+      pthread_create( &readers[i].thread, NULL, read_loop, &readers[i] );
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join( readers[i].thread, NULL );
+      torn += readers[i].torn;
+      busy += readers[i].busy;
+      ns += readers[i].ns / n;
+    }
+    printf( "%-14s%10d%12.1f%10lu%10lu\n",
+            interval ? "shm 10kHz" : "shm flat out", n, ns, torn, busy );
+  }
+  writing = 0;
+  pthread_join( wt, NULL );
+}
+
+int main( void ) {
+  struct sensehat_sample s;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  double t0, bus_ns;
+
+  bus = i2c_sim_open();
+  sh = bus ? sensehat_open( bus, NULL ) : NULL;
+  if ( sh == NULL ) {
+    perror( "sensehat_open" );
+    return 1;
+  }
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NREADS / 10; i++) sensehat_sample( sh, &s );
+  bus_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / (NREADS / 10);
+
+  writer = sample_shm_create( NAME );
+  if ( writer == NULL ) {
+    perror( "sample_shm_create" );
+    return 1;
+  }
+
+  printf( "%-14s%10s%12s%10s%10s\n", "path", "readers", "ns/read", "torn",
+          "busy" );
+  printf( "%-14s%10d%12.0f%10d%10d\n", "sim bus", 1, bus_ns, 0, 0 );
+  // a writer at 10 kHz, then one that never stops writing
+  run( 100000 );
+  run( 0 );
+
+  sample_shm_close( writer, 1 );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ *  bench_soak.c
+ *    Soak test of the whole sensehatd pipeline: millions of samples through
+ *    acquisition, conversion, rollups, weather events, the history store
+ *    and the sample link, with the heap allocations and the RSS on the way
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_soak [-n samples]
+ *    The simulated sense-hat is read at the highest ODR on a clock of its
+ *    own, 25 samples to the simulated second, as fast as the pipeline goes,
+ *    for SAMPLES samples by default: about a day. Each sample takes the
+ *    path sensehatd -d -e -u gives it; the link goes over a socketpair to
+ *    a receiver in the same process, standing in for linkd.
+ *
+ *  Every REPORTS-th of the run prints the RSS and the allocations counted
+ *  by alloc_count.c. After the first WARMUP samples everything should be
+ *  set up: the allocations after it must be 0, and the RSS should stay
+ *  where it is. The history is read back at the end, and every sample
+ *  must be in it, and must have reached the receiver.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "sensehat.h"
+#include "sample_shm.h"
+#include "rollup.h"
+#include "weather.h"
+#include "sample_link.h"
+#include "sample_pool.h"
+#include "ts_store.h"
+#include "ts_writer.h"
+#include "alloc_count.h"
+
+#define SAMPLES 2000000UL
+#define WARMUP  100000UL
+#define REPORTS 8
+
+struct soak {
+  __u64 now;                   // sim clock
+  struct sample_pool *pool;
+  struct sample_batch *batch;
+  struct ts_writer *writer;
+  unsigned long waits;          // for the writer to put a batch back
+  unsigned long received;      // by the link receiver
+  unsigned long buckets, events;
+};
+
+static __u64 sim_clock( void *arg ) {
+  return *(__u64 *) arg;
+}
+
+/* A day of weather, a front coming through now and then */
+static void drift( void *arg, __u64 now, struct i2c_sim_env *env ) {
+  double h = now / 3.6e12;
+
+  env->pressure = 1013.25f + 4.0f * sin( h / 3.0 );
+  env->temperature = 12.0f + 5.0f * sin( h * M_PI / 12 );
+  env->humidity = 70.0f + 15.0f * cos( h / 2.0 );
+}
+
+static void on_bucket( void *arg, const struct rollup_bucket *b ) {
+  ((struct soak *) arg)->buckets++;
+}
+
+static void on_event( void *arg, const struct weather_event *ev ) {
+  ((struct soak *) arg)->events++;
+}
+
+static void on_frame( void *arg, const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+  ((struct soak *) arg)->received += hdr->count;
+}
+
+static int count( void *arg, const struct ts_sample *s ) {
+  (*(unsigned long *) arg)++;
+  return 0;
+}
+
+/* From the page tables, statm is only as exact as the per-CPU counters */
+static long rss_kib( void ) {
+  char line[128];
+  long kib = -1;
+  FILE *fp;
+
+  // read while the counter is not looked at, fopen() allocates
+  fp = fopen( "/proc/self/smaps_rollup", "r" );
+  if ( fp == NULL ) return -1;
+  while ( fgets( line, sizeof(line), fp ) != NULL )
+    if ( sscanf( line, "Rss: %ld", &kib ) == 1 ) break;
+  fclose( fp );
+  return kib;
+}
+
+/* What record() in sensehatd does, but that it waits for a batch where the
+   daemon drops the sample: flat out, the loop outruns the writer on one
+   core, where the daemon has 40 ms between samples to spare */
+static void record( struct soak *sk, __u64 ts,
+                    const struct sensehat_sample *s ) {
+  struct timespec pause = { 0, 100000 };
+
+  while ( sk->batch == NULL &&
+          (sk->batch = sample_batch_get( sk->pool )) == NULL ) {
+    sk->waits++;
+    nanosleep( &pause, NULL );
+  }
+  sk->batch->rec[sk->batch->count++] = (struct sample_link_rec) { ts, *s };
+  if ( sk->batch->count == sk->batch->size &&
+       ts_writer_hand( sk->writer, &sk->batch ) == -1 )
+    perror( "ts_writer_hand" );
+}
+
+int main( int argc, char **argv ) {
+  char tmp[] = "/tmp/bench_soak.XXXXXX";
+  char shm_name[64], cmd[128];
+  struct i2c_sim_env rms = { 0.02f, 0.05f, 0.3f };
+  struct sensehat_config cfg = { 4, 1, 3, 3, 3 };
+  struct soak sk = { .now = 1000000000ULL };
+  unsigned long samples = SAMPLES, stored = 0, i;
+  unsigned long base = 0, reporting = 0, steady;
+  struct alloc_stats as, after;
+  struct sample_pool_stats ps;
+  struct ts_writer_stats ws;
+  struct sample_link_rx *rx;
+  struct sample_link *link;
+  struct sensehat_sample s;
+  struct sample_shm *shm;
+  struct ts_store *store;
+  struct rollup *rollup;
+  struct weather *w;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  __u64 t0, start, period;
+  long rss, rss_warm = 0;
+  int opt, sv[2], fresh, rc = 0;
+
+  while ( (opt = getopt( argc, argv, "n:" )) != -1 ) {
+    switch ( opt ) {
+      case 'n': samples = strtoul( optarg, NULL, 10 ); break;
+      default:
+        fprintf( stderr, "usage: %s [-n samples]\n", argv[0] );
+        return 1;
+    }
+  }
+  if ( samples <= WARMUP ) samples = WARMUP + 1;
+  if ( mkdtemp( tmp ) == NULL ) {
+    perror( "mkdtemp" );
+    return 1;
+  }
+  snprintf( shm_name, sizeof(shm_name), "/bench_soak.%d", (int) getpid() );
+
+  // everything the daemon sets up before its loop
+  bus = i2c_sim_open();
+  if ( bus == NULL ) return 1;
+  i2c_sim_set_clock( bus, sim_clock, &sk.now );
+  i2c_sim_set_noise( bus, &rms );
+  i2c_sim_set_env_fn( bus, drift, NULL );
+  sh = sensehat_open( bus, &cfg );
+  shm = sample_shm_create( shm_name );
+  rollup = rollup_new( NULL, on_bucket, &sk );
+  w = weather_new( NULL, on_event, &sk );
+  store = ts_store_open( tmp, NULL );
+  sk.pool = sample_pool_new( NULL );
+  sk.writer = store == NULL || sk.pool == NULL ? NULL :
+              ts_writer_new( store );
+  link = sample_link_new( NULL );
+  if ( sh == NULL || shm == NULL || rollup == NULL || w == NULL ||
+       sk.writer == NULL || link == NULL ||
+       socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) == -1 ||
+       (rx = sample_link_rx_new( sv[1] )) == NULL ) {
+    perror( "setup" );
+    return 1;
+  }
+  sample_link_attach( link, sv[0] );
+  period = sensehat_lps25h_period_ns( cfg.lps25h_odr );
+  t0 = clock_ns( CLOCK_REALTIME );
+
+  printf( "%9s %7s %9s %10s %12s %8s %7s\n", "samples", "hours", "RSS KiB",
+          "allocs", "since warm", "pool out", "wall s" );
+  // the first read of the RSS grows it by what it takes itself
+  rss_kib();
+  start = clock_ns( CLOCK_MONOTONIC );
+  for (i = 1; i <= samples; i++) {
+    float v[WEATHER_CHANNELS];
+
+    sk.now += period;
+    if ( sensehat_sample( sh, &s ) == -1 ) {
+      perror( "sensehat_sample" );
+      rc = 1;
+      break;
+    }
+    sample_shm_publish( shm, &s, sk.now );
+    v[WEATHER_PRESSURE] = s.pressure;
+    v[WEATHER_TEMPERATURE] = s.temperature;
+    v[WEATHER_HUMIDITY] = s.humidity;
+    fresh = LPS25H_STATUS_REG_P_DA_ef( s.lps25h_status ) ?
+            1 << WEATHER_PRESSURE : 0;
+    if ( (s.hts221_status & 3) == 3 )
+      fresh |= 1 << WEATHER_TEMPERATURE | 1 << WEATHER_HUMIDITY;
+    // the rollup channels are in the same order
+    record( &sk, t0 + sk.now, &s );
+    rollup_add( rollup, t0 + sk.now, v );
+    weather_add( w, t0 + sk.now, v, fresh );
+    sample_link_push( link, &(struct sample_link_rec) { t0 + sk.now, s },
+                      sk.now );
+    if ( sample_link_send( link, sk.now ) == -1 ) {
+      perror( "sample_link_send" );
+      rc = 1;
+      break;
+    }
+    if ( sample_link_recv( rx, on_frame, &sk ) == -1 ) {
+      perror( "sample_link_recv" );
+      rc = 1;
+      break;
+    }
+
+    if ( i == WARMUP || i % (samples / REPORTS) == 0 || i == samples ) {
+      alloc_stats( &as );
+      if ( i == WARMUP ) base = as.allocs;
+      rss = rss_kib();
+      if ( i == WARMUP ) rss_warm = rss;
+      sample_pool_stats( sk.pool, &ps );
+      printf( "%9lu %7.2f %9ld %10lu %12lu %8lu %7.2f\n", i,
+              (sk.now - 1000000000ULL) / 3.6e12, rss, as.allocs,
+              i >= WARMUP ? as.allocs - base - reporting : 0, ps.out,
+              (clock_ns( CLOCK_MONOTONIC ) - start) / 1e9 );
+      // what the report itself allocates is not the pipeline's
+      alloc_stats( &after );
+      if ( i >= WARMUP ) reporting += after.allocs - as.allocs;
+    }
+  }
+  alloc_stats( &as );
+  steady = as.allocs - base - reporting;
+  rss = rss_kib();
+
+  // the tail of the link and the history
+  sample_link_send( link, ~0ULL >> 1 );
+  while ( sample_link_recv( rx, on_frame, &sk ) > 0 );
+  if ( sk.batch != NULL && sk.batch->count > 0 )
+    ts_writer_hand( sk.writer, &sk.batch );
+  sample_batch_put( &sk.batch );
+  ts_writer_stop( sk.writer );
+  ts_writer_stats( sk.writer, &ws );
+  sample_pool_stats( sk.pool, &ps );
+  ts_store_close( store );
+  ts_store_query( tmp, 0, ~0ULL, count, &stored );
+
+  printf( "pool: %lu batches of %zu bytes, %lu gets, most %lu out, %lu "
+          "exhausted\n", ps.batches, ps.bytes / ps.batches, ps.gets,
+          ps.most_out, ps.exhausted );
+  printf( "history: %lu records in %lu batches, %lu errors, most %lu "
+          "behind, %lu waits for it, %lu read back\n", ws.records,
+          ws.batches, ws.errors, ws.most_backlog, sk.waits, stored );
+  printf( "%lu received over the link, %lu rollup buckets, %lu weather "
+          "events\n", sk.received, sk.buckets, sk.events );
+  printf( "after warm-up: %lu allocations, RSS %+ld KiB: %s\n", steady,
+          rss - rss_warm, steady == 0 ? "ok" : "ALLOCATING" );
+  if ( steady != 0 ) rc = 1;
+  if ( stored != i - 1 || sk.received != i - 1 ) {
+    printf( "samples: MISMATCH\n" );
+    rc = 1;
+  } else {
+    printf( "samples: ok\n" );
+  }
+
+  ts_writer_free( sk.writer );
+  sample_pool_free( sk.pool );
+  sample_link_rx_free( rx );
+  sample_link_free( link );
+  close( sv[0] );
+  close( sv[1] );
+  weather_free( w );
+  rollup_free( rollup );
+  sample_shm_close( shm, 1 );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  snprintf( cmd, sizeof(cmd), "rm -rf '%s'", tmp );
+  if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", tmp );
+  return rc;
+}
@@ -0,0 +1,113 @@
+/*
+ *  bench_startup.c
+ *    Bus cost of bringing the sense-hat up on the simulated bus: the old
+ *    register by register start, a start from a register image and a start
+ *    from an image with the HTS221 calibration already cached on disk
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "calib_cache.h"
+#include "sensehat.h"
+
+#define NRUNS 20000
+
+static const struct sensehat_image image = SENSEHAT_IMAGE( 3, 3, 3, 3, 3 );
+
+static void write_reg( struct i2c_bus *bus, __u16 addr, __u8 reg, __u8 val ) {
+  i2c_bus_write( bus, addr, reg, &val, 1 );
+}
+
+/* The start sequence before register images: every register on its own */
+static void legacy_open( struct i2c_bus *bus ) {
+  const struct sensehat_image *img = &image;
+  __u8 buf[HTS221_CAL_SIZE];
+
+  i2c_bus_read( bus, LPS25H_SAD, LPS25H_WHO_AM_I, buf, 1 );
+  write_reg( bus, LPS25H_SAD, LPS25H_CTRL_REG1, img->lps25h_ctrl[1] );
+  write_reg( bus, LPS25H_SAD, LPS25H_RES_CONF, img->lps25h_res_conf[1] );
+  write_reg( bus, LPS25H_SAD, LPS25H_FIFO_CTRL, img->lps25h_fifo_ctrl[1] );
+  i2c_bus_read( bus, HTS221_SAD, HTS221_WHO_AM_I, buf, 1 );
+  write_reg( bus, HTS221_SAD, HTS221_CTRL_REG1, img->hts221_ctrl[1] );
+  write_reg( bus, HTS221_SAD, HTS221_AV_CONF, img->hts221_av_conf[1] );
+  i2c_bus_read( bus, HTS221_SAD, HTS221_CAL_H0_rH_x2 | HTS221_reg_auto, buf,
+                HTS221_CAL_SIZE );
+}
+
+static int image_open( struct i2c_bus *bus, const char *cache_dir ) {
+  struct sensehat *sh;
+
+  sh = sensehat_open_image( bus, &image, cache_dir );
+  if ( sh == NULL ) return -1;
+  sensehat_close( sh );
+  return 0;
+}
+
+static void report( const char *path, struct i2c_bus *bus, double ns ) {
+  printf( "%-10s%12.1f%12.1f%12.1f%12.0f\n", path,
+          (double) bus->transfers / NRUNS, (double) bus->messages / NRUNS,
+          (double) bus->bytes / NRUNS, ns / NRUNS );
+}
+
+int main( void ) {
+  char dir[] = "/tmp/bench_startup.XXXXXX";
+  char path[64];
+  struct i2c_bus *bus;
+  double t0;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) {
+    perror( "i2c_sim_open" );
+    return 1;
+  }
+  if ( mkdtemp( dir ) == NULL ) {
+    perror( "mkdtemp" );
+    return 1;
+  }
+
+  printf( "%-10s%12s%12s%12s%12s\n", "path", "syscalls", "messages", "bytes",
+          "ns/start" );
+
+  i2c_bus_reset_stats( bus );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NRUNS; i++) legacy_open( bus );
+  report( "legacy", bus, clock_ns( CLOCK_MONOTONIC ) - t0 );
+
+  i2c_bus_reset_stats( bus );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NRUNS; i++) {
+    if ( image_open( bus, NULL ) == -1 ) {
+      perror( "sensehat_open_image" );
+      return 1;
+    }
+  }
+  report( "image", bus, clock_ns( CLOCK_MONOTONIC ) - t0 );
+
+  // the first start fills the cache, the rest read it from disk
+  if ( image_open( bus, dir ) == -1 ) {
+    perror( "sensehat_open_image" );
+    return 1;
+  }
+  i2c_bus_reset_stats( bus );
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < NRUNS; i++) image_open( bus, dir );
+  report( "cached", bus, clock_ns( CLOCK_MONOTONIC ) - t0 );
+
+  snprintf( path, sizeof(path), "%s/hts221-%s-%02x.cal", dir, bus->name,
+            HTS221_SAD );
+  unlink( path );
+  rmdir( dir );
+  i2c_bus_close( bus );
+  return 0;
+}
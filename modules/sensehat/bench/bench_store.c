@@ -0,0 +1,259 @@
+/*
+ *  bench_store.c
+ *    A day of samples at 12.5 Hz appended to the time-series store and to
+ *    a text log in the format of show_readings(), then one hour read back
+ *    from each. Also checks that every sample decodes to what was written,
+ *    that a torn tail is dropped when the store is reopened, as is a block
+ *    whose keyframe never reached the index, and that the appends go on
+ *    when the clock steps back.
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_store [dir]  (default a new directory in /tmp)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "ts_store.h"
+
+#define NSAMPLES  (24 * 3600 * 25 / 2)
+#define PERIOD_NS 80000000ULL
+#define T_START   1500000000000000000ULL  // July 2017
+#define SEGMENT   (NSAMPLES / 4 + 1)      // so the day spans several
+#define STEP_NS   (3600 * 1000000000ULL)  // the clock goes back an hour
+#define NSTEPPED  1000
+
+/* Slow daily swings with a little noise, and an occasional step large
+   enough to force a keyframe */
+static void make_sample( unsigned long i, struct ts_sample *s ) {
+  double day = 2 * M_PI * i / NSAMPLES;
+
+  s->timestamp = T_START + i * PERIOD_NS + (i * 7919) % 1000;
+  s->p_raw = (__s32) ((1013.25 + 8 * sin( day )) * 4096) + (i * 31) % 97;
+  if ( i % 50000 == 0 ) s->p_raw += 200000;
+  s->h_raw = (__s16) (3000 + 2000 * cos( day )) + (i * 13) % 7;
+  s->t_raw = (__s16) (400 + 300 * sin( day )) + (i * 17) % 5;
+  s->lps25h_status = (i & 1) ? 0x03 : 0x33;
+  s->hts221_status = 0x03;
+}
+
+struct check {
+  unsigned long next;
+  unsigned long bad;
+};
+
+static int check_sample( void *arg, const struct ts_sample *s ) {
+  struct check *c = arg;
+  struct ts_sample want;
+
+  // field by field, the padding of the two is whatever was on the stack
+  make_sample( c->next++, &want );
+  if ( want.timestamp != s->timestamp || want.p_raw != s->p_raw ||
+       want.h_raw != s->h_raw || want.t_raw != s->t_raw ||
+       want.lps25h_status != s->lps25h_status ||
+       want.hts221_status != s->hts221_status )
+    c->bad++;
+  return 0;
+}
+
+static int count_sample( void *arg, const struct ts_sample *s ) {
+  (*(long *) arg)++;
+  return 0;
+}
+
+static long file_size( const char *path ) {
+  struct stat st;
+
+  return stat( path, &st ) == -1 ? 0 : st.st_size;
+}
+
+int main( int argc, char **argv ) {
+  struct ts_store_config cfg = TS_STORE_CONFIG_DEFAULT;
+  char tmp[] = "/tmp/bench_store.XXXXXX";
+  const char *dir = argc > 1 ? argv[1] : NULL;
+  char path[512], line[128];
+  struct ts_store_stats stats;
+  struct ts_store *st;
+  struct ts_sample s;
+  struct check c;
+  double t0, append_ns, text_ns, query_ns, scan_ns;
+  long text_bytes, store_bytes, found, kept, scanned, before, after, total = 0;
+  int rc;
+  __u64 q0, q1;
+  FILE *log;
+
+  if ( dir == NULL ) {
+    if ( mkdtemp( tmp ) == NULL ) {
+      perror( "mkdtemp" );
+      return 1;
+    }
+    dir = tmp;
+  }
+
+  cfg.segment_records = SEGMENT;
+  st = ts_store_open( dir, &cfg );
+  if ( st == NULL ) {
+    perror( "ts_store_open" );
+    return 1;
+  }
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (unsigned long i = 0; i < NSAMPLES; i++) {
+    make_sample( i, &s );
+    if ( ts_store_append( st, &s ) == -1 ) {
+      perror( "ts_store_append" );
+      return 1;
+    }
+  }
+  ts_store_stats( st, &stats );
+  if ( ts_store_close( st ) == -1 ) {
+    perror( "ts_store_close" );
+    return 1;
+  }
+  append_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+  store_bytes = stats.bytes;
+
+  // the text log the cron wrapper keeps today, with a timestamp per line
+  snprintf( path, sizeof(path), "%s/readings.log", dir );
+  log = fopen( path, "w" );
+  if ( log == NULL ) {
+    perror( path );
+    return 1;
+  }
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  for (unsigned long i = 0; i < NSAMPLES; i++) {
+    make_sample( i, &s );
+    fprintf( log, "%llu 0x%-8.04x%+-10.5g0x%-10.04x%+-10.5g"
+             "0x%-10.04x%+-10.5g\n", (unsigned long long) s.timestamp,
+             (__u32) s.p_raw,
+             s.p_raw / 4096.0, (__u16) s.t_raw, s.t_raw / 100.0,
+             (__u16) s.h_raw, s.h_raw / 100.0 );
+  }
+  fclose( log );
+  text_ns = (clock_ns( CLOCK_MONOTONIC ) - t0) / NSAMPLES;
+  text_bytes = file_size( path );
+
+  // one hour from the middle of the day
+  q0 = T_START + (NSAMPLES / 2) * PERIOD_NS;
+  q1 = q0 + 3600 * 1000000000ULL - 1;
+  c.next = NSAMPLES / 2;
+  c.bad = 0;
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  found = ts_store_query( dir, q0, q1, check_sample, &c );
+  query_ns = clock_ns( CLOCK_MONOTONIC ) - t0;
+
+  log = fopen( path, "r" );
+  scanned = 0;
+  t0 = clock_ns( CLOCK_MONOTONIC );
+  while ( fgets( line, sizeof(line), log ) != NULL ) {
+    unsigned long long ts;
+    if ( sscanf( line, "%llu", &ts ) == 1 && ts >= q0 && ts <= q1 )
+      scanned++;
+  }
+  scan_ns = clock_ns( CLOCK_MONOTONIC ) - t0;
+  fclose( log );
+
+  printf( "%-8s%12s%14s%12s%14s\n", "format", "bytes/smp", "MB/day",
+          "ns/append", "1h query ms" );
+  printf( "%-8s%12.2f%14.1f%12.0f%14.2f\n", "text",
+          (double) text_bytes / NSAMPLES, text_bytes / 1e6, text_ns,
+          scan_ns / 1e6 );
+  printf( "%-8s%12.2f%14.1f%12.0f%14.2f\n", "store",
+          (double) store_bytes / NSAMPLES, store_bytes / 1e6,
+          append_ns, query_ns / 1e6 );
+  printf( "keyframes %lu writes %lu syncs %lu segments %lu\n",
+          stats.keyframes, stats.writes, stats.syncs, stats.segments );
+  printf( "hour query: %ld samples (text %ld), %lu mismatched\n", found,
+          scanned, c.bad );
+
+  // chop half a record off the latest segment and carry on appending
+  make_sample( (NSAMPLES - 1) / SEGMENT * SEGMENT, &s );
+  snprintf( path, sizeof(path), "%s/%016llx.tsd", dir,
+            (unsigned long long) s.timestamp );
+  if ( truncate( path, file_size( path ) - 6 ) == -1 ) perror( path );
+  st = ts_store_open( dir, &cfg );
+  if ( st == NULL ) {
+    perror( "ts_store_open" );
+    return 1;
+  }
+  for (unsigned long i = NSAMPLES - 1; i < NSAMPLES + 1000; i++) {
+    make_sample( i, &s );
+    ts_store_append( st, &s );
+  }
+  ts_store_close( st );
+  c.next = 0;
+  c.bad = 0;
+  found = ts_store_query( dir, 0, ~0ULL, check_sample, &c );
+  printf( "after torn tail: %ld samples, %lu mismatched\n", found, c.bad );
+  rc = found == NSAMPLES + 1000 && c.bad == 0 ? 0 : 1;
+
+  // lose the last keyframe of the latest segment but not its records, as a
+  // crash between the two writes of a batch does: the block goes with it
+  make_sample( (NSAMPLES + 1000 - 1) / SEGMENT * SEGMENT, &s );
+  snprintf( path, sizeof(path), "%s/%016llx.tsi", dir,
+            (unsigned long long) s.timestamp );
+  if ( truncate( path, file_size( path ) - 24 ) == -1 ) perror( path );
+  st = ts_store_open( dir, &cfg );
+  if ( st == NULL ) {
+    perror( "ts_store_open" );
+    return 1;
+  }
+  c.next = 0;
+  c.bad = 0;
+  kept = ts_store_query( dir, 0, ~0ULL, check_sample, &c );
+  for (unsigned long i = kept; i < NSAMPLES + 1000; i++) {
+    make_sample( i, &s );
+    ts_store_append( st, &s );
+  }
+  ts_store_close( st );
+  c.next = 0;
+  found = ts_store_query( dir, 0, ~0ULL, check_sample, &c );
+  printf( "after torn index: %ld samples kept, %ld after appending the "
+          "rest, %lu mismatched\n", kept, found, c.bad );
+  if ( kept >= NSAMPLES + 1000 || found != NSAMPLES + 1000 || c.bad != 0 )
+    rc = 1;
+
+  // the clock steps back: the samples after it go into a segment of their
+  // own, and a query of the hour they fall in finds both
+  make_sample( NSAMPLES + 1000, &s );
+  q0 = s.timestamp - STEP_NS;
+  make_sample( NSAMPLES + 1000 + NSTEPPED - 1, &s );
+  q1 = s.timestamp - STEP_NS;
+  before = ts_store_query( dir, q0, q1, count_sample, &total );
+  st = ts_store_open( dir, &cfg );
+  if ( st == NULL ) {
+    perror( "ts_store_open" );
+    return 1;
+  }
+  for (unsigned long i = NSAMPLES + 1000; i < NSAMPLES + 1000 + NSTEPPED;
+       i++) {
+    make_sample( i, &s );
+    s.timestamp -= STEP_NS;
+    if ( ts_store_append( st, &s ) == -1 ) {
+      perror( "ts_store_append" );
+      return 1;
+    }
+  }
+  ts_store_stats( st, &stats );
+  ts_store_close( st );
+  after = ts_store_query( dir, q0, q1, count_sample, &total );
+  found = ts_store_query( dir, 0, ~0ULL, count_sample, &total );
+  printf( "clock stepped back: %lu steps, %ld samples in the hour before "
+          "and %ld after, %ld in all\n", stats.steps, before, after, found );
+  if ( stats.steps != 1 || after != before + NSTEPPED ||
+       found != NSAMPLES + 1000 + NSTEPPED )
+    rc = 1;
+
+  if ( dir == tmp ) {
+    snprintf( path, sizeof(path), "rm -rf '%s'", tmp );
+    if ( system( path ) != 0 ) fprintf( stderr, "could not remove %s\n", tmp );
+  }
+  return rc;
+}
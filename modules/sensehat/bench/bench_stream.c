@@ -0,0 +1,92 @@
+/*
+ *  bench_stream.c
+ *    LPS25H FIFO stream mode on the simulated bus: transactions per sample,
+ *    samples per drain and overrun accounting when the producer polls late
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "i2c_sim.h"
+#include "sensehat.h"
+#include "lps25h_stream.h"
+
+#define NPOLLS 100000
+
+static __u64 vclock;
+
+static __u64 virtual_clock( void *arg ) {
+  (void) arg;
+  return vclock;
+}
+
+/* Poll every lateness * watermark interval on the simulated clock */
+static int run( struct sensehat *sh, int watermark, double lateness ) {
+  struct i2c_bus *bus = sensehat_bus( sh );
+  struct lps25h_fifo_sample out[64];
+  struct lps25h_stream_stats stats;
+  struct lps25h_stream *st;
+  unsigned long consumed = 0;
+  __u64 step;
+
+  st = lps25h_stream_start( sh, watermark, 1024 );
+  if ( st == NULL ) {
+    perror( "lps25h_stream_start" );
+    return -1;
+  }
+  step = (__u64) (lps25h_stream_interval_ns( st ) * lateness);
+  i2c_bus_reset_stats( bus );
+
+  for (int i = 0; i < NPOLLS; i++) {
+    size_t n;
+
+    vclock += step;
+    if ( lps25h_stream_poll( st ) == -1 ) {
+      perror( "lps25h_stream_poll" );
+      return -1;
+    }
+    while ( (n = lps25h_stream_read( st, out, 64 )) > 0 ) consumed += n;
+  }
+
+  lps25h_stream_stats( st, &stats );
+  printf( "%-6d%-9.1f%10lu%10lu%12.3f%10.1f%10lu%10lu\n",
+          watermark, lateness, stats.samples, consumed,
+          (double) bus->transfers / stats.samples,
+          stats.drains ? (double) stats.samples / stats.drains : 0.0,
+          stats.fifo_overruns, stats.ring_dropped );
+  return lps25h_stream_stop( st );
+}
+
+int main( void ) {
+  struct i2c_bus *bus;
+  struct sensehat *sh;
+  struct sensehat_config cfg = SENSEHAT_CONFIG_DEFAULT;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) {
+    perror( "i2c_sim_open" );
+    return 1;
+  }
+  i2c_sim_set_clock( bus, virtual_clock, NULL );
+  cfg.lps25h_odr = 4;  // 25 Hz
+  sh = sensehat_open( bus, &cfg );
+  if ( sh == NULL ) {
+    perror( "sensehat_open" );
+    return 1;
+  }
+
+  printf( "%-6s%-9s%10s%10s%12s%10s%10s%10s\n", "wtm", "late",
+          "samples", "consumed", "xfer/smpl", "smpl/drn", "overrun",
+          "dropped" );
+  if ( run( sh, 1, 1.0 ) == -1 || run( sh, 8, 1.0 ) == -1 ||
+       run( sh, 16, 1.0 ) == -1 || run( sh, 31, 1.0 ) == -1 ||
+       run( sh, 16, 3.0 ) == -1 )
+    return 1;
+
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
@@ -0,0 +1,549 @@
+/*
+ *  bench_suite.c
+ *    The hot paths of the sensor, framebuffer and storage code timed in
+ *    many short batches, with a machine-readable report of the percentiles
+ *    per case and a comparison against a baseline report
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_suite [-o report] [-b baseline [-i report] [-t percent]]
+ *                     [-f prefix]
+ *    -o  write the report to a file instead of stdout
+ *    -b  compare with a baseline report on stderr and exit with 1 when a
+ *        case got slower at the median by more than the spread of the two
+ *        reports, and by at least -t percent (3 by default), or now makes
+ *        more calls per operation
+ *    -i  compare this report with the baseline instead of running
+ *    -f  only run the cases whose names start with prefix
+ *
+ *  Everything runs off the hardware: the sensors are the simulated bus of
+ *  i2c_sim.h and the framebuffer an ordinary file. Each case is timed in
+ *  ROUNDS rounds of ROUND_NS, each made of batches of as many operations
+ *  as take BATCH_NS, so that the percentiles show the spread between
+ *  batches, e.g. the batches where the store writes its buffer out. The
+ *  round with the lowest median is reported, the one least disturbed by
+ *  the rest of the machine, and how far the medians of the other rounds
+ *  are above it as the spread. Two reports of the same build differ by
+ *  about that much, so a change in the median smaller than the spread of
+ *  the two is noise and not a regression. Calls per operation count i2c
+ *  transactions, ioctls and writes; they do not depend on the speed of
+ *  the machine, so they compare exactly between an RPi gen 1 and gen 2.
+ *
+ *  The report is tab separated with a header line. Lines starting with
+ *  '#' say where it was taken.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+#include "sensehat.h"
+#include "convert.h"
+#include "ledmatrix.h"
+#include "sample_shm.h"
+#include "ts_store.h"
+#include "rollup.h"
+
+#define ROUNDS      5
+#define ROUND_NS    1000000000ULL
+#define BATCH_NS    100000ULL
+#define MAX_BATCHES 20000
+#define BLOCK      256       // samples per call of the batch conversions
+#define SHM_NAME   "/bench_suite"
+#define MAX_CASES  32
+
+struct env {
+  struct i2c_bus *bus;
+  struct sensehat *sh;
+  struct sensehat_sample s;
+  struct hts221_calib cal;
+  __s16 t_raw[BLOCK], h_raw[BLOCK];
+  __s32 p_raw[BLOCK], out[BLOCK];
+  float f_out[3][BLOCK];
+  struct ledmatrix *lm;
+  struct led_palette pal;
+  struct fb_t *fb;          // the legacy mapping of the same file
+  __u8 colors[64][3];
+  __u8 idx[64];
+  struct sample_shm *shm;
+  struct ts_store *store;
+  struct rollup *rollup;
+  char line[256];
+};
+
+struct bench_case {
+  const char *name;
+  const char *calls;  // what calls per operation count
+  // run n operations, return the calls made
+  unsigned long (*run)( struct env *e, unsigned long n );
+};
+
+struct result {
+  char name[64];
+  char calls[32];
+  unsigned long batches, ops;            // of the round reported
+  double mean, min, p50, p90, p99, max;  // ns per operation
+  double calls_per_op;
+  double spread;   // % of the slowest round median over the reported one
+};
+
+/* ------------------------------------------------------------------- cases */
+
+static unsigned long sample_combined( struct env *e, unsigned long n ) {
+  unsigned long t = e->bus->transfers;
+
+  while ( n-- ) sensehat_sample( e->sh, &e->s );
+  return e->bus->transfers - t;
+}
+
+/* One message per transfer stands in for one write() or read() syscall */
+static void legacy_xfer( struct i2c_bus *bus, __u16 addr, __u8 reg,
+                         __u8 *buf, __u16 len ) {
+  struct i2c_msg msg = { addr, 0, 1, &reg };
+
+  i2c_bus_transfer( bus, &msg, 1 );
+  msg.flags = I2C_M_RD;
+  msg.len = len;
+  msg.buf = buf;
+  i2c_bus_transfer( bus, &msg, 1 );
+}
+
+/* The sequence of tests/sensehat_sensor_test.c before the driver, with
+   an I2C_SLAVE ioctl per device */
+static unsigned long sample_legacy( struct env *e, unsigned long n ) {
+  unsigned long t = e->bus->transfers;
+  __u8 buf[3];
+
+  for (unsigned long i = 0; i < n; i++) {
+    legacy_xfer( e->bus, LPS25H_SAD, LPS25H_STATUS_REG, buf, 2 );
+    legacy_xfer( e->bus, LPS25H_SAD, LPS25H_FIFO_STATUS, buf, 2 );
+    legacy_xfer( e->bus, LPS25H_SAD, LPS25H_PRESS_POUT | LPS25H_reg_auto,
+                 buf, 3 );
+    legacy_xfer( e->bus, HTS221_SAD, HTS221_STATUS_REG, buf, 2 );
+    legacy_xfer( e->bus, HTS221_SAD, HTS221_HUMIDITY_OUT | HTS221_reg_auto,
+                 buf, 2 );
+    legacy_xfer( e->bus, HTS221_SAD, HTS221_TEMP_OUT | HTS221_reg_auto,
+                 buf, 2 );
+  }
+  return e->bus->transfers - t + 2 * n;
+}
+
+/* The per sample float formulas of show_readings(), with the calibration
+   of the simulated HTS221 */
+static unsigned long convert_float( struct env *e, unsigned long n ) {
+  const float T0 = 15.0f, T1 = 35.0f, H0 = 20.0f, H1 = 80.0f;
+  const float T0_OUT = 200, T1_OUT = 880, H0_OUT = -3000, H1_OUT = 9000;
+
+  for (unsigned long i = 0; i < n; i++) {
+    size_t k = i % BLOCK;
+
+    e->f_out[0][k] = (float) e->p_raw[k] / 4096.0f;
+    e->f_out[1][k] = T0 + (((float) e->t_raw[k] - T0_OUT) /
+                     (T1_OUT - T0_OUT)) * (T1 - T0);
+    e->f_out[2][k] = H0 + (((float) e->h_raw[k] - H0_OUT) /
+                     (H1_OUT - H0_OUT)) * (H1 - H0);
+  }
+  return 0;
+}
+
+static unsigned long convert_batch( struct env *e, unsigned long n ) {
+  while ( n > 0 ) {
+    size_t k = n < BLOCK ? n : BLOCK;
+
+    lps25h_convert_pressure( e->p_raw, e->out, k );
+    hts221_convert_temperature( &e->cal, e->t_raw, e->out, k );
+    hts221_convert_humidity( &e->cal, e->h_raw, e->out, k );
+    n -= k;
+  }
+  return 0;
+}
+
+static void next_frame( struct env *e ) {
+  for (int i = 0; i < 64; i++) e->idx[i] = (e->idx[i] + 1) & 63;
+}
+
+/* display_pixels() from tests/sensehat_rgbmatrix_test.c */
+static unsigned long render_legacy( struct env *e, unsigned long n ) {
+  while ( n-- ) {
+    next_frame( e );
+    for (size_t i = 0; i < 64; i++) {
+      __u16 r = (e->colors[e->idx[i]][0] >> 3) & 0x1F;
+      __u16 g = (e->colors[e->idx[i]][1] >> 2) & 0x3F;
+      __u16 b = (e->colors[e->idx[i]][2] >> 3) & 0x1F;
+      e->fb->pixel[i/8][i%8] = (r << 11) + (g << 5) + b;
+    }
+  }
+  return 0;
+}
+
+static unsigned long render_ledmatrix( struct env *e, unsigned long n ) {
+  unsigned long commits = 0;
+
+  while ( n-- ) {
+    next_frame( e );
+    ledmatrix_draw_indexed( e->lm, &e->pal, e->idx );
+    commits += ledmatrix_commit( e->lm );
+  }
+  return commits;
+}
+
+/* The line show_readings() prints */
+static unsigned long serialize_text( struct env *e, unsigned long n ) {
+  const struct sensehat_sample *s = &e->s;
+
+  while ( n-- )
+    snprintf( e->line, sizeof(e->line), "0x%-8.04x%+-10.5g0x%-10.04x"
+              "%+-10.5g0x%-10.04x%+-10.5g\n", (__u32) s->p_raw, s->pressure,
+              (__u16) s->t_raw, s->temperature, (__u16) s->h_raw,
+              s->humidity );
+  return 0;
+}
+
+static unsigned long serialize_shm( struct env *e, unsigned long n ) {
+  while ( n-- )
+    sample_shm_publish( e->shm, &e->s, clock_ns( CLOCK_MONOTONIC ) );
+  return 0;
+}
+
+static unsigned long store_writes( struct env *e ) {
+  struct ts_store_stats st;
+
+  ts_store_stats( e->store, &st );
+  return st.writes;
+}
+
+static void append( struct env *e, __u64 t ) {
+  struct ts_sample rec = {
+    .timestamp = t,
+    .p_raw = e->s.p_raw,
+    .h_raw = e->s.h_raw,
+    .t_raw = e->s.t_raw,
+    .lps25h_status = e->s.lps25h_status,
+    .hts221_status = e->s.hts221_status,
+  };
+
+  ts_store_append( e->store, &rec );
+}
+
+static unsigned long serialize_store( struct env *e, unsigned long n ) {
+  unsigned long w = store_writes( e );
+
+  while ( n-- ) append( e, clock_ns( CLOCK_MONOTONIC ) );
+  return store_writes( e ) - w;
+}
+
+/* The body of the sensehatd loop: read, publish, store and roll up */
+static unsigned long macro_pipeline( struct env *e, unsigned long n ) {
+  unsigned long calls = e->bus->transfers + store_writes( e );
+
+  while ( n-- ) {
+    __u64 now = clock_ns( CLOCK_MONOTONIC );
+    float v[ROLLUP_CHANNELS];
+
+    sensehat_sample( e->sh, &e->s );
+    sample_shm_publish( e->shm, &e->s, now );
+    append( e, now );
+    v[ROLLUP_PRESSURE] = e->s.pressure;
+    v[ROLLUP_TEMPERATURE] = e->s.temperature;
+    v[ROLLUP_HUMIDITY] = e->s.humidity;
+    rollup_add( e->rollup, now, v );
+  }
+  return e->bus->transfers + store_writes( e ) - calls;
+}
+
+static const struct bench_case cases[] = {
+  { "sample/combined", "i2c_transfers", sample_combined },
+  { "sample/legacy", "syscalls", sample_legacy },
+  { "convert/float", "-", convert_float },
+  { "convert/batch", "-", convert_batch },
+  { "render/legacy", "-", render_legacy },
+  { "render/ledmatrix", "fb_commits", render_ledmatrix },
+  { "serialize/text", "-", serialize_text },
+  { "serialize/shm", "-", serialize_shm },
+  { "serialize/store", "writes", serialize_store },
+  { "macro/pipeline", "syscalls", macro_pipeline },
+};
+
+/* ------------------------------------------------------------------ runner */
+
+static int cmp_double( const void *a, const void *b ) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile( const double *sorted, int n, double p ) {
+  return sorted[(int) (p * (n - 1) + 0.5)];
+}
+
+static void run_case( struct env *e, const struct bench_case *c,
+                      struct result *r ) {
+  static double ns[MAX_BATCHES];
+  unsigned long n = 1, calls = 0, ops = 0;
+  double worst = 0.0;
+  __u64 t0, start;
+
+  // one operation to get first time costs out of the way, e.g. the store
+  // creating a segment, then grow the batch until it takes BATCH_NS
+  c->run( e, 1 );
+  for (;;) {
+    t0 = clock_ns( CLOCK_MONOTONIC );
+    c->run( e, n );
+    if ( clock_ns( CLOCK_MONOTONIC ) - t0 >= BATCH_NS || n >= 1UL << 24 ) break;
+    n *= 2;
+  }
+  snprintf( r->name, sizeof(r->name), "%s", c->name );
+  snprintf( r->calls, sizeof(r->calls), "%s", c->calls );
+
+  for (int round = 0; round < ROUNDS; round++) {
+    double sum = 0.0, p50;
+    int k = 0;
+
+    start = clock_ns( CLOCK_MONOTONIC );
+    do {
+      t0 = clock_ns( CLOCK_MONOTONIC );
+      calls += c->run( e, n );
+      ns[k] = (double) (clock_ns( CLOCK_MONOTONIC ) - t0) / n;
+      sum += ns[k++];
+    } while ( k < MAX_BATCHES &&
+              clock_ns( CLOCK_MONOTONIC ) - start < ROUND_NS );
+    ops += n * k;
+    qsort( ns, k, sizeof(ns[0]), cmp_double );
+
+    p50 = percentile( ns, k, 0.50 );
+    if ( p50 > worst ) worst = p50;
+    if ( round > 0 && p50 >= r->p50 ) continue;
+    r->batches = k;
+    r->ops = n * k;
+    r->mean = sum / k;
+    r->min = ns[0];
+    r->p50 = p50;
+    r->p90 = percentile( ns, k, 0.90 );
+    r->p99 = percentile( ns, k, 0.99 );
+    r->max = ns[k - 1];
+  }
+  r->calls_per_op = (double) calls / ops;
+  r->spread = 100.0 * (worst - r->p50) / r->p50;
+}
+
+static void discard( void *arg, const struct rollup_bucket *b ) {
+}
+
+static int env_open( struct env *e, const char *dir ) {
+  char path[512];
+  int fd;
+
+  memset( e, 0, sizeof(*e) );
+  e->bus = i2c_sim_open();
+  e->sh = e->bus != NULL ? sensehat_open( e->bus, NULL ) : NULL;
+  if ( e->sh == NULL ) return -1;
+  sensehat_sample( e->sh, &e->s );
+  e->cal = *sensehat_calib( e->sh );
+  for (int i = 0; i < BLOCK; i++) {
+    e->p_raw[i] = 4150000 + i * 37;
+    e->t_raw[i] = 300 + (i * 7) % 500;
+    e->h_raw[i] = -2000 + (i * 53) % 10000;
+  }
+
+  for (int i = 0; i < 64; i++) {
+    e->colors[i][0] = i * 4;
+    e->colors[i][1] = 255 - i * 4;
+    e->colors[i][2] = (i * 37) & 0xff;
+    e->idx[i] = i;
+  }
+  led_palette_init( &e->pal, (const __u8 (*)[3]) e->colors, 64 );
+  snprintf( path, sizeof(path), "%s/fb", dir );
+  fd = open( path, O_RDWR | O_CREAT, 0644 );
+  if ( fd == -1 ) return -1;
+  e->lm = ledmatrix_open( path );
+  if ( e->lm == NULL ) return -1;
+  // the legacy path writes straight into its own mapping of the file
+  e->fb = mmap( NULL, sizeof(struct fb_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( e->fb == MAP_FAILED ) return -1;
+
+  e->shm = sample_shm_create( SHM_NAME );
+  snprintf( path, sizeof(path), "%s/store", dir );
+  if ( mkdir( path, 0755 ) == -1 ) return -1;
+  e->store = ts_store_open( path, NULL );
+  e->rollup = rollup_new( NULL, discard, NULL );
+  if ( e->shm == NULL || e->store == NULL || e->rollup == NULL ) return -1;
+  return 0;
+}
+
+static void env_close( struct env *e ) {
+  rollup_free( e->rollup );
+  ts_store_close( e->store );
+  sample_shm_close( e->shm, 1 );
+  munmap( e->fb, sizeof(struct fb_t) );
+  ledmatrix_close( e->lm );
+  sensehat_close( e->sh );
+  i2c_bus_close( e->bus );
+}
+
+/* ------------------------------------------------------------------ report */
+
+static void write_report( FILE *out, const struct result *r, int n ) {
+  struct utsname u;
+
+  uname( &u );
+  fprintf( out, "# %s %s %s, gcc %s, conversion kernels %s\n", u.nodename,
+           u.machine, u.release, __VERSION__, convert_isa );
+  fprintf( out, "case\tbatches\tops\tmean_ns\tmin_ns\tp50_ns\tp90_ns\t"
+           "p99_ns\tmax_ns\tcalls_per_op\tcalls\tspread_pct\n" );
+  for (int i = 0; i < n; i++, r++)
+    fprintf( out, "%s\t%lu\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.3f\t"
+             "%s\t%.1f\n", r->name, r->batches, r->ops, r->mean, r->min,
+             r->p50, r->p90, r->p99, r->max, r->calls_per_op, r->calls,
+             r->spread );
+}
+
+/* Returns the number of cases read, or -1 and errno. Reports from before
+   the spread was recorded read with a spread of 0. */
+static int read_report( const char *path, struct result *r, int max ) {
+  char line[512];
+  FILE *fp;
+  int n = 0;
+
+  fp = fopen( path, "r" );
+  if ( fp == NULL ) return -1;
+  while ( n < max && fgets( line, sizeof(line), fp ) != NULL ) {
+    if ( line[0] == '#' || strncmp( line, "case\t", 5 ) == 0 ) continue;
+    r[n].spread = 0.0;
+    if ( sscanf( line, "%63s %lu %lu %lf %lf %lf %lf %lf %lf %lf %31s %lf",
+                 r[n].name, &r[n].batches, &r[n].ops, &r[n].mean, &r[n].min,
+                 &r[n].p50, &r[n].p90, &r[n].p99, &r[n].max,
+                 &r[n].calls_per_op, r[n].calls, &r[n].spread ) >= 11 )
+      n++;
+  }
+  fclose( fp );
+  if ( n == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  return n;
+}
+
+/* Print the cases both reports have, returns the number of regressions.
+   A change counts when it is over both tol and the spread of the two. */
+static int compare( const struct result *base, int nbase,
+                    const struct result *cur, int ncur, double tol ) {
+  int regressions = 0;
+
+  fprintf( stderr, "%-18s%10s%10s%8s%8s%10s%10s%8s  %s\n", "case",
+           "base p50", "p50", "change", "noise", "base p99", "p99", "calls",
+           "" );
+  for (int i = 0; i < ncur; i++) {
+    const struct result *c = &cur[i], *b = NULL;
+    const char *verdict = "";
+    double change, noise;
+
+    for (int j = 0; j < nbase && b == NULL; j++)
+      if ( strcmp( base[j].name, c->name ) == 0 ) b = &base[j];
+    if ( b == NULL ) {
+      fprintf( stderr, "%-18s%10s%10.1f  (new)\n", c->name, "-", c->p50 );
+      continue;
+    }
+    change = b->p50 > 0.0 ? 100.0 * (c->p50 - b->p50) / b->p50 : 0.0;
+    noise = b->spread + c->spread;
+    if ( noise < tol ) noise = tol;
+    if ( c->calls_per_op > b->calls_per_op + 0.0005 ) {
+      verdict = "MORE CALLS";
+      regressions++;
+    } else if ( change > noise ) {
+      verdict = "SLOWER";
+      regressions++;
+    } else if ( change < -noise ) {
+      verdict = "faster";
+    }
+    fprintf( stderr, "%-18s%10.1f%10.1f%+7.1f%%%7.1f%%%10.1f%10.1f%8.2f  "
+             "%s\n", c->name, b->p50, c->p50, change, noise, b->p99, c->p99,
+             c->calls_per_op, verdict );
+  }
+  return regressions;
+}
+
+int main( int argc, char **argv ) {
+  static struct result cur[MAX_CASES], base[MAX_CASES];
+  char tmp[] = "/tmp/bench_suite.XXXXXX";
+  const char *out_path = NULL, *base_path = NULL, *in_path = NULL;
+  const char *prefix = "";
+  double tol = 3.0;
+  int opt, ncur = 0, nbase = 0, rc = 0;
+  char cmd[128];
+  struct env e;
+  FILE *out;
+
+  while ( (opt = getopt( argc, argv, "o:b:i:t:f:" )) != -1 ) {
+    switch ( opt ) {
+      case 'o': out_path = optarg; break;
+      case 'b': base_path = optarg; break;
+      case 'i': in_path = optarg; break;
+      case 't': tol = atof( optarg ); break;
+      case 'f': prefix = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-o report] [-b baseline [-i report] "
+                 "[-t percent]] [-f prefix]\n", argv[0] );
+        return 1;
+    }
+  }
+  if ( base_path != NULL &&
+       (nbase = read_report( base_path, base, MAX_CASES )) == -1 ) {
+    perror( base_path );
+    return 1;
+  }
+
+  if ( in_path != NULL ) {
+    ncur = read_report( in_path, cur, MAX_CASES );
+    if ( ncur == -1 ) {
+      perror( in_path );
+      return 1;
+    }
+  } else {
+    if ( mkdtemp( tmp ) == NULL ) {
+      perror( "mkdtemp" );
+      return 1;
+    }
+    shm_unlink( SHM_NAME );
+    if ( env_open( &e, tmp ) == -1 ) {
+      perror( "bench_suite" );
+      return 1;
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      if ( strncmp( cases[i].name, prefix, strlen( prefix ) ) != 0 )
+        continue;
+      run_case( &e, &cases[i], &cur[ncur++] );
+    }
+    env_close( &e );
+    snprintf( cmd, sizeof(cmd), "rm -rf '%s'", tmp );
+    if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", tmp );
+
+    out = out_path != NULL ? fopen( out_path, "w" ) : stdout;
+    if ( out == NULL ) {
+      perror( out_path );
+      return 1;
+    }
+    write_report( out, cur, ncur );
+    if ( out != stdout && fclose( out ) != 0 ) {
+      perror( out_path );
+      rc = 1;
+    }
+  }
+
+  if ( base_path != NULL && compare( base, nbase, cur, ncur, tol ) > 0 )
+    rc = 1;
+  return rc;
+}
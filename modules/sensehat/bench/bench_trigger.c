@@ -0,0 +1,293 @@
+/*
+ *  bench_trigger.c
+ *    Motion to recording latency of the trigger against a stand-in for
+ *    picam, next to the way a hook is usually sent and waited for: created
+ *    when motion is seen and the state looked at every POLL_MS
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_trigger [-d delay ms]
+ *    -d  the stand-in takes delay ms to start recording, as the camera
+ *        would, 0 by default so only the trigger path is measured
+ *
+ *  The stand-in is a thread doing what picam does with its hooks, see
+ *  tests/picam_standin.sh. The directories are made in /dev/shm as on the
+ *  master. Motion comes at a random point of the POLL_MS grid so the
+ *  polling waits are what they would be.
+ *
+ *  Then a burst of PIR edges BOUNCE_MS apart and motion while recording
+ *  check that the debounce sends one start_record for them all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "trigger.h"
+
+#define CYCLES      1000
+#define POLL_CYCLES 50
+#define POLL_MS     100
+#define BOUNCE_MS   5
+
+struct standin {
+  char hooks[64];
+  char state[64];
+  __u64 delay;   // ns
+  int ifd;
+  pthread_t thread;
+  unsigned long hooks_seen;
+};
+
+static void sleep_until( __u64 t ) {
+  struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+
+  while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+          EINTR );
+}
+
+static void put( const char *dir, const char *name, const char *s ) {
+  char path[128];
+  int fd;
+
+  snprintf( path, sizeof(path), "%s/%s", dir, name );
+  fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd == -1 ) return;
+  if ( write( fd, s, strlen( s ) ) == -1 ) perror( path );
+  close( fd );
+}
+
+/* What picam does with its hooks, until the hook quit appears */
+static void *picam( void *arg ) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  struct standin *p = arg;
+  char path[128];
+  ssize_t n;
+
+  for (;;) {
+    n = read( p->ifd, buf, sizeof(buf) );
+    if ( n <= 0 ) {
+      if ( n == -1 && errno == EINTR ) continue;
+      return NULL;
+    }
+    for (char *c = buf; c < buf + n; c += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) c;
+      if ( ev->len == 0 ) continue;
+      if ( strcmp( ev->name, "quit" ) == 0 ) return NULL;
+      if ( strcmp( ev->name, "start_record" ) != 0 &&
+           strcmp( ev->name, "stop_record" ) != 0 )
+        continue;
+      snprintf( path, sizeof(path), "%s/%s", p->hooks, ev->name );
+      // the close after the rename is the same hook again
+      if ( unlink( path ) == -1 ) continue;
+      p->hooks_seen++;
+      if ( ev->name[2] == 'a' ) {
+        if ( p->delay > 0 ) sleep_until( clock_ns( CLOCK_MONOTONIC ) +
+                                         p->delay );
+        put( p->state, "record", "true" );
+      } else {
+        put( p->state, "record", "false" );
+      }
+    }
+  }
+}
+
+static int standin_start( struct standin *p, const char *dir, __u64 delay ) {
+  snprintf( p->hooks, sizeof(p->hooks), "%s/hooks", dir );
+  snprintf( p->state, sizeof(p->state), "%s/state", dir );
+  p->delay = delay;
+  if ( mkdir( p->hooks, 0755 ) == -1 || mkdir( p->state, 0755 ) == -1 )
+    return -1;
+  put( p->state, "record", "false" );
+  p->ifd = inotify_init1( IN_CLOEXEC );
+  if ( p->ifd == -1 || inotify_add_watch( p->ifd, p->hooks, IN_CLOSE_WRITE |
+                                          IN_MOVED_TO ) == -1 )
+    return -1;
+  return pthread_create( &p->thread, NULL, picam, p ) == 0 ? 0 : -1;
+}
+
+static void standin_stop( struct standin *p ) {
+  put( p->hooks, "quit", "" );
+  pthread_join( p->thread, NULL );
+  close( p->ifd );
+}
+
+/* Handle what the trigger has to until it is in state st with started
+   recordings confirmed */
+static int wait_state( struct trigger *t, int st, unsigned long started ) {
+  struct pollfd pfd = { trigger_fd( t ), POLLIN, 0 };
+  __u64 now = clock_ns( CLOCK_MONOTONIC ), end = now + 10000000000ULL, due;
+  struct trigger_stats s;
+  int rc;
+
+  for (;;) {
+    rc = trigger_handle( t, now );
+    if ( rc == -1 ) return -1;
+    trigger_stats( t, &s );
+    if ( s.started >= started && (st == -1 || rc == st) ) return 0;
+    if ( now >= end ) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    due = trigger_due( t );
+    poll( &pfd, 1, due == 0 ? 1000 : due <= now ? 0 :
+          (int) ((due - now + 999999) / 1000000) );
+    now = clock_ns( CLOCK_MONOTONIC );
+  }
+}
+
+static int cmp( const void *a, const void *b ) {
+  __u64 x = *(const __u64 *) a, y = *(const __u64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void report( const char *name, __u64 *lat, int n, double hook_ns ) {
+  qsort( lat, n, sizeof(*lat), cmp );
+  printf( "%-14s %9.0f %9.3f %9.3f %9.3f\n", name, hook_ns,
+          lat[n / 2] / 1e6, lat[n * 99 / 100] / 1e6, lat[n - 1] / 1e6 );
+}
+
+/* The trigger: staged hooks, inotify for the answer */
+static int run_trigger( struct standin *p, __u64 *lat, double *hook_ns ) {
+  struct trigger_config cfg = { 0, 0, 5000000000ULL };
+  struct trigger *t;
+  __u64 edge, sum = 0;
+
+  t = trigger_new( p->hooks, p->state, &cfg );
+  if ( t == NULL ) return -1;
+  for (int i = 0; i < CYCLES; i++) {
+    edge = clock_ns( CLOCK_MONOTONIC );
+    if ( trigger_motion( t, edge ) != 1 ) return -1;
+    sum += clock_ns( CLOCK_MONOTONIC ) - edge;
+    if ( wait_state( t, -1, i + 1 ) == -1 ) return -1;
+    lat[i] = clock_ns( CLOCK_MONOTONIC ) - edge;
+    // with no hold the stop went out with the answer
+    if ( wait_state( t, TRIGGER_IDLE, i + 1 ) == -1 ) return -1;
+  }
+  *hook_ns = (double) sum / CYCLES;
+  trigger_free( t );
+  return 0;
+}
+
+static int recording( struct standin *p ) {
+  char path[128], c = 0;
+  int fd;
+
+  snprintf( path, sizeof(path), "%s/record", p->state );
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) return -1;
+  if ( read( fd, &c, 1 ) != 1 ) c = 0;
+  close( fd );
+  return c == 't';
+}
+
+/* The usual way: create the hook when motion is seen, look at the state
+   on a fixed grid */
+static int run_polled( struct standin *p, __u64 *lat, double *hook_ns ) {
+  __u64 grid = POLL_MS * 1000000ULL, tick, edge, sum = 0;
+
+  tick = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0; i < POLL_CYCLES; i++) {
+    sleep_until( clock_ns( CLOCK_MONOTONIC ) + rand() % grid );
+    edge = clock_ns( CLOCK_MONOTONIC );
+    put( p->hooks, "start_record", "" );
+    sum += clock_ns( CLOCK_MONOTONIC ) - edge;
+    do {
+      while ( tick <= clock_ns( CLOCK_MONOTONIC ) ) tick += grid;
+      sleep_until( tick );
+    } while ( recording( p ) != 1 );
+    lat[i] = clock_ns( CLOCK_MONOTONIC ) - edge;
+    put( p->hooks, "stop_record", "" );
+    while ( recording( p ) != 0 ) usleep( 1000 );
+  }
+  *hook_ns = (double) sum / POLL_CYCLES;
+  return 0;
+}
+
+/* A bouncing edge, then motion all through the recording */
+static int run_bounce( struct standin *p ) {
+  struct trigger_config cfg = { 50000000ULL, 300000000ULL, 5000000000ULL };
+  unsigned long seen = p->hooks_seen;
+  struct trigger_stats st;
+  struct trigger *t;
+  __u64 now;
+
+  t = trigger_new( p->hooks, p->state, &cfg );
+  if ( t == NULL ) return -1;
+  for (int i = 0; i < 10; i++) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( trigger_motion( t, now ) == -1 ) return -1;
+    trigger_handle( t, now );
+    sleep_until( now + BOUNCE_MS * 1000000ULL );
+  }
+  for (int i = 0; i < 5; i++) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( trigger_motion( t, now ) == -1 ) return -1;
+    trigger_handle( t, now );
+    sleep_until( now + 100000000ULL );
+  }
+  if ( wait_state( t, TRIGGER_IDLE, 1 ) == -1 ) return -1;
+  trigger_stats( t, &st );
+  printf( "bounce: %lu edges, %lu bounces, %lu start, %lu stop, %lu hooks "
+          "seen by picam: %s\n", st.edges, st.bounces, st.starts, st.stops,
+          p->hooks_seen - seen, st.starts == 1 && st.stops == 1 &&
+          p->hooks_seen - seen == 2 ? "ok" : "MISMATCH" );
+  trigger_free( t );
+  return 0;
+}
+
+int main( int argc, char **argv ) {
+  char dir[] = "/dev/shm/bench_trigger.XXXXXX";
+  char tmp[] = "/tmp/bench_trigger.XXXXXX";
+  static __u64 lat[CYCLES], plat[POLL_CYCLES];
+  double hook_ns, phook_ns;
+  struct standin p;
+  __u64 delay = 0;
+  char *base, cmd[128];
+  int opt, rc = 0;
+
+  while ( (opt = getopt( argc, argv, "d:" )) != -1 ) {
+    switch ( opt ) {
+      case 'd': delay = strtoull( optarg, NULL, 10 ) * 1000000ULL; break;
+      default:
+        fprintf( stderr, "usage: %s [-d delay ms]\n", argv[0] );
+        return 1;
+    }
+  }
+  base = mkdtemp( dir );
+  if ( base == NULL ) base = mkdtemp( tmp );
+  if ( base == NULL || standin_start( &p, base, delay ) == -1 ) {
+    perror( "standin" );
+    return 1;
+  }
+
+  if ( run_trigger( &p, lat, &hook_ns ) == -1 ||
+       run_polled( &p, plat, &phook_ns ) == -1 || run_bounce( &p ) == -1 ) {
+    perror( "bench_trigger" );
+    rc = 1;
+  } else {
+    printf( "camera start %.0f ms, %d and %d cycles\n", delay / 1e6, CYCLES,
+            POLL_CYCLES );
+    printf( "%-14s %9s %9s %9s %9s\n", "", "hook ns", "p50 ms", "p99 ms",
+            "max ms" );
+    report( "staged+inotify", lat, CYCLES, hook_ns );
+    report( "create+poll", plat, POLL_CYCLES, phook_ns );
+  }
+
+  standin_stop( &p );
+  snprintf( cmd, sizeof(cmd), "rm -rf '%s'", base );
+  if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", base );
+  return rc;
+}
@@ -0,0 +1,319 @@
+/*
+ *  bench_weather.c
+ *    The weather event detector replayed over a recorded history: which
+ *    events it finds and when, and what it costs per reading
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: bench_weather [-c calibration cache dir] [history dir]
+ *    Without a history, one is recorded first from the simulated sense-hat
+ *    at the highest ODR, 25 Hz for the LPS25H and 12.5 Hz for the HTS221,
+ *    on a clock of its own so the HOURS of it take seconds. It holds a
+ *    pressure fall of 1 mbar an hour from 2 h to 5 h, a shower at 6 h that
+ *    drops the temperature 3 degrees and raises the humidity 20 rH in a
+ *    quarter of an hour, and two gaps in the readings, as if sensehatd was
+ *    restarted, of 2 min at 1 h and of 20 min at 7 h. The events found are
+ *    checked against those expected.
+ *
+ *  A history from sensehatd -d is replayed as it is, converted with the
+ *  HTS221 calibration cached for DEVPATH_I2C in the cache dir, by default
+ *  CALIB_CACHE_DIR; the events are listed but there is nothing to check
+ *  them against.
+ *
+ *  The readings are converted up front, so the CPU time reported is that
+ *  of the detector alone. At the highest ODR sensehatd calls it 25 times a
+ *  second, and the share of a core that takes is checked against
+ *  BUDGET_PCT, which is meant for the RPi Zero; run it there for the
+ *  figure that counts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "LPS25H.h"
+#include "HTS221.h"
+#include "clock.h"
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "calib_cache.h"
+#include "convert.h"
+#include "sensehat.h"
+#include "ts_store.h"
+#include "weather.h"
+
+#define HOURS      8
+#define HOUR_NS    3600000000000ULL
+#define CALIB_KEY  "i2c-1-5f"  // as sensehatd keys DEVPATH_I2C
+#define MAX_CALLS  25          // a second at the highest ODR
+#define BUDGET_PCT 1.0         // of a core
+#define MAX_EVENTS 64
+
+struct reading {
+  __u64 ts;
+  float v[WEATHER_CHANNELS];
+  int fresh;
+};
+
+struct replay {
+  struct hts221_calib cal;
+  struct reading *r;
+  size_t n, size;
+};
+
+struct expect {
+  int channel, kind, start;
+  double from, to;  // h
+};
+
+/* The scenario of the recording, and the gaps in it */
+static const struct expect expected[] = {
+  { WEATHER_PRESSURE, WEATHER_FALL, 1, 2.0, 3.0 },
+  { WEATHER_PRESSURE, WEATHER_FALL, 0, 5.0, 6.0 },
+  { WEATHER_TEMPERATURE, WEATHER_FALL, 1, 6.0, 6.25 },
+  { WEATHER_TEMPERATURE, WEATHER_FALL, 0, 6.25, 6.5 },
+  { WEATHER_HUMIDITY, WEATHER_RISE, 1, 6.0, 6.25 },
+  { WEATHER_HUMIDITY, WEATHER_RISE, 0, 6.25, 6.5 },
+};
+#define EXPECTED (sizeof(expected) / sizeof(expected[0]))
+
+static const double gaps[][2] = { { 1.0, 1.0 + 2 / 60.0 },
+                                  { 7.0, 7.0 + 20 / 60.0 } };
+
+struct found {
+  __u64 t0;
+  struct weather_event ev[MAX_EVENTS];
+  int n;
+};
+
+static float ramp( double h, double h0, double h1, float from, float to ) {
+  if ( h <= h0 ) return from;
+  if ( h >= h1 ) return to;
+  return from + (to - from) * (h - h0) / (h1 - h0);
+}
+
+/* The sim clock starts at 1 s, hours are counted from there */
+static void scenario( void *arg, __u64 now, struct i2c_sim_env *env ) {
+  double h = (now - 1000000000ULL) / (double) HOUR_NS;
+
+  env->pressure = ramp( h, 2.0, 5.0, 1015.0f, 1012.0f );
+  env->temperature = ramp( h, 6.0, 6.25, 15.0f, 12.0f );
+  env->humidity = ramp( h, 6.0, 6.25, 60.0f, 80.0f );
+}
+
+static __u64 sim_clock( void *arg ) {
+  return *(__u64 *) arg;
+}
+
+static int in_gap( double h ) {
+  for (size_t i = 0; i < sizeof(gaps) / sizeof(gaps[0]); i++)
+    if ( h >= gaps[i][0] && h < gaps[i][1] ) return 1;
+  return 0;
+}
+
+/* Read the sim at the LPS25H pace the way sensehatd -d stores it, and take
+   the calibration from its registers */
+static int record( const char *dir, __u64 t0, __u8 cal[HTS221_CAL_SIZE] ) {
+  struct i2c_sim_env rms = { 0.02f, 0.05f, 0.3f };
+  // the LPS25H averages less at 25 Hz, as the datasheet asks
+  struct sensehat_config cfg = { 4, 1, 3, 3, 3 };
+  struct sensehat_sample s;
+  struct ts_sample rec;
+  struct ts_store *st;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  __u64 now = 1000000000ULL, period, t;
+  int rc = 0;
+
+  bus = i2c_sim_open();
+  if ( bus == NULL ) return -1;
+  i2c_sim_set_clock( bus, sim_clock, &now );
+  i2c_sim_set_noise( bus, &rms );
+  i2c_sim_set_env_fn( bus, scenario, NULL );
+  memcpy( cal, i2c_sim_regs( bus, HTS221_SAD ) + HTS221_CAL_H0_rH_x2,
+          HTS221_CAL_SIZE );
+  sh = sensehat_open( bus, &cfg );
+  st = ts_store_open( dir, NULL );
+  if ( sh == NULL || st == NULL ) return -1;
+
+  period = sensehat_lps25h_period_ns( cfg.lps25h_odr );
+  for (t = 0; t < HOURS * HOUR_NS && rc == 0; t += period) {
+    now = 1000000000ULL + t;
+    if ( in_gap( t / (double) HOUR_NS ) ) continue;
+    if ( sensehat_sample( sh, &s ) == -1 ) {
+      rc = -1;
+      break;
+    }
+    rec = (struct ts_sample) {
+      .timestamp = t0 + t,
+      .p_raw = s.p_raw,
+      .h_raw = s.h_raw,
+      .t_raw = s.t_raw,
+      .lps25h_status = s.lps25h_status,
+      .hts221_status = s.hts221_status,
+    };
+    rc = ts_store_append( st, &rec );
+  }
+  if ( ts_store_close( st ) == -1 ) rc = -1;
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return rc;
+}
+
+/* Convert the way sensehat.c does and mark what sensehatd marks fresh */
+static int collect( void *arg, const struct ts_sample *s ) {
+  struct replay *rp = arg;
+  struct reading *r;
+
+  if ( rp->n == rp->size ) {
+    rp->size = rp->size ? rp->size * 2 : 65536;
+    r = realloc( rp->r, rp->size * sizeof(struct reading) );
+    if ( r == NULL ) return 1;
+    rp->r = r;
+  }
+  r = &rp->r[rp->n++];
+  r->ts = s->timestamp;
+  r->v[WEATHER_PRESSURE] = s->p_raw / 4096.0f;
+  r->v[WEATHER_TEMPERATURE] =
+    hts221_temperature_mdegc( &rp->cal, s->t_raw ) / 1000.0f;
+  r->v[WEATHER_HUMIDITY] = hts221_humidity_mrh( &rp->cal, s->h_raw ) / 1000.0f;
+  r->fresh = 0;
+  if ( LPS25H_STATUS_REG_P_DA_ef( s->lps25h_status ) )
+    r->fresh |= 1 << WEATHER_PRESSURE;
+  if ( (s->hts221_status & 3) == 3 )
+    r->fresh |= 1 << WEATHER_TEMPERATURE | 1 << WEATHER_HUMIDITY;
+  return 0;
+}
+
+static void on_event( void *arg, const struct weather_event *ev ) {
+  struct found *f = arg;
+
+  printf( "  %5.2f h  %-11s %s %-5s %+8.2f /h  %8.2f\n",
+          (ev->timestamp - f->t0) / (double) HOUR_NS,
+          weather_names[ev->channel],
+          ev->kind == WEATHER_RISE ? "rise" : "fall",
+          ev->start ? "start" : "end", ev->rate, ev->value );
+  if ( f->n < MAX_EVENTS ) f->ev[f->n] = *ev;
+  f->n++;
+}
+
+/* Every event expected found once, and nothing else */
+static int check( const struct found *f ) {
+  int used[EXPECTED] = { 0 };
+  size_t k;
+
+  if ( f->n > MAX_EVENTS ) return -1;
+  for (int i = 0; i < f->n; i++) {
+    const struct weather_event *ev = &f->ev[i];
+    double h = (ev->timestamp - f->t0) / (double) HOUR_NS;
+
+    for (k = 0; k < EXPECTED; k++) {
+      if ( !used[k] && expected[k].channel == ev->channel &&
+           expected[k].kind == ev->kind && expected[k].start == ev->start &&
+           h >= expected[k].from && h < expected[k].to )
+        break;
+    }
+    if ( k == EXPECTED ) return -1;
+    used[k] = 1;
+  }
+  return f->n == (int) EXPECTED ? 0 : -1;
+}
+
+int main( int argc, char **argv ) {
+  char tmp[] = "/tmp/bench_weather.XXXXXX";
+  const char *cache_dir = CALIB_CACHE_DIR, *dir;
+  __u8 cal[HTS221_CAL_SIZE];
+  struct replay rp = { .r = NULL };
+  struct found f = { .n = 0 };
+  struct weather_stats ws;
+  struct weather *w;
+  char cmd[128];
+  double span, ns, pct;
+  __u64 t0 = 0, cpu;
+  int opt, sim, rc = 0;
+
+  while ( (opt = getopt( argc, argv, "c:" )) != -1 ) {
+    switch ( opt ) {
+      case 'c': cache_dir = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-c cache dir] [history dir]\n",
+                 argv[0] );
+        return 1;
+    }
+  }
+  sim = optind == argc;
+  if ( sim ) {
+    if ( mkdtemp( tmp ) == NULL ) {
+      perror( "mkdtemp" );
+      return 1;
+    }
+    dir = tmp;
+    // as if the hours just ended
+    t0 = clock_ns( CLOCK_REALTIME ) - HOURS * HOUR_NS;
+    printf( "recording %d h from the sim\n", HOURS );
+    if ( record( dir, t0, cal ) == -1 ) {
+      perror( "record" );
+      rc = 1;
+      goto out;
+    }
+  } else {
+    dir = argv[optind];
+    if ( calib_cache_load( cache_dir, CALIB_KEY, cal ) == -1 ) {
+      perror( cache_dir );
+      return 1;
+    }
+  }
+
+  hts221_calib_init( &rp.cal, cal );
+  if ( ts_store_query( dir, 0, ~0ULL, collect, &rp ) == -1 || rp.n == 0 ) {
+    fprintf( stderr, "%s: no samples\n", dir );
+    rc = 1;
+    goto out;
+  }
+  span = (rp.r[rp.n - 1].ts - rp.r[0].ts) / 1e9;
+  printf( "%zu readings over %.2f h\n", rp.n, span / 3600 );
+
+  f.t0 = sim ? t0 : rp.r[0].ts;
+  w = weather_new( NULL, on_event, &f );
+  if ( w == NULL ) {
+    perror( "weather_new" );
+    rc = 1;
+    goto out;
+  }
+  cpu = clock_ns( CLOCK_PROCESS_CPUTIME_ID );
+  for (size_t i = 0; i < rp.n; i++)
+    weather_add( w, rp.r[i].ts, rp.r[i].v, rp.r[i].fresh );
+  cpu = clock_ns( CLOCK_PROCESS_CPUTIME_ID ) - cpu;
+  weather_stats( w, &ws );
+  weather_free( w );
+
+  printf( "%lu points, %lu filled, %lu windows restarted, %lu late, %lu "
+          "events\n", ws.points, ws.filled, ws.resets, ws.late, ws.events );
+  ns = (double) cpu / rp.n;
+  pct = ns * MAX_CALLS / 1e7;
+  printf( "%.3f ms CPU, %.1f ns per reading, %.5f%% of a core at the "
+          "highest ODR, budget %.1f%%: %s\n", cpu / 1e6, ns, pct,
+          BUDGET_PCT, pct <= BUDGET_PCT ? "ok" : "OVER" );
+  if ( pct > BUDGET_PCT ) rc = 1;
+  if ( sim ) {
+    // one gap fits in the windows, the other only in the pressure one
+    if ( check( &f ) == 0 && ws.resets == 2 && ws.filled > 0 ) {
+      printf( "events: ok\n" );
+    } else {
+      printf( "events: MISMATCH\n" );
+      rc = 1;
+    }
+  }
+
+out:
+  free( rp.r );
+  if ( sim ) {
+    snprintf( cmd, sizeof(cmd), "rm -rf '%s'", tmp );
+    if ( system( cmd ) != 0 ) fprintf( stderr, "could not remove %s\n", tmp );
+  }
+  return rc;
+}
@@ -0,0 +1,100 @@
+/*
+ *  calib_cache.c
+ *    On-disk cache of the HTS221 calibration block
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "calib_cache.h"
+
+#define CALIB_CACHE_MAGIC "HTSC"
+
+struct calib_entry {
+  char magic[4];
+  char key[CALIB_CACHE_KEYLEN];
+  __u8 cal[HTS221_CAL_SIZE];
+  __u32 crc;
+};
+
+static __u32 crc32( const void *data, size_t len ) {
+  const __u8 *p = data;
+  __u32 crc = 0xffffffff;
+
+  while ( len-- ) {
+    crc ^= *p++;
+    for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static int entry_path( char *path, size_t size, const char *dir,
+                       const char *key ) {
+  if ( snprintf( path, size, "%s/hts221-%s.cal", dir, key ) >= (int) size ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+int calib_cache_load( const char *dir, const char *key,
+                      __u8 cal[HTS221_CAL_SIZE] ) {
+  struct calib_entry e;
+  char path[PATH_MAX];
+  ssize_t res;
+  int fd;
+
+  if ( entry_path( path, sizeof(path), dir, key ) == -1 ) return -1;
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) return -1;
+  res = read( fd, &e, sizeof(e) );
+  close( fd );
+
+  if ( res != sizeof(e) || memcmp( e.magic, CALIB_CACHE_MAGIC, 4 ) != 0 ||
+       strncmp( e.key, key, CALIB_CACHE_KEYLEN ) != 0 ||
+       crc32( &e, offsetof(struct calib_entry, crc) ) != e.crc ) {
+    errno = ENOENT;
+    return -1;
+  }
+  memcpy( cal, e.cal, HTS221_CAL_SIZE );
+  return 0;
+}
+
+int calib_cache_store( const char *dir, const char *key,
+                       const __u8 cal[HTS221_CAL_SIZE] ) {
+  struct calib_entry e;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  int fd, err;
+
+  memset( &e, 0, sizeof(e) );
+  memcpy( e.magic, CALIB_CACHE_MAGIC, 4 );
+  strncpy( e.key, key, CALIB_CACHE_KEYLEN - 1 );
+  memcpy( e.cal, cal, HTS221_CAL_SIZE );
+  e.crc = crc32( &e, offsetof(struct calib_entry, crc) );
+
+  if ( entry_path( path, sizeof(path), dir, key ) == -1 ) return -1;
+  if ( snprintf( tmp, sizeof(tmp), "%s.tmp", path ) >= (int) sizeof(tmp) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd == -1 ) return -1;
+  if ( write( fd, &e, sizeof(e) ) != sizeof(e) || fsync( fd ) == -1 ) {
+    err = errno ? errno : EIO;
+    close( fd );
+    unlink( tmp );
+    errno = err;
+    return -1;
+  }
+  close( fd );
+  return rename( tmp, path );
+}
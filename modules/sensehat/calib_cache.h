@@ -0,0 +1,32 @@
+/*
+ *  calib_cache.h
+ *    On-disk cache of the HTS221 calibration block
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The calibration is burnt in at the factory, so after the first start it
+ *  can be loaded from disk instead of being read from the chip. Entries are
+ *  keyed by bus name and slave address (e.g. "i2c-1-5f") and carry a CRC,
+ *  so a truncated or foreign file is treated as a miss.
+ */
+#ifndef _CALIB_CACHE_H_
+#define _CALIB_CACHE_H_
+
+#include <asm/types.h>
+
+#include "convert.h"
+
+#define CALIB_CACHE_DIR "/var/cache/fagelmatare"
+#define CALIB_CACHE_KEYLEN 32
+
+/* Returns 0 and fills cal on a hit, -1 with errno on a miss */
+int calib_cache_load( const char *dir, const char *key,
+                      __u8 cal[HTS221_CAL_SIZE] );
+
+/* Replace the entry atomically (write to a temporary file and rename) */
+int calib_cache_store( const char *dir, const char *key,
+                       const __u8 cal[HTS221_CAL_SIZE] );
+
+#endif /* _CALIB_CACHE_H_ */
@@ -0,0 +1,28 @@
+/*
+ *  clock.h
+ *    Reading a clock in nanoseconds, for the library, the daemons and the
+ *    benches alike
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Internal to this module: none of the headers of libsensehat.a include
+ *  it, so it is not part of what other modules build against.
+ */
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <time.h>
+#include <asm/types.h>
+
+/* clk in ns, e.g. CLOCK_MONOTONIC for intervals and deadlines,
+   CLOCK_REALTIME for timestamps that leave the host */
+static inline __u64 clock_ns( clockid_t clk ) {
+  struct timespec ts;
+
+  clock_gettime( clk, &ts );
+  return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* _CLOCK_H_ */
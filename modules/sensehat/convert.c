@@ -0,0 +1,207 @@
+/*
+ *  convert.c
+ *    Fixed-point raw to physical unit conversion for the LPS25H and HTS221
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include "convert.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_ISA "neon"
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define CONVERT_ISA "avx2"
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define CONVERT_ISA "sse4.1"
+#else
+#define CONVERT_ISA "scalar"
+#endif
+
+const char convert_isa[] = CONVERT_ISA;
+
+/* Find the largest shift for which slope and intercept scaled by 2^shift
+   keep raw * mul and raw * mul + add within 32 bits for any 16 bit raw */
+static int fold( double slope, double intercept, __s32 *mul, __s32 *add,
+                 int *shift ) {
+  for (int s = 24; s >= 0; s--) {
+    long long m = llround( ldexp( slope, s ) );
+    // bias by half an output unit so the arithmetic shift rounds
+    long long a = llround( ldexp( intercept, s ) ) + (s ? 1LL << (s - 1) : 0);
+    long long hi = m * 32767 + a, lo = m * -32768 + a;
+
+    if ( llabs( m ) * 32768 > INT32_MAX ) continue;
+    if ( hi > INT32_MAX || hi < INT32_MIN || lo > INT32_MAX || lo < INT32_MIN )
+      continue;
+    *mul = (__s32) m;
+    *add = (__s32) a;
+    *shift = s;
+    return 0;
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+/* Calibration block layout, datasheet table 19, offsets from 0x30 */
+int hts221_calib_init( struct hts221_calib *cal,
+                       const __u8 raw[HTS221_CAL_SIZE] ) {
+  __u16 T0_degC_x8 = (((__u16) raw[5] & 0x3) << 8) | (__u16) raw[2];
+  __u16 T1_degC_x8 = (((__u16) raw[5] & 0xc) << 6) | (__u16) raw[3];
+  __s16 H0_T0_OUT = (__s16) (raw[6] | (raw[7] << 8));
+  __s16 H1_T0_OUT = (__s16) (raw[10] | (raw[11] << 8));
+  __s16 T0_OUT = (__s16) (raw[12] | (raw[13] << 8));
+  __s16 T1_OUT = (__s16) (raw[14] | (raw[15] << 8));
+  double t_slope, h_slope;
+
+  // a blank calibration block would make the interpolation divide by zero
+  if ( T1_OUT == T0_OUT || H1_T0_OUT == H0_T0_OUT ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // millidegrees per count and thousandths of a percent rH per count
+  t_slope = (T1_degC_x8 - T0_degC_x8) * 125.0 / (T1_OUT - T0_OUT);
+  h_slope = (raw[1] - raw[0]) * 500.0 / (H1_T0_OUT - H0_T0_OUT);
+
+  if ( fold( t_slope, T0_degC_x8 * 125.0 - T0_OUT * t_slope,
+             &cal->t_mul, &cal->t_add, &cal->t_shift ) == -1 )
+    return -1;
+  return fold( h_slope, raw[0] * 500.0 - H0_T0_OUT * h_slope,
+               &cal->h_mul, &cal->h_add, &cal->h_shift );
+}
+
+/* Vector part of the kernels, returns how many elements were converted.
+   Every path computes exactly the scalar expression, lane by lane. */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static size_t linear_simd( const __s16 *raw, __s32 *out, size_t n,
+                           __s32 mul, __s32 add, int shift ) {
+  int32x4_t vadd = vdupq_n_s32( add );
+  int32x4_t vshift = vdupq_n_s32( -shift );  // negative shift is to the right
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    int16x8_t r = vld1q_s16( raw + i );
+    int32x4_t lo = vmlaq_n_s32( vadd, vmovl_s16( vget_low_s16( r ) ), mul );
+    int32x4_t hi = vmlaq_n_s32( vadd, vmovl_s16( vget_high_s16( r ) ), mul );
+
+    vst1q_s32( out + i, vshlq_s32( lo, vshift ) );
+    vst1q_s32( out + i + 4, vshlq_s32( hi, vshift ) );
+  }
+  return i;
+}
+
+static size_t pressure_simd( const __s32 *raw, __s32 *out, size_t n ) {
+  int32x4_t bias = vdupq_n_s32( 256 );
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    int32x4_t v = vmlaq_n_s32( bias, vld1q_s32( raw + i ), 125 );
+    vst1q_s32( out + i, vshrq_n_s32( v, 9 ) );
+  }
+  return i;
+}
+
+#elif defined(__AVX2__)
+
+static size_t linear_simd( const __s16 *raw, __s32 *out, size_t n,
+                           __s32 mul, __s32 add, int shift ) {
+  __m256i vmul = _mm256_set1_epi32( mul );
+  __m256i vadd = _mm256_set1_epi32( add );
+  __m128i vshift = _mm_cvtsi32_si128( shift );
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepi16_epi32(
+                  _mm_loadu_si128( (const __m128i *) (raw + i) ) );
+    v = _mm256_add_epi32( _mm256_mullo_epi32( v, vmul ), vadd );
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_sra_epi32( v, vshift ) );
+  }
+  return i;
+}
+
+static size_t pressure_simd( const __s32 *raw, __s32 *out, size_t n ) {
+  __m256i vmul = _mm256_set1_epi32( 125 );
+  __m256i bias = _mm256_set1_epi32( 256 );
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256( (const __m256i *) (raw + i) );
+    v = _mm256_add_epi32( _mm256_mullo_epi32( v, vmul ), bias );
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_srai_epi32( v, 9 ) );
+  }
+  return i;
+}
+
+#elif defined(__SSE4_1__)
+
+static size_t linear_simd( const __s16 *raw, __s32 *out, size_t n,
+                           __s32 mul, __s32 add, int shift ) {
+  __m128i vmul = _mm_set1_epi32( mul );
+  __m128i vadd = _mm_set1_epi32( add );
+  __m128i vshift = _mm_cvtsi32_si128( shift );
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i v = _mm_cvtepi16_epi32(
+                  _mm_loadl_epi64( (const __m128i *) (raw + i) ) );
+    v = _mm_add_epi32( _mm_mullo_epi32( v, vmul ), vadd );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_sra_epi32( v, vshift ) );
+  }
+  return i;
+}
+
+static size_t pressure_simd( const __s32 *raw, __s32 *out, size_t n ) {
+  __m128i vmul = _mm_set1_epi32( 125 );
+  __m128i bias = _mm_set1_epi32( 256 );
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128( (const __m128i *) (raw + i) );
+    v = _mm_add_epi32( _mm_mullo_epi32( v, vmul ), bias );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_srai_epi32( v, 9 ) );
+  }
+  return i;
+}
+
+#else
+
+static size_t linear_simd( const __s16 *raw, __s32 *out, size_t n,
+                           __s32 mul, __s32 add, int shift ) {
+  return 0;
+}
+
+static size_t pressure_simd( const __s32 *raw, __s32 *out, size_t n ) {
+  return 0;
+}
+
+#endif
+
+static void linear( const __s16 *raw, __s32 *out, size_t n,
+                    __s32 mul, __s32 add, int shift ) {
+  for (size_t i = linear_simd( raw, out, n, mul, add, shift ); i < n; i++)
+    out[i] = (raw[i] * mul + add) >> shift;
+}
+
+void hts221_convert_temperature( const struct hts221_calib *cal,
+                                 const __s16 *raw, __s32 *out, size_t n ) {
+  linear( raw, out, n, cal->t_mul, cal->t_add, cal->t_shift );
+}
+
+void hts221_convert_humidity( const struct hts221_calib *cal,
+                              const __s16 *raw, __s32 *out, size_t n ) {
+  linear( raw, out, n, cal->h_mul, cal->h_add, cal->h_shift );
+}
+
+void lps25h_convert_pressure( const __s32 *raw, __s32 *out, size_t n ) {
+  for (size_t i = pressure_simd( raw, out, n ); i < n; i++)
+    out[i] = lps25h_pressure_ubar( raw[i] );
+}
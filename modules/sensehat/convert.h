@@ -0,0 +1,65 @@
+/*
+ *  convert.h
+ *    Fixed-point raw to physical unit conversion for the LPS25H and HTS221
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The HTS221 linear interpolation (datasheet tables 19 and 20) is folded
+ *  once into a multiplier, an addend and a shift so every sample costs one
+ *  integer multiply-add and an arithmetic shift, with no float division:
+ *
+ *    value = (raw * mul + add) >> shift
+ *
+ *  The shift is the largest that keeps every possible 16 bit input inside
+ *  32 bits, which lets the batch kernels use 32 bit SIMD lanes. Outputs are
+ *  in milli-units: millidegrees C, thousandths of a percent rH and
+ *  microbar (0.001 mbar) for pressure.
+ *  The batch kernels use NEON on ARMv7 and AVX2 or SSE4.1 on x86 when the
+ *  compiler targets them (e.g. -mfpu=neon-vfpv4, -mavx2), scalar otherwise.
+ */
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+#define HTS221_CAL_SIZE 16
+
+extern const char convert_isa[];  // "neon", "avx2", "sse4.1" or "scalar"
+
+struct hts221_calib {
+  __s32 t_mul, t_add;
+  int t_shift;
+  __s32 h_mul, h_add;
+  int h_shift;
+};
+
+/* Fold the 16 byte calibration block read from HTS221_CAL_H0_rH_x2.
+   Returns -1 with errno EINVAL for a blank or corrupt block. */
+int hts221_calib_init( struct hts221_calib *cal,
+                       const __u8 raw[HTS221_CAL_SIZE] );
+
+static inline __s32 hts221_temperature_mdegc( const struct hts221_calib *cal,
+                                              __s16 raw ) {
+  return (raw * cal->t_mul + cal->t_add) >> cal->t_shift;
+}
+
+static inline __s32 hts221_humidity_mrh( const struct hts221_calib *cal,
+                                         __s16 raw ) {
+  return (raw * cal->h_mul + cal->h_add) >> cal->h_shift;
+}
+
+/* mbar = raw / 4096, so microbar = raw * 125 / 512 (rounded) */
+static inline __s32 lps25h_pressure_ubar( __s32 raw ) {
+  return (raw * 125 + 256) >> 9;
+}
+
+void hts221_convert_temperature( const struct hts221_calib *cal,
+                                 const __s16 *raw, __s32 *out, size_t n );
+void hts221_convert_humidity( const struct hts221_calib *cal,
+                              const __s16 *raw, __s32 *out, size_t n );
+void lps25h_convert_pressure( const __s32 *raw, __s32 *out, size_t n );
+
+#endif /* _CONVERT_H_ */
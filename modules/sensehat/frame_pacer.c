@@ -0,0 +1,49 @@
+/*
+ *  frame_pacer.c
+ *    Fixed rate frame pacing on absolute CLOCK_MONOTONIC deadlines
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <errno.h>
+#include <time.h>
+
+#include "clock.h"
+#include "frame_pacer.h"
+
+int frame_pacer_init( struct frame_pacer *fp, double hz ) {
+  if ( !(hz > 0) ) {
+    errno = EINVAL;
+    return -1;
+  }
+  fp->period = (__u64) (1e9 / hz);
+  if ( fp->period == 0 ) fp->period = 1;
+  fp->next = clock_ns( CLOCK_MONOTONIC ) + fp->period;
+  fp->frames = 0;
+  fp->missed = 0;
+  return 0;
+}
+
+int frame_pacer_wait( struct frame_pacer *fp ) {
+  struct timespec ts;
+  __u64 now = clock_ns( CLOCK_MONOTONIC );
+  __u64 late;
+
+  if ( now >= fp->next + fp->period ) {
+    // more than a frame behind, realign the grid to the next deadline
+    late = (now - fp->next) / fp->period;
+    fp->next += late * fp->period;
+    fp->missed += late;
+  } else {
+    late = 0;
+  }
+
+  ts.tv_sec = fp->next / 1000000000ULL;
+  ts.tv_nsec = fp->next % 1000000000ULL;
+  while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+          EINTR );
+  fp->next += fp->period;
+  fp->frames++;
+  return (int) late;
+}
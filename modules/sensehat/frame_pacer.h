@@ -0,0 +1,35 @@
+/*
+ *  frame_pacer.h
+ *    Fixed rate frame pacing on absolute CLOCK_MONOTONIC deadlines
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  A loop that sleeps a fixed time after each frame, e.g. usleep(2000), runs
+ *  slower than intended by however long the frame took to draw, and the
+ *  error depends on the load. frame_pacer_wait() sleeps until the next
+ *  deadline on a fixed grid instead. A loop that falls more than a whole
+ *  frame behind skips the deadlines it missed rather than trying to catch
+ *  up in a burst.
+ */
+#ifndef _FRAME_PACER_H_
+#define _FRAME_PACER_H_
+
+#include <asm/types.h>
+
+struct frame_pacer {
+  __u64 period;          // ns between frames
+  __u64 next;            // next deadline, CLOCK_MONOTONIC ns
+  unsigned long frames;  // calls to frame_pacer_wait()
+  unsigned long missed;  // deadlines skipped after a late frame
+};
+
+/* Start pacing at hz frames per second from now */
+int frame_pacer_init( struct frame_pacer *fp, double hz );
+
+/* Sleep until the next frame is due. Returns the number of deadlines that
+   were missed since the previous call, 0 when on time. */
+int frame_pacer_wait( struct frame_pacer *fp );
+
+#endif /* _FRAME_PACER_H_ */
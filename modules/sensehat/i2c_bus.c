@@ -0,0 +1,126 @@
+/*
+ *  i2c_bus.c
+ *    i2c-dev backend using combined I2C_RDWR transactions
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_bus.h"
+#include "metrics.h"
+
+struct i2c_dev_bus {
+  struct i2c_bus bus;
+  int fd;
+};
+
+static int i2c_dev_transfer( struct i2c_bus *bus, struct i2c_msg *msgs,
+                             int nmsgs ) {
+  struct i2c_dev_bus *dev = (struct i2c_dev_bus *) bus;
+  struct i2c_rdwr_ioctl_data data;
+
+  data.msgs = msgs;
+  data.nmsgs = nmsgs;
+  return ioctl( dev->fd, I2C_RDWR, &data );
+}
+
+static void i2c_dev_close( struct i2c_bus *bus ) {
+  struct i2c_dev_bus *dev = (struct i2c_dev_bus *) bus;
+
+  close( dev->fd );
+  free( dev );
+}
+
+static const struct i2c_bus_ops i2c_dev_ops = {
+  .transfer = i2c_dev_transfer,
+  .close = i2c_dev_close,
+};
+
+struct i2c_bus *i2c_bus_open( const char *path ) {
+  struct i2c_dev_bus *dev;
+  const char *base;
+
+  dev = calloc( 1, sizeof(struct i2c_dev_bus) );
+  if ( dev == NULL ) return NULL;
+
+  dev->fd = open( path, O_RDWR );
+  if ( dev->fd == -1 ) {
+    free( dev );
+    return NULL;
+  }
+  dev->bus.ops = &i2c_dev_ops;
+  base = strrchr( path, '/' );
+  strncpy( dev->bus.name, base ? base + 1 : path, sizeof(dev->bus.name) - 1 );
+  return &dev->bus;
+}
+
+int i2c_bus_transfer( struct i2c_bus *bus, struct i2c_msg *msgs, int nmsgs ) {
+  __u64 start;
+  int res;
+
+  if ( nmsgs <= 0 || nmsgs > I2C_BUS_MAX_MSGS ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  bus->transfers++;
+  start = metrics_start();
+  res = bus->ops->transfer( bus, msgs, nmsgs );
+  metrics_i2c( msgs, nmsgs, res, start );
+  if ( res != nmsgs ) {
+    bus->errors++;
+    // the adapter gave up part way through the transaction
+    if ( res >= 0 ) errno = EIO;
+    return -1;
+  }
+
+  bus->messages += nmsgs;
+  for (int i = 0; i < nmsgs; i++) bus->bytes += msgs[i].len;
+  return res;
+}
+
+int i2c_bus_read( struct i2c_bus *bus, __u16 addr, __u8 reg, __u8 *buf,
+                  __u16 len ) {
+  struct i2c_msg msgs[2];
+
+  i2c_msg_read_reg( msgs, addr, &reg, buf, len );
+  return i2c_bus_transfer( bus, msgs, 2 ) == -1 ? -1 : 0;
+}
+
+int i2c_bus_write( struct i2c_bus *bus, __u16 addr, __u8 reg,
+                   const __u8 *buf, __u16 len ) {
+  struct i2c_msg msg;
+  __u8 data[1 + 32];
+
+  if ( len > sizeof(data) - 1 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  data[0] = reg;
+  memcpy( data + 1, buf, len );
+
+  msg.addr = addr;
+  msg.flags = 0;
+  msg.len = len + 1;
+  msg.buf = data;
+  return i2c_bus_transfer( bus, &msg, 1 ) == -1 ? -1 : 0;
+}
+
+void i2c_bus_reset_stats( struct i2c_bus *bus ) {
+  bus->transfers = 0;
+  bus->messages = 0;
+  bus->bytes = 0;
+  bus->errors = 0;
+}
+
+void i2c_bus_close( struct i2c_bus *bus ) {
+  if ( bus != NULL ) bus->ops->close( bus );
+}
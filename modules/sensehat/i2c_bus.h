@@ -0,0 +1,77 @@
+/*
+ *  i2c_bus.h
+ *    Pluggable I2C bus backend used by the sense-hat driver
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  A bus carries combined transactions: an array of i2c messages that are
+ *  performed back to back with a single STOP at the end. On real hardware
+ *  one transaction is one ioctl(I2C_RDWR), so the counters below are the
+ *  syscall cost of whatever was issued on the bus.
+ *
+ *  i2c-bcm2835, the adapter of the Pi, takes a single read message per
+ *  transaction, and only as the last one; anything else fails with
+ *  EOPNOTSUPP. Writes combine freely, but a register read is a transaction
+ *  of its own: the pointer write and the read, or writes and then a read.
+ */
+#ifndef _I2C_BUS_H_
+#define _I2C_BUS_H_
+
+#include <asm/types.h>
+#include <linux/i2c.h>
+
+#define DEVPATH_I2C     "/dev/i2c-1"  // the device file on raspberry pi
+
+// largest number of messages accepted in one combined transaction
+#define I2C_BUS_MAX_MSGS 42
+
+struct i2c_bus;
+
+struct i2c_bus_ops {
+  // perform all messages as one transaction, return nmsgs or -1 and errno
+  int (*transfer)( struct i2c_bus *bus, struct i2c_msg *msgs, int nmsgs );
+  void (*close)( struct i2c_bus *bus );
+};
+
+struct i2c_bus {
+  const struct i2c_bus_ops *ops;
+  char name[16];            // adapter name, e.g. "i2c-1"
+  unsigned long transfers;  // combined transactions (syscalls on hardware)
+  unsigned long messages;   // i2c messages inside those transactions
+  unsigned long bytes;      // payload bytes moved in either direction
+  unsigned long errors;     // failed or short transactions
+};
+
+/* Open the i2c-dev character device at path (normally DEVPATH_I2C) */
+struct i2c_bus *i2c_bus_open( const char *path );
+
+int i2c_bus_transfer( struct i2c_bus *bus, struct i2c_msg *msgs, int nmsgs );
+
+/* Read len bytes starting at register reg of slave addr in one transaction.
+   The caller is responsible for OR'ing in the auto-increment bit. */
+int i2c_bus_read( struct i2c_bus *bus, __u16 addr, __u8 reg, __u8 *buf,
+                  __u16 len );
+
+/* Write len bytes starting at register reg of slave addr */
+int i2c_bus_write( struct i2c_bus *bus, __u16 addr, __u8 reg,
+                   const __u8 *buf, __u16 len );
+
+void i2c_bus_reset_stats( struct i2c_bus *bus );
+void i2c_bus_close( struct i2c_bus *bus );
+
+/* Fill in msgs[0..1] with a register pointer write followed by a read */
+static inline void i2c_msg_read_reg( struct i2c_msg *msgs, __u16 addr,
+                                     __u8 *reg, __u8 *buf, __u16 len ) {
+  msgs[0].addr = addr;
+  msgs[0].flags = 0;
+  msgs[0].len = 1;
+  msgs[0].buf = reg;
+  msgs[1].addr = addr;
+  msgs[1].flags = I2C_M_RD;
+  msgs[1].len = len;
+  msgs[1].buf = buf;
+}
+
+#endif /* _I2C_BUS_H_ */
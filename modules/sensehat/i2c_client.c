@@ -0,0 +1,178 @@
+/*
+ *  i2c_client.c
+ *    i2c_bus backend that sends its transactions to the bus-owner server
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  A transaction is translated into register operations: a one byte write
+ *  followed by a read of the same slave is a register read, any other write
+ *  is a register write with its first byte as the register. A read without
+ *  a register pointer write in front of it cannot be expressed and fails
+ *  with EOPNOTSUPP.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2c_server.h"
+
+struct i2c_client {
+  struct i2c_bus bus;
+  int fd;
+  int prio;
+  __u32 seq;
+  union {
+    struct i2c_server_req req;
+    __u8 raw[I2C_SERVER_REQ_MAX];
+  } out;
+  union {
+    struct i2c_server_rep rep;
+    __u8 raw[I2C_SERVER_REP_MAX];
+  } in;
+};
+
+/* Build the request, returns its size or -1 and errno */
+static ssize_t encode( struct i2c_client *cl, struct i2c_msg *msgs,
+                       int nmsgs ) {
+  struct i2c_server_req *req = &cl->out.req;
+  struct i2c_server_op *op = req->op;
+  __u8 data[I2C_SERVER_MAX_DATA];
+  size_t dlen = 0, rlen = 0;
+
+  for (int i = 0; i < nmsgs; op++) {
+    struct i2c_msg *m = &msgs[i];
+
+    if ( op == req->op + I2C_SERVER_MAX_OPS ) {
+      errno = EINVAL;
+      return -1;
+    }
+    if ( (m->flags & I2C_M_RD) || m->len == 0 ) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    op->addr = m->addr;
+    op->reg = m->buf[0];
+    if ( m->len == 1 && i + 1 < nmsgs && (m[1].flags & I2C_M_RD) &&
+         m[1].addr == m->addr ) {
+      op->write = 0;
+      op->len = m[1].len;
+      rlen += m[1].len;
+      i += 2;
+    } else {
+      op->write = 1;
+      op->len = m->len - 1;
+      if ( dlen + op->len > sizeof(data) ) {
+        errno = EINVAL;
+        return -1;
+      }
+      memcpy( data + dlen, m->buf + 1, op->len );
+      dlen += op->len;
+      i++;
+    }
+  }
+  if ( rlen > I2C_SERVER_MAX_DATA ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  req->seq = ++cl->seq;
+  req->prio = cl->prio;
+  req->nops = op - req->op;
+  req->reserved = 0;
+  memcpy( op, data, dlen );
+  return (__u8 *) op + dlen - cl->out.raw;
+}
+
+static int client_transfer( struct i2c_bus *bus, struct i2c_msg *msgs,
+                            int nmsgs ) {
+  struct i2c_client *cl = (struct i2c_client *) bus;
+  const __u8 *data = cl->in.raw + sizeof(struct i2c_server_rep);
+  ssize_t len, n;
+
+  len = encode( cl, msgs, nmsgs );
+  if ( len == -1 ) return -1;
+  if ( send( cl->fd, cl->out.raw, len, MSG_NOSIGNAL ) == -1 ) return -1;
+  do {
+    n = recv( cl->fd, cl->in.raw, sizeof(cl->in.raw), 0 );
+    if ( n == 0 ) errno = ECONNRESET;
+    if ( n <= 0 ) return -1;
+  } while ( (size_t) n < sizeof(struct i2c_server_rep) ||
+            cl->in.rep.seq != cl->seq );
+
+  if ( cl->in.rep.err != 0 ) {
+    errno = cl->in.rep.err;
+    return -1;
+  }
+  for (int i = 0; i < nmsgs; i++) {
+    if ( !(msgs[i].flags & I2C_M_RD) ) continue;
+    if ( data + msgs[i].len > cl->in.raw + n ) {
+      errno = EPROTO;
+      return -1;
+    }
+    memcpy( msgs[i].buf, data, msgs[i].len );
+    data += msgs[i].len;
+  }
+  return nmsgs;
+}
+
+static void client_close( struct i2c_bus *bus ) {
+  struct i2c_client *cl = (struct i2c_client *) bus;
+
+  close( cl->fd );
+  free( cl );
+}
+
+static const struct i2c_bus_ops client_ops = {
+  .transfer = client_transfer,
+  .close = client_close,
+};
+
+struct i2c_bus *i2c_server_connect( const char *path, int prio ) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  struct i2c_client *cl;
+  const ssize_t hello = sizeof(struct i2c_server_rep) + sizeof(cl->bus.name);
+  ssize_t n;
+  int err;
+
+  if ( strlen( path ) >= sizeof(sa.sun_path) ||
+       prio < 0 || prio >= I2C_SERVER_PRIOS ) {
+    errno = strlen( path ) >= sizeof(sa.sun_path) ? ENAMETOOLONG : EINVAL;
+    return NULL;
+  }
+  cl = calloc( 1, sizeof(struct i2c_client) );
+  if ( cl == NULL ) return NULL;
+  cl->bus.ops = &client_ops;
+  cl->prio = prio;
+  strcpy( sa.sun_path, path );
+
+  cl->fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if ( cl->fd == -1 ) goto fail;
+  if ( connect( cl->fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 )
+    goto fail_fd;
+
+  // the server greets with the adapter name, or hangs up when it is full
+  n = recv( cl->fd, cl->in.raw, sizeof(cl->in.raw), 0 );
+  if ( n < hello ) {
+    errno = n == -1 ? errno : ECONNREFUSED;
+    goto fail_fd;
+  }
+  memcpy( cl->bus.name, cl->in.raw + sizeof(struct i2c_server_rep),
+          sizeof(cl->bus.name) );
+  cl->bus.name[sizeof(cl->bus.name) - 1] = '\0';
+  return &cl->bus;
+
+fail_fd:
+  err = errno;
+  close( cl->fd );
+  errno = err;
+fail:
+  err = errno;
+  free( cl );
+  errno = err;
+  return NULL;
+}
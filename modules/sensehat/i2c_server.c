@@ -0,0 +1,605 @@
+/*
+ *  i2c_server.c
+ *    Bus-owner server: serves i2c transactions of many clients over a Unix
+ *    socket, merging their register reads
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_server.h"
+
+#define BATCH_READS 256   // reads in one batch, before merging
+#define SCRATCH     4096  // bytes moved in one batch
+
+#define INC 0x80          // auto-increment bit of the ST register address
+#define NEVER (~0ULL)
+
+// epoll tags, anything else is a connection slot
+#define TAG_LISTEN (~0U)
+#define TAG_TIMER  (~0U - 1)
+#define TAG_WAKE   (~0U - 2)
+
+struct conn {
+  int fd;           // -1 while the slot is free
+  int queued;
+  int next;         // next queued slot of the same priority, or -1
+  __u64 arrived;
+  size_t len;
+  union {
+    struct i2c_server_req req;
+    __u8 raw[I2C_SERVER_REQ_MAX];
+  } in;
+};
+
+/* One read of a batched request and where in the batch its bytes end up */
+struct rd {
+  struct conn *c;
+  __u16 addr;
+  __u8 reg;
+  __u16 len;
+  int msg;
+  __u16 off;
+};
+
+struct queue {
+  int head;
+  int tail;
+};
+
+struct i2c_server {
+  struct i2c_bus *bus;
+  struct i2c_server_config cfg;
+  char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  int lfd;
+  int epfd;
+  int tfd;
+  int wfd;
+  volatile int stopping;
+  __u64 armed;
+  int nconns;
+  int nqueued;
+  int last_addr;                  // of the last message on the bus, or -1
+  struct queue q[I2C_SERVER_PRIOS];
+  struct conn *conns;
+  struct conn **batch;
+  struct rd rd[BATCH_READS];
+  struct i2c_msg msgs[I2C_BUS_MAX_MSGS];
+  __u8 regs[I2C_BUS_MAX_MSGS];
+  int errs[I2C_BUS_MAX_MSGS];     // of the transaction each message went in
+  __u8 scratch[SCRATCH];
+  __u8 rep[I2C_SERVER_REP_MAX];
+  struct i2c_server_stats stats;
+};
+
+/* Registers after which the register pointer of a device may wrap instead
+   of advancing: PRESS_OUT_H of the LPS25H rolls back to PRESS_OUT_XL while
+   its FIFO queues samples, in FIFO or stream mode, so that a burst drains
+   several slots. In mean mode the outputs pass straight through and the
+   pointer advances, but the mode is not known here, so no merged burst
+   reads on past it either way. */
+static const struct {
+  __u16 addr;
+  __u8 reg;
+} wraps[] = {
+  { LPS25H_SAD, LPS25H_PRESS_POUT + 2 },
+};
+
+/* ----------------------------------------------------------------- plan */
+
+static int cmp_rd( const void *a, const void *b ) {
+  const struct rd *x = *(const struct rd **) a;
+  const struct rd *y = *(const struct rd **) b;
+
+  if ( x->addr != y->addr ) return x->addr - y->addr;
+  // reads with the auto-increment bit sort after the plain ones
+  if ( x->reg != y->reg ) return x->reg - y->reg;
+  return y->len - x->len;
+}
+
+static int crosses_wrap( __u16 addr, unsigned start, unsigned end ) {
+  for (size_t i = 0; i < sizeof(wraps) / sizeof(wraps[0]); i++)
+    if ( wraps[i].addr == addr && start <= wraps[i].reg &&
+         end > wraps[i].reg + 1u )
+      return 1;
+  return 0;
+}
+
+/* Extend the burst read by m, starting at reg, to serve r as well if that
+   returns the same bytes r would get on its own. Returns 0 if it does not. */
+static int join( struct i2c_msg *m, __u8 reg, struct rd *r ) {
+  unsigned start = reg & ~INC, end = start + m->len;
+  unsigned r_start = r->reg & ~INC, r_end = r_start + r->len;
+
+  if ( m->addr != r->addr ) return 0;
+  if ( r->reg == reg ) {
+    // a shorter read is a prefix of a longer one from the same register
+    if ( r->len > m->len ) m->len = r->len;
+    r->off = 0;
+    return 1;
+  }
+  if ( !(reg & INC) || !(r->reg & INC) ) return 0;
+  if ( r_start > end || r_end > 0x80 ) return 0;
+  if ( r_end < end ) r_end = end;
+  if ( crosses_wrap( r->addr, start, r_end ) ) return 0;
+  m->len = r_end - start;
+  r->off = r_start - start;
+  return 1;
+}
+
+/* Merge the reads rd[0..nrd) into as few bursts as possible, sorted by
+   slave address. Returns the number of messages, or -1 if they do not fit
+   in one batch. */
+static int plan( struct i2c_server *srv, int nrd ) {
+  struct rd *order[BATCH_READS];
+  struct i2c_msg *m = NULL;
+  size_t used = 0;
+  int nmsgs = 0;
+
+  for (int i = 0; i < nrd; i++) order[i] = &srv->rd[i];
+  qsort( order, nrd, sizeof(order[0]), cmp_rd );
+
+  for (int i = 0; i < nrd; i++) {
+    struct rd *r = order[i];
+
+    if ( m != NULL && join( m, srv->regs[nmsgs - 2], r ) ) {
+      r->msg = nmsgs - 1;
+      continue;
+    }
+    if ( nmsgs + 2 > I2C_BUS_MAX_MSGS ) return -1;
+    srv->regs[nmsgs] = r->reg;
+    i2c_msg_read_reg( &srv->msgs[nmsgs], r->addr, &srv->regs[nmsgs], NULL,
+                      r->len );
+    r->off = 0;
+    r->msg = nmsgs + 1;
+    nmsgs += 2;
+    m = &srv->msgs[nmsgs - 1];
+  }
+
+  for (int i = 1; i < nmsgs; i += 2) {
+    if ( used + srv->msgs[i].len > SCRATCH ) return -1;
+    srv->msgs[i].buf = srv->scratch + used;
+    used += srv->msgs[i].len;
+  }
+  return nmsgs;
+}
+
+/* A request that writes goes out as the client sent it */
+static int verbatim( struct i2c_server *srv, struct conn *c ) {
+  const struct i2c_server_req *req = &c->in.req;
+  const __u8 *data = (const __u8 *) &req->op[req->nops];
+  size_t used = 0;
+  int nmsgs = 0, nrd = 0;
+
+  for (int i = 0; i < req->nops; i++) {
+    const struct i2c_server_op *op = &req->op[i];
+
+    if ( op->write ) {
+      srv->scratch[used] = op->reg;
+      memcpy( srv->scratch + used + 1, data, op->len );
+      srv->msgs[nmsgs].addr = op->addr;
+      srv->msgs[nmsgs].flags = 0;
+      srv->msgs[nmsgs].len = op->len + 1;
+      srv->msgs[nmsgs].buf = srv->scratch + used;
+      used += op->len + 1;
+      data += op->len;
+      nmsgs++;
+    } else {
+      struct rd *r = &srv->rd[nrd++];
+
+      srv->regs[nmsgs] = op->reg;
+      i2c_msg_read_reg( &srv->msgs[nmsgs], op->addr, &srv->regs[nmsgs],
+                        srv->scratch + used, op->len );
+      used += op->len;
+      r->c = c;
+      r->len = op->len;
+      r->msg = nmsgs + 1;
+      r->off = 0;
+      nmsgs += 2;
+    }
+  }
+  return nmsgs;
+}
+
+/* i2c-bcm2835 takes a single read message per transaction, and only as
+   the last one. Send msgs[0..nmsgs) as consecutive transactions that each
+   end with a read or with the last message, so a batch is one pointer
+   write and read per burst, in the address order of the plan. The errno
+   of each transaction is left in errs[] for its messages. With stop set,
+   nothing more goes out after a transaction fails. Returns the first
+   errno, or 0. */
+static int transmit( struct i2c_server *srv, int nmsgs, int stop ) {
+  struct i2c_server_stats *st = &srv->stats;
+  int start = 0, err, first = 0;
+
+  for (int i = 0; i < nmsgs; i++) {
+    if ( !(srv->msgs[i].flags & I2C_M_RD) && i + 1 < nmsgs ) continue;
+    err = i2c_bus_transfer( srv->bus, &srv->msgs[start], i + 1 - start ) ==
+          -1 ? errno : 0;
+    st->transfers++;
+    for (int j = start; j <= i; j++) {
+      srv->errs[j] = err;
+      if ( srv->msgs[j].addr != srv->last_addr ) st->switches++;
+      srv->last_addr = srv->msgs[j].addr;
+    }
+    if ( err && !first ) first = err;
+    if ( err && stop ) break;
+    start = i + 1;
+  }
+  return first;
+}
+
+/* ---------------------------------------------------------- connections */
+
+static int writes( const struct conn *c ) {
+  for (int i = 0; i < c->in.req.nops; i++)
+    if ( c->in.req.op[i].write ) return 1;
+  return 0;
+}
+
+/* Sizes add up and everything fits in one batch and one reply */
+static int valid( const struct conn *c ) {
+  const struct i2c_server_req *req = &c->in.req;
+  size_t len = sizeof(*req), rlen = 0, msgs = 0;
+
+  if ( c->len < len || req->nops == 0 || req->nops > I2C_SERVER_MAX_OPS ||
+       req->prio >= I2C_SERVER_PRIOS )
+    return 0;
+  len += req->nops * sizeof(struct i2c_server_op);
+  for (int i = 0; i < req->nops && len <= c->len; i++) {
+    const struct i2c_server_op *op = &req->op[i];
+
+    if ( op->write ) {
+      len += op->len;
+      msgs++;
+    } else {
+      if ( op->len == 0 ) return 0;
+      rlen += op->len;
+      msgs += 2;
+    }
+  }
+  return len == c->len && rlen <= I2C_SERVER_MAX_DATA &&
+         msgs <= I2C_BUS_MAX_MSGS;
+}
+
+static void enqueue( struct i2c_server *srv, struct conn *c ) {
+  struct queue *q = &srv->q[c->in.req.prio];
+  int slot = c - srv->conns;
+
+  c->next = -1;
+  if ( q->tail == -1 ) q->head = slot;
+  else srv->conns[q->tail].next = slot;
+  q->tail = slot;
+  c->queued = 1;
+  srv->nqueued++;
+}
+
+static void unlink_conn( struct i2c_server *srv, struct conn *c ) {
+  struct queue *q = &srv->q[c->in.req.prio];
+  int slot = c - srv->conns, prev = -1;
+
+  for (int i = q->head; i != -1; prev = i, i = srv->conns[i].next) {
+    if ( i != slot ) continue;
+    if ( prev == -1 ) q->head = c->next;
+    else srv->conns[prev].next = c->next;
+    if ( q->tail == slot ) q->tail = prev;
+    break;
+  }
+  c->queued = 0;
+  srv->nqueued--;
+}
+
+static void drop( struct i2c_server *srv, struct conn *c ) {
+  if ( c->queued ) unlink_conn( srv, c );
+  close( c->fd );
+  c->fd = -1;
+  srv->nconns--;
+}
+
+static void reply( struct i2c_server *srv, struct conn *c, int err,
+                   size_t len ) {
+  struct i2c_server_rep *rep = (struct i2c_server_rep *) srv->rep;
+
+  rep->seq = c->in.req.seq;
+  rep->err = err;
+  if ( err ) len = 0;
+  if ( send( c->fd, srv->rep, sizeof(*rep) + len,
+             MSG_DONTWAIT | MSG_NOSIGNAL ) == -1 )
+    drop( srv, c );
+}
+
+static void on_accept( struct i2c_server *srv ) {
+  struct i2c_server_rep *hello = (struct i2c_server_rep *) srv->rep;
+  struct epoll_event ev = { .events = EPOLLIN };
+  struct conn *c = NULL;
+  int fd;
+
+  // blocking, every call on it passes MSG_DONTWAIT
+  fd = accept( srv->lfd, NULL, NULL );
+  if ( fd == -1 ) return;
+  for (unsigned int i = 0; i < srv->cfg.max_conns; i++)
+    if ( srv->conns[i].fd == -1 ) {
+      c = &srv->conns[i];
+      break;
+    }
+  if ( c != NULL ) ev.data.u32 = c - srv->conns;
+  if ( c == NULL || epoll_ctl( srv->epfd, EPOLL_CTL_ADD, fd, &ev ) == -1 ) {
+    close( fd );
+    return;
+  }
+  c->fd = fd;
+  c->queued = 0;
+  srv->nconns++;
+  srv->stats.conns++;
+
+  hello->seq = 0;
+  hello->err = 0;
+  memcpy( hello + 1, srv->bus->name, sizeof(srv->bus->name) );
+  if ( send( fd, srv->rep, sizeof(*hello) + sizeof(srv->bus->name),
+             MSG_DONTWAIT | MSG_NOSIGNAL ) == -1 )
+    drop( srv, c );
+}
+
+static void on_request( struct i2c_server *srv, struct conn *c ) {
+  struct i2c_server_req stray;
+  ssize_t n;
+
+  if ( c->queued ) {
+    // clients wait for the reply before sending again
+    n = recv( c->fd, &stray, sizeof(stray), MSG_DONTWAIT );
+    if ( n <= 0 ) drop( srv, c );
+    return;
+  }
+  n = recv( c->fd, c->in.raw, sizeof(c->in.raw), MSG_DONTWAIT | MSG_TRUNC );
+  if ( n == -1 && errno == EAGAIN ) return;
+  if ( n <= 0 ) {
+    drop( srv, c );
+    return;
+  }
+  c->len = n;
+  if ( (size_t) n > sizeof(c->in.raw) || !valid( c ) ) {
+    if ( (size_t) n < sizeof(c->in.req.seq) ) c->in.req.seq = 0;
+    reply( srv, c, EINVAL, 0 );
+    return;
+  }
+  c->arrived = clock_ns( CLOCK_MONOTONIC );
+  enqueue( srv, c );
+}
+
+/* ------------------------------------------------------------- dispatch */
+
+/* Serve the next batch if one is due. Returns 1 if a batch went out. */
+static int dispatch( struct i2c_server *srv, __u64 now ) {
+  struct i2c_server_stats *st = &srv->stats;
+  int prio, nconn = 0, nrd = 0, nmsgs = 0, err = 0, slot, whole = 0;
+  struct queue *q;
+
+  if ( srv->q[I2C_SERVER_PRIO_HIGH].head != -1 ) {
+    prio = I2C_SERVER_PRIO_HIGH;
+  } else if ( srv->q[I2C_SERVER_PRIO_NORMAL].head != -1 ) {
+    struct conn *head = &srv->conns[srv->q[I2C_SERVER_PRIO_NORMAL].head];
+
+    // no point in holding when every client is already waiting
+    if ( now < head->arrived + srv->cfg.hold && srv->nqueued < srv->nconns )
+      return 0;
+    prio = I2C_SERVER_PRIO_NORMAL;
+  } else {
+    return 0;
+  }
+  q = &srv->q[prio];
+
+  if ( writes( &srv->conns[q->head] ) ) {
+    struct conn *c = &srv->conns[q->head];
+
+    nmsgs = verbatim( srv, c );
+    whole = 1;
+    nrd = 0;
+    for (int i = 0; i < c->in.req.nops; i++) nrd += !c->in.req.op[i].write;
+    unlink_conn( srv, c );
+    srv->batch[nconn++] = c;
+  } else {
+    // first come first served, up to the first request that does not fit
+    while ( (slot = q->head) != -1 ) {
+      struct conn *c = &srv->conns[slot];
+      const struct i2c_server_req *req = &c->in.req;
+
+      if ( writes( c ) || nrd + req->nops > BATCH_READS ) break;
+      for (int i = 0; i < req->nops; i++) {
+        struct rd *r = &srv->rd[nrd + i];
+
+        r->c = c;
+        r->addr = req->op[i].addr;
+        r->reg = req->op[i].reg;
+        r->len = req->op[i].len;
+      }
+      if ( plan( srv, nrd + req->nops ) == -1 ) break;
+      nrd += req->nops;
+      unlink_conn( srv, c );
+      srv->batch[nconn++] = c;
+    }
+    // the last attempt may have been the one that did not fit
+    nmsgs = plan( srv, nrd );
+    st->reads += nrd;
+    st->bursts += nmsgs / 2;
+  }
+
+  // a request that writes fails as a whole at its first failed transaction,
+  // a failed burst of a batch only fails the requests that read from it
+  err = transmit( srv, nmsgs, whole );
+  if ( !whole ) err = 0;
+  st->batches++;
+
+  // the reads of each request are contiguous in rd, in op order
+  now = clock_ns( CLOCK_MONOTONIC );
+  for (int i = 0, r = 0; i < nconn; i++) {
+    struct conn *c = srv->batch[i];
+    __u8 *out = srv->rep + sizeof(struct i2c_server_rep);
+    __u64 wait = now - c->arrived;
+    int e = err;
+
+    for (; r < nrd && srv->rd[r].c == c; r++) {
+      if ( e == 0 ) e = srv->errs[srv->rd[r].msg];
+      memcpy( out, srv->msgs[srv->rd[r].msg].buf + srv->rd[r].off,
+              srv->rd[r].len );
+      out += srv->rd[r].len;
+    }
+    reply( srv, c, e, out - srv->rep - sizeof(struct i2c_server_rep) );
+    st->requests++;
+    if ( e ) st->failed++;
+    st->served[prio]++;
+    st->wait_sum[prio] += wait;
+    if ( wait > st->wait_max[prio] ) st->wait_max[prio] = wait;
+  }
+  return 1;
+}
+
+/* Wake when the oldest normal request has been held long enough */
+static int arm( struct i2c_server *srv ) {
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  int head = srv->q[I2C_SERVER_PRIO_NORMAL].head;
+  __u64 due = head == -1 ? NEVER : srv->conns[head].arrived + srv->cfg.hold;
+
+  if ( due == srv->armed ) return 0;
+  if ( due != NEVER ) {
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+  }
+  if ( timerfd_settime( srv->tfd, TFD_TIMER_ABSTIME, &its, NULL ) == -1 )
+    return -1;
+  srv->armed = due;
+  return 0;
+}
+
+/* --------------------------------------------------------------- public */
+
+static int watch( struct i2c_server *srv, int fd, __u32 tag ) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+
+  return epoll_ctl( srv->epfd, EPOLL_CTL_ADD, fd, &ev );
+}
+
+struct i2c_server *i2c_server_new( struct i2c_bus *bus, const char *path,
+                                   const struct i2c_server_config *cfg ) {
+  static const struct i2c_server_config defaults = I2C_SERVER_CONFIG_DEFAULT;
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  struct i2c_server *srv;
+  int err;
+
+  if ( strlen( path ) >= sizeof(sa.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  srv = calloc( 1, sizeof(struct i2c_server) );
+  if ( srv == NULL ) return NULL;
+  srv->bus = bus;
+  srv->cfg = cfg != NULL ? *cfg : defaults;
+  srv->lfd = srv->epfd = srv->tfd = srv->wfd = -1;
+  srv->armed = NEVER;
+  srv->last_addr = -1;
+  for (int i = 0; i < I2C_SERVER_PRIOS; i++)
+    srv->q[i].head = srv->q[i].tail = -1;
+
+  srv->conns = calloc( srv->cfg.max_conns, sizeof(struct conn) );
+  srv->batch = calloc( srv->cfg.max_conns, sizeof(struct conn *) );
+  if ( srv->conns == NULL || srv->batch == NULL ) goto fail;
+  for (unsigned int i = 0; i < srv->cfg.max_conns; i++)
+    srv->conns[i].fd = -1;
+
+  srv->epfd = epoll_create1( EPOLL_CLOEXEC );
+  if ( srv->epfd == -1 ) goto fail;
+  srv->tfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  if ( srv->tfd == -1 || watch( srv, srv->tfd, TAG_TIMER ) == -1 ) goto fail;
+  srv->wfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( srv->wfd == -1 || watch( srv, srv->wfd, TAG_WAKE ) == -1 ) goto fail;
+
+  strcpy( sa.sun_path, path );
+  strcpy( srv->path, path );
+  srv->lfd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0 );
+  if ( srv->lfd == -1 ) goto fail;
+  unlink( path );
+  if ( bind( srv->lfd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ||
+       listen( srv->lfd, SOMAXCONN ) == -1 ||
+       watch( srv, srv->lfd, TAG_LISTEN ) == -1 )
+    goto fail;
+  return srv;
+
+fail:
+  err = errno;
+  i2c_server_free( srv );
+  errno = err;
+  return NULL;
+}
+
+int i2c_server_run( struct i2c_server *srv ) {
+  struct epoll_event evs[64];
+  __u64 count;
+  int n;
+
+  while ( !srv->stopping ) {
+    n = epoll_wait( srv->epfd, evs, 64, -1 );
+    if ( n == -1 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      __u32 tag = evs[i].data.u32;
+
+      if ( tag == TAG_LISTEN ) {
+        on_accept( srv );
+      } else if ( tag == TAG_TIMER || tag == TAG_WAKE ) {
+        // only clears the readiness, the clock decides what is due
+        if ( read( tag == TAG_TIMER ? srv->tfd : srv->wfd, &count,
+                   sizeof(count) ) == -1 && errno != EAGAIN )
+          return -1;
+      } else if ( srv->conns[tag].fd != -1 ) {
+        on_request( srv, &srv->conns[tag] );
+      }
+    }
+    while ( dispatch( srv, clock_ns( CLOCK_MONOTONIC ) ) );
+    if ( arm( srv ) == -1 ) return -1;
+  }
+  return 0;
+}
+
+void i2c_server_stop( struct i2c_server *srv ) {
+  __u64 one = 1;
+
+  srv->stopping = 1;
+  if ( write( srv->wfd, &one, sizeof(one) ) == -1 ) return;
+}
+
+void i2c_server_stats( struct i2c_server *srv,
+                       struct i2c_server_stats *stats ) {
+  memcpy( stats, &srv->stats, sizeof(struct i2c_server_stats) );
+}
+
+void i2c_server_free( struct i2c_server *srv ) {
+  if ( srv == NULL ) return;
+  if ( srv->conns != NULL )
+    for (unsigned int i = 0; i < srv->cfg.max_conns; i++)
+      if ( srv->conns[i].fd != -1 ) close( srv->conns[i].fd );
+  if ( srv->lfd != -1 ) {
+    close( srv->lfd );
+    unlink( srv->path );
+  }
+  if ( srv->wfd != -1 ) close( srv->wfd );
+  if ( srv->tfd != -1 ) close( srv->tfd );
+  if ( srv->epfd != -1 ) close( srv->epfd );
+  free( srv->batch );
+  free( srv->conns );
+  free( srv );
+}
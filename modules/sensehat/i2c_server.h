@@ -0,0 +1,134 @@
+/*
+ *  i2c_server.h
+ *    Bus-owner server: serves i2c transactions of many clients over a Unix
+ *    socket, merging their register reads
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Clients connect to a SOCK_SEQPACKET socket and get an i2c_bus backend
+ *  from i2c_server_connect(), so the sense-hat driver and anything else
+ *  written against i2c_bus.h run unchanged on top of it. Each transfer is
+ *  sent as one request and the client blocks for the reply.
+ *
+ *  The server queues requests by priority. A high priority request is
+ *  served as soon as the bus is free; normal ones wait up to the hold time
+ *  for others to share a batch with. Requests that only read registers are
+ *  batched: the reads of all of them are sorted by slave address and
+ *  register, identical and overlapping or adjacent reads of the same
+ *  device are merged into one auto-increment burst, and the bursts go out
+ *  back to back, grouped by address. A request that writes is never merged
+ *  and goes out as sent, on its own.
+ *
+ *  i2c-bcm2835 takes a single read message per transaction, and only as
+ *  the last one, so each burst is a pointer write and read of its own, and
+ *  a request that writes is split after each of its reads. A burst that
+ *  fails fails the requests that read from it, not the whole batch.
+ *
+ *  A read merges with another when both set the auto-increment bit of the
+ *  ST devices (0x80 in the register address), or when both start at the
+ *  same register: a shorter read is a prefix of a longer one either way.
+ */
+#ifndef _I2C_SERVER_H_
+#define _I2C_SERVER_H_
+
+#include <asm/types.h>
+
+#include "i2c_bus.h"
+
+#define I2C_SERVER_PATH "/run/i2cd.sock"
+
+#define I2C_SERVER_MAX_OPS  (I2C_BUS_MAX_MSGS / 2)
+#define I2C_SERVER_MAX_DATA 1024  // payload bytes of a request or reply
+
+enum {
+  I2C_SERVER_PRIO_NORMAL,
+  I2C_SERVER_PRIO_HIGH,   // latency critical, never held back
+  I2C_SERVER_PRIOS
+};
+
+/* ------------------------------------------------------------ wire format */
+
+/* A register pointer write followed by a read of len bytes, or a write
+   of len bytes starting at reg. reg is sent as the device expects it,
+   including any auto-increment bit. */
+struct i2c_server_op {
+  __u16 addr;
+  __u8 reg;
+  __u8 write;
+  __u16 len;
+};
+
+/* Request: the header, nops ops, then the data of the writes in order */
+struct i2c_server_req {
+  __u32 seq;
+  __u8 prio;
+  __u8 nops;
+  __u16 reserved;
+  struct i2c_server_op op[];
+};
+
+/* Reply: the header, then the data of the reads in order unless err is
+   set. The first packet on a new connection is a reply with seq 0 and the
+   adapter name as its data. */
+struct i2c_server_rep {
+  __u32 seq;
+  __s32 err;  // errno of the bus transaction, 0 on success
+};
+
+#define I2C_SERVER_REQ_MAX (sizeof(struct i2c_server_req) + \
+                I2C_SERVER_MAX_OPS * sizeof(struct i2c_server_op) + \
+                I2C_SERVER_MAX_DATA)
+#define I2C_SERVER_REP_MAX (sizeof(struct i2c_server_rep) + \
+                I2C_SERVER_MAX_DATA)
+
+/* --------------------------------------------------------------- server */
+
+struct i2c_server_config {
+  __u64 hold;              // ns a normal request may wait for company
+  unsigned int max_conns;  // connected clients
+};
+
+#define I2C_SERVER_CONFIG_DEFAULT { 500000ULL, 64 }
+
+struct i2c_server_stats {
+  unsigned long conns;      // clients accepted
+  unsigned long requests;   // requests answered
+  unsigned long failed;     // of those, answered with an error
+  unsigned long reads;      // register reads in the requests
+  unsigned long bursts;     // reads left after merging
+  unsigned long batches;    // batches served
+  unsigned long transfers;  // bus transactions issued for them
+  unsigned long switches;   // slave address changes between messages
+  unsigned long served[I2C_SERVER_PRIOS];
+  __u64 wait_sum[I2C_SERVER_PRIOS];  // ns from arrival to reply
+  __u64 wait_max[I2C_SERVER_PRIOS];
+};
+
+struct i2c_server;
+
+/* Listen on path for clients of bus. cfg may be NULL for the defaults. A
+   stale socket left at path is replaced. */
+struct i2c_server *i2c_server_new( struct i2c_bus *bus, const char *path,
+                                   const struct i2c_server_config *cfg );
+
+/* Serve until i2c_server_stop(), returns 0 or -1 and errno */
+int i2c_server_run( struct i2c_server *srv );
+
+/* May be called from a signal handler or another thread */
+void i2c_server_stop( struct i2c_server *srv );
+
+void i2c_server_stats( struct i2c_server *srv,
+                       struct i2c_server_stats *stats );
+
+/* Close all connections and remove the socket */
+void i2c_server_free( struct i2c_server *srv );
+
+/* --------------------------------------------------------------- client */
+
+/* Connect to the server at path; the bus takes the adapter name of the
+   server's bus, so calibration caches keyed by it are shared */
+struct i2c_bus *i2c_server_connect( const char *path, int prio );
+
+#endif /* _I2C_SERVER_H_ */
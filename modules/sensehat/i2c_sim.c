@@ -0,0 +1,498 @@
+/*
+ *  i2c_sim.c
+ *    In-memory simulated sense-hat bus with an LPS25H and an HTS221
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_sim.h"
+
+#define SIM_NREGS 128
+#define SIM_FIFO_SLOTS 32  // LPS25H pressure FIFO depth
+
+/* Time from setting ONE_SHOT to data available, modelled on the longest
+   averaging settings */
+#define SIM_LPS_ONE_SHOT_NS 36000000ULL
+#define SIM_HTS_ONE_SHOT_NS 28000000ULL
+
+/* Factory calibration burnt into the simulated HTS221, datasheet table 19 */
+#define SIM_H0_rH_x2    40     // 20 rH
+#define SIM_H1_rH_x2    160    // 80 rH
+#define SIM_T0_degC_x8  120    // 15 deg C
+#define SIM_T1_degC_x8  280    // 35 deg C (uses the msb bits in 0x35)
+#define SIM_H0_T0_OUT   -3000
+#define SIM_H1_T0_OUT   9000
+#define SIM_T0_OUT      200
+#define SIM_T1_OUT      880
+
+struct i2c_sim;
+
+struct sim_dev {
+  __u16 addr;
+  __u8 regs[SIM_NREGS];
+  __u8 writable[SIM_NREGS];
+  __u8 ptr;         // register address pointer
+  int autoinc;      // pointer advances after each byte
+  __u64 last_conv;  // sim time of the last conversion
+  __u64 one_shot;   // sim time a one-shot conversion completes, 0 if none
+  __s32 fifo[SIM_FIFO_SLOTS];
+  int fifo_head;    // oldest unread slot
+  int fifo_level;   // unread slots
+  __u64 (*period)( struct sim_dev *dev );
+  void (*convert)( struct i2c_sim *sim, struct sim_dev *dev );
+  // called before the byte at reg is returned to the master
+  void (*on_read)( struct sim_dev *dev, __u8 reg );
+  void (*on_write)( struct i2c_sim *sim, struct sim_dev *dev, __u8 reg );
+  // auto-increment successor of reg, NULL for plain reg + 1
+  __u8 (*next_reg)( struct sim_dev *dev, __u8 reg );
+};
+
+struct i2c_sim {
+  struct i2c_bus bus;
+  struct sim_dev lps;
+  struct sim_dev hts;
+  __u64 now;
+  i2c_sim_clock_fn clock;
+  void *clock_arg;
+  i2c_sim_env_fn env_fn;
+  void *env_arg;
+  struct i2c_sim_env env;
+  struct i2c_sim_env noise;  // RMS of one internal measurement
+  __u64 rng;
+  unsigned long bitrate;     // SCL in Hz, 0 to take no time on the wire
+};
+
+static __u64 sim_monotonic( void *arg ) {
+  (void) arg;
+  return clock_ns( CLOCK_MONOTONIC );
+}
+
+static void sim_env( struct i2c_sim *sim, struct i2c_sim_env *env ) {
+  *env = sim->env;
+  if ( sim->env_fn != NULL ) sim->env_fn( sim->env_arg, sim->now, env );
+}
+
+/* Standard normal deviate, xorshift64 and Box-Muller */
+static float sim_gauss( struct i2c_sim *sim ) {
+  double u[2];
+
+  for (int i = 0; i < 2; i++) {
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 7;
+    sim->rng ^= sim->rng << 17;
+    u[i] = ((sim->rng >> 11) + 0.5) / 9007199254740992.0;
+  }
+  return (float) (sqrt( -2.0 * log( u[0] ) ) * cos( 2 * M_PI * u[1] ));
+}
+
+/* Noise of a conversion that averages 2^shift internal measurements */
+static float sim_noise( struct i2c_sim *sim, float rms, int shift ) {
+  return rms > 0.0f ? rms * sim_gauss( sim ) / sqrtf( 1 << shift ) : 0.0f;
+}
+
+static void put_le16( __u8 *p, __s16 v ) {
+  p[0] = (__u16) v & 0xff;
+  p[1] = ((__u16) v >> 8) & 0xff;
+}
+
+static __s16 clamp_s16( float v ) {
+  if ( v > 32767.0f ) return 32767;
+  if ( v < -32768.0f ) return -32768;
+  return (__s16) lroundf( v );
+}
+
+/* ------------------------------------------------------------------ LPS25H */
+
+static __u64 lps_period( struct sim_dev *dev ) {
+  static const __u64 odr_ns[8] = {
+    0, 1000000000ULL, 142857143ULL, 80000000ULL, 40000000ULL, 0, 0, 0
+  };
+  __u8 ctrl1 = dev->regs[LPS25H_CTRL_REG1];
+
+  if ( !(ctrl1 & LPS25H_CTRL_REG1_PD_if(1)) ) return 0;
+  return odr_ns[(ctrl1 >> 4) & 0x7];
+}
+
+/* FIFO modes that queue samples rather than passing them straight to the
+   output registers; FIFO mean mode (6) is modelled as pass-through */
+static int lps_fifo_active( struct sim_dev *dev ) {
+  int mode = dev->regs[LPS25H_FIFO_CTRL] >> 5;
+
+  return (dev->regs[LPS25H_CTRL_REG2] & LPS25H_CTRL_REG2_FIFO_EN_if(1)) &&
+         mode != 0 && mode != 6;
+}
+
+static void lps_fifo_status( struct sim_dev *dev ) {
+  int wtm = dev->regs[LPS25H_FIFO_CTRL] & 0x1f;
+  __u8 status;
+
+  status = dev->fifo_level >= SIM_FIFO_SLOTS ? 0x1f : dev->fifo_level;
+  if ( dev->fifo_level == 0 ) status |= 1 << 5;
+  if ( dev->fifo_level >= SIM_FIFO_SLOTS ) status |= 1 << 6;
+  if ( (dev->regs[LPS25H_CTRL_REG2] & LPS25H_CTRL_REG2_WTM_EN_if(1)) &&
+       dev->fifo_level > wtm )
+    status |= 1 << 7;
+  dev->regs[LPS25H_FIFO_STATUS] = status;
+}
+
+static void put_press( __u8 *r, __s32 p_raw ) {
+  r[LPS25H_PRESS_POUT] = p_raw & 0xff;
+  r[LPS25H_PRESS_POUT + 1] = (p_raw >> 8) & 0xff;
+  r[LPS25H_PRESS_POUT + 2] = (p_raw >> 16) & 0xff;
+}
+
+static void lps_fifo_push( struct sim_dev *dev, __s32 p_raw ) {
+  int mode = dev->regs[LPS25H_FIFO_CTRL] >> 5;
+
+  if ( dev->fifo_level == SIM_FIFO_SLOTS ) {
+    // FIFO mode stops when full, the stream modes discard the oldest slot
+    if ( mode == 1 ) return;
+    dev->fifo_head = (dev->fifo_head + 1) % SIM_FIFO_SLOTS;
+    dev->fifo_level--;
+  }
+  dev->fifo[(dev->fifo_head + dev->fifo_level) % SIM_FIFO_SLOTS] = p_raw;
+  dev->fifo_level++;
+  lps_fifo_status( dev );
+}
+
+static void lps_convert( struct i2c_sim *sim, struct sim_dev *dev ) {
+  struct i2c_sim_env env;
+  __s32 p_raw;
+  __s16 t_raw;
+  __u8 *r = dev->regs;
+
+  sim_env( sim, &env );
+  // RES_CONF AVGP selects 8, 32, 128 or 512 internal measurements
+  env.pressure += sim_noise( sim, sim->noise.pressure,
+                             3 + 2 * (r[LPS25H_RES_CONF] & 0x3) );
+  p_raw = (__s32) lroundf( env.pressure * 4096.0f );
+  t_raw = clamp_s16( (env.temperature - 42.5f) * 480.0f );
+
+  if ( lps_fifo_active( dev ) ) lps_fifo_push( dev, p_raw );
+  else put_press( r, p_raw );
+  put_le16( r + LPS25H_TEMP_OUT, t_raw );
+
+  // a conversion on top of unread data is an overrun
+  if ( LPS25H_STATUS_REG_P_DA_ef( r[LPS25H_STATUS_REG] ) )
+    r[LPS25H_STATUS_REG] |= 1 << 5;
+  if ( LPS25H_STATUS_REG_T_DA_ef( r[LPS25H_STATUS_REG] ) )
+    r[LPS25H_STATUS_REG] |= 1 << 4;
+  r[LPS25H_STATUS_REG] |= 0x3;
+}
+
+static void lps_on_read( struct sim_dev *dev, __u8 reg ) {
+  // reading PRESS_OUT_XL latches the oldest FIFO slot into the outputs
+  if ( reg == LPS25H_PRESS_POUT && lps_fifo_active( dev ) &&
+       dev->fifo_level > 0 ) {
+    put_press( dev->regs, dev->fifo[dev->fifo_head] );
+    dev->fifo_head = (dev->fifo_head + 1) % SIM_FIFO_SLOTS;
+    dev->fifo_level--;
+    lps_fifo_status( dev );
+  }
+  // reading the high byte completes the output and clears data available
+  if ( reg == LPS25H_PRESS_POUT + 2 )
+    dev->regs[LPS25H_STATUS_REG] &= ~((1 << 5) | (1 << 1));
+  else if ( reg == LPS25H_TEMP_OUT + 1 )
+    dev->regs[LPS25H_STATUS_REG] &= ~((1 << 4) | 1);
+}
+
+static void lps_on_write( struct i2c_sim *sim, struct sim_dev *dev,
+                          __u8 reg ) {
+  __u8 *r = dev->regs;
+
+  // restart the conversion cadence whenever power or ODR changes, power
+  // down abandons a one-shot conversion
+  if ( reg == LPS25H_CTRL_REG1 ) {
+    dev->last_conv = sim->now;
+    if ( !(r[reg] & LPS25H_CTRL_REG1_PD_if(1)) ) dev->one_shot = 0;
+  }
+  // ONE_SHOT only starts a conversion when powered up with ODR 0
+  if ( reg == LPS25H_CTRL_REG2 && (r[reg] & LPS25H_CTRL_REG2_ONE_SHOT_if(1)) &&
+       (r[LPS25H_CTRL_REG1] & 0xf0) == LPS25H_CTRL_REG1_PD_if(1) )
+    dev->one_shot = sim->now + SIM_LPS_ONE_SHOT_NS;
+  // entering bypass mode empties the FIFO
+  if ( reg == LPS25H_FIFO_CTRL && (dev->regs[reg] >> 5) == 0 ) {
+    dev->fifo_head = 0;
+    dev->fifo_level = 0;
+  }
+  if ( reg == LPS25H_FIFO_CTRL || reg == LPS25H_CTRL_REG2 )
+    lps_fifo_status( dev );
+}
+
+/* With the FIFO enabled the address rolls back from PRESS_OUT_H to
+   PRESS_OUT_XL, so one burst read drains several slots */
+static __u8 lps_next_reg( struct sim_dev *dev, __u8 reg ) {
+  if ( reg == LPS25H_PRESS_POUT + 2 && lps_fifo_active( dev ) )
+    return LPS25H_PRESS_POUT;
+  return reg + 1;
+}
+
+static void lps_init( struct sim_dev *dev ) {
+  static const __u8 writable[] = {
+    LPS25H_REF_P, LPS25H_REF_P + 1, LPS25H_REF_P + 2, LPS25H_RES_CONF,
+    LPS25H_CTRL_REG1, LPS25H_CTRL_REG2, LPS25H_CTRL_REG3, LPS25H_CTRL_REG4,
+    LPS25H_INT_CFG, LPS25H_FIFO_CTRL, LPS25H_THS_P, LPS25H_THS_P + 1,
+    LPS25H_RPDS, LPS25H_RPDS + 1
+  };
+
+  dev->addr = LPS25H_SAD;
+  dev->regs[LPS25H_WHO_AM_I] = LPS25H_who_am_i;
+  dev->regs[LPS25H_RES_CONF] = 0x05;
+  lps_fifo_status( dev );
+  for (size_t i = 0; i < sizeof(writable); i++) dev->writable[writable[i]] = 1;
+  dev->period = lps_period;
+  dev->convert = lps_convert;
+  dev->on_read = lps_on_read;
+  dev->on_write = lps_on_write;
+  dev->next_reg = lps_next_reg;
+}
+
+/* ------------------------------------------------------------------ HTS221 */
+
+static __u64 hts_period( struct sim_dev *dev ) {
+  static const __u64 odr_ns[4] = {
+    0, 1000000000ULL, 142857143ULL, 80000000ULL
+  };
+  __u8 ctrl1 = dev->regs[HTS221_CTRL_REG1];
+
+  if ( !(ctrl1 & HTS221_CTRL_REG1_PD_if(1)) ) return 0;
+  return odr_ns[ctrl1 & 0x3];
+}
+
+static void hts_convert( struct i2c_sim *sim, struct sim_dev *dev ) {
+  struct i2c_sim_env env;
+  float t0 = SIM_T0_degC_x8 / 8.0f, t1 = SIM_T1_degC_x8 / 8.0f;
+  float h0 = SIM_H0_rH_x2 / 2.0f, h1 = SIM_H1_rH_x2 / 2.0f;
+  float h;
+  __u8 *r = dev->regs;
+
+  sim_env( sim, &env );
+  // AV_CONF AVGH selects 4 to 512 measurements, AVGT 2 to 256
+  env.humidity += sim_noise( sim, sim->noise.humidity,
+                             2 + (r[HTS221_AV_CONF] & 0x7) );
+  env.temperature += sim_noise( sim, sim->noise.temperature,
+                                1 + ((r[HTS221_AV_CONF] >> 3) & 0x7) );
+  h = env.humidity < 0.0f ? 0.0f : env.humidity > 100.0f ? 100.0f
+                                                          : env.humidity;
+  put_le16( r + HTS221_TEMP_OUT, clamp_s16( SIM_T0_OUT + (env.temperature - t0)
+            * (SIM_T1_OUT - SIM_T0_OUT) / (t1 - t0) ) );
+  put_le16( r + HTS221_HUMIDITY_OUT, clamp_s16( SIM_H0_T0_OUT + (h - h0)
+            * (SIM_H1_T0_OUT - SIM_H0_T0_OUT) / (h1 - h0) ) );
+  r[HTS221_STATUS_REG] |= 0x3;
+}
+
+static void hts_on_read( struct sim_dev *dev, __u8 reg ) {
+  if ( reg == HTS221_HUMIDITY_OUT + 1 )
+    dev->regs[HTS221_STATUS_REG] &= ~(1 << 1);
+  else if ( reg == HTS221_TEMP_OUT + 1 )
+    dev->regs[HTS221_STATUS_REG] &= ~1;
+}
+
+static void hts_on_write( struct i2c_sim *sim, struct sim_dev *dev,
+                          __u8 reg ) {
+  __u8 *r = dev->regs;
+
+  if ( reg == HTS221_CTRL_REG1 ) {
+    dev->last_conv = sim->now;
+    if ( !(r[reg] & HTS221_CTRL_REG1_PD_if(1)) ) dev->one_shot = 0;
+  }
+  if ( reg == HTS221_CTRL_REG2 && (r[reg] & HTS221_CTRL_REG2_ONE_SHOT_if(1)) &&
+       (r[HTS221_CTRL_REG1] & 0x83) == HTS221_CTRL_REG1_PD_if(1) )
+    dev->one_shot = sim->now + SIM_HTS_ONE_SHOT_NS;
+}
+
+static void hts_init( struct sim_dev *dev ) {
+  __u8 *cal = dev->regs + HTS221_CAL_H0_rH_x2;
+
+  dev->addr = HTS221_SAD;
+  dev->regs[HTS221_WHO_AM_I] = HTS221_who_am_i;
+  dev->regs[HTS221_AV_CONF] = 0x1b;
+  dev->writable[HTS221_AV_CONF] = 1;
+  dev->writable[HTS221_CTRL_REG1] = 1;
+  dev->writable[HTS221_CTRL_REG2] = 1;
+  dev->writable[HTS221_CTRL_REG3] = 1;
+
+  cal[0] = SIM_H0_rH_x2;
+  cal[1] = SIM_H1_rH_x2;
+  cal[2] = SIM_T0_degC_x8 & 0xff;
+  cal[3] = SIM_T1_degC_x8 & 0xff;
+  cal[5] = ((SIM_T0_degC_x8 >> 8) & 0x3) | (((SIM_T1_degC_x8 >> 8) & 0x3) << 2);
+  put_le16( cal + 6, SIM_H0_T0_OUT );
+  put_le16( cal + 10, SIM_H1_T0_OUT );
+  put_le16( cal + 12, SIM_T0_OUT );
+  put_le16( cal + 14, SIM_T1_OUT );
+
+  dev->period = hts_period;
+  dev->convert = hts_convert;
+  dev->on_read = hts_on_read;
+  dev->on_write = hts_on_write;
+}
+
+/* --------------------------------------------------------------------- bus */
+
+static void sim_advance( struct i2c_sim *sim, struct sim_dev *dev ) {
+  __u64 period = dev->period( dev );
+  __u64 n;
+
+  if ( period == 0 ) {
+    dev->last_conv = sim->now;
+    // ONE_SHOT is bit 0 of CTRL_REG2 (0x21) on both devices and clears
+    // when the conversion is done
+    if ( dev->one_shot != 0 && sim->now >= dev->one_shot ) {
+      dev->convert( sim, dev );
+      dev->regs[LPS25H_CTRL_REG2] &= ~LPS25H_CTRL_REG2_ONE_SHOT_if(1);
+      dev->one_shot = 0;
+    }
+    return;
+  }
+  n = (sim->now - dev->last_conv) / period;
+  if ( n == 0 ) return;
+  dev->last_conv += n * period;
+  // anything beyond a few periods only matters for overrun flags
+  if ( n > 64 ) n = 64;
+  while ( n-- ) dev->convert( sim, dev );
+}
+
+static __u8 sim_next_reg( struct sim_dev *dev, __u8 reg ) {
+  if ( dev->next_reg != NULL ) reg = dev->next_reg( dev, reg );
+  else reg++;
+  return reg & (SIM_NREGS - 1);
+}
+
+static struct sim_dev *sim_dev( struct i2c_sim *sim, __u16 addr ) {
+  if ( addr == sim->lps.addr ) return &sim->lps;
+  if ( addr == sim->hts.addr ) return &sim->hts;
+  return NULL;
+}
+
+/* Bits on the wire: a (repeated) START and the address byte for every
+   message, 9 clocks per byte with the acknowledge, and the STOP */
+static void sim_wire_time( struct i2c_sim *sim, struct i2c_msg *msgs,
+                           int nmsgs ) {
+  struct timespec ts;
+  __u64 bits = 1, ns;
+
+  for (int i = 0; i < nmsgs; i++) bits += 1 + 9 + 9 * msgs[i].len;
+  ns = bits * 1000000000ULL / sim->bitrate;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while ( nanosleep( &ts, &ts ) == -1 && errno == EINTR );
+}
+
+static int sim_transfer( struct i2c_bus *bus, struct i2c_msg *msgs,
+                         int nmsgs ) {
+  struct i2c_sim *sim = (struct i2c_sim *) bus;
+
+  // as i2c-bcm2835: "only one read message supported, has to be last"
+  for (int i = 0; i < nmsgs - 1; i++)
+    if ( msgs[i].flags & I2C_M_RD ) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+  sim->now = sim->clock( sim->clock_arg );
+  sim_advance( sim, &sim->lps );
+  sim_advance( sim, &sim->hts );
+
+  for (int i = 0; i < nmsgs; i++) {
+    struct sim_dev *dev = sim_dev( sim, msgs[i].addr );
+    struct i2c_msg *m = &msgs[i];
+
+    if ( dev == NULL ) {
+      errno = ENXIO;
+      return -1;
+    }
+    if ( m->flags & I2C_M_RD ) {
+      for (__u16 j = 0; j < m->len; j++) {
+        dev->on_read( dev, dev->ptr );
+        m->buf[j] = dev->regs[dev->ptr];
+        if ( dev->autoinc ) dev->ptr = sim_next_reg( dev, dev->ptr );
+      }
+    } else if ( m->len > 0 ) {
+      dev->ptr = m->buf[0] & (SIM_NREGS - 1);
+      dev->autoinc = (m->buf[0] & 0x80) != 0;
+      for (__u16 j = 1; j < m->len; j++) {
+        if ( dev->writable[dev->ptr] ) {
+          dev->regs[dev->ptr] = m->buf[j];
+          dev->on_write( sim, dev, dev->ptr );
+        }
+        if ( dev->autoinc ) dev->ptr = sim_next_reg( dev, dev->ptr );
+      }
+    }
+  }
+  if ( sim->bitrate != 0 ) sim_wire_time( sim, msgs, nmsgs );
+  return nmsgs;
+}
+
+static void sim_close( struct i2c_bus *bus ) {
+  free( bus );
+}
+
+static const struct i2c_bus_ops sim_ops = {
+  .transfer = sim_transfer,
+  .close = sim_close,
+};
+
+struct i2c_bus *i2c_sim_open( void ) {
+  struct i2c_sim *sim;
+
+  sim = calloc( 1, sizeof(struct i2c_sim) );
+  if ( sim == NULL ) return NULL;
+
+  sim->bus.ops = &sim_ops;
+  strcpy( sim->bus.name, "sim" );
+  sim->clock = sim_monotonic;
+  sim->env.pressure = 1013.25f;
+  sim->env.temperature = 21.5f;
+  sim->env.humidity = 45.0f;
+  sim->rng = 0x9e3779b97f4a7c15ULL;
+  lps_init( &sim->lps );
+  hts_init( &sim->hts );
+  sim->now = sim->clock( sim->clock_arg );
+  return &sim->bus;
+}
+
+void i2c_sim_set_clock( struct i2c_bus *bus, i2c_sim_clock_fn fn,
+                        void *arg ) {
+  struct i2c_sim *sim = (struct i2c_sim *) bus;
+
+  sim->clock = fn != NULL ? fn : sim_monotonic;
+  sim->clock_arg = arg;
+  sim->now = sim->clock( sim->clock_arg );
+  sim->lps.last_conv = sim->now;
+  sim->hts.last_conv = sim->now;
+}
+
+void i2c_sim_set_env( struct i2c_bus *bus, const struct i2c_sim_env *env ) {
+  ((struct i2c_sim *) bus)->env = *env;
+}
+
+void i2c_sim_set_noise( struct i2c_bus *bus, const struct i2c_sim_env *rms ) {
+  ((struct i2c_sim *) bus)->noise = *rms;
+}
+
+void i2c_sim_set_bitrate( struct i2c_bus *bus, unsigned long hz ) {
+  ((struct i2c_sim *) bus)->bitrate = hz;
+}
+
+void i2c_sim_set_env_fn( struct i2c_bus *bus, i2c_sim_env_fn fn, void *arg ) {
+  struct i2c_sim *sim = (struct i2c_sim *) bus;
+
+  sim->env_fn = fn;
+  sim->env_arg = arg;
+}
+
+__u8 *i2c_sim_regs( struct i2c_bus *bus, __u16 addr ) {
+  struct sim_dev *dev = sim_dev( (struct i2c_sim *) bus, addr );
+
+  return dev != NULL ? dev->regs : NULL;
+}
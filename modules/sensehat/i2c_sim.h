@@ -0,0 +1,56 @@
+/*
+ *  i2c_sim.h
+ *    In-memory simulated sense-hat bus with an LPS25H and an HTS221
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The simulated devices are modelled on the register maps in LPS25H.h and
+ *  HTS221.h. Conversions happen lazily: every transaction first advances
+ *  each powered device by the number of output periods elapsed on the sim
+ *  clock, so data-ready bits and overruns behave like the real chips.
+ *
+ *  Transactions are held to the rules of i2c-bcm2835, the adapter of the
+ *  Pi: a read message anywhere but last fails the whole transaction with
+ *  EOPNOTSUPP, so what runs on the simulator runs on the Pi.
+ */
+#ifndef _I2C_SIM_H_
+#define _I2C_SIM_H_
+
+#include <asm/types.h>
+
+#include "i2c_bus.h"
+
+struct i2c_sim_env {
+  float pressure;     // mbar
+  float temperature;  // deg C
+  float humidity;     // rH
+};
+
+typedef __u64 (*i2c_sim_clock_fn)( void *arg );
+typedef void (*i2c_sim_env_fn)( void *arg, __u64 now_ns,
+                                struct i2c_sim_env *env );
+
+struct i2c_bus *i2c_sim_open( void );
+
+/* Replace the time source (nanoseconds), default is CLOCK_MONOTONIC */
+void i2c_sim_set_clock( struct i2c_bus *bus, i2c_sim_clock_fn fn, void *arg );
+
+/* Constant environment, or a callback evaluated at every conversion */
+void i2c_sim_set_env( struct i2c_bus *bus, const struct i2c_sim_env *env );
+void i2c_sim_set_env_fn( struct i2c_bus *bus, i2c_sim_env_fn fn, void *arg );
+
+/* Gaussian noise added to every conversion, given as the RMS of a single
+   internal measurement. Each conversion averages as many of them as
+   RES_CONF and AV_CONF select. The default is none. */
+void i2c_sim_set_noise( struct i2c_bus *bus, const struct i2c_sim_env *rms );
+
+/* Make every transaction take as long as it would on a bus clocked at hz,
+   e.g. 400000 for fast mode. The default is 0, no time at all. */
+void i2c_sim_set_bitrate( struct i2c_bus *bus, unsigned long hz );
+
+/* Raw 128 byte register file of the device at addr, NULL if not present */
+__u8 *i2c_sim_regs( struct i2c_bus *bus, __u16 addr );
+
+#endif /* _I2C_SIM_H_ */
@@ -0,0 +1,401 @@
+/*
+ *  i2c_trace.c
+ *    Record the transactions of a bus to a trace file and replay them
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "i2c_trace.h"
+
+#define TRACE_MAX_DEVS 8
+#define TRACE_NREGS    128
+
+/* The register file of a slave as far as the trace shows it. The first
+   byte written selects the register, its msb asks for auto-increment, as
+   on the LPS25H and the HTS221. */
+struct trace_dev {
+  __u16 addr;
+  __u8 regs[TRACE_NREGS];
+  __u8 ptr;
+  int autoinc;
+};
+
+/* A record of the mapped trace, copied out since records are not aligned */
+struct trace_view {
+  struct i2c_trace_rec rec;
+  struct i2c_trace_msg msg[I2C_BUS_MAX_MSGS];
+  const __u8 *data;
+  size_t next;  // offset of the record after it
+};
+
+struct trace {
+  struct i2c_bus bus;
+  struct i2c_trace_stats stats;
+  // recording
+  struct i2c_bus *inner;
+  FILE *fp;
+  __u64 start;
+  // replaying
+  struct i2c_trace_config cfg;
+  const __u8 *map;
+  size_t map_len;
+  size_t first, end;  // offset of the first record, and past the last one
+  size_t pos;         // offset of the next record
+  __u64 t_first;
+  __u64 span;         // trace time one pass takes when looping
+  __u64 offset;       // trace time added by the passes before
+  __u64 origin;       // CLOCK_MONOTONIC ns the first record was due
+  struct trace_dev dev[TRACE_MAX_DEVS];
+  int ndevs;
+};
+
+static void sleep_until( __u64 t ) {
+  struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+
+  while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) ==
+          EINTR );
+}
+
+/* --------------------------------------------------------------- recording */
+
+static int record_transfer( struct i2c_bus *bus, struct i2c_msg *msgs,
+                            int nmsgs ) {
+  struct trace *tr = (struct trace *) bus;
+  struct i2c_trace_msg m[I2C_BUS_MAX_MSGS];
+  struct i2c_trace_rec rec;
+  size_t size = nmsgs * sizeof(m[0]);
+  int res, err;
+
+  rec.t = clock_ns( CLOCK_MONOTONIC ) - tr->start;
+  res = tr->inner->ops->transfer( tr->inner, msgs, nmsgs );
+  err = errno;
+
+  for (int i = 0; i < nmsgs; i++) {
+    m[i].addr = msgs[i].addr;
+    m[i].flags = msgs[i].flags;
+    m[i].len = msgs[i].len;
+    size += msgs[i].len;
+  }
+  rec.res = res == -1 ? -err : res;
+  rec.nmsgs = nmsgs;
+  rec.size = size;
+
+  // after a failed write the rest of the file would not parse
+  if ( size > 0xffff || ferror( tr->fp ) ||
+       fwrite( &rec, sizeof(rec), 1, tr->fp ) != 1 ||
+       fwrite( m, sizeof(m[0]), nmsgs, tr->fp ) != (size_t) nmsgs ) {
+    tr->stats.lost++;
+  } else {
+    for (int i = 0; i < nmsgs; i++)
+      fwrite( msgs[i].buf, 1, msgs[i].len, tr->fp );
+    if ( ferror( tr->fp ) ) tr->stats.lost++;
+    else tr->stats.records++;
+  }
+  errno = err;
+  return res;
+}
+
+static void record_close( struct i2c_bus *bus ) {
+  struct trace *tr = (struct trace *) bus;
+
+  fclose( tr->fp );
+  i2c_bus_close( tr->inner );
+  free( tr );
+}
+
+static const struct i2c_bus_ops record_ops = {
+  .transfer = record_transfer,
+  .close = record_close,
+};
+
+struct i2c_bus *i2c_trace_record( struct i2c_bus *bus, const char *path ) {
+  struct i2c_trace_head head = { .version = I2C_TRACE_VERSION };
+  struct trace *tr;
+  int err;
+
+  tr = calloc( 1, sizeof(struct trace) );
+  if ( tr == NULL ) return NULL;
+  tr->fp = fopen( path, "w" );
+  if ( tr->fp == NULL ) goto fail;
+
+  memcpy( head.magic, I2C_TRACE_MAGIC, sizeof(head.magic) );
+  head.realtime = clock_ns( CLOCK_REALTIME );
+  memcpy( head.name, bus->name, sizeof(head.name) );
+  if ( fwrite( &head, sizeof(head), 1, tr->fp ) != 1 ) goto fail;
+
+  tr->bus.ops = &record_ops;
+  memcpy( tr->bus.name, bus->name, sizeof(tr->bus.name) );
+  tr->inner = bus;
+  tr->start = clock_ns( CLOCK_MONOTONIC );
+  return &tr->bus;
+
+fail:
+  err = errno;
+  if ( tr->fp != NULL ) fclose( tr->fp );
+  free( tr );
+  errno = err;
+  return NULL;
+}
+
+/* --------------------------------------------------------------- replaying */
+
+/* Copy out the record at off, -1 if there is no whole record there */
+static int view( const struct trace *tr, size_t off, struct trace_view *v ) {
+  size_t mlen, dlen = 0;
+
+  if ( tr->map_len - off < sizeof(v->rec) ) return -1;
+  memcpy( &v->rec, tr->map + off, sizeof(v->rec) );
+  off += sizeof(v->rec);
+  mlen = v->rec.nmsgs * sizeof(v->msg[0]);
+  if ( v->rec.nmsgs == 0 || v->rec.nmsgs > I2C_BUS_MAX_MSGS ||
+       v->rec.size < mlen || tr->map_len - off < v->rec.size )
+    return -1;
+  memcpy( v->msg, tr->map + off, mlen );
+  for (int i = 0; i < v->rec.nmsgs; i++) dlen += v->msg[i].len;
+  if ( dlen != v->rec.size - mlen ) return -1;
+  v->data = tr->map + off + mlen;
+  v->next = off + v->rec.size;
+  return 0;
+}
+
+static struct trace_dev *find_dev( struct trace *tr, __u16 addr, int add ) {
+  for (int i = 0; i < tr->ndevs; i++)
+    if ( tr->dev[i].addr == addr ) return &tr->dev[i];
+  if ( !add || tr->ndevs == TRACE_MAX_DEVS ) return NULL;
+  tr->dev[tr->ndevs].addr = addr;
+  return &tr->dev[tr->ndevs++];
+}
+
+/* Move the bytes of one message between buf and the registers of dev */
+static void move( struct trace_dev *dev, __u16 flags, __u8 *buf, __u16 len,
+                  int to_regs ) {
+  __u16 i = 0;
+
+  if ( !(flags & I2C_M_RD) ) {
+    if ( len == 0 ) return;
+    dev->ptr = buf[0] & (TRACE_NREGS - 1);
+    dev->autoinc = (buf[0] & 0x80) != 0;
+    i = 1;
+    to_regs = 1;
+  }
+  for (; i < len; i++) {
+    if ( to_regs ) dev->regs[dev->ptr] = buf[i];
+    else buf[i] = dev->regs[dev->ptr];
+    if ( dev->autoinc ) dev->ptr = (dev->ptr + 1) & (TRACE_NREGS - 1);
+  }
+}
+
+/* Bring the registers up to date with a record */
+static void apply( struct trace *tr, const struct trace_view *v ) {
+  const __u8 *d = v->data;
+
+  if ( v->rec.res != v->rec.nmsgs ) return;
+  for (int i = 0; i < v->rec.nmsgs; i++) {
+    struct trace_dev *dev = find_dev( tr, v->msg[i].addr, 1 );
+
+    if ( dev != NULL )
+      move( dev, v->msg[i].flags, (__u8 *) d, v->msg[i].len, 1 );
+    d += v->msg[i].len;
+  }
+}
+
+/* Answer a transaction from the registers */
+static int serve( struct trace *tr, struct i2c_msg *msgs, int nmsgs ) {
+  for (int i = 0; i < nmsgs; i++) {
+    struct trace_dev *dev = find_dev( tr, msgs[i].addr, 0 );
+
+    if ( dev == NULL ) {
+      errno = ENXIO;
+      return -1;
+    }
+    move( dev, msgs[i].flags, msgs[i].buf, msgs[i].len, 0 );
+  }
+  return nmsgs;
+}
+
+static int matches( const struct trace_view *v, const struct i2c_msg *msgs,
+                    int nmsgs ) {
+  const __u8 *d = v->data;
+
+  if ( v->rec.nmsgs != nmsgs ) return 0;
+  for (int i = 0; i < nmsgs; i++) {
+    if ( v->msg[i].addr != msgs[i].addr ||
+         v->msg[i].flags != msgs[i].flags || v->msg[i].len != msgs[i].len )
+      return 0;
+    if ( !(msgs[i].flags & I2C_M_RD) &&
+         memcmp( d, msgs[i].buf, msgs[i].len ) != 0 )
+      return 0;
+    d += msgs[i].len;
+  }
+  return 1;
+}
+
+/* Wait until the record issued at t is due */
+static void pace( struct trace *tr, __u64 t ) {
+  __u64 now, due, behind;
+
+  if ( tr->cfg.speed <= I2C_TRACE_ASAP ) return;
+  t += tr->offset - tr->t_first;
+  now = clock_ns( CLOCK_MONOTONIC );
+  if ( tr->origin == 0 ) tr->origin = now - (__u64) (t / tr->cfg.speed);
+  due = tr->origin + (__u64) (t / tr->cfg.speed);
+  if ( now < due ) {
+    sleep_until( due );
+    return;
+  }
+  behind = now - due;
+  tr->stats.behind_sum += behind;
+  if ( behind > tr->stats.behind_max ) tr->stats.behind_max = behind;
+}
+
+static int replay_transfer( struct i2c_bus *bus, struct i2c_msg *msgs,
+                            int nmsgs ) {
+  struct trace *tr = (struct trace *) bus;
+  struct trace_view v;
+  size_t off = tr->pos;
+  int skip;
+
+  if ( tr->pos == tr->end ) {
+    if ( !tr->cfg.loop ) {
+      errno = ENODATA;
+      return -1;
+    }
+    tr->pos = off = tr->first;
+    tr->offset += tr->span;
+    tr->stats.loops++;
+  }
+
+  for (skip = 0; skip < I2C_TRACE_WINDOW && off != tr->end; skip++) {
+    view( tr, off, &v );
+    if ( matches( &v, msgs, nmsgs ) ) break;
+    off = v.next;
+  }
+
+  if ( skip == I2C_TRACE_WINDOW || off == tr->end ) {
+    // nothing in reach, stand in for the next record
+    view( tr, tr->pos, &v );
+    tr->pos = v.next;
+    pace( tr, v.rec.t );
+    apply( tr, &v );
+    tr->stats.unmatched++;
+    return serve( tr, msgs, nmsgs );
+  }
+
+  for (off = tr->pos; skip-- > 0; off = v.next) {
+    view( tr, off, &v );
+    apply( tr, &v );
+    tr->stats.skipped++;
+  }
+  view( tr, off, &v );
+  tr->pos = v.next;
+  pace( tr, v.rec.t );
+  apply( tr, &v );
+  tr->stats.records++;
+
+  if ( v.rec.res < 0 ) {
+    errno = -v.rec.res;
+    return -1;
+  }
+  for (int i = 0; i < nmsgs; i++) {
+    if ( msgs[i].flags & I2C_M_RD )
+      memcpy( msgs[i].buf, v.data, msgs[i].len );
+    v.data += msgs[i].len;
+  }
+  return v.rec.res;
+}
+
+static void replay_close( struct i2c_bus *bus ) {
+  struct trace *tr = (struct trace *) bus;
+
+  munmap( (void *) tr->map, tr->map_len );
+  free( tr );
+}
+
+static const struct i2c_bus_ops replay_ops = {
+  .transfer = replay_transfer,
+  .close = replay_close,
+};
+
+struct i2c_bus *i2c_trace_replay( const char *path,
+                                  const struct i2c_trace_config *cfg ) {
+  static const struct i2c_trace_config defaults = I2C_TRACE_CONFIG_DEFAULT;
+  struct i2c_trace_head head;
+  struct trace_view v;
+  unsigned long n = 0;
+  __u64 t_last = 0;
+  struct stat st;
+  struct trace *tr;
+  int fd, err;
+
+  tr = calloc( 1, sizeof(struct trace) );
+  if ( tr == NULL ) return NULL;
+  tr->cfg = cfg != NULL ? *cfg : defaults;
+
+  fd = open( path, O_RDONLY | O_CLOEXEC );
+  if ( fd == -1 ) goto fail;
+  if ( fstat( fd, &st ) == -1 ) goto fail_fd;
+  if ( st.st_size < (off_t) sizeof(head) ) {
+    errno = EINVAL;
+    goto fail_fd;
+  }
+  tr->map_len = st.st_size;
+  tr->map = mmap( NULL, tr->map_len, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if ( tr->map == MAP_FAILED ) goto fail_fd;
+  close( fd );
+
+  memcpy( &head, tr->map, sizeof(head) );
+  if ( memcmp( head.magic, I2C_TRACE_MAGIC, sizeof(head.magic) ) != 0 ||
+       head.version != I2C_TRACE_VERSION ) {
+    errno = EINVAL;
+    goto fail_map;
+  }
+
+  // the records up to the first that is cut short or garbled
+  tr->first = tr->end = sizeof(head);
+  while ( view( tr, tr->end, &v ) == 0 ) {
+    if ( n++ == 0 ) tr->t_first = v.rec.t;
+    t_last = v.rec.t;
+    tr->end = v.next;
+  }
+  if ( n == 0 ) {
+    errno = ENODATA;
+    goto fail_map;
+  }
+  // one more mean interval between the last record and the first again
+  tr->span = t_last - tr->t_first;
+  if ( n > 1 ) tr->span += tr->span / (n - 1);
+  tr->pos = tr->first;
+
+  tr->bus.ops = &replay_ops;
+  memcpy( tr->bus.name, head.name, sizeof(tr->bus.name) - 1 );
+  return &tr->bus;
+
+fail_fd:
+  err = errno;
+  close( fd );
+  errno = err;
+  goto fail;
+fail_map:
+  err = errno;
+  munmap( (void *) tr->map, tr->map_len );
+  errno = err;
+fail:
+  free( tr );
+  return NULL;
+}
+
+void i2c_trace_stats( struct i2c_bus *bus, struct i2c_trace_stats *stats ) {
+  memcpy( stats, &((struct trace *) bus)->stats, sizeof(*stats) );
+}
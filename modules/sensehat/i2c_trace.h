@@ -0,0 +1,93 @@
+/*
+ *  i2c_trace.h
+ *    Record the transactions of a bus to a trace file and replay them
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  i2c_trace_record() wraps a bus and appends every transaction to the
+ *  trace: when it was issued, what it returned, the shape of each message
+ *  and the bytes moved either way. The trace starts with a struct
+ *  i2c_trace_head and is written through stdio, so a record costs a copy
+ *  and no syscall; a crash loses the unwritten tail and the partial record
+ *  it may leave behind is ignored on replay. The byte order is the host's.
+ *
+ *  i2c_trace_replay() is a bus that answers from a trace, so the driver and
+ *  everything behind it run on recorded data without the hardware. Each
+ *  transaction is matched against the next records of the same shape: the
+ *  same slaves, directions and lengths, and the same bytes written. The
+ *  match is answered with the recorded read bytes and result, no earlier
+ *  than the record was issued relative to the first one, divided by the
+ *  speed. Records passed over to find the match are skipped.
+ *
+ *  The replay also keeps the register files of the slaves as the records
+ *  show them, so a transaction with no match in reach, e.g. from a driver
+ *  that now reads in a different order, is answered from the registers
+ *  instead and takes the place of the next record. Either way the trace
+ *  moves on by at least one record per transaction and stops with
+ *  ENODATA at its end, or starts over with cfg.loop.
+ */
+#ifndef _I2C_TRACE_H_
+#define _I2C_TRACE_H_
+
+#include <asm/types.h>
+
+#include "i2c_bus.h"
+
+#define I2C_TRACE_MAGIC   "I2CT"
+#define I2C_TRACE_VERSION 1
+
+#define I2C_TRACE_WINDOW  32  // records searched ahead for a match
+#define I2C_TRACE_ASAP    0.0 // speed: do not wait for any record
+
+struct i2c_trace_head {
+  char magic[4];
+  __u32 version;
+  __u64 realtime;  // CLOCK_REALTIME ns when recording started
+  char name[16];   // adapter recorded
+};
+
+/* Followed by nmsgs struct i2c_trace_msg and then the bytes of every
+   message in turn, size bytes in all */
+struct i2c_trace_rec {
+  __u64 t;         // ns since recording started (CLOCK_MONOTONIC)
+  __s32 res;       // what the transaction returned, -errno if it failed
+  __u16 nmsgs;
+  __u16 size;
+};
+
+struct i2c_trace_msg {
+  __u16 addr;
+  __u16 flags;
+  __u16 len;
+};
+
+struct i2c_trace_config {
+  double speed;    // 1.0 is as recorded, I2C_TRACE_ASAP to not wait at all
+  int loop;        // start over at the end instead of failing
+};
+
+#define I2C_TRACE_CONFIG_DEFAULT { 1.0, 0 }
+
+struct i2c_trace_stats {
+  unsigned long records;    // written, or replayed by a matching transaction
+  unsigned long lost;       // not written for an error of the trace file
+  unsigned long skipped;    // passed over to get to a match
+  unsigned long unmatched;  // transactions answered from the registers
+  unsigned long loops;      // times the trace started over
+  __u64 behind_sum;         // ns transactions were answered after their
+  __u64 behind_max;         // records were due, i.e. the driver fell behind
+};
+
+/* Record the transactions on bus to a new trace at path. The returned bus
+   owns bus and closes it too; on failure bus is left to the caller. */
+struct i2c_bus *i2c_trace_record( struct i2c_bus *bus, const char *path );
+
+/* Replay the trace at path. cfg may be NULL for the defaults. */
+struct i2c_bus *i2c_trace_replay( const char *path,
+                                  const struct i2c_trace_config *cfg );
+
+void i2c_trace_stats( struct i2c_bus *bus, struct i2c_trace_stats *stats );
+
+#endif /* _I2C_TRACE_H_ */
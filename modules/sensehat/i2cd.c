@@ -0,0 +1,99 @@
+/*
+ *  i2cd.c
+ *    Bus-owner daemon: the only opener of the i2c bus, serving everybody
+ *    else over a Unix socket, see i2c_server.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: i2cd [-s] [-r bitrate] [-p socket] [-w hold us]
+ *    -s  serve the simulated sense-hat instead of DEVPATH_I2C
+ *    -r  with -s, take as long per transaction as a bus at bitrate Hz
+ *    -p  socket path, I2C_SERVER_PATH by default
+ *    -w  how long a normal priority request may be held back for others
+ *        to merge with, in microseconds
+ *
+ *  Clients use i2c_server_connect() in place of i2c_bus_open(). Request,
+ *  merge and wait figures are printed on exit. The bus transactions are
+ *  recorded in the metrics segment under proc="i2cd", see metrics.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "i2c_server.h"
+#include "metrics.h"
+
+static struct i2c_server *srv;
+
+static void on_signal( int sig ) {
+  i2c_server_stop( srv );
+}
+
+static void report( struct i2c_server *srv ) {
+  static const char *names[] = { "normal", "high" };
+  struct i2c_server_stats st;
+
+  i2c_server_stats( srv, &st );
+  fprintf( stderr, "%lu clients, %lu requests (%lu failed), %lu reads in "
+           "%lu bursts, %lu batches in %lu bus transactions, %lu address "
+           "switches\n", st.conns, st.requests, st.failed, st.reads,
+           st.bursts, st.batches, st.transfers, st.switches );
+  for (int i = 0; i < I2C_SERVER_PRIOS; i++)
+    fprintf( stderr, "%s priority: %lu served, wait mean %.0f max %llu us\n",
+             names[i], st.served[i],
+             st.served[i] ? st.wait_sum[i] / 1e3 / st.served[i] : 0.0,
+             (unsigned long long) st.wait_max[i] / 1000 );
+}
+
+int main( int argc, char **argv ) {
+  struct i2c_server_config cfg = I2C_SERVER_CONFIG_DEFAULT;
+  const char *path = I2C_SERVER_PATH;
+  struct sigaction sa = { .sa_handler = on_signal };
+  struct i2c_bus *bus;
+  unsigned long bitrate = 0;
+  int sim = 0, opt, rc = 0;
+
+  while ( (opt = getopt( argc, argv, "sr:p:w:" )) != -1 ) {
+    switch ( opt ) {
+      case 's': sim = 1; break;
+      case 'r': bitrate = strtoul( optarg, NULL, 10 ); break;
+      case 'p': path = optarg; break;
+      case 'w': cfg.hold = strtoull( optarg, NULL, 10 ) * 1000ULL; break;
+      default:
+        fprintf( stderr, "usage: %s [-s] [-r bitrate] [-p socket] "
+                 "[-w hold us]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  if ( metrics_open( METRICS_SHM_NAME, "i2cd" ) == -1 )
+    perror( METRICS_SHM_NAME );
+  bus = sim ? i2c_sim_open() : i2c_bus_open( DEVPATH_I2C );
+  if ( bus == NULL ) {
+    perror( sim ? "i2c_sim_open" : DEVPATH_I2C );
+    return 1;
+  }
+  if ( sim ) i2c_sim_set_bitrate( bus, bitrate );
+  srv = i2c_server_new( bus, path, &cfg );
+  if ( srv == NULL ) {
+    perror( path );
+    return 1;
+  }
+
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+  if ( i2c_server_run( srv ) == -1 ) {
+    perror( "i2c_server_run" );
+    rc = 1;
+  }
+  report( srv );
+
+  i2c_server_free( srv );
+  i2c_bus_close( bus );
+  return rc;
+}
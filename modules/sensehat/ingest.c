@@ -0,0 +1,444 @@
+/*
+ *  ingest.c
+ *    Fan-in server for the sample links of many feeders, see sample_link.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "clock.h"
+#include "ingest.h"
+
+// epoll tags, anything else is a connection slot
+#define TAG_TCP  (~0U)
+#define TAG_UNIX (~0U - 1)
+#define TAG_WAKE (~0U - 2)
+
+#define EVENTS 64
+
+struct worker;
+
+/* The link's receiver and its buffer follow the slot in the arena */
+struct slot {
+  int open;             // set by the acceptor, cleared by the worker; 0 in
+                        // a fresh arena, so free slots are never touched
+  int fd;
+  unsigned int feeder;
+  struct worker *w;
+  struct sample_link_rx *rx;
+  struct sample_link_rx_stats seen;  // of rx, as far as counted
+};
+
+struct worker {
+  struct ingest *ing;
+  unsigned int index;
+  int epfd;
+  int started;
+  pthread_t thread;
+  unsigned int nconns;  // changed by the acceptor and the worker
+  __u8 *arena;
+  struct ingest_stats stats;
+} __attribute__((aligned(64)));
+
+struct ingest {
+  struct ingest_config cfg;
+  ingest_fn fn;
+  void *arg;
+  char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  int tfd;
+  int ufd;
+  int epfd;
+  int wfd;              // readable once stopping, in every epoll set
+  volatile int stopping;
+  struct worker *w;
+};
+
+size_t ingest_slot_size( void ) {
+  size_t size = sizeof(struct slot) + sample_link_rx_size();
+
+  // a slot per cache line at least, neighbours belong to other feeders
+  return (size + 63) & ~(size_t) 63;
+}
+
+static struct slot *slot_at( struct worker *w, unsigned int i ) {
+  return (struct slot *) (w->arena + i * ingest_slot_size());
+}
+
+/* ------------------------------------------------------------- workers */
+
+static void on_frame( void *arg, const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+  struct slot *c = arg;
+  struct ingest_stats *st = &c->w->stats;
+  struct ingest *ing = c->w->ing;
+  __u64 newest = rec[hdr->count - 1].timestamp;
+  __u64 arrived = clock_ns( CLOCK_MONOTONIC ), done;
+
+  ing->fn( ing->arg, c->feeder, hdr, rec );
+  done = clock_ns( CLOCK_MONOTONIC );
+  // the feeder's clock is only trusted for the spacing of its own records
+  for (int i = 0; i < hdr->count; i++) {
+    __u64 ns = hdr->age + (done - arrived) +
+               (newest > rec[i].timestamp ? newest - rec[i].timestamp : 0);
+    __u64 units = ns >> 10;
+    int b = units == 0 ? 0 : 64 - __builtin_clzll( units );
+
+    st->latency[b > INGEST_BUCKETS ? INGEST_BUCKETS : b]++;
+    st->latency_sum += ns;
+  }
+  st->records += hdr->count;
+  st->frames++;
+}
+
+/* Count what the receiver saw since the last look */
+static void settle( struct slot *c ) {
+  struct ingest_stats *st = &c->w->stats;
+  struct sample_link_rx_stats now;
+
+  sample_link_rx_stats( c->rx, &now );
+  st->reads += now.reads - c->seen.reads;
+  st->lost += now.lost - c->seen.lost;
+  st->bytes += now.bytes - c->seen.bytes;
+  c->seen = now;
+}
+
+static void drop( struct slot *c ) {
+  struct worker *w = c->w;
+
+  close( c->fd );
+  w->stats.closed++;
+  // from here on the acceptor may hand the slot out again
+  __atomic_store_n( &c->open, 0, __ATOMIC_RELEASE );
+  __atomic_fetch_sub( &w->nconns, 1, __ATOMIC_RELEASE );
+}
+
+static void *work( void *arg ) {
+  struct worker *w = arg;
+  struct ingest *ing = w->ing;
+  struct epoll_event evs[EVENTS];
+  struct slot *c;
+  int n, rc;
+
+  while ( !ing->stopping ) {
+    n = epoll_wait( w->epfd, evs, EVENTS, -1 );
+    if ( n == -1 ) {
+      if ( errno == EINTR ) continue;
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if ( evs[i].data.u32 == TAG_WAKE ) continue;
+      c = slot_at( w, evs[i].data.u32 );
+      rc = sample_link_recv( c->rx, on_frame, c );
+      settle( c );
+      if ( rc == -1 ) {
+        if ( errno == EPROTO ) w->stats.errors++;
+        drop( c );
+      }
+    }
+  }
+  return NULL;
+}
+
+/* ------------------------------------------------------------- acceptor */
+
+static void on_accept( struct ingest *ing, int lfd ) {
+  struct epoll_event ev = { .events = EPOLLIN };
+  struct worker *w = &ing->w[0];
+  struct slot *c = NULL;
+  unsigned int i;
+  int fd;
+
+  // blocking, every call on it passes MSG_DONTWAIT
+  fd = accept( lfd, NULL, NULL );
+  if ( fd == -1 ) return;
+  for (i = 1; i < ing->cfg.workers; i++)
+    if ( __atomic_load_n( &ing->w[i].nconns, __ATOMIC_RELAXED ) <
+         __atomic_load_n( &w->nconns, __ATOMIC_RELAXED ) )
+      w = &ing->w[i];
+  for (i = 0; i < ing->cfg.max_conns; i++)
+    if ( !__atomic_load_n( &slot_at( w, i )->open, __ATOMIC_ACQUIRE ) ) {
+      c = slot_at( w, i );
+      break;
+    }
+  if ( c == NULL ) {
+    w->stats.refused++;
+    close( fd );
+    return;
+  }
+
+  c->feeder = w->index * ing->cfg.max_conns + i;
+  c->w = w;
+  c->rx = sample_link_rx_init( c + 1, fd );
+  memset( &c->seen, 0, sizeof(c->seen) );
+  c->fd = fd;
+  c->open = 1;
+  __atomic_fetch_add( &w->nconns, 1, __ATOMIC_RELAXED );
+  w->stats.conns++;
+  // the worker sees the slot as filled in once the fd is in its set
+  ev.data.u32 = i;
+  if ( epoll_ctl( w->epfd, EPOLL_CTL_ADD, fd, &ev ) == -1 ) drop( c );
+}
+
+/* --------------------------------------------------------------- public */
+
+static int watch( int epfd, int fd, __u32 tag ) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+
+  return epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev );
+}
+
+static int listen_tcp( const char *port ) {
+  struct addrinfo hints = { .ai_flags = AI_PASSIVE,
+                            .ai_socktype = SOCK_STREAM }, *res;
+  int fd, one = 1, rc;
+
+  rc = getaddrinfo( NULL, port, &hints, &res );
+  if ( rc != 0 ) {
+    errno = rc == EAI_SYSTEM ? errno : EINVAL;
+    return -1;
+  }
+  fd = socket( res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+               SOCK_CLOEXEC, res->ai_protocol );
+  if ( fd != -1 ) {
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if ( bind( fd, res->ai_addr, res->ai_addrlen ) == -1 ||
+         listen( fd, SOMAXCONN ) == -1 ) {
+      rc = errno;
+      close( fd );
+      errno = rc;
+      fd = -1;
+    }
+  }
+  freeaddrinfo( res );
+  return fd;
+}
+
+static int listen_unix( const char *path ) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  int fd, err;
+
+  strcpy( sa.sun_path, path );
+  fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if ( fd == -1 ) return -1;
+  unlink( path );
+  if ( bind( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ||
+       listen( fd, SOMAXCONN ) == -1 ) {
+    err = errno;
+    close( fd );
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+struct ingest *ingest_new( const char *port, const char *path,
+                           const struct ingest_config *cfg, ingest_fn fn,
+                           void *arg ) {
+  static const struct ingest_config defaults = INGEST_CONFIG_DEFAULT;
+  struct ingest *ing;
+  size_t len;
+  long cpus;
+  int err;
+
+  if ( (port == NULL && path == NULL) || (path != NULL &&
+       strlen( path ) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) ) {
+    errno = path != NULL ? ENAMETOOLONG : EINVAL;
+    return NULL;
+  }
+  ing = calloc( 1, sizeof(struct ingest) );
+  if ( ing == NULL ) return NULL;
+  ing->cfg = cfg != NULL ? *cfg : defaults;
+  ing->fn = fn;
+  ing->arg = arg;
+  ing->tfd = ing->ufd = ing->epfd = ing->wfd = -1;
+  if ( ing->cfg.workers == 0 ) {
+    cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    ing->cfg.workers = cpus < 1 ? 1 : cpus;
+  }
+  if ( ing->cfg.workers > INGEST_MAX_WORKERS )
+    ing->cfg.workers = INGEST_MAX_WORKERS;
+  if ( ing->cfg.max_conns == 0 ) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  ing->epfd = epoll_create1( EPOLL_CLOEXEC );
+  ing->wfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( ing->epfd == -1 || ing->wfd == -1 ||
+       watch( ing->epfd, ing->wfd, TAG_WAKE ) == -1 )
+    goto fail;
+
+  if ( posix_memalign( (void **) &ing->w, 64,
+                       ing->cfg.workers * sizeof(struct worker) ) != 0 ) {
+    ing->w = NULL;
+    errno = ENOMEM;
+    goto fail;
+  }
+  memset( ing->w, 0, ing->cfg.workers * sizeof(struct worker) );
+  len = ing->cfg.max_conns * ingest_slot_size();
+  for (unsigned int i = 0; i < ing->cfg.workers; i++) {
+    struct worker *w = &ing->w[i];
+
+    w->ing = ing;
+    w->index = i;
+    w->epfd = -1;
+    w->arena = MAP_FAILED;
+  }
+  for (unsigned int i = 0; i < ing->cfg.workers; i++) {
+    struct worker *w = &ing->w[i];
+
+    w->arena = mmap( NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if ( w->arena == MAP_FAILED ) goto fail;
+    w->epfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( w->epfd == -1 || watch( w->epfd, ing->wfd, TAG_WAKE ) == -1 )
+      goto fail;
+  }
+
+  if ( port != NULL ) {
+    ing->tfd = listen_tcp( port );
+    if ( ing->tfd == -1 || watch( ing->epfd, ing->tfd, TAG_TCP ) == -1 )
+      goto fail;
+  }
+  if ( path != NULL ) {
+    strcpy( ing->path, path );
+    ing->ufd = listen_unix( path );
+    if ( ing->ufd == -1 || watch( ing->epfd, ing->ufd, TAG_UNIX ) == -1 )
+      goto fail;
+  }
+  return ing;
+
+fail:
+  err = errno;
+  ingest_free( ing );
+  errno = err;
+  return NULL;
+}
+
+int ingest_run( struct ingest *ing ) {
+  struct epoll_event evs[EVENTS];
+  int n, rc = 0, err = 0;
+
+  for (unsigned int i = 0; i < ing->cfg.workers; i++) {
+    err = pthread_create( &ing->w[i].thread, NULL, work, &ing->w[i] );
+    if ( err != 0 ) {
+      ingest_stop( ing );
+      break;
+    }
+    ing->w[i].started = 1;
+  }
+
+  while ( !ing->stopping ) {
+    n = epoll_wait( ing->epfd, evs, EVENTS, -1 );
+    if ( n == -1 ) {
+      if ( errno == EINTR ) continue;
+      err = errno;
+      ingest_stop( ing );
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if ( evs[i].data.u32 == TAG_TCP ) on_accept( ing, ing->tfd );
+      else if ( evs[i].data.u32 == TAG_UNIX ) on_accept( ing, ing->ufd );
+    }
+  }
+
+  for (unsigned int i = 0; i < ing->cfg.workers; i++)
+    if ( ing->w[i].started ) {
+      pthread_join( ing->w[i].thread, NULL );
+      ing->w[i].started = 0;
+    }
+  if ( err != 0 ) {
+    errno = err;
+    rc = -1;
+  }
+  return rc;
+}
+
+void ingest_stop( struct ingest *ing ) {
+  __u64 one = 1;
+
+  ing->stopping = 1;
+  if ( write( ing->wfd, &one, sizeof(one) ) == -1 ) return;
+}
+
+void ingest_stats( struct ingest *ing, int worker, struct ingest_stats *st ) {
+  const struct ingest_stats *w;
+
+  if ( worker >= 0 ) {
+    memcpy( st, &ing->w[worker].stats, sizeof(*st) );
+    return;
+  }
+  memset( st, 0, sizeof(*st) );
+  for (unsigned int i = 0; i < ing->cfg.workers; i++) {
+    w = &ing->w[i].stats;
+    st->conns += w->conns;
+    st->closed += w->closed;
+    st->refused += w->refused;
+    st->records += w->records;
+    st->frames += w->frames;
+    st->reads += w->reads;
+    st->lost += w->lost;
+    st->errors += w->errors;
+    st->bytes += w->bytes;
+    for (int b = 0; b <= INGEST_BUCKETS; b++)
+      st->latency[b] += w->latency[b];
+    st->latency_sum += w->latency_sum;
+  }
+}
+
+__u64 ingest_percentile( const struct ingest_stats *st, double p ) {
+  __u64 total = 0, seen = 0;
+  int b;
+
+  for (b = 0; b <= INGEST_BUCKETS; b++) total += st->latency[b];
+  if ( total == 0 ) return 0;
+  for (b = 0; b < INGEST_BUCKETS; b++) {
+    seen += st->latency[b];
+    if ( seen >= p * total ) break;
+  }
+  return 1024ULL << b;
+}
+
+unsigned int ingest_workers( struct ingest *ing ) {
+  return ing->cfg.workers;
+}
+
+void ingest_free( struct ingest *ing ) {
+  size_t len;
+
+  if ( ing == NULL ) return;
+  len = ing->cfg.max_conns * ingest_slot_size();
+  if ( ing->w != NULL )
+    for (unsigned int i = 0; i < ing->cfg.workers; i++) {
+      struct worker *w = &ing->w[i];
+
+      if ( w->arena != MAP_FAILED ) {
+        for (unsigned int j = 0; j < ing->cfg.max_conns; j++)
+          if ( slot_at( w, j )->open ) close( slot_at( w, j )->fd );
+        munmap( w->arena, len );
+      }
+      if ( w->epfd != -1 ) close( w->epfd );
+    }
+  if ( ing->tfd != -1 ) close( ing->tfd );
+  if ( ing->ufd != -1 ) {
+    close( ing->ufd );
+    unlink( ing->path );
+  }
+  if ( ing->wfd != -1 ) close( ing->wfd );
+  if ( ing->epfd != -1 ) close( ing->epfd );
+  free( ing->w );
+  free( ing );
+}
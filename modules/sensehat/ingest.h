@@ -0,0 +1,101 @@
+/*
+ *  ingest.h
+ *    Fan-in server for the sample links of many feeders, see sample_link.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Feeders connect over TCP or a Unix stream socket and send the frames of
+ *  sample_link. One thread accepts them and hands each connection to the
+ *  worker with the fewest; from then on only that worker touches it. Each
+ *  worker waits on an epoll set of its own and passes every whole frame to
+ *  the callback in place, so the callbacks of one feeder always run on the
+ *  same thread and per-feeder state needs no locks. Workers share nothing
+ *  but the stop flag, which is what lets them scale with the cores.
+ *
+ *  The connections of a worker are slots in one arena mapped up front,
+ *  each with the receive buffer of its link in it: connecting and
+ *  receiving allocate nothing. The arena is reserved, not committed, so a
+ *  slot costs memory only as far as its frames have reached into it.
+ *
+ *  Every record is timed from when it was queued on the feeder to the end
+ *  of its callback: the age of the newest record of its frame from the
+ *  header, plus how much older the record is than that one by their
+ *  timestamps, plus the time from the frame's arrival to the end of the
+ *  callback. The time on the wire is not in it. A feeder without an RTC
+ *  has its wall clock years off until NTP sets it, so its timestamps are
+ *  never compared with the clock of this host.
+ */
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+#include "sample_link.h"
+
+#define INGEST_MAX_WORKERS 64
+/* Histogram bucket i counts latencies up to 2^i * 1024 ns, the last one
+   everything above, as in metrics.h */
+#define INGEST_BUCKETS     24
+
+struct ingest_config {
+  unsigned int workers;    // threads receiving, 0 for one per online CPU
+  unsigned int max_conns;  // connections per worker
+};
+
+#define INGEST_CONFIG_DEFAULT { 0, 256 }
+
+struct ingest_stats {
+  unsigned long conns;     // connections accepted
+  unsigned long closed;    // of those, closed again
+  unsigned long refused;   // turned away with every slot taken
+  unsigned long records;
+  unsigned long frames;
+  unsigned long reads;     // recv() calls
+  unsigned long lost;      // records the feeders lost, see sample_link.h
+  unsigned long errors;    // connections closed on a corrupt frame
+  unsigned long bytes;
+  __u64 latency[INGEST_BUCKETS + 1];  // records by latency
+  __u64 latency_sum;                  // ns
+};
+
+/* A frame of the feeder in slot feeder, on the thread of its worker.
+   Feeder numbers are reused once a connection has closed. */
+typedef void (*ingest_fn)( void *arg, unsigned int feeder,
+                           const struct sample_link_hdr *hdr,
+                           const struct sample_link_rec *rec );
+
+struct ingest;
+
+/* Listen on TCP port and on the Unix socket path, either may be NULL but
+   not both. cfg may be NULL for the defaults. A stale socket left at path
+   is replaced. */
+struct ingest *ingest_new( const char *port, const char *path,
+                           const struct ingest_config *cfg, ingest_fn fn,
+                           void *arg );
+
+/* Start the workers and accept until ingest_stop(). Returns 0 once the
+   workers are done, or -1 and errno. */
+int ingest_run( struct ingest *ing );
+
+/* May be called from a signal handler or another thread */
+void ingest_stop( struct ingest *ing );
+
+/* Counts of worker i, or of all of them for -1. Exact once ingest_run()
+   has returned; while it runs they may lag behind a little. */
+void ingest_stats( struct ingest *ing, int worker, struct ingest_stats *st );
+
+/* Latency under which fraction p of the records fell, in ns: the upper
+   edge of the bucket it falls in */
+__u64 ingest_percentile( const struct ingest_stats *st, double p );
+
+/* Workers actually started, and the bytes of arena per connection slot */
+unsigned int ingest_workers( struct ingest *ing );
+size_t ingest_slot_size( void );
+
+/* Close all connections and remove the socket */
+void ingest_free( struct ingest *ing );
+
+#endif /* _INGEST_H_ */
@@ -0,0 +1,157 @@
+/*
+ *  ingestd.c
+ *    Ingest server for many feeders sending their samples with
+ *    sensehatd -u, see ingest.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: ingestd [-p port] [-l socket] [-w workers] [-c connections]
+ *    -p  listen on TCP port, SAMPLE_LINK_PORT by default
+ *    -l  also listen on the Unix stream socket, e.g. for feeders on the
+ *        same host
+ *    -w  receive on workers threads, one per online CPU by default
+ *    -c  take up to connections feeders per worker, 256 by default
+ *
+ *  Every REPORT_S seconds a line goes to stderr with the feeders that sent
+ *  anything since the last one, the records per second, the records lost
+ *  on the way and the 99th percentile of the latency from the queueing of
+ *  a sample on its feeder to its arrival here, see ingest.h. With the
+ *  defaults of sensehatd -u most of it is the second a sample may wait for
+ *  its frame to fill. A feeder counts as sending by when its frames
+ *  arrived, not by the timestamps in them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "clock.h"
+#include "ingest.h"
+
+#define REPORT_S 10
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal( int sig ) {
+  running = 0;
+}
+
+/* CLOCK_MONOTONIC ns the latest frame of each feeder arrived at; each is
+   written by the worker of its feeder only */
+struct feeders {
+  unsigned int n;
+  __u64 *last;
+};
+
+static void on_frame( void *arg, unsigned int feeder,
+                      const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+  struct feeders *f = arg;
+
+  __atomic_store_n( &f->last[feeder], clock_ns( CLOCK_MONOTONIC ),
+                    __ATOMIC_RELAXED );
+}
+
+static void *serve( void *arg ) {
+  struct ingest *ing = arg;
+
+  if ( ingest_run( ing ) == -1 ) perror( "ingest_run" );
+  running = 0;
+  return NULL;
+}
+
+static void report( struct ingest *ing, struct feeders *f,
+                    struct ingest_stats *prev, __u64 from, double secs ) {
+  struct ingest_stats st, d;
+  unsigned int active = 0;
+
+  for (unsigned int i = 0; i < f->n; i++)
+    if ( __atomic_load_n( &f->last[i], __ATOMIC_RELAXED ) >= from ) active++;
+  ingest_stats( ing, -1, &st );
+  d = st;
+  d.records -= prev->records;
+  d.lost -= prev->lost;
+  for (int b = 0; b <= INGEST_BUCKETS; b++)
+    d.latency[b] -= prev->latency[b];
+  fprintf( stderr, "%u feeders, %lu open, %.0f records/s, %lu lost, p99 "
+           "%llu us, %lu refused\n", active, st.conns - st.closed,
+           d.records / secs, d.lost,
+           (unsigned long long) ingest_percentile( &d, 0.99 ) / 1000,
+           st.refused );
+  *prev = st;
+}
+
+int main( int argc, char **argv ) {
+  struct ingest_config cfg = INGEST_CONFIG_DEFAULT;
+  struct sigaction sa = { .sa_handler = on_signal };
+  const char *port = SAMPLE_LINK_PORT;
+  const char *path = NULL;
+  struct ingest_stats prev;
+  __u64 since, now;
+  struct feeders f;
+  struct ingest *ing;
+  sigset_t mask, old;
+  pthread_t thread;
+  int opt, err;
+
+  while ( (opt = getopt( argc, argv, "p:l:w:c:" )) != -1 ) {
+    switch ( opt ) {
+      case 'p': port = optarg; break;
+      case 'l': path = optarg; break;
+      case 'w': cfg.workers = atoi( optarg ); break;
+      case 'c': cfg.max_conns = atoi( optarg ); break;
+      default:
+        fprintf( stderr, "usage: %s [-p port] [-l socket] [-w workers] "
+                 "[-c connections]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  ing = ingest_new( port, path, &cfg, on_frame, &f );
+  if ( ing == NULL ) {
+    perror( path != NULL ? path : port );
+    return 1;
+  }
+  f.n = ingest_workers( ing ) * cfg.max_conns;
+  f.last = calloc( f.n, sizeof(__u64) );
+  if ( f.last == NULL ) {
+    perror( "calloc" );
+    return 1;
+  }
+
+  // the signals are for this thread, the sleep below ends with them
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  pthread_sigmask( SIG_BLOCK, &mask, &old );
+  err = pthread_create( &thread, NULL, serve, ing );
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+  if ( err != 0 ) {
+    errno = err;
+    perror( "pthread_create" );
+    return 1;
+  }
+
+  memset( &prev, 0, sizeof(prev) );
+  since = clock_ns( CLOCK_MONOTONIC );
+  while ( running ) {
+    sleep( REPORT_S );
+    now = clock_ns( CLOCK_MONOTONIC );
+    report( ing, &f, &prev, since, (now - since) / 1e9 );
+    since = now;
+  }
+
+  ingest_stop( ing );
+  pthread_join( thread, NULL );
+  ingest_free( ing );
+  free( f.last );
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ *  ledmatrix.c
+ *    Double-buffered renderer for the sense-hat 8x8 RGB565 LED matrix
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+
+#include "ledmatrix.h"
+
+struct ledmatrix {
+  struct fb_t back;
+  struct fb_t front;     // copy of what was last committed
+  struct fb_t *fb;       // the mapped framebuffer
+  struct ledmatrix_stats stats;
+};
+
+void led_palette_init( struct led_palette *pal, const __u8 (*rgb)[3],
+                       int n ) {
+  memset( pal, 0, sizeof(struct led_palette) );
+  for (int i = 0; i < n && i < 256; i++)
+    pal->rgb565[i] = rgb565( rgb[i][0], rgb[i][1], rgb[i][2] );
+}
+
+/* A framebuffer device must be large enough for a frame, a regular file is
+   grown to one */
+static int check_size( int fd ) {
+  struct fb_fix_screeninfo fix_info;
+  struct stat st;
+
+  if ( fstat( fd, &st ) == -1 ) return -1;
+  if ( S_ISREG( st.st_mode ) ) {
+    if ( st.st_size < (off_t) sizeof(struct fb_t) )
+      return ftruncate( fd, sizeof(struct fb_t) );
+    return 0;
+  }
+
+  if ( ioctl( fd, FBIOGET_FSCREENINFO, &fix_info ) == -1 ) return -1;
+  if ( fix_info.smem_len < sizeof(struct fb_t) ) {
+    errno = ENODEV;
+    return -1;
+  }
+  return 0;
+}
+
+struct ledmatrix *ledmatrix_open( const char *path ) {
+  struct ledmatrix *lm;
+  int fd, err;
+
+  lm = calloc( 1, sizeof(struct ledmatrix) );
+  if ( lm == NULL ) return NULL;
+
+  fd = open( path, O_RDWR );
+  if ( fd == -1 ) goto fail;
+  if ( check_size( fd ) == -1 ) {
+    err = errno;
+    close( fd );
+    errno = err;
+    goto fail;
+  }
+  lm->fb = mmap( NULL, sizeof(struct fb_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( lm->fb == MAP_FAILED ) goto fail;
+
+  // start out from whatever is on the display
+  memcpy( &lm->front, lm->fb, sizeof(struct fb_t) );
+  lm->back = lm->front;
+  return lm;
+
+fail:
+  err = errno;
+  free( lm );
+  errno = err;
+  return NULL;
+}
+
+struct fb_t *ledmatrix_back( struct ledmatrix *lm ) {
+  return &lm->back;
+}
+
+void ledmatrix_clear( struct ledmatrix *lm, __u16 color ) {
+  for (int y = 0; y < LEDMATRIX_H; y++)
+    for (int x = 0; x < LEDMATRIX_W; x++)
+      lm->back.pixel[y][x] = color;
+}
+
+void ledmatrix_draw_indexed( struct ledmatrix *lm,
+                             const struct led_palette *pal,
+                             const __u8 idx[LEDMATRIX_W * LEDMATRIX_H] ) {
+  __u16 *p = &lm->back.pixel[0][0];
+
+  for (int i = 0; i < LEDMATRIX_W * LEDMATRIX_H; i++)
+    p[i] = pal->rgb565[idx[i]];
+}
+
+/* The diff is against our own copy of the front buffer rather than the
+   framebuffer, which may be uncached device memory */
+int ledmatrix_commit( struct ledmatrix *lm ) {
+  if ( memcmp( &lm->back, &lm->front, sizeof(struct fb_t) ) == 0 ) {
+    lm->stats.skipped++;
+    return 0;
+  }
+  lm->front = lm->back;
+  memcpy( lm->fb, &lm->back, sizeof(struct fb_t) );
+  lm->stats.commits++;
+  return 1;
+}
+
+void ledmatrix_stats( struct ledmatrix *lm, struct ledmatrix_stats *stats ) {
+  memcpy( stats, &lm->stats, sizeof(struct ledmatrix_stats) );
+}
+
+void ledmatrix_close( struct ledmatrix *lm ) {
+  if ( lm == NULL ) return;
+  munmap( lm->fb, sizeof(struct fb_t) );
+  free( lm );
+}
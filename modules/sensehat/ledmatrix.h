@@ -0,0 +1,76 @@
+/*
+ *  ledmatrix.h
+ *    Double-buffered renderer for the sense-hat 8x8 RGB565 LED matrix
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Drawing goes to an off-screen back buffer. ledmatrix_commit() copies the
+ *  whole 128 byte frame into the mmapped framebuffer in one go, and only
+ *  when it differs from the last committed frame, so readers of the
+ *  framebuffer never see a half drawn frame from a redraw loop.
+ *
+ *  The framebuffer is normally /dev/fb1 ("RPi-Sense FB"), but any regular
+ *  file works too; it is grown to the size of a frame when needed. That
+ *  makes it possible to run and benchmark the renderer off the device.
+ */
+#ifndef _LEDMATRIX_H_
+#define _LEDMATRIX_H_
+
+#include <asm/types.h>
+
+#define DEVPATH_FB "/dev/fb1"  // sense-hat framebuffer on raspberry pi
+
+#define LEDMATRIX_W 8
+#define LEDMATRIX_H 8
+
+struct fb_t { __u16 pixel[LEDMATRIX_H][LEDMATRIX_W]; };
+
+/* RGB888 to RGB565, done once per palette entry instead of per pixel */
+static inline __u16 rgb565( int r, int g, int b ) {
+  return (__u16) (((r >> 3) & 0x1f) << 11 | ((g >> 2) & 0x3f) << 5 |
+                  ((b >> 3) & 0x1f));
+}
+
+struct led_palette {
+  __u16 rgb565[256];
+};
+
+/* Convert n (at most 256) RGB888 colours, unused entries are black */
+void led_palette_init( struct led_palette *pal, const __u8 (*rgb)[3],
+                       int n );
+
+struct ledmatrix_stats {
+  unsigned long commits;  // frames copied to the framebuffer
+  unsigned long skipped;  // commits dropped since nothing changed
+};
+
+struct ledmatrix;
+
+/* Map the framebuffer at path, NULL and errno on failure */
+struct ledmatrix *ledmatrix_open( const char *path );
+
+/* The back buffer, drawn into freely until the next commit */
+struct fb_t *ledmatrix_back( struct ledmatrix *lm );
+
+static inline void ledmatrix_set( struct fb_t *back, int x, int y,
+                                  __u16 color ) {
+  back->pixel[y][x] = color;
+}
+
+void ledmatrix_clear( struct ledmatrix *lm, __u16 color );
+
+/* Fill the back buffer from 64 palette indices in row-major order */
+void ledmatrix_draw_indexed( struct ledmatrix *lm,
+                             const struct led_palette *pal,
+                             const __u8 idx[LEDMATRIX_W * LEDMATRIX_H] );
+
+/* Publish the back buffer. Returns 1 if the framebuffer was written and
+   0 if the frame was identical to the one already shown. */
+int ledmatrix_commit( struct ledmatrix *lm );
+
+void ledmatrix_stats( struct ledmatrix *lm, struct ledmatrix_stats *stats );
+void ledmatrix_close( struct ledmatrix *lm );
+
+#endif /* _LEDMATRIX_H_ */
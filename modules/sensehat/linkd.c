@@ -0,0 +1,174 @@
+/*
+ *  linkd.c
+ *    Master end of the sample link: receives the frames sensehatd -u sends
+ *    and publishes the samples into shared memory, see sample_link.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: linkd [-p port] [-n shm name]
+ *    -p  listen on port, SAMPLE_LINK_PORT by default
+ *    -n  publish into the segment name, SAMPLE_SHM_NAME by default
+ *
+ *  Readers on the master then use sample_shm_attach() as they would on the
+ *  slave. The segment only holds the latest sample, so of every frame only
+ *  the newest record is published. The slave has no RTC and its wall clock
+ *  is off by years until NTP syncs it, so its timestamps are not compared
+ *  with the clock of the master: the record is published as read when the
+ *  frame arrived less the age the sender put in the header, which covers
+ *  the linger and any backlog after the link stalled, but not the time on
+ *  the wire. There is one slave: a new connection replaces the old
+ *  one, e.g. after the slave rebooted while the old one had not timed out.
+ *  What was received and lost is printed on exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "sample_link.h"
+#include "sample_shm.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal( int sig ) {
+  running = 0;
+}
+
+static int listen_on( const char *port ) {
+  struct addrinfo hints = { .ai_flags = AI_PASSIVE,
+                            .ai_socktype = SOCK_STREAM }, *res;
+  int fd, one = 1, rc;
+
+  rc = getaddrinfo( NULL, port, &hints, &res );
+  if ( rc != 0 ) {
+    errno = rc == EAI_SYSTEM ? errno : EINVAL;
+    return -1;
+  }
+  fd = socket( res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+               res->ai_protocol );
+  if ( fd != -1 ) {
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if ( bind( fd, res->ai_addr, res->ai_addrlen ) == -1 ||
+         listen( fd, 1 ) == -1 ) {
+      rc = errno;
+      close( fd );
+      errno = rc;
+      fd = -1;
+    }
+  }
+  freeaddrinfo( res );
+  return fd;
+}
+
+/* The segment wants the monotonic clock of this host, the record has the
+   wall clock of the slave: it is timed by the frame's arrival and age */
+static void on_frame( void *arg, const struct sample_link_hdr *hdr,
+                      const struct sample_link_rec *rec ) {
+  const struct sample_link_rec *last = &rec[hdr->count - 1];
+  __u64 mono = clock_ns( CLOCK_MONOTONIC );
+
+  sample_shm_publish( arg, &last->s,
+                      mono > hdr->age ? mono - hdr->age : 0 );
+}
+
+static void report( struct sample_link_rx *rx ) {
+  struct sample_link_rx_stats st;
+
+  sample_link_rx_stats( rx, &st );
+  fprintf( stderr, "link: %lu records in %lu frames, %lu reads, %lu "
+           "lost\n", st.records, st.frames, st.reads, st.lost );
+}
+
+int main( int argc, char **argv ) {
+  struct sigaction sa = { .sa_handler = on_signal };
+  const char *port = SAMPLE_LINK_PORT;
+  const char *name = SAMPLE_SHM_NAME;
+  struct sample_link_rx *rx = NULL;
+  struct pollfd pfd[2];
+  struct sample_shm *shm;
+  int opt, lfd, fd = -1, nfd;
+
+  while ( (opt = getopt( argc, argv, "p:n:" )) != -1 ) {
+    switch ( opt ) {
+      case 'p': port = optarg; break;
+      case 'n': name = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-p port] [-n shm name]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  lfd = listen_on( port );
+  if ( lfd == -1 ) {
+    perror( port );
+    return 1;
+  }
+  shm = sample_shm_create( name );
+  if ( shm == NULL ) {
+    perror( name );
+    return 1;
+  }
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+
+  while ( running ) {
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fd;
+    pfd[1].events = POLLIN;
+    if ( poll( pfd, fd == -1 ? 1 : 2, -1 ) == -1 ) {
+      if ( errno != EINTR ) perror( "poll" );
+      continue;
+    }
+
+    if ( pfd[0].revents & POLLIN ) {
+      nfd = accept( lfd, NULL, NULL );
+      if ( nfd == -1 ) {
+        perror( "accept" );
+      } else {
+        if ( rx != NULL ) {
+          report( rx );
+          sample_link_rx_free( rx );
+          close( fd );
+        }
+        fd = nfd;
+        rx = sample_link_rx_new( fd );
+        if ( rx == NULL ) {
+          perror( "sample_link_rx_new" );
+          close( fd );
+          fd = -1;
+        }
+        continue;
+      }
+    }
+
+    if ( fd != -1 && pfd[1].revents != 0 &&
+         sample_link_recv( rx, on_frame, shm ) == -1 ) {
+      if ( errno != ECONNRESET ) perror( "sample_link_recv" );
+      report( rx );
+      sample_link_rx_free( rx );
+      close( fd );
+      rx = NULL;
+      fd = -1;
+    }
+  }
+
+  if ( rx != NULL ) {
+    report( rx );
+    sample_link_rx_free( rx );
+    close( fd );
+  }
+  close( lfd );
+  // as with sensehatd, readers keep the last value and its age
+  sample_shm_close( shm, 0 );
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ *  lps25h_stream.c
+ *    High rate LPS25H pressure capture through the FIFO in stream mode
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "LPS25H.h"
+#include "clock.h"
+#include "spsc_ring.h"
+#include "lps25h_stream.h"
+
+#define F_MODE_BYPASS  0
+#define F_MODE_STREAM  2
+
+struct lps25h_stream {
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  int watermark;
+  __u64 period;
+  struct spsc_ring ring;
+  struct lps25h_stream_stats stats;
+  struct lps25h_fifo_sample batch[LPS25H_FIFO_SLOTS];
+};
+
+/* Write several single registers of the LPS25H in one transaction */
+static int write_regs( struct i2c_bus *bus, __u8 (*regs)[2], int n ) {
+  struct i2c_msg msgs[4];
+
+  for (int i = 0; i < n; i++) {
+    msgs[i].addr = LPS25H_SAD;
+    msgs[i].flags = 0;
+    msgs[i].len = 2;
+    msgs[i].buf = regs[i];
+  }
+  return i2c_bus_transfer( bus, msgs, n ) == -1 ? -1 : 0;
+}
+
+struct lps25h_stream *lps25h_stream_start( struct sensehat *sh, int watermark,
+                                           size_t ring_size ) {
+  struct lps25h_stream *st;
+  int odr = sensehat_config( sh )->lps25h_odr;
+  int err;
+  __u8 regs[3][2] = {
+    { LPS25H_CTRL_REG2, LPS25H_CTRL_REG2_FIFO_EN_if(1) |
+                        LPS25H_CTRL_REG2_WTM_EN_if(1) },
+    // passing through bypass mode empties the FIFO
+    { LPS25H_FIFO_CTRL, LPS25H_FIFO_CTRL_F_MODE_if(F_MODE_BYPASS) },
+    { LPS25H_FIFO_CTRL, LPS25H_FIFO_CTRL_F_MODE_if(F_MODE_STREAM) |
+                        LPS25H_FIFO_CTRL_WTM_POINT_if(watermark - 1) }
+  };
+
+  // the FIFO is only fed by the continuous ODR settings
+  if ( watermark < 1 || watermark > LPS25H_FIFO_SLOTS ||
+       sensehat_lps25h_period_ns( odr ) == 0 ) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  st = calloc( 1, sizeof(struct lps25h_stream) );
+  if ( st == NULL ) return NULL;
+  st->sh = sh;
+  st->bus = sensehat_bus( sh );
+  st->watermark = watermark;
+  st->period = sensehat_lps25h_period_ns( odr );
+
+  if ( spsc_ring_init( &st->ring, ring_size,
+                       sizeof(struct lps25h_fifo_sample) ) == -1 ) {
+    free( st );
+    return NULL;
+  }
+  if ( write_regs( st->bus, regs, 3 ) == -1 ) {
+    err = errno;
+    spsc_ring_free( &st->ring );
+    free( st );
+    errno = err;
+    return NULL;
+  }
+  return st;
+}
+
+__u64 lps25h_stream_interval_ns( struct lps25h_stream *st ) {
+  return st->period * st->watermark;
+}
+
+static int drain( struct lps25h_stream *st, __u8 fifo_status ) {
+  __u8 buf[LPS25H_FIFO_SLOTS * 3];
+  int level;
+  size_t pushed;
+  __u64 now;
+
+  // DIFF_POINT saturates at 31, a full FIFO is flagged separately
+  if ( LPS25H_FIFO_STATUS_FULL_FIFO_ef( fifo_status ) ) {
+    level = LPS25H_FIFO_SLOTS;
+    st->stats.fifo_overruns++;
+  } else {
+    level = LPS25H_FIFO_STATUS_DIFF_POINT_ef( fifo_status );
+  }
+  st->stats.last_drain = level;
+  st->stats.drain_hist[level]++;
+  if ( level == 0 ) return 0;
+
+  if ( i2c_bus_read( st->bus, LPS25H_SAD, LPS25H_PRESS_POUT | LPS25H_reg_auto,
+                     buf, level * 3 ) == -1 )
+    return -1;
+  now = clock_ns( CLOCK_MONOTONIC );
+
+  // the newest slot was converted at most one period ago
+  for (int i = 0; i < level; i++) {
+    struct lps25h_fifo_sample *s = &st->batch[i];
+    const __u8 *p = buf + i * 3;
+
+    s->p_raw = (__s32) (((__u32) p[2] << 24) | ((__u32) p[1] << 16) |
+                        ((__u32) p[0] << 8)) >> 8;
+    s->pressure = (float) s->p_raw * (1.0f / 4096.0f);
+    s->timestamp = now - (__u64) (level - 1 - i) * st->period;
+  }
+
+  pushed = spsc_ring_push( &st->ring, st->batch, level );
+  st->stats.ring_dropped += level - pushed;
+  st->stats.drains++;
+  st->stats.samples += level;
+  return level;
+}
+
+static int read_fifo_status( struct lps25h_stream *st, __u8 *status ) {
+  return i2c_bus_read( st->bus, LPS25H_SAD, LPS25H_FIFO_STATUS, status, 1 );
+}
+
+int lps25h_stream_poll( struct lps25h_stream *st ) {
+  __u8 status;
+
+  if ( read_fifo_status( st, &status ) == -1 ) return -1;
+  if ( !LPS25H_FIFO_STATUS_WTM_FIFO_ef( status ) &&
+       !LPS25H_FIFO_STATUS_FULL_FIFO_ef( status ) )
+    return 0;
+  return drain( st, status );
+}
+
+int lps25h_stream_drain( struct lps25h_stream *st ) {
+  __u8 status;
+
+  if ( read_fifo_status( st, &status ) == -1 ) return -1;
+  return drain( st, status );
+}
+
+size_t lps25h_stream_read( struct lps25h_stream *st,
+                           struct lps25h_fifo_sample *dst, size_t n ) {
+  return spsc_ring_pop( &st->ring, dst, n );
+}
+
+void lps25h_stream_stats( struct lps25h_stream *st,
+                          struct lps25h_stream_stats *stats ) {
+  memcpy( stats, &st->stats, sizeof(struct lps25h_stream_stats) );
+}
+
+/* Go back to the FIFO settings of the image the driver was opened with */
+int lps25h_stream_stop( struct lps25h_stream *st ) {
+  const struct sensehat_image *img = sensehat_image( st->sh );
+  __u8 regs[3][2] = {
+    { LPS25H_FIFO_CTRL, LPS25H_FIFO_CTRL_F_MODE_if(F_MODE_BYPASS) },
+    { img->lps25h_fifo_ctrl[0], img->lps25h_fifo_ctrl[1] },
+    { LPS25H_CTRL_REG2, img->lps25h_ctrl[2] }
+  };
+  int res;
+
+  res = write_regs( st->bus, regs, 3 );
+  spsc_ring_free( &st->ring );
+  free( st );
+  return res;
+}
@@ -0,0 +1,69 @@
+/*
+ *  lps25h_stream.h
+ *    High rate LPS25H pressure capture through the FIFO in stream mode
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The FIFO collects samples at the configured ODR while the host sleeps.
+ *  Once the watermark is reached the whole FIFO is drained with a single
+ *  auto-increment burst read of PRESS_OUT (the address rolls back from
+ *  PRESS_OUT_H to PRESS_OUT_XL while the FIFO is enabled) and the samples
+ *  are pushed into a lock-free ring that one consumer thread reads from.
+ *  INT1 is not wired on the sense-hat, so the producer polls FIFO_STATUS
+ *  once per lps25h_stream_interval_ns() instead of waiting for an interrupt.
+ */
+#ifndef _LPS25H_STREAM_H_
+#define _LPS25H_STREAM_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+#include "sensehat.h"
+
+#define LPS25H_FIFO_SLOTS 32
+
+struct lps25h_fifo_sample {
+  __u64 timestamp;  // CLOCK_MONOTONIC ns, back-dated from the drain by ODR
+  __s32 p_raw;
+  float pressure;   // mbar
+};
+
+struct lps25h_stream_stats {
+  unsigned long drains;         // burst reads issued
+  unsigned long samples;        // samples drained from the FIFO
+  unsigned long fifo_overruns;  // drains that found the FIFO full
+  unsigned long ring_dropped;   // samples lost because the consumer lagged
+  unsigned int last_drain;      // samples collected by the latest drain
+  unsigned long drain_hist[LPS25H_FIFO_SLOTS + 1];  // drains by sample count
+};
+
+struct lps25h_stream;
+
+/* Switch the LPS25H to stream mode with the watermark at 1..32 samples.
+   ring_size is the consumer ring capacity, a power of two. */
+struct lps25h_stream *lps25h_stream_start( struct sensehat *sh, int watermark,
+                                           size_t ring_size );
+
+/* Time for the FIFO to fill up to the watermark at the configured ODR */
+__u64 lps25h_stream_interval_ns( struct lps25h_stream *st );
+
+/* Producer: drain the FIFO if the watermark has been reached. Returns the
+   number of samples drained (0 below the watermark) or -1 on error. */
+int lps25h_stream_poll( struct lps25h_stream *st );
+
+/* Producer: drain whatever is queued regardless of the watermark */
+int lps25h_stream_drain( struct lps25h_stream *st );
+
+/* Consumer: copy out up to n samples, returns how many were available */
+size_t lps25h_stream_read( struct lps25h_stream *st,
+                           struct lps25h_fifo_sample *dst, size_t n );
+
+void lps25h_stream_stats( struct lps25h_stream *st,
+                          struct lps25h_stream_stats *stats );
+
+/* Return the LPS25H to the running average mode set up by sensehat_open */
+int lps25h_stream_stop( struct lps25h_stream *st );
+
+#endif /* _LPS25H_STREAM_H_ */
@@ -0,0 +1,411 @@
+/*
+ *  metrics.c
+ *    Counters and latency histograms of the acquisition stack in shared
+ *    memory, exported as Prometheus text
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "clock.h"
+#include "metrics.h"
+
+#define METRICS_MAGIC   "SHMT"
+#define METRICS_VERSION 1
+#define METRICS_RETRIES 64
+
+struct metrics_segment {
+  char magic[4];
+  __u32 version;
+  __u32 nblocks;
+  __u32 block_size;
+  struct metrics_block block[METRICS_MAX_BLOCKS];
+};
+
+static struct metrics_segment *seg;
+static char proc_label[16];
+static pthread_key_t release_key;
+static __thread struct metrics_block *self;
+static __thread int no_block;  // the segment was full
+
+static const struct {
+  const char *name;
+  const char *help;
+} counters[METRICS_COUNTERS] = {
+  [METRICS_I2C_TRANSFERS] = { "sensehat_i2c_transfers_total",
+    "Combined i2c transactions, one syscall each on hardware" },
+  [METRICS_I2C_MESSAGES] = { "sensehat_i2c_messages_total",
+    "i2c messages in successful transactions" },
+  [METRICS_I2C_BYTES] = { "sensehat_i2c_bytes_total",
+    "Payload bytes of successful transactions" },
+  [METRICS_I2C_ERRORS] = { "sensehat_i2c_errors_total",
+    "Transactions that failed" },
+  [METRICS_I2C_SHORT] = { "sensehat_i2c_short_total",
+    "Transactions the adapter gave up part way through" },
+  [METRICS_STALE] = { "sensehat_stale_reads_total",
+    "Reads that found no new conversion" },
+  [METRICS_WHO_AM_I] = { "sensehat_who_am_i_failures_total",
+    "WHO_AM_I reads that did not match the device" },
+  [METRICS_SAMPLES] = { "sensehat_samples_total",
+    "Samples delivered" },
+  [METRICS_TRIGGERS] = { "picam_triggers_total",
+    "Recordings picam was told to start on motion" },
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} histograms[METRICS_HISTOGRAMS] = {
+  [METRICS_I2C_LATENCY] = { "sensehat_i2c_transfer_seconds",
+    "Time taken by combined i2c transactions" },
+  [METRICS_SAMPLE_LATENCY] = { "sensehat_sample_latency_seconds",
+    "Time from the deadline of a sample to its delivery" },
+  [METRICS_TRIGGER_LATENCY] = { "picam_trigger_latency_seconds",
+    "Time from a PIR edge to picam confirming the recording" },
+};
+
+/* ----------------------------------------------------------------- write */
+
+static void begin( struct metrics_block *b ) {
+  __atomic_store_n( &b->seq, b->seq + 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void end( struct metrics_block *b ) {
+  __atomic_store_n( &b->seq, b->seq + 1, __ATOMIC_RELEASE );
+}
+
+static void hist_add( struct metrics_hist *h, __u64 ns ) {
+  __u64 units = ns >> 10;
+  int i = units == 0 ? 0 : 64 - __builtin_clzll( units );
+
+  h->count[i > METRICS_BUCKETS ? METRICS_BUCKETS : i]++;
+  h->sum += ns;
+}
+
+static void release( void *arg ) {
+  struct metrics_block *b = arg;
+
+  __atomic_store_n( &b->owner, 0, __ATOMIC_RELEASE );
+}
+
+/* Take a block for the calling thread: one this process left behind, one
+   never used, or one of a process that is gone, in that order */
+static struct metrics_block *claim( void ) {
+  __u32 pid = getpid(), tid = syscall( SYS_gettid );
+
+  for (int pass = 0; pass < 3; pass++) {
+    for (int i = 0; i < METRICS_MAX_BLOCKS; i++) {
+      struct metrics_block *b = &seg->block[i];
+      __u32 owner = __atomic_load_n( &b->owner, __ATOMIC_ACQUIRE );
+      __u32 bpid = __atomic_load_n( &b->pid, __ATOMIC_ACQUIRE );
+
+      if ( pass == 0 && (owner != 0 || bpid != pid) ) continue;
+      if ( pass == 1 && (owner != 0 || bpid != 0) ) continue;
+      if ( pass == 2 && (bpid == 0 || bpid == pid ||
+                         kill( bpid, 0 ) == 0 || errno != ESRCH) )
+        continue;
+      if ( !__atomic_compare_exchange_n( &b->owner, &owner, tid, 0,
+                                         __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED ) )
+        continue;
+
+      if ( pass > 0 ) {
+        begin( b );
+        memset( b->counter, 0, sizeof(*b) - offsetof(struct metrics_block,
+                                                      counter) );
+        memcpy( b->proc, proc_label, sizeof(b->proc) );
+        __atomic_store_n( &b->pid, pid, __ATOMIC_RELAXED );
+        end( b );
+      }
+      pthread_setspecific( release_key, b );
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static struct metrics_block *block( void ) {
+  if ( self == NULL && seg != NULL && !no_block ) {
+    self = claim();
+    no_block = self == NULL;
+  }
+  return self;
+}
+
+static struct metrics_hist *reg_hist( struct metrics_block *b, __u16 addr,
+                                      __u8 reg ) {
+  for (int i = 0; i < METRICS_MAX_REGS; i++) {
+    struct metrics_reg *r = &b->reg[i];
+
+    if ( !r->used ) {
+      r->addr = addr;
+      r->reg = reg;
+      r->used = 1;
+    }
+    if ( r->addr == addr && r->reg == reg ) return &r->hist;
+  }
+  return NULL;
+}
+
+int metrics_open( const char *name, const char *proc ) {
+  struct metrics_segment *s;
+  struct stat st;
+  int fd, err;
+
+  if ( seg != NULL ) return 0;
+  fd = shm_open( name, O_RDWR | O_CREAT, 0644 );
+  if ( fd == -1 ) return -1;
+  // a fresh segment is all zeros, which is all blocks free
+  if ( fstat( fd, &st ) == -1 ||
+       (st.st_size < (off_t) sizeof(*s) &&
+        ftruncate( fd, sizeof(*s) ) == -1) )
+    goto fail;
+  s = mmap( NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( s == MAP_FAILED ) goto fail;
+  close( fd );
+
+  if ( memcmp( s->magic, METRICS_MAGIC, 4 ) != 0 ) {
+    s->version = METRICS_VERSION;
+    s->nblocks = METRICS_MAX_BLOCKS;
+    s->block_size = sizeof(struct metrics_block);
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    memcpy( s->magic, METRICS_MAGIC, 4 );
+  } else if ( s->version != METRICS_VERSION ||
+              s->nblocks != METRICS_MAX_BLOCKS ||
+              s->block_size != sizeof(struct metrics_block) ) {
+    munmap( s, sizeof(*s) );
+    errno = EPROTO;
+    return -1;
+  }
+
+  if ( pthread_key_create( &release_key, release ) != 0 ) {
+    munmap( s, sizeof(*s) );
+    errno = EAGAIN;
+    return -1;
+  }
+  strncpy( proc_label, proc, sizeof(proc_label) - 1 );
+  seg = s;
+  return 0;
+
+fail:
+  err = errno;
+  close( fd );
+  errno = err;
+  return -1;
+}
+
+__u64 metrics_start( void ) {
+  return seg != NULL ? clock_ns( CLOCK_MONOTONIC ) : 0;
+}
+
+void metrics_count( int counter, unsigned long n ) {
+  struct metrics_block *b = block();
+
+  if ( b == NULL ) return;
+  begin( b );
+  b->counter[counter] += n;
+  end( b );
+}
+
+void metrics_observe( int hist, __u64 ns ) {
+  struct metrics_block *b = block();
+
+  if ( b == NULL ) return;
+  begin( b );
+  hist_add( &b->hist[hist], ns );
+  end( b );
+}
+
+void metrics_i2c( const struct i2c_msg *msgs, int nmsgs, int res,
+                  __u64 start ) {
+  struct metrics_block *b;
+  struct metrics_hist *h;
+  __u64 ns;
+
+  if ( start == 0 || (b = block()) == NULL ) return;
+  ns = clock_ns( CLOCK_MONOTONIC ) - start;
+
+  begin( b );
+  b->counter[METRICS_I2C_TRANSFERS]++;
+  hist_add( &b->hist[METRICS_I2C_LATENCY], ns );
+  if ( res == nmsgs ) {
+    b->counter[METRICS_I2C_MESSAGES] += nmsgs;
+    for (int i = 0; i < nmsgs; i++) {
+      b->counter[METRICS_I2C_BYTES] += msgs[i].len;
+      // a register read is a one byte pointer write and a read
+      if ( i == 0 || !(msgs[i].flags & I2C_M_RD) ||
+           (msgs[i - 1].flags & I2C_M_RD) || msgs[i - 1].len != 1 ||
+           msgs[i - 1].addr != msgs[i].addr )
+        continue;
+      h = reg_hist( b, msgs[i].addr, msgs[i - 1].buf[0] & 0x7f );
+      if ( h != NULL ) hist_add( h, ns );
+    }
+  } else {
+    b->counter[res < 0 ? METRICS_I2C_ERRORS : METRICS_I2C_SHORT]++;
+  }
+  end( b );
+}
+
+void metrics_sample( __u64 deadline ) {
+  struct metrics_block *b = block();
+  __u64 now;
+
+  if ( b == NULL ) return;
+  now = clock_ns( CLOCK_MONOTONIC );
+  begin( b );
+  b->counter[METRICS_SAMPLES]++;
+  hist_add( &b->hist[METRICS_SAMPLE_LATENCY],
+            now > deadline ? now - deadline : 0 );
+  end( b );
+}
+
+/* ---------------------------------------------------------------- export */
+
+/* Consistent copy of a block, or -1 if its owner kept updating it */
+static int snapshot( const struct metrics_block *b,
+                     struct metrics_block *out ) {
+  __u32 s1, s2;
+
+  for (int tries = 0; tries < METRICS_RETRIES; tries++) {
+    s1 = __atomic_load_n( &b->seq, __ATOMIC_ACQUIRE );
+    if ( s1 & 1 ) continue;
+    memcpy( out, b, sizeof(*out) );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    s2 = __atomic_load_n( &b->seq, __ATOMIC_RELAXED );
+    if ( s1 == s2 ) return 0;
+  }
+  return -1;
+}
+
+static void hist_merge( struct metrics_hist *sum,
+                        const struct metrics_hist *h ) {
+  for (int i = 0; i <= METRICS_BUCKETS; i++) sum->count[i] += h->count[i];
+  sum->sum += h->sum;
+}
+
+/* Sum b into the total of its process */
+static void merge( struct metrics_block *total, int *ntotal,
+                   const struct metrics_block *b ) {
+  struct metrics_block *t = NULL;
+
+  for (int i = 0; i < *ntotal; i++)
+    if ( strncmp( total[i].proc, b->proc, sizeof(b->proc) ) == 0 )
+      t = &total[i];
+  if ( t == NULL ) {
+    t = &total[(*ntotal)++];
+    memset( t, 0, sizeof(*t) );
+    memcpy( t->proc, b->proc, sizeof(t->proc) );
+  }
+
+  for (int i = 0; i < METRICS_COUNTERS; i++) t->counter[i] += b->counter[i];
+  for (int i = 0; i < METRICS_HISTOGRAMS; i++)
+    hist_merge( &t->hist[i], &b->hist[i] );
+  for (int i = 0; i < METRICS_MAX_REGS && b->reg[i].used; i++) {
+    struct metrics_hist *h = reg_hist( t, b->reg[i].addr, b->reg[i].reg );
+
+    if ( h != NULL ) hist_merge( h, &b->reg[i].hist );
+  }
+}
+
+static void print_hist( FILE *out, const char *name, const char *labels,
+                        const struct metrics_hist *h ) {
+  __u64 cum = 0;
+
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    cum += h->count[i];
+    fprintf( out, "%s_bucket{%s,le=\"%.9g\"} %llu\n", name, labels,
+             (double) (1ULL << i) * 1024e-9, (unsigned long long) cum );
+  }
+  cum += h->count[METRICS_BUCKETS];
+  fprintf( out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+           (unsigned long long) cum );
+  fprintf( out, "%s_sum{%s} %.9f\n", name, labels, h->sum / 1e9 );
+  fprintf( out, "%s_count{%s} %llu\n", name, labels,
+           (unsigned long long) cum );
+}
+
+int metrics_export( const char *name, FILE *out ) {
+  const char *regs = "sensehat_register_read_seconds";
+  struct metrics_segment *s;
+  struct metrics_block *total, b;
+  char labels[64];
+  int fd, ntotal = 0;
+
+  fd = shm_open( name, O_RDONLY, 0 );
+  if ( fd == -1 ) return -1;
+  s = mmap( NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( s == MAP_FAILED ) return -1;
+  if ( memcmp( s->magic, METRICS_MAGIC, 4 ) != 0 ||
+       s->version != METRICS_VERSION || s->nblocks != METRICS_MAX_BLOCKS ||
+       s->block_size != sizeof(struct metrics_block) ) {
+    munmap( s, sizeof(*s) );
+    errno = EPROTO;
+    return -1;
+  }
+  total = malloc( METRICS_MAX_BLOCKS * sizeof(struct metrics_block) );
+  if ( total == NULL ) {
+    munmap( s, sizeof(*s) );
+    return -1;
+  }
+
+  for (int i = 0; i < METRICS_MAX_BLOCKS; i++)
+    if ( __atomic_load_n( &s->block[i].pid, __ATOMIC_ACQUIRE ) != 0 &&
+         snapshot( &s->block[i], &b ) == 0 )
+      merge( total, &ntotal, &b );
+  munmap( s, sizeof(*s) );
+
+  for (int c = 0; c < METRICS_COUNTERS; c++) {
+    fprintf( out, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name,
+             counters[c].help, counters[c].name );
+    for (int i = 0; i < ntotal; i++)
+      fprintf( out, "%s{proc=\"%.16s\"} %llu\n", counters[c].name,
+               total[i].proc, (unsigned long long) total[i].counter[c] );
+  }
+
+  fprintf( out, "# HELP sensehat_i2c_transfers_per_sample i2c transactions "
+           "per sample delivered\n"
+           "# TYPE sensehat_i2c_transfers_per_sample gauge\n" );
+  for (int i = 0; i < ntotal; i++)
+    if ( total[i].counter[METRICS_SAMPLES] != 0 )
+      fprintf( out, "sensehat_i2c_transfers_per_sample{proc=\"%.16s\"} "
+               "%.3f\n", total[i].proc,
+               (double) total[i].counter[METRICS_I2C_TRANSFERS] /
+               total[i].counter[METRICS_SAMPLES] );
+
+  for (int h = 0; h < METRICS_HISTOGRAMS; h++) {
+    fprintf( out, "# HELP %s %s\n# TYPE %s histogram\n", histograms[h].name,
+             histograms[h].help, histograms[h].name );
+    for (int i = 0; i < ntotal; i++) {
+      snprintf( labels, sizeof(labels), "proc=\"%.16s\"", total[i].proc );
+      print_hist( out, histograms[h].name, labels, &total[i].hist[h] );
+    }
+  }
+
+  fprintf( out, "# HELP %s Time taken by transactions reading a register\n"
+           "# TYPE %s histogram\n", regs, regs );
+  for (int i = 0; i < ntotal; i++)
+    for (int r = 0; r < METRICS_MAX_REGS && total[i].reg[r].used; r++) {
+      snprintf( labels, sizeof(labels),
+                "proc=\"%.16s\",addr=\"0x%02x\",reg=\"0x%02x\"",
+                total[i].proc, total[i].reg[r].addr, total[i].reg[r].reg );
+      print_hist( out, regs, labels, &total[i].reg[r].hist );
+    }
+
+  free( total );
+  return ferror( out ) ? -1 : 0;
+}
@@ -0,0 +1,103 @@
+/*
+ *  metrics.h
+ *    Counters and latency histograms of the acquisition stack in shared
+ *    memory, exported as Prometheus text
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Every thread that records gets a block of its own in one segment shared
+ *  by all processes of the stack, so recording never waits on anybody: the
+ *  writer of a block bumps its sequence number around an update and a
+ *  reader retries a copy that raced with one. A block stays with its
+ *  process when the thread exits and is taken over by the next thread of
+ *  that process, so the totals of a process never go backwards; blocks of
+ *  processes that are gone are reused once the segment is otherwise full.
+ *
+ *  Nothing is recorded, and i2c transactions are not even timed, until the
+ *  process calls metrics_open(). The i2c_bus layer records every
+ *  transaction: messages, bytes, failures, short transactions and its
+ *  latency, once as a whole and once for every register read in it.
+ *
+ *  metrics_export() sums the blocks by process and writes them out in the
+ *  Prometheus text exposition format, see metricsd.c.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <asm/types.h>
+#include <linux/i2c.h>
+
+#define METRICS_SHM_NAME    "/sensehat-metrics"
+#define METRICS_MAX_BLOCKS  64
+#define METRICS_MAX_REGS    16  // distinct registers timed per thread
+/* Histogram bucket i counts latencies up to 2^i * 1024 ns, the last one
+   everything above 2^23 * 1024 ns, about 8.6 s */
+#define METRICS_BUCKETS     24
+
+enum {
+  METRICS_I2C_TRANSFERS,   // combined transactions, one syscall each
+  METRICS_I2C_MESSAGES,
+  METRICS_I2C_BYTES,
+  METRICS_I2C_ERRORS,      // transactions that failed outright
+  METRICS_I2C_SHORT,       // transactions the adapter gave up part way
+  METRICS_STALE,           // reads that found no new conversion
+  METRICS_WHO_AM_I,        // WHO_AM_I mismatches
+  METRICS_SAMPLES,         // samples delivered
+  METRICS_TRIGGERS,        // recordings picam was told to start
+  METRICS_COUNTERS
+};
+
+enum {
+  METRICS_I2C_LATENCY,     // whole transactions
+  METRICS_SAMPLE_LATENCY,  // from the deadline of a sample to its delivery
+  METRICS_TRIGGER_LATENCY, // from motion to picam recording, see trigger.h
+  METRICS_HISTOGRAMS
+};
+
+struct metrics_hist {
+  __u64 count[METRICS_BUCKETS + 1];
+  __u64 sum;  // ns
+};
+
+struct metrics_reg {
+  __u16 addr;
+  __u8 reg;   // without the auto-increment bit
+  __u8 used;
+  struct metrics_hist hist;
+};
+
+struct metrics_block {
+  __u32 seq;     // odd while the owner updates the block
+  __u32 owner;   // thread id, 0 once the thread has exited
+  __u32 pid;     // 0 if the block was never used
+  char proc[16];
+  __u64 counter[METRICS_COUNTERS];
+  struct metrics_hist hist[METRICS_HISTOGRAMS];
+  struct metrics_reg reg[METRICS_MAX_REGS];
+} __attribute__((aligned(64)));
+
+/* Map the segment at name, creating it if needed, and start recording
+   under the process label proc. Returns 0 or -1 and errno. */
+int metrics_open( const char *name, const char *proc );
+
+/* Start of a timed operation: CLOCK_MONOTONIC ns, or 0 if not recording */
+__u64 metrics_start( void );
+
+void metrics_count( int counter, unsigned long n );
+void metrics_observe( int hist, __u64 ns );
+
+/* A transaction that returned res and began at start */
+void metrics_i2c( const struct i2c_msg *msgs, int nmsgs, int res,
+                  __u64 start );
+
+/* A sample delivered now that was due at deadline (CLOCK_MONOTONIC) */
+void metrics_sample( __u64 deadline );
+
+/* Write all blocks of the segment at name, summed by process, as
+   Prometheus text. Returns 0 or -1 and errno. */
+int metrics_export( const char *name, FILE *out );
+
+#endif /* _METRICS_H_ */
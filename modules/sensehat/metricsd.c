@@ -0,0 +1,134 @@
+/*
+ *  metricsd.c
+ *    Prometheus endpoint for the metrics segment, see metrics.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: metricsd [-n shm name] [-l socket]
+ *    without -l  print the metrics once and exit, e.g. for the textfile
+ *                collector of node_exporter
+ *    -l          answer every connection to the Unix socket with the
+ *                metrics as an HTTP/1.0 response, e.g.
+ *                curl --unix-socket socket http://localhost/metrics
+ *
+ *  The segment is read without taking part in any update, so scraping
+ *  never holds up the recording threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal( int sig ) {
+  running = 0;
+}
+
+static int listen_on( const char *path ) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  int fd;
+
+  if ( strlen( path ) >= sizeof(sa.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy( sa.sun_path, path );
+  fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( fd == -1 ) return -1;
+  unlink( path );
+  if ( bind( fd, (struct sockaddr *) &sa, sizeof(sa) ) == -1 ||
+       listen( fd, 8 ) == -1 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+/* Whatever the request was, the answer is the same */
+static void serve( int fd, const char *name ) {
+  static const char ok[] = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+  static const char fail[] = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+  struct timeval tv = { 1, 0 };
+  char req[1024], *body = NULL;
+  size_t len = 0;
+  FILE *out;
+  int rc;
+
+  setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+  setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+  if ( recv( fd, req, sizeof(req), 0 ) == -1 ) return;
+
+  out = open_memstream( &body, &len );
+  if ( out == NULL ) return;
+  rc = metrics_export( name, out );
+  fclose( out );
+  if ( rc == -1 ) {
+    send( fd, fail, sizeof(fail) - 1, MSG_NOSIGNAL );
+  } else if ( send( fd, ok, sizeof(ok) - 1, MSG_NOSIGNAL ) != -1 ) {
+    for (size_t off = 0; off < len; ) {
+      ssize_t n = send( fd, body + off, len - off, MSG_NOSIGNAL );
+
+      if ( n <= 0 ) break;
+      off += n;
+    }
+  }
+  free( body );
+}
+
+int main( int argc, char **argv ) {
+  struct sigaction sa = { .sa_handler = on_signal };
+  const char *name = METRICS_SHM_NAME;
+  const char *path = NULL;
+  int opt, lfd, fd;
+
+  while ( (opt = getopt( argc, argv, "n:l:" )) != -1 ) {
+    switch ( opt ) {
+      case 'n': name = optarg; break;
+      case 'l': path = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-n shm name] [-l socket]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  if ( path == NULL ) {
+    if ( metrics_export( name, stdout ) == -1 ) {
+      perror( name );
+      return 1;
+    }
+    return 0;
+  }
+
+  lfd = listen_on( path );
+  if ( lfd == -1 ) {
+    perror( path );
+    return 1;
+  }
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+  signal( SIGPIPE, SIG_IGN );
+
+  while ( running ) {
+    fd = accept( lfd, NULL, NULL );
+    if ( fd == -1 ) {
+      if ( errno != EINTR ) perror( "accept" );
+      continue;
+    }
+    serve( fd, name );
+    close( fd );
+  }
+  close( lfd );
+  unlink( path );
+  return 0;
+}
@@ -0,0 +1,327 @@
+/*
+ *  rollup.c
+ *    Incremental min/max/mean/stddev aggregation over 1 s, 1 min, 1 h and
+ *    1 day windows
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rollup.h"
+
+const __u64 rollup_window_ns[ROLLUP_LEVELS] = {
+  1000000000ULL, 60000000000ULL, 3600000000000ULL, 86400000000000ULL
+};
+
+struct dq_entry {
+  __u64 ts;  // newest instant the value covers
+  float v;
+};
+
+/* Ring of entries with values monotonic from front to back */
+struct deque {
+  struct dq_entry *e;
+  size_t mask;
+  size_t head;  // front, oldest
+  size_t tail;  // one past the back
+};
+
+struct level {
+  int open;
+  __u64 end;                   // end of the open bucket
+  struct rollup_bucket cur;
+  struct deque dmin[ROLLUP_CHANNELS];
+  struct deque dmax[ROLLUP_CHANNELS];
+};
+
+struct pending {
+  __u64 ts;
+  float v[ROLLUP_CHANNELS];
+};
+
+struct rollup {
+  struct rollup_config cfg;
+  rollup_emit_fn fn;
+  void *arg;
+  struct level lv[ROLLUP_LEVELS];
+  struct pending *held;        // reorder ring, sorted oldest first
+  size_t held_mask;
+  size_t held_head;
+  size_t nheld;
+  __u64 newest;                // newest timestamp seen
+  __u64 released;              // newest timestamp passed on
+  int have_released;
+  struct rollup_stats stats;
+};
+
+static int dq_init( struct deque *dq, size_t capacity ) {
+  size_t size = 1;
+
+  while ( size < capacity ) size <<= 1;
+  dq->e = malloc( size * sizeof(struct dq_entry) );
+  dq->mask = size - 1;
+  dq->head = dq->tail = 0;
+  return dq->e == NULL ? -1 : 0;
+}
+
+/* Drop entries from the back that the new value supersedes: it is newer,
+   so it outlives them, and at least as extreme */
+static void dq_push( struct rollup *r, struct deque *dq, __u64 ts, float v,
+                     int is_max ) {
+  while ( dq->tail != dq->head ) {
+    float back = dq->e[(dq->tail - 1) & dq->mask].v;
+    if ( is_max ? back > v : back < v ) break;
+    dq->tail--;
+  }
+  if ( dq->tail - dq->head > dq->mask ) {
+    dq->head++;
+    r->stats.evicted++;
+  }
+  dq->e[dq->tail & dq->mask] = (struct dq_entry) { ts, v };
+  dq->tail++;
+}
+
+static void dq_expire( struct deque *dq, __u64 cutoff ) {
+  while ( dq->head != dq->tail && dq->e[dq->head & dq->mask].ts < cutoff )
+    dq->head++;
+}
+
+static void agg_start( struct rollup_bucket *b, int level, __u64 ts ) {
+  memset( b, 0, sizeof(struct rollup_bucket) );
+  b->level = level;
+  b->start = ts - ts % rollup_window_ns[level];
+}
+
+static void feed( struct rollup *r, int k, const struct rollup_bucket *sub );
+
+static void close_bucket( struct rollup *r, int k ) {
+  struct level *lv = &r->lv[k];
+
+  lv->open = 0;
+  r->stats.buckets[k]++;
+  r->fn( r->arg, &lv->cur );
+  if ( k + 1 < ROLLUP_LEVELS ) feed( r, k + 1, &lv->cur );
+}
+
+static void open_bucket( struct level *lv, int k, __u64 ts ) {
+  agg_start( &lv->cur, k, ts );
+  lv->end = lv->cur.start + rollup_window_ns[k];
+  lv->open = 1;
+}
+
+/* Welford's update for one sample at the 1 s level */
+static void add_sample( struct rollup *r, const struct pending *p ) {
+  struct level *lv = &r->lv[ROLLUP_1S];
+  __u64 cutoff;
+
+  if ( lv->open && p->ts >= lv->end ) close_bucket( r, ROLLUP_1S );
+  if ( !lv->open ) open_bucket( lv, ROLLUP_1S, p->ts );
+
+  lv->cur.count++;
+  for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+    struct rollup_agg *a = &lv->cur.ch[c];
+    double x = p->v[c], delta;
+
+    a->count++;
+    if ( a->count == 1 || x < a->min ) a->min = x;
+    if ( a->count == 1 || x > a->max ) a->max = x;
+    delta = x - a->mean;
+    a->mean += delta / a->count;
+    a->m2 += delta * (x - a->mean);
+  }
+
+  cutoff = p->ts > rollup_window_ns[ROLLUP_1S] ?
+           p->ts - rollup_window_ns[ROLLUP_1S] + 1 : 0;
+  for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+    dq_push( r, &lv->dmin[c], p->ts, p->v[c], 0 );
+    dq_push( r, &lv->dmax[c], p->ts, p->v[c], 1 );
+    dq_expire( &lv->dmin[c], cutoff );
+    dq_expire( &lv->dmax[c], cutoff );
+  }
+}
+
+/* Merge a finished bucket of level k - 1 into level k */
+static void feed( struct rollup *r, int k, const struct rollup_bucket *sub ) {
+  struct level *lv = &r->lv[k];
+  __u64 last = sub->start + rollup_window_ns[k - 1] - 1;
+  __u64 cutoff;
+
+  if ( lv->open && sub->start >= lv->end ) close_bucket( r, k );
+  if ( !lv->open ) open_bucket( lv, k, sub->start );
+
+  lv->cur.count += sub->count;
+  for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+    struct rollup_agg *a = &lv->cur.ch[c];
+    const struct rollup_agg *b = &sub->ch[c];
+    double n, delta;
+
+    if ( b->count == 0 ) continue;
+    if ( a->count == 0 ) {
+      *a = *b;
+      continue;
+    }
+    n = (double) a->count + b->count;
+    delta = b->mean - a->mean;
+    a->mean += delta * b->count / n;
+    a->m2 += b->m2 + delta * delta * a->count * b->count / n;
+    a->count += b->count;
+    if ( b->min < a->min ) a->min = b->min;
+    if ( b->max > a->max ) a->max = b->max;
+  }
+
+  cutoff = last > rollup_window_ns[k] ? last - rollup_window_ns[k] + 1 : 0;
+  for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+    if ( sub->ch[c].count == 0 ) continue;
+    dq_push( r, &lv->dmin[c], last, sub->ch[c].min, 0 );
+    dq_push( r, &lv->dmax[c], last, sub->ch[c].max, 1 );
+    dq_expire( &lv->dmin[c], cutoff );
+    dq_expire( &lv->dmax[c], cutoff );
+  }
+}
+
+struct rollup *rollup_new( const struct rollup_config *cfg, rollup_emit_fn fn,
+                           void *arg ) {
+  static const struct rollup_config defaults = ROLLUP_CONFIG_DEFAULT;
+  struct rollup *r;
+  size_t capacity;
+
+  r = calloc( 1, sizeof(struct rollup) );
+  if ( r == NULL ) return NULL;
+  r->cfg = cfg != NULL ? *cfg : defaults;
+  r->fn = fn;
+  r->arg = arg;
+  if ( r->cfg.reorder == 0 || !(r->cfg.max_rate > 0) ) {
+    errno = EINVAL;
+    goto fail;
+  }
+  for (capacity = 1; capacity < r->cfg.reorder + 1; capacity <<= 1);
+  r->held = malloc( capacity * sizeof(struct pending) );
+  if ( r->held == NULL ) goto fail;
+  r->held_mask = capacity - 1;
+
+  for (int k = 0; k < ROLLUP_LEVELS; k++) {
+    // raw samples in a second, or sub-buckets in a window, plus the ends
+    capacity = k == 0 ? (size_t) r->cfg.max_rate + 2 :
+               rollup_window_ns[k] / rollup_window_ns[k - 1] + 2;
+    for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+      if ( dq_init( &r->lv[k].dmin[c], capacity ) == -1 ||
+           dq_init( &r->lv[k].dmax[c], capacity ) == -1 )
+        goto fail;
+    }
+  }
+  return r;
+
+fail:
+  rollup_free( r );
+  return NULL;
+}
+
+static struct pending *held( struct rollup *r, size_t i ) {
+  return &r->held[(r->held_head + i) & r->held_mask];
+}
+
+static void release_oldest( struct rollup *r ) {
+  struct pending *p = held( r, 0 );
+
+  r->released = p->ts;
+  r->have_released = 1;
+  add_sample( r, p );
+  r->held_head++;
+  r->nheld--;
+}
+
+int rollup_add( struct rollup *r, __u64 timestamp,
+                const float v[ROLLUP_CHANNELS] ) {
+  size_t i;
+
+  if ( r->have_released && timestamp < r->released ) {
+    r->stats.late++;
+    return 1;
+  }
+
+  // insertion sort from the back, in order samples stop at once
+  i = r->nheld;
+  while ( i > 0 && held( r, i - 1 )->ts > timestamp ) {
+    *held( r, i ) = *held( r, i - 1 );
+    i--;
+  }
+  if ( i != r->nheld ) r->stats.reordered++;
+  held( r, i )->ts = timestamp;
+  memcpy( held( r, i )->v, v, sizeof(held( r, i )->v) );
+  r->nheld++;
+  r->stats.samples++;
+  if ( timestamp > r->newest ) r->newest = timestamp;
+
+  while ( r->nheld > 0 &&
+          (r->nheld > r->cfg.reorder ||
+           held( r, 0 )->ts + r->cfg.lateness <= r->newest) )
+    release_oldest( r );
+  return 0;
+}
+
+void rollup_flush( struct rollup *r ) {
+  while ( r->nheld > 0 ) release_oldest( r );
+  for (int k = 0; k < ROLLUP_LEVELS; k++)
+    if ( r->lv[k].open ) close_bucket( r, k );
+}
+
+int rollup_range( struct rollup *r, int level, struct rollup_range *range ) {
+  __u64 cutoff;
+
+  if ( level < 0 || level >= ROLLUP_LEVELS ) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ( !r->have_released ) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  // the finer levels cover the newest part of the window
+  if ( level > 0 ) {
+    if ( rollup_range( r, level - 1, range ) == -1 ) return -1;
+  } else {
+    for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+      range->min[c] = INFINITY;
+      range->max[c] = -INFINITY;
+    }
+  }
+  range->end = r->released;
+
+  cutoff = r->released > rollup_window_ns[level] ?
+           r->released - rollup_window_ns[level] + 1 : 0;
+  for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+    struct deque *dmin = &r->lv[level].dmin[c];
+    struct deque *dmax = &r->lv[level].dmax[c];
+
+    dq_expire( dmin, cutoff );
+    dq_expire( dmax, cutoff );
+    if ( dmin->head != dmin->tail &&
+         dmin->e[dmin->head & dmin->mask].v < range->min[c] )
+      range->min[c] = dmin->e[dmin->head & dmin->mask].v;
+    if ( dmax->head != dmax->tail &&
+         dmax->e[dmax->head & dmax->mask].v > range->max[c] )
+      range->max[c] = dmax->e[dmax->head & dmax->mask].v;
+  }
+  return 0;
+}
+
+void rollup_stats( struct rollup *r, struct rollup_stats *stats ) {
+  memcpy( stats, &r->stats, sizeof(struct rollup_stats) );
+}
+
+void rollup_free( struct rollup *r ) {
+  if ( r == NULL ) return;
+  for (int k = 0; k < ROLLUP_LEVELS; k++) {
+    for (int c = 0; c < ROLLUP_CHANNELS; c++) {
+      free( r->lv[k].dmin[c].e );
+      free( r->lv[k].dmax[c].e );
+    }
+  }
+  free( r->held );
+  free( r );
+}
@@ -0,0 +1,123 @@
+/*
+ *  rollup.h
+ *    Incremental min/max/mean/stddev aggregation over 1 s, 1 min, 1 h and
+ *    1 day windows
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Samples of pressure, temperature and humidity go in one at a time and
+ *  finished buckets come out through a callback, aligned to multiples of
+ *  the window size (so day buckets start at midnight UTC for realtime
+ *  timestamps). A window with no samples produces no bucket; the count in
+ *  each bucket shows how much of it was covered.
+ *
+ *  Only the 1 s level looks at individual samples, with Welford's update
+ *  for the variance. Each coarser level is fed the finished buckets of
+ *  the level below and merges them (Chan et al.), so the per-sample cost
+ *  is constant whatever the number of levels.
+ *
+ *  Every level also keeps monotonic deques of the minima and maxima in the
+ *  window ending at the newest sample, for rolling "last minute" style
+ *  extremes. The 1 s level keeps raw samples, the coarser ones keep the
+ *  extremes of finished sub-buckets, so memory stays bounded at 1 kHz.
+ *
+ *  Samples may arrive out of order by up to cfg.lateness: they wait in a
+ *  small reorder buffer until the newest timestamp seen is that far ahead.
+ *  Anything older than a sample already passed on is dropped and counted.
+ */
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stddef.h>
+#include <math.h>
+#include <asm/types.h>
+
+enum {
+  ROLLUP_PRESSURE,
+  ROLLUP_TEMPERATURE,
+  ROLLUP_HUMIDITY,
+  ROLLUP_CHANNELS
+};
+
+enum {
+  ROLLUP_1S,
+  ROLLUP_1M,
+  ROLLUP_1H,
+  ROLLUP_1D,
+  ROLLUP_LEVELS
+};
+
+extern const __u64 rollup_window_ns[ROLLUP_LEVELS];
+
+struct rollup_agg {
+  __u32 count;
+  float min;
+  float max;
+  double mean;
+  double m2;     // sum of squared deviations from the mean
+};
+
+struct rollup_bucket {
+  int level;
+  __u64 start;   // ns, a multiple of rollup_window_ns[level]
+  __u32 count;   // samples in the bucket
+  struct rollup_agg ch[ROLLUP_CHANNELS];
+};
+
+/* Rolling extremes over the window ending at the newest sample. Above the
+   1 s level the old end of the window is only exact to one sub-bucket. */
+struct rollup_range {
+  __u64 end;
+  float min[ROLLUP_CHANNELS];
+  float max[ROLLUP_CHANNELS];
+};
+
+struct rollup_config {
+  __u64 lateness;   // ns a sample may arrive behind the newest one
+  size_t reorder;   // samples held back at most while waiting for late ones
+  double max_rate;  // Hz of the input, sizes the 1 s deques
+};
+
+#define ROLLUP_CONFIG_DEFAULT { 200000000ULL, 64, 1000.0 }
+
+struct rollup_stats {
+  unsigned long samples;    // samples accepted
+  unsigned long reordered;  // samples that arrived out of order
+  unsigned long late;       // samples dropped as too late
+  unsigned long evicted;    // deque entries dropped for lack of room
+  unsigned long buckets[ROLLUP_LEVELS];
+};
+
+typedef void (*rollup_emit_fn)( void *arg, const struct rollup_bucket *b );
+
+struct rollup;
+
+/* cfg may be NULL for the defaults */
+struct rollup *rollup_new( const struct rollup_config *cfg, rollup_emit_fn fn,
+                           void *arg );
+
+/* Add a sample. Returns 0, or 1 if it was dropped as too late. */
+int rollup_add( struct rollup *r, __u64 timestamp,
+                const float v[ROLLUP_CHANNELS] );
+
+/* Pass on everything held back and emit the open buckets, e.g. on exit */
+void rollup_flush( struct rollup *r );
+
+/* Rolling extremes for a level, -1 and ENODATA before the first sample */
+int rollup_range( struct rollup *r, int level, struct rollup_range *range );
+
+void rollup_stats( struct rollup *r, struct rollup_stats *stats );
+void rollup_free( struct rollup *r );
+
+/* Sample variance and standard deviation of a channel */
+static inline double rollup_variance( const struct rollup_agg *a ) {
+  return a->count > 1 ? a->m2 / (a->count - 1) : 0.0;
+}
+
+static inline double rollup_stddev( const struct rollup_agg *a ) {
+  return sqrt( rollup_variance( a ) );
+}
+
+#endif /* _ROLLUP_H_ */
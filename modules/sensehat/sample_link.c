@@ -0,0 +1,310 @@
+/*
+ *  sample_link.c
+ *    Batched sample transport from the slave to the master over a stream
+ *    socket, e.g. TCP over the USB network link
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "spsc_ring.h"
+#include "sample_link.h"
+
+/* Room for two of the largest frames, so one is always whole in there */
+#define RX_BUF (2 * (sizeof(struct sample_link_hdr) + \
+                     SAMPLE_LINK_MAX_BATCH * sizeof(struct sample_link_rec)))
+
+struct sample_link {
+  struct sample_link_config cfg;
+  int fd;
+  struct spsc_ring ring;
+  __u64 *pushed;     // push time of the record in each slot
+  __u64 seq;         // number of the next record to go out
+  __u64 lost;
+  // frames in flight, built from the records at the start of the ring
+  int nframes;
+  struct sample_link_hdr hdr[SAMPLE_LINK_MAX_FRAMES];
+  size_t inflight;   // records in them
+  size_t sent;       // bytes of them the kernel has taken
+  struct sample_link_stats stats;
+};
+
+/* The receive buffer follows the struct */
+struct sample_link_rx {
+  int fd;
+  __u8 *buf;
+  size_t len;
+  int started;
+  __u64 next_seq;    // number expected in the next frame
+  __u64 lost;        // as the sender counted it in the last frame
+  struct sample_link_rx_stats stats;
+};
+
+struct sample_link *sample_link_new( const struct sample_link_config *cfg ) {
+  static const struct sample_link_config defaults =
+    SAMPLE_LINK_CONFIG_DEFAULT;
+  struct sample_link *l;
+
+  if ( cfg == NULL ) cfg = &defaults;
+  if ( cfg->batch == 0 || cfg->batch > SAMPLE_LINK_MAX_BATCH ) {
+    errno = EINVAL;
+    return NULL;
+  }
+  l = calloc( 1, sizeof(struct sample_link) );
+  if ( l == NULL ) return NULL;
+  l->cfg = *cfg;
+  l->fd = -1;
+  if ( spsc_ring_init( &l->ring, cfg->queue,
+                       sizeof(struct sample_link_rec) ) == -1 ) {
+    free( l );
+    return NULL;
+  }
+  l->pushed = calloc( cfg->queue, sizeof(__u64) );
+  if ( l->pushed == NULL ) {
+    sample_link_free( l );
+    return NULL;
+  }
+  return l;
+}
+
+void sample_link_attach( struct sample_link *l, int fd ) {
+  l->fd = fd;
+  l->sent = 0;
+}
+
+void sample_link_push( struct sample_link *l, const struct sample_link_rec *r,
+                       __u64 now ) {
+  if ( spsc_ring_count( &l->ring ) == spsc_ring_capacity( &l->ring ) ) {
+    l->lost++;
+    // a frame the kernel has part of must be finished as it was built
+    if ( l->sent > 0 ) {
+      l->stats.refused++;
+      return;
+    }
+    l->inflight = 0;
+    l->nframes = 0;
+    spsc_ring_consume( &l->ring, 1 );
+    l->stats.dropped++;
+  }
+  l->pushed[l->ring.head & l->ring.mask] = now;
+  spsc_ring_push( &l->ring, r, 1 );
+}
+
+/* Cut the queue into frames: full ones, then the rest if it waited long */
+static void build( struct sample_link *l, __u64 now ) {
+  size_t queued = spsc_ring_count( &l->ring ), off = 0;
+
+  l->nframes = 0;
+  while ( l->nframes < SAMPLE_LINK_MAX_FRAMES && off < queued ) {
+    struct sample_link_hdr *hdr;
+    size_t n = queued - off;
+
+    if ( n >= l->cfg.batch ) n = l->cfg.batch;
+    else if ( now - l->pushed[(l->ring.tail + off) & l->ring.mask] <
+              l->cfg.linger )
+      break;
+    hdr = &l->hdr[l->nframes++];
+    hdr->magic = SAMPLE_LINK_MAGIC;
+    hdr->version = SAMPLE_LINK_VERSION;
+    hdr->count = n;
+    hdr->seq = l->seq + off;
+    hdr->lost = l->lost;
+    hdr->age = 0;
+    off += n;
+  }
+  l->inflight = off;
+  l->sent = 0;
+}
+
+/* Append base..base+len to iov, less what *skip says is already sent */
+static int gather( struct iovec *iov, int n, void *base, size_t len,
+                   size_t *skip ) {
+  if ( *skip >= len ) {
+    *skip -= len;
+    return n;
+  }
+  iov[n].iov_base = (__u8 *) base + *skip;
+  iov[n].iov_len = len - *skip;
+  *skip = 0;
+  return n + 1;
+}
+
+int sample_link_send( struct sample_link *l, __u64 now ) {
+  struct iovec iov[3 * SAMPLE_LINK_MAX_FRAMES], run[2];
+  struct msghdr msg = { .msg_iov = iov };
+  size_t skip, off, pos, total;
+  __u64 mono, pushed;
+  ssize_t n;
+  int niov;
+
+  for (;;) {
+    if ( l->inflight == 0 ) build( l, now );
+    if ( l->inflight == 0 ) return 1;
+    if ( l->fd == -1 ) return 0;
+
+    // the headers and the records where they lie in the ring, with the age
+    // of a frame as of this send unless the kernel has part of its header
+    niov = 0;
+    skip = l->sent;
+    off = pos = 0;
+    mono = clock_ns( CLOCK_MONOTONIC );
+    for (int i = 0; i < l->nframes; i++) {
+      if ( pos >= l->sent ) {
+        pushed = l->pushed[(l->ring.tail + off + l->hdr[i].count - 1) &
+                           l->ring.mask];
+        l->hdr[i].age = mono > pushed ? mono - pushed : 0;
+      }
+      pos += sizeof(l->hdr[i]) +
+             l->hdr[i].count * sizeof(struct sample_link_rec);
+      niov = gather( iov, niov, &l->hdr[i], sizeof(l->hdr[i]), &skip );
+      spsc_ring_peek( &l->ring, off, l->hdr[i].count, run );
+      niov = gather( iov, niov, run[0].iov_base, run[0].iov_len, &skip );
+      if ( run[1].iov_len > 0 )
+        niov = gather( iov, niov, run[1].iov_base, run[1].iov_len, &skip );
+      off += l->hdr[i].count;
+    }
+    msg.msg_iovlen = niov;
+
+    n = sendmsg( l->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL );
+    l->stats.sends++;
+    if ( n == -1 ) {
+      if ( errno == EINTR ) continue;
+      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        l->stats.blocked++;
+        return 0;
+      }
+      // whatever the kernel took went down with the link
+      l->stats.failures++;
+      l->fd = -1;
+      l->sent = 0;
+      return -1;
+    }
+    l->stats.bytes += n;
+    l->sent += n;
+    total = l->nframes * sizeof(l->hdr[0]) +
+            l->inflight * sizeof(struct sample_link_rec);
+    if ( l->sent < total ) {
+      l->stats.blocked++;
+      return 0;
+    }
+    spsc_ring_consume( &l->ring, l->inflight );
+    l->seq += l->inflight;
+    l->stats.records += l->inflight;
+    l->stats.frames += l->nframes;
+    l->inflight = 0;
+    l->nframes = 0;
+    l->sent = 0;
+  }
+}
+
+__u64 sample_link_due( struct sample_link *l ) {
+  size_t queued = spsc_ring_count( &l->ring );
+  __u64 oldest;
+
+  if ( queued == 0 ) return 0;
+  oldest = l->pushed[l->ring.tail & l->ring.mask];
+  if ( l->inflight > 0 || queued >= l->cfg.batch ) return oldest;
+  return oldest + l->cfg.linger;
+}
+
+void sample_link_stats( struct sample_link *l, struct sample_link_stats *st ) {
+  memcpy( st, &l->stats, sizeof(*st) );
+}
+
+void sample_link_free( struct sample_link *l ) {
+  if ( l == NULL ) return;
+  spsc_ring_free( &l->ring );
+  free( l->pushed );
+  free( l );
+}
+
+/* ---------------------------------------------------------------- receiver */
+
+size_t sample_link_rx_size( void ) {
+  return sizeof(struct sample_link_rx) + RX_BUF;
+}
+
+struct sample_link_rx *sample_link_rx_init( void *mem, int fd ) {
+  struct sample_link_rx *rx = mem;
+
+  // the buffer is only touched as far as frames reach into it
+  memset( rx, 0, sizeof(*rx) );
+  // 8 byte alignment holds for every frame, they are multiples of 8 bytes
+  rx->buf = (__u8 *) (rx + 1);
+  rx->fd = fd;
+  return rx;
+}
+
+struct sample_link_rx *sample_link_rx_new( int fd ) {
+  void *mem = malloc( sample_link_rx_size() );
+
+  return mem == NULL ? NULL : sample_link_rx_init( mem, fd );
+}
+
+static void account( struct sample_link_rx *rx,
+                     const struct sample_link_hdr *hdr ) {
+  if ( rx->started && hdr->seq > rx->next_seq )
+    rx->stats.lost += hdr->seq - rx->next_seq;
+  // numbers going backwards mean the sender started over
+  if ( rx->started && hdr->seq < rx->next_seq ) rx->lost = 0;
+  if ( hdr->lost >= rx->lost ) rx->stats.lost += hdr->lost - rx->lost;
+  rx->lost = hdr->lost;
+  rx->next_seq = hdr->seq + hdr->count;
+  rx->started = 1;
+}
+
+int sample_link_recv( struct sample_link_rx *rx, sample_link_fn fn,
+                      void *arg ) {
+  const struct sample_link_hdr *hdr;
+  size_t off = 0, size;
+  ssize_t n;
+  int records = 0;
+
+  n = recv( rx->fd, rx->buf + rx->len, RX_BUF - rx->len, MSG_DONTWAIT );
+  rx->stats.reads++;
+  if ( n == -1 )
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  if ( n == 0 ) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  rx->len += n;
+  rx->stats.bytes += n;
+
+  while ( rx->len - off >= sizeof(*hdr) ) {
+    hdr = (const struct sample_link_hdr *) (rx->buf + off);
+    if ( hdr->magic != SAMPLE_LINK_MAGIC ||
+         hdr->version != SAMPLE_LINK_VERSION || hdr->count == 0 ||
+         hdr->count > SAMPLE_LINK_MAX_BATCH ) {
+      errno = EPROTO;
+      return -1;
+    }
+    size = sizeof(*hdr) + hdr->count * sizeof(struct sample_link_rec);
+    if ( rx->len - off < size ) break;
+    account( rx, hdr );
+    fn( arg, hdr, (const struct sample_link_rec *) (hdr + 1) );
+    rx->stats.frames++;
+    rx->stats.records += hdr->count;
+    records += hdr->count;
+    off += size;
+  }
+  // only the start of a frame is left, move it to the front
+  memmove( rx->buf, rx->buf + off, rx->len - off );
+  rx->len -= off;
+  return records;
+}
+
+void sample_link_rx_stats( struct sample_link_rx *rx,
+                           struct sample_link_rx_stats *st ) {
+  memcpy( st, &rx->stats, sizeof(*st) );
+}
+
+void sample_link_rx_free( struct sample_link_rx *rx ) {
+  free( rx );
+}
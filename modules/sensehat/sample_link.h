@@ -0,0 +1,149 @@
+/*
+ *  sample_link.h
+ *    Batched sample transport from the slave to the master over a stream
+ *    socket, e.g. TCP over the USB network link
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The sender queues samples in a ring and sends them as frames: a fixed
+ *  struct sample_link_hdr followed by count records back to back. A frame
+ *  goes out once cfg.batch records are queued or the oldest has waited
+ *  cfg.linger, so at 12.5 Hz a second of samples costs one send instead of
+ *  twelve. The records are gathered straight from the ring with sendmsg(),
+ *  up to SAMPLE_LINK_MAX_FRAMES frames per call, and only leave the ring
+ *  once the kernel has taken all of them.
+ *
+ *  Backpressure: a send never blocks. While the socket is full the records
+ *  stay queued and sample_link_send() returns 0; call it again when the
+ *  socket is writable. The queue holds cfg.queue records. Once it is full
+ *  the oldest are dropped, or, while a frame is half way out, the new
+ *  record is refused instead. If the link fails, the frames in flight are
+ *  sent again in full over the next socket attached. The loss is counted
+ *  in the header so the master sees it too.
+ *
+ *  The slave may have no RTC, so its record timestamps are only good for
+ *  intervals between records until NTP has set its clock. How old the
+ *  newest record of a frame is goes in the header instead, measured on the
+ *  monotonic clock of the sender just before sendmsg(), so the master can
+ *  tell when it was read on its own clock, less the time on the wire.
+ *
+ *  The receiver reads into one buffer and hands out every whole frame in
+ *  place: hdr and the records point into the buffer, nothing is copied.
+ *  Records are numbered by the sender as they are sent, so a gap in the
+ *  numbers on the master is data the kernel had taken when the link went
+ *  down. Both ends run in the byte order of the host; the slave and the
+ *  master are both little-endian ARM.
+ *
+ *  The push and send side of a link is for one thread, as is a receiver.
+ */
+#ifndef _SAMPLE_LINK_H_
+#define _SAMPLE_LINK_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+#include "sensehat.h"
+
+#define SAMPLE_LINK_MAGIC      0x4b4e4c53  // "SLNK"
+#define SAMPLE_LINK_VERSION    2
+#define SAMPLE_LINK_MAX_BATCH  1024  // records per frame
+#define SAMPLE_LINK_MAX_FRAMES 8     // frames per sendmsg()
+#define SAMPLE_LINK_PORT       "5401"
+
+struct sample_link_hdr {
+  __u32 magic;
+  __u16 version;
+  __u16 count;  // records following
+  __u64 seq;    // number of the first record, from 0 at sender start
+  __u64 lost;   // records the sender has dropped or refused so far
+  __u64 age;    // ns the newest record had been queued when it went out
+};
+
+struct sample_link_rec {
+  __u64 timestamp;  // CLOCK_REALTIME ns the sample was read
+  struct sensehat_sample s;
+};
+
+struct sample_link_config {
+  size_t batch;   // records per frame
+  __u64 linger;   // ns the oldest record waits for a full frame
+  size_t queue;   // records held while the link is slow or down, power of 2
+};
+
+#define SAMPLE_LINK_CONFIG_DEFAULT { 64, 1000000000ULL, 4096 }
+
+struct sample_link_stats {
+  unsigned long records;  // sent
+  unsigned long frames;
+  unsigned long sends;    // sendmsg() calls
+  unsigned long blocked;  // of those, found the socket full
+  unsigned long dropped;  // oldest records dropped from a full queue
+  unsigned long refused;  // new records refused while a frame was in flight
+  unsigned long failures; // sends that failed, i.e. the link went down
+  unsigned long bytes;
+};
+
+struct sample_link;
+
+/* cfg may be NULL for the defaults. The link starts without a socket. */
+struct sample_link *sample_link_new( const struct sample_link_config *cfg );
+
+/* Send over the stream socket fd from now on, -1 for none. The link does
+   not own fd. */
+void sample_link_attach( struct sample_link *l, int fd );
+
+/* Queue a sample pushed at now (CLOCK_MONOTONIC), which the age sent
+   with it is taken from */
+void sample_link_push( struct sample_link *l, const struct sample_link_rec *r,
+                       __u64 now );
+
+/* Send every frame due at now. Returns 1 when they are out, 0 if the
+   socket is full or there is none, -1 and errno if the send failed; the
+   socket is then detached, attach a new one to carry on. */
+int sample_link_send( struct sample_link *l, __u64 now );
+
+/* When the next frame is due (CLOCK_MONOTONIC), 0 if nothing is queued */
+__u64 sample_link_due( struct sample_link *l );
+
+void sample_link_stats( struct sample_link *l, struct sample_link_stats *st );
+void sample_link_free( struct sample_link *l );
+
+/* ---------------------------------------------------------------- receiver */
+
+struct sample_link_rx_stats {
+  unsigned long records;
+  unsigned long frames;
+  unsigned long reads;    // recv() calls
+  unsigned long lost;     // as the sender counted them, plus gaps
+  unsigned long bytes;
+};
+
+/* A frame in the receive buffer, valid until the callback returns */
+typedef void (*sample_link_fn)( void *arg, const struct sample_link_hdr *hdr,
+                                const struct sample_link_rec *rec );
+
+struct sample_link_rx;
+
+/* Receive from the stream socket fd, which it does not own */
+struct sample_link_rx *sample_link_rx_new( int fd );
+
+/* The same in memory of the caller, sample_link_rx_size() bytes aligned
+   to 8, e.g. a slot of an arena of them. Nothing is allocated, and the
+   receiver is not passed to sample_link_rx_free(). */
+size_t sample_link_rx_size( void );
+struct sample_link_rx *sample_link_rx_init( void *mem, int fd );
+
+/* Read what the socket has and pass on every whole frame. Returns the
+   number of records passed on, 0 if there was nothing to read, or -1 and
+   errno: ECONNRESET when the sender has gone, EPROTO for a corrupt frame.
+   After either, start over with a new receiver on a new socket. */
+int sample_link_recv( struct sample_link_rx *rx, sample_link_fn fn,
+                      void *arg );
+
+void sample_link_rx_stats( struct sample_link_rx *rx,
+                           struct sample_link_rx_stats *st );
+void sample_link_rx_free( struct sample_link_rx *rx );
+
+#endif /* _SAMPLE_LINK_H_ */
@@ -0,0 +1,115 @@
+/*
+ *  sample_pool.c
+ *    Pool of fixed-size sample batches handed between the stages of the
+ *    pipeline without copying or allocating
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spsc_ring.h"
+#include "sample_pool.h"
+
+struct sample_pool {
+  struct sample_batch *free;      // of the owner, most recently put first
+  unsigned char *mem;
+  size_t stride;
+  struct sample_pool_stats stats;
+  // put back from other threads, pushed one by one and taken over whole,
+  // so no batch is popped while another thread looks at it: no ABA
+  struct sample_batch *returned __attribute__((aligned(SPSC_CACHELINE)));
+  unsigned long out;
+};
+
+struct sample_pool *sample_pool_new( const struct sample_pool_config *cfg ) {
+  static const struct sample_pool_config defaults =
+    SAMPLE_POOL_CONFIG_DEFAULT;
+  struct sample_pool *p;
+  struct sample_batch *b;
+
+  if ( cfg == NULL ) cfg = &defaults;
+  if ( cfg->batches == 0 || cfg->records == 0 ) {
+    errno = EINVAL;
+    return NULL;
+  }
+  // malloc() only aligns to 16 bytes, the cache line of returned and the
+  // strides of the batches are only whole lines on a line boundary
+  if ( posix_memalign( (void **) &p, SPSC_CACHELINE,
+                       sizeof(struct sample_pool) ) != 0 ) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset( p, 0, sizeof(struct sample_pool) );
+  // whole cache lines, so two stages never share one
+  p->stride = sizeof(struct sample_batch) +
+              cfg->records * sizeof(struct sample_link_rec);
+  p->stride = (p->stride + SPSC_CACHELINE - 1) & ~(size_t) (SPSC_CACHELINE - 1);
+  if ( posix_memalign( (void **) &p->mem, SPSC_CACHELINE,
+                       cfg->batches * p->stride ) != 0 ) {
+    free( p );
+    errno = ENOMEM;
+    return NULL;
+  }
+  // fault every page in now rather than on the first pass of the pipeline
+  memset( p->mem, 0, cfg->batches * p->stride );
+
+  // the first batch on top, so a pipeline that needs few stays on those
+  for (size_t i = cfg->batches; i > 0; i--) {
+    b = (struct sample_batch *) (p->mem + (i - 1) * p->stride);
+    b->pool = p;
+    b->size = cfg->records;
+    b->next = p->free;
+    p->free = b;
+  }
+  p->stats.batches = cfg->batches;
+  p->stats.bytes = cfg->batches * p->stride;
+  return p;
+}
+
+struct sample_batch *sample_batch_get( struct sample_pool *p ) {
+  struct sample_batch *b;
+  unsigned long out;
+
+  if ( p->free == NULL )
+    p->free = __atomic_exchange_n( &p->returned, NULL, __ATOMIC_ACQUIRE );
+  if ( p->free == NULL ) {
+    p->stats.exhausted++;
+    errno = ENOBUFS;
+    return NULL;
+  }
+  b = p->free;
+  p->free = b->next;
+  b->next = NULL;
+  b->count = 0;
+  p->stats.gets++;
+  out = __atomic_add_fetch( &p->out, 1, __ATOMIC_RELAXED );
+  if ( out > p->stats.most_out ) p->stats.most_out = out;
+  return b;
+}
+
+void sample_batch_put( struct sample_batch **b ) {
+  struct sample_batch *m = sample_batch_move( b );
+  struct sample_pool *p;
+
+  if ( m == NULL ) return;
+  p = m->pool;
+  m->next = __atomic_load_n( &p->returned, __ATOMIC_RELAXED );
+  while ( !__atomic_compare_exchange_n( &p->returned, &m->next, m, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+  __atomic_sub_fetch( &p->out, 1, __ATOMIC_RELAXED );
+}
+
+void sample_pool_stats( struct sample_pool *p, struct sample_pool_stats *st ) {
+  memcpy( st, &p->stats, sizeof(struct sample_pool_stats) );
+  st->out = __atomic_load_n( &p->out, __ATOMIC_RELAXED );
+}
+
+void sample_pool_free( struct sample_pool *p ) {
+  if ( p == NULL ) return;
+  free( p->mem );
+  free( p );
+}
@@ -0,0 +1,87 @@
+/*
+ *  sample_pool.h
+ *    Pool of fixed-size sample batches handed between the stages of the
+ *    pipeline without copying or allocating
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Every batch of a pool is allocated and touched by sample_pool_new(), so
+ *  after startup the pipeline neither calls malloc() nor faults in pages
+ *  for its samples, however long it runs: nothing on the heap comes and
+ *  goes to fragment it. A stage that is out of batches gets ENOBUFS
+ *  instead, and decides what to drop.
+ *
+ *  A batch has exactly one owner at a time. It is taken out of the pool by
+ *  sample_batch_get(), handed on with sample_batch_move(), which clears
+ *  the handle of the giver, and given back with sample_batch_put(), which
+ *  clears the handle of the last owner. A handle that was moved from or
+ *  put is NULL, so touching the batch again faults at once instead of
+ *  corrupting a batch that has been reused meanwhile.
+ *
+ *  Batches are taken out by one thread, the owner of the pool, but may be
+ *  put back from any: they go onto a lock-free list of their own that the
+ *  owner takes over whole once its free list is empty.
+ */
+#ifndef _SAMPLE_POOL_H_
+#define _SAMPLE_POOL_H_
+
+#include <stddef.h>
+
+#include "sample_link.h"
+
+struct sample_pool_config {
+  size_t batches;  // in the pool
+  size_t records;  // per batch
+};
+
+/* 16 batches of 64 records, the write size of ts_store: 80 s of samples
+   at 12.5 Hz */
+#define SAMPLE_POOL_CONFIG_DEFAULT { 16, 64 }
+
+struct sample_batch {
+  struct sample_batch *next;  // while in the pool
+  struct sample_pool *pool;
+  size_t count;               // records filled in
+  size_t size;                // records it has room for
+  struct sample_link_rec rec[];
+};
+
+struct sample_pool_stats {
+  unsigned long batches;
+  unsigned long out;        // batches owned by stages now
+  unsigned long most_out;   // the most there have been at once
+  unsigned long gets;
+  unsigned long exhausted;  // gets that found every batch out
+  size_t bytes;             // the memory of the pool
+};
+
+struct sample_pool;
+
+/* cfg may be NULL for the defaults */
+struct sample_pool *sample_pool_new( const struct sample_pool_config *cfg );
+
+/* Take an empty batch, NULL and ENOBUFS while every batch is out. Only
+   from the thread that owns the pool. */
+struct sample_batch *sample_batch_get( struct sample_pool *p );
+
+/* Hand the batch on: returns it and clears *b */
+static inline struct sample_batch *sample_batch_move(
+    struct sample_batch **b ) {
+  struct sample_batch *m = *b;
+
+  *b = NULL;
+  return m;
+}
+
+/* Give the batch back to its pool and clear *b, which may be NULL. From
+   any thread. */
+void sample_batch_put( struct sample_batch **b );
+
+void sample_pool_stats( struct sample_pool *p, struct sample_pool_stats *st );
+
+/* Once every batch is back */
+void sample_pool_free( struct sample_pool *p );
+
+#endif /* _SAMPLE_POOL_H_ */
@@ -0,0 +1,205 @@
+/*
+ *  sample_shm.c
+ *    Latest sense-hat sample published in shared memory under a seqlock
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "sample_shm.h"
+
+#define SAMPLE_SHM_MAGIC "SHAT"
+/* 32 bit words, so every copy is a plain load or store on ARMv6 too */
+#define DATA_WORDS (sizeof(struct sample_shm_data) / sizeof(__u32))
+
+struct shm_segment {
+  char magic[4];
+  __u32 version;
+  __u32 size;      // sizeof(struct sample_shm_data) of the writer
+  __u32 pid;       // latest writer
+  __u32 seq __attribute__((aligned(64)));  // odd while an update is going on
+  __u32 data[DATA_WORDS];
+};
+
+static inline void cpu_relax( void ) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__( "pause" ::: "memory" );
+#elif defined(__arm__) && defined(__ARM_ARCH) && __ARM_ARCH >= 7 || \
+      defined(__aarch64__)
+  __asm__ __volatile__( "yield" ::: "memory" );
+#else
+  __asm__ __volatile__( "" ::: "memory" );
+#endif
+}
+
+struct sample_shm {
+  struct shm_segment *seg;
+  int writer;
+  char name[NAME_MAX];
+};
+
+/* The sample is copied a word at a time, so it must be whole words */
+typedef char sample_shm_data_words[
+  sizeof(struct sample_shm_data) % sizeof(__u32) == 0 ? 1 : -1];
+
+static struct sample_shm *map( const char *name, int writer ) {
+  struct sample_shm *shm;
+  struct stat st;
+  int fd, err;
+
+  if ( strlen( name ) >= NAME_MAX ) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  shm = calloc( 1, sizeof(struct sample_shm) );
+  if ( shm == NULL ) return NULL;
+  strcpy( shm->name, name );
+  shm->writer = writer;
+
+  fd = shm_open( name, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644 );
+  if ( fd == -1 ) goto fail;
+  if ( writer ) {
+    if ( ftruncate( fd, sizeof(struct shm_segment) ) == -1 ) goto fail_fd;
+  } else {
+    if ( fstat( fd, &st ) == -1 ) goto fail_fd;
+    if ( st.st_size < (off_t) sizeof(struct shm_segment) ) {
+      errno = EPROTO;
+      goto fail_fd;
+    }
+  }
+  shm->seg = mmap( NULL, sizeof(struct shm_segment),
+                   writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                   fd, 0 );
+  if ( shm->seg == MAP_FAILED ) goto fail_fd;
+  close( fd );
+  return shm;
+
+fail_fd:
+  err = errno;
+  close( fd );
+  errno = err;
+fail:
+  err = errno;
+  free( shm );
+  errno = err;
+  return NULL;
+}
+
+/* A restarted writer carries on from the sequence number it finds, so
+   readers that stayed attached never see it go backwards */
+struct sample_shm *sample_shm_create( const char *name ) {
+  struct sample_shm *shm;
+  struct shm_segment *seg;
+  __u32 seq;
+
+  shm = map( name, 1 );
+  if ( shm == NULL ) return NULL;
+  seg = shm->seg;
+
+  if ( memcmp( seg->magic, SAMPLE_SHM_MAGIC, 4 ) != 0 ||
+       seg->version != SAMPLE_SHM_VERSION ||
+       seg->size != sizeof(struct sample_shm_data) ) {
+    __atomic_store_n( &seg->seq, 0, __ATOMIC_RELAXED );
+    memset( seg->data, 0, sizeof(seg->data) );
+    seg->version = SAMPLE_SHM_VERSION;
+    seg->size = sizeof(struct sample_shm_data);
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    memcpy( seg->magic, SAMPLE_SHM_MAGIC, 4 );
+  }
+
+  // the previous writer may have died during an update
+  seq = __atomic_load_n( &seg->seq, __ATOMIC_RELAXED );
+  if ( seq & 1 ) __atomic_store_n( &seg->seq, seq + 1, __ATOMIC_RELEASE );
+  seg->pid = getpid();
+  return shm;
+}
+
+void sample_shm_publish( struct sample_shm *shm,
+                         const struct sensehat_sample *s, __u64 timestamp ) {
+  struct shm_segment *seg = shm->seg;
+  union {
+    struct sample_shm_data d;
+    __u32 w[DATA_WORDS];
+  } u;
+  __u32 seq = __atomic_load_n( &seg->seq, __ATOMIC_RELAXED );
+
+  memset( &u, 0, sizeof(u) );
+  u.d.seq = seq / 2 + 1;
+  u.d.timestamp = timestamp;
+  u.d.realtime = clock_ns( CLOCK_REALTIME );
+  u.d.sample = *s;
+
+  __atomic_store_n( &seg->seq, seq + 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  for (size_t i = 0; i < DATA_WORDS; i++)
+    __atomic_store_n( &seg->data[i], u.w[i], __ATOMIC_RELAXED );
+  __atomic_store_n( &seg->seq, seq + 2, __ATOMIC_RELEASE );
+}
+
+struct sample_shm *sample_shm_attach( const char *name ) {
+  struct sample_shm *shm;
+  struct shm_segment *seg;
+
+  shm = map( name, 0 );
+  if ( shm == NULL ) return NULL;
+  seg = shm->seg;
+
+  if ( memcmp( seg->magic, SAMPLE_SHM_MAGIC, 4 ) != 0 ||
+       seg->version != SAMPLE_SHM_VERSION ||
+       seg->size != sizeof(struct sample_shm_data) ) {
+    sample_shm_close( shm, 0 );
+    errno = EPROTO;
+    return NULL;
+  }
+  return shm;
+}
+
+int sample_shm_read( struct sample_shm *shm, struct sample_shm_data *out ) {
+  struct shm_segment *seg = shm->seg;
+  union {
+    struct sample_shm_data d;
+    __u32 w[DATA_WORDS];
+  } u;
+  __u32 s1, s2;
+
+  for (int tries = 0; tries < SAMPLE_SHM_RETRIES; tries++) {
+    s1 = __atomic_load_n( &seg->seq, __ATOMIC_ACQUIRE );
+    if ( s1 & 1 ) {
+      cpu_relax();
+      continue;
+    }
+    if ( s1 == 0 ) {
+      errno = ENODATA;
+      return -1;
+    }
+    for (size_t i = 0; i < DATA_WORDS; i++)
+      u.w[i] = __atomic_load_n( &seg->data[i], __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    s2 = __atomic_load_n( &seg->seq, __ATOMIC_RELAXED );
+    if ( s1 == s2 ) {
+      *out = u.d;
+      return 0;
+    }
+    cpu_relax();
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+void sample_shm_close( struct sample_shm *shm, int unlink_segment ) {
+  if ( shm == NULL ) return;
+  munmap( shm->seg, sizeof(struct shm_segment) );
+  if ( shm->writer && unlink_segment ) shm_unlink( shm->name );
+  free( shm );
+}
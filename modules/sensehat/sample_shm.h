@@ -0,0 +1,61 @@
+/*
+ *  sample_shm.h
+ *    Latest sense-hat sample published in shared memory under a seqlock
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  One acquisition process owns the bus and publishes every sample into a
+ *  POSIX shared memory segment (/dev/shm/sensehat by default). Any number
+ *  of readers map the segment read-only and take consistent snapshots
+ *  without system calls or locks.
+ *
+ *  The writer makes the sequence number odd, stores the sample and makes
+ *  it even again. A reader copies the sample between two loads of the
+ *  sequence number and retries if they differ or the first was odd. Every
+ *  word of the sample is copied with an atomic access, so a torn copy is
+ *  only ever discarded, never acted on.
+ */
+#ifndef _SAMPLE_SHM_H_
+#define _SAMPLE_SHM_H_
+
+#include <asm/types.h>
+
+#include "sensehat.h"
+
+#define SAMPLE_SHM_NAME    "/sensehat"
+#define SAMPLE_SHM_VERSION 1
+
+/* Reader gives up with EAGAIN after this many torn copies in a row, which
+   only happens if the writer died half way through an update */
+#define SAMPLE_SHM_RETRIES 1000
+
+struct sample_shm_data {
+  __u64 seq;        // number of samples published, 1 for the first
+  __u64 timestamp;  // CLOCK_MONOTONIC ns when the sample was read
+  __u64 realtime;   // CLOCK_REALTIME ns at the same moment
+  struct sensehat_sample sample;  // includes the LPS25H and HTS221 status
+};
+
+struct sample_shm;
+
+/* Writer: create (or take over) the segment, NULL and errno on failure */
+struct sample_shm *sample_shm_create( const char *name );
+
+/* Writer: publish a sample read at timestamp (CLOCK_MONOTONIC ns) */
+void sample_shm_publish( struct sample_shm *shm,
+                         const struct sensehat_sample *s, __u64 timestamp );
+
+/* Reader: map an existing segment read-only, NULL and errno on failure */
+struct sample_shm *sample_shm_attach( const char *name );
+
+/* Reader: copy the latest sample. Returns 0, or -1 with ENODATA before the
+   first publication or EAGAIN if no consistent copy could be taken. */
+int sample_shm_read( struct sample_shm *shm, struct sample_shm_data *out );
+
+/* Writer and reader: unmap. The writer also removes the segment when
+   unlink_segment is set; readers already attached keep their mapping. */
+void sample_shm_close( struct sample_shm *shm, int unlink_segment );
+
+#endif /* _SAMPLE_SHM_H_ */
@@ -0,0 +1,217 @@
+/*
+ *  sched.c
+ *    Single-threaded periodic task scheduler on timerfd and epoll
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "clock.h"
+#include "sched.h"
+
+#define NEVER (~0ULL)
+
+struct watch {
+  int fd;
+  sched_fd_fn fn;
+  void *arg;
+};
+
+struct sched {
+  int epfd;
+  int tfd;
+  __u64 slack;
+  __u64 start;
+  __u64 armed;                    // expiry the timer is set to, or NEVER
+  __u64 fired;                    // earliest deadline of the last wakeup
+  int nfds;
+  __u64 next[SCHED_MAX_TASKS];    // next deadline of each task
+  struct watch fds[SCHED_MAX_FDS];
+  struct sched_stats stats;
+};
+
+/* Wake for the earliest deadline, deferred to the latest other deadline
+   that is still within the slack of it */
+static int arm( struct sched *s ) {
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  __u64 first = NEVER, wake;
+
+  for (int i = 0; i < s->stats.ntasks; i++)
+    if ( s->next[i] < first ) first = s->next[i];
+  wake = first;
+  for (int i = 0; i < s->stats.ntasks; i++)
+    if ( s->next[i] > wake && s->next[i] - first <= s->slack )
+      wake = s->next[i];
+
+  if ( wake == s->armed ) return 0;
+  if ( wake != NEVER ) {
+    its.it_value.tv_sec = wake / 1000000000ULL;
+    its.it_value.tv_nsec = wake % 1000000000ULL;
+  }
+  if ( timerfd_settime( s->tfd, TFD_TIMER_ABSTIME, &its, NULL ) == -1 )
+    return -1;
+  s->armed = wake;
+  return 0;
+}
+
+struct sched *sched_new( __u64 slack ) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  struct sched *s;
+  int err;
+
+  s = calloc( 1, sizeof(struct sched) );
+  if ( s == NULL ) return NULL;
+  s->slack = slack;
+  s->armed = NEVER;
+  s->tfd = -1;
+  s->epfd = epoll_create1( EPOLL_CLOEXEC );
+  if ( s->epfd == -1 ) goto fail;
+  s->tfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  if ( s->tfd == -1 ) goto fail;
+  // the timer is told apart from the watched fds by a NULL pointer
+  if ( epoll_ctl( s->epfd, EPOLL_CTL_ADD, s->tfd, &ev ) == -1 ) goto fail;
+  s->start = clock_ns( CLOCK_MONOTONIC );
+  return s;
+
+fail:
+  err = errno;
+  sched_free( s );
+  errno = err;
+  return NULL;
+}
+
+int sched_add( struct sched *s, __u64 period ) {
+  int id = s->stats.ntasks;
+
+  if ( period == 0 || id == SCHED_MAX_TASKS ) {
+    errno = period == 0 ? EINVAL : ENOSPC;
+    return -1;
+  }
+  s->next[id] = s->start + period;
+  s->stats.task[id].period = period;
+  s->stats.ntasks++;
+  if ( arm( s ) == -1 ) {
+    s->stats.ntasks--;
+    return -1;
+  }
+  return id;
+}
+
+int sched_set_period( struct sched *s, int id, __u64 period ) {
+  if ( period == 0 || id < 0 || id >= s->stats.ntasks ) {
+    errno = EINVAL;
+    return -1;
+  }
+  s->next[id] = clock_ns( CLOCK_MONOTONIC ) + period;
+  s->stats.task[id].period = period;
+  return arm( s );
+}
+
+int sched_add_fd( struct sched *s, int fd, __u32 events, sched_fd_fn fn,
+                  void *arg ) {
+  struct epoll_event ev = { .events = events };
+  struct watch *w;
+
+  if ( s->nfds == SCHED_MAX_FDS ) {
+    errno = ENOSPC;
+    return -1;
+  }
+  w = &s->fds[s->nfds];
+  w->fd = fd;
+  w->fn = fn;
+  w->arg = arg;
+  ev.data.ptr = w;
+  if ( epoll_ctl( s->epfd, EPOLL_CTL_ADD, fd, &ev ) == -1 ) return -1;
+  s->nfds++;
+  return 0;
+}
+
+/* Everything due by now runs, including deadlines that passed while the
+   wakeup was late */
+static int run_due( struct sched *s, __u64 now ) {
+  __u64 late = now - s->armed;
+  int mask = 0, n = 0;
+
+  s->fired = NEVER;
+  for (int i = 0; i < s->stats.ntasks; i++) {
+    struct sched_task_stats *t = &s->stats.task[i];
+    __u64 delay;
+
+    if ( s->next[i] > now ) continue;
+    delay = now - s->next[i];
+    if ( s->next[i] < s->fired ) s->fired = s->next[i];
+    t->runs++;
+    t->delay_sum += delay;
+    if ( delay > t->delay_max ) t->delay_max = delay;
+    if ( delay >= t->period ) {
+      // a whole period behind, realign rather than run in a burst
+      t->missed += delay / t->period;
+      s->next[i] += delay / t->period * t->period;
+    }
+    s->next[i] += t->period;
+    mask |= 1 << i;
+    n++;
+  }
+
+  s->stats.wakeups++;
+  if ( n > 1 ) s->stats.coalesced++;
+  s->stats.late_sum += late;
+  if ( late > s->stats.late_max ) s->stats.late_max = late;
+  return arm( s ) == -1 ? -1 : mask;
+}
+
+int sched_wait( struct sched *s ) {
+  struct epoll_event evs[SCHED_MAX_FDS + 1];
+  int n, polled = 0;
+  __u64 now, expirations;
+
+  for (;;) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( s->armed != NEVER && now >= s->armed ) return run_due( s, now );
+    if ( polled ) return 0;
+
+    n = epoll_wait( s->epfd, evs, SCHED_MAX_FDS + 1, -1 );
+    if ( n == -1 ) return -1;
+    for (int i = 0; i < n; i++) {
+      struct watch *w = evs[i].data.ptr;
+
+      if ( w == NULL ) {
+        // only clears the readiness, the expiry is checked against the clock
+        if ( read( s->tfd, &expirations, sizeof(expirations) ) == -1 &&
+             errno != EAGAIN )
+          return -1;
+        continue;
+      }
+      w->fn( w->arg, w->fd, evs[i].events );
+      polled = 1;
+    }
+  }
+}
+
+__u64 sched_fired( struct sched *s ) {
+  return s->fired;
+}
+
+double sched_wakeup_rate( const struct sched_stats *stats ) {
+  return stats->elapsed ? stats->wakeups * 1e9 / stats->elapsed : 0.0;
+}
+
+void sched_stats( struct sched *s, struct sched_stats *stats ) {
+  s->stats.elapsed = clock_ns( CLOCK_MONOTONIC ) - s->start;
+  memcpy( stats, &s->stats, sizeof(struct sched_stats) );
+}
+
+void sched_free( struct sched *s ) {
+  if ( s == NULL ) return;
+  if ( s->tfd != -1 ) close( s->tfd );
+  if ( s->epfd != -1 ) close( s->epfd );
+  free( s );
+}
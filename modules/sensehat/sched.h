@@ -0,0 +1,81 @@
+/*
+ *  sched.h
+ *    Single-threaded periodic task scheduler on timerfd and epoll
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Each task has its own period on a fixed CLOCK_MONOTONIC grid, all grids
+ *  starting at sched_new(). sched_wait() sleeps in epoll_wait() on a single
+ *  absolute timerfd until something is due and returns the set of due tasks
+ *  as a bit mask, so the caller can serve them together, e.g. reading both
+ *  sensors back to back in one wakeup.
+ *
+ *  Deadlines close together are coalesced: a deadline may be deferred by up
+ *  to the slack so that it shares a wakeup with the next one. A task is
+ *  never run early, so data-ready driven reads always find fresh output.
+ *  Without another deadline in reach the timer fires on time.
+ *
+ *  Other file descriptors can be added to the same epoll set. Their
+ *  callbacks run inside sched_wait(), which then returns 0 if no task is
+ *  due yet.
+ */
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <asm/types.h>
+
+#define SCHED_MAX_TASKS 8
+#define SCHED_MAX_FDS   8
+
+struct sched_task_stats {
+  __u64 period;          // ns
+  unsigned long runs;
+  unsigned long missed;  // periods skipped after falling a whole period behind
+  __u64 delay_sum;       // ns from deadline to wakeup, summed over runs
+  __u64 delay_max;
+};
+
+struct sched_stats {
+  __u64 elapsed;            // ns since sched_new()
+  unsigned long wakeups;    // timer expirations that ran tasks
+  unsigned long coalesced;  // of those, wakeups that ran more than one task
+  __u64 late_sum;           // ns from the armed expiry to wakeup, summed
+  __u64 late_max;
+  int ntasks;
+  struct sched_task_stats task[SCHED_MAX_TASKS];
+};
+
+typedef void (*sched_fd_fn)( void *arg, int fd, __u32 events );
+
+struct sched;
+
+/* slack is the most a deadline may be deferred to share a wakeup, in ns */
+struct sched *sched_new( __u64 slack );
+
+/* Add a task running every period ns. Returns its id, a bit number in the
+   mask returned by sched_wait(), or -1 and errno. */
+int sched_add( struct sched *s, __u64 period );
+
+/* Change the period of a task. Its grid restarts one new period from now. */
+int sched_set_period( struct sched *s, int id, __u64 period );
+
+/* Watch fd for the epoll events, fn is called from sched_wait() */
+int sched_add_fd( struct sched *s, int fd, __u32 events, sched_fd_fn fn,
+                  void *arg );
+
+/* Sleep until tasks are due and return their mask. Returns 0 when only
+   file descriptor callbacks ran, -1 and errno (EINTR on a signal). */
+int sched_wait( struct sched *s );
+
+/* Earliest deadline served by the last wakeup, CLOCK_MONOTONIC ns */
+__u64 sched_fired( struct sched *s );
+
+/* Wakeups per second over the elapsed time */
+double sched_wakeup_rate( const struct sched_stats *stats );
+
+void sched_stats( struct sched *s, struct sched_stats *stats );
+void sched_free( struct sched *s );
+
+#endif /* _SCHED_H_ */
@@ -0,0 +1,259 @@
+/*
+ *  sensehat.c
+ *    Driver for the LPS25H pressure and HTS221 humidity/temperature sensors
+ *    on the Raspberry Pi sense-hat
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Configuration follows the usage in RTIMULibDrive11, see the comments in
+ *  tests/sensehat_sensor_test.c for the history of these settings.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "HTS221.h"   // HTS221 relative humidity and temperature sensor
+#include "LPS25H.h"   // LPS25H MEMS 260-1260 hPa pressure sensor
+#include "calib_cache.h"
+#include "metrics.h"
+#include "sensehat.h"
+
+struct sensehat {
+  struct i2c_bus *bus;
+  struct sensehat_image img;
+  struct hts221_calib cal;
+  __u8 cal_raw[HTS221_CAL_SIZE];
+  char *cache_dir;
+};
+
+const struct sensehat_image sensehat_default_image = SENSEHAT_IMAGE( 3, 3, 3,
+                                                                     3, 3 );
+
+int sensehat_image_build( struct sensehat_image *img,
+                          const struct sensehat_config *cfg ) {
+  if ( cfg->lps25h_odr < 0 || cfg->lps25h_odr > LPS25H_ODR_MAX ||
+       cfg->lps25h_avgp < 0 || cfg->lps25h_avgp > LPS25H_AVGP_MAX ||
+       cfg->hts221_odr < 0 || cfg->hts221_odr > HTS221_ODR_MAX ||
+       cfg->hts221_avgt < 0 || cfg->hts221_avgt > HTS221_AVGT_MAX ||
+       cfg->hts221_avgh < 0 || cfg->hts221_avgh > HTS221_AVGH_MAX ) {
+    errno = EINVAL;
+    return -1;
+  }
+  *img = (struct sensehat_image) SENSEHAT_IMAGE_( FIELD_ASIS,
+    cfg->lps25h_odr, cfg->lps25h_avgp, cfg->hts221_odr, cfg->hts221_avgt,
+    cfg->hts221_avgh );
+  return 0;
+}
+
+static void cache_key( struct sensehat *sh, char key[CALIB_CACHE_KEYLEN] ) {
+  snprintf( key, CALIB_CACHE_KEYLEN, "%s-%02x", sh->bus->name, HTS221_SAD );
+}
+
+/* WHO_AM_I is register 0x0f on both devices */
+static int probe( struct sensehat *sh ) {
+  __u8 lps_id, hts_id;
+
+  if ( i2c_bus_read( sh->bus, LPS25H_SAD, LPS25H_WHO_AM_I, &lps_id, 1 ) == -1 ||
+       i2c_bus_read( sh->bus, HTS221_SAD, HTS221_WHO_AM_I, &hts_id, 1 ) == -1 )
+    return -1;
+  if ( lps_id != LPS25H_who_am_i || hts_id != HTS221_who_am_i ) {
+    metrics_count( METRICS_WHO_AM_I, 1 );
+    errno = ENODEV;
+    return -1;
+  }
+  return 0;
+}
+
+/* The calibration block in a transaction of its own, see i2c_bus.h */
+static int read_calib( struct sensehat *sh, __u8 *cal ) {
+  return i2c_bus_read( sh->bus, HTS221_SAD, HTS221_CAL_H0_rH_x2 |
+                       HTS221_reg_auto, cal, HTS221_CAL_SIZE );
+}
+
+/* Upload the whole image as one transaction. The LPS25H is powered up by
+   the last message addressed to it so that RES_CONF and FIFO_CTRL are in
+   place before the first conversion starts. */
+static int upload( struct sensehat *sh ) {
+  struct sensehat_image *img = &sh->img;
+  struct i2c_msg msgs[5] = {
+    { LPS25H_SAD, 0, sizeof(img->lps25h_res_conf), img->lps25h_res_conf },
+    { LPS25H_SAD, 0, sizeof(img->lps25h_fifo_ctrl), img->lps25h_fifo_ctrl },
+    { LPS25H_SAD, 0, sizeof(img->lps25h_ctrl), img->lps25h_ctrl },
+    { HTS221_SAD, 0, sizeof(img->hts221_av_conf), img->hts221_av_conf },
+    { HTS221_SAD, 0, sizeof(img->hts221_ctrl), img->hts221_ctrl },
+  };
+
+  return i2c_bus_transfer( sh->bus, msgs, 5 ) == -1 ? -1 : 0;
+}
+
+int sensehat_set_image( struct sensehat *sh,
+                        const struct sensehat_image *img ) {
+  struct sensehat_image prev = sh->img;
+
+  sh->img = *img;
+  if ( upload( sh ) == -1 ) {
+    sh->img = prev;
+    return -1;
+  }
+  return 0;
+}
+
+/* Fold the calibration registers into conversion coefficients once, see
+   datasheet tables 19 and 20 */
+static int load_calibration( struct sensehat *sh ) {
+  if ( hts221_calib_init( &sh->cal, sh->cal_raw ) == -1 ) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+struct sensehat *sensehat_open_image( struct i2c_bus *bus,
+                                      const struct sensehat_image *img,
+                                      const char *cache_dir ) {
+  char key[CALIB_CACHE_KEYLEN];
+  struct sensehat *sh;
+  int cached = 0, err;
+
+  sh = calloc( 1, sizeof(struct sensehat) );
+  if ( sh == NULL ) return NULL;
+  sh->bus = bus;
+  sh->img = *img;
+
+  if ( cache_dir != NULL ) {
+    sh->cache_dir = strdup( cache_dir );
+    if ( sh->cache_dir == NULL ) goto fail;
+    cache_key( sh, key );
+    cached = calib_cache_load( cache_dir, key, sh->cal_raw ) == 0;
+  }
+
+  if ( probe( sh ) == -1 ||
+       (!cached && read_calib( sh, sh->cal_raw ) == -1) ||
+       upload( sh ) == -1 || load_calibration( sh ) == -1 )
+    goto fail;
+  // a failed store only costs the next start one more read
+  if ( !cached && sh->cache_dir != NULL )
+    calib_cache_store( sh->cache_dir, key, sh->cal_raw );
+  return sh;
+
+fail:
+  err = errno;
+  free( sh->cache_dir );
+  free( sh );
+  errno = err;
+  return NULL;
+}
+
+struct sensehat *sensehat_open( struct i2c_bus *bus,
+                                const struct sensehat_config *cfg ) {
+  struct sensehat_image img;
+
+  if ( cfg == NULL ) return sensehat_open_image( bus, &sensehat_default_image,
+                                                 NULL );
+  if ( sensehat_image_build( &img, cfg ) == -1 ) return NULL;
+  return sensehat_open_image( bus, &img, NULL );
+}
+
+int sensehat_refresh_calib( struct sensehat *sh ) {
+  char key[CALIB_CACHE_KEYLEN];
+  __u8 cal[HTS221_CAL_SIZE];
+
+  if ( read_calib( sh, cal ) == -1 ) return -1;
+  if ( memcmp( cal, sh->cal_raw, HTS221_CAL_SIZE ) == 0 ) return 0;
+
+  memcpy( sh->cal_raw, cal, HTS221_CAL_SIZE );
+  if ( load_calibration( sh ) == -1 ) return -1;
+  if ( sh->cache_dir != NULL ) {
+    cache_key( sh, key );
+    calib_cache_store( sh->cache_dir, key, sh->cal_raw );
+  }
+  return 1;
+}
+
+static void convert_pressure( struct sensehat_sample *s, const __u8 *buf ) {
+  s->lps25h_status = buf[0];
+  s->p_raw = (__s32) (((__u32) buf[3] << 24) | ((__u32) buf[2] << 16) |
+                      ((__u32) buf[1] << 8)) >> 8;
+  s->pressure = (float) s->p_raw * (1.0f / 4096.0f);
+}
+
+static void convert_humidity( struct sensehat *sh, struct sensehat_sample *s,
+                              const __u8 *buf ) {
+  s->hts221_status = buf[0];
+  s->h_raw = (__s16) (buf[1] | (buf[2] << 8));
+  s->t_raw = (__s16) (buf[3] | (buf[4] << 8));
+  s->temperature = hts221_temperature_mdegc( &sh->cal, s->t_raw ) * 0.001f;
+  s->humidity = hts221_humidity_mrh( &sh->cal, s->h_raw ) * 0.001f;
+}
+
+/* STATUS_REG directly precedes the output registers on both devices so one
+   auto-increment read fetches status and data together:
+   LPS25H 0x27..0x2a  status, PRESS_OUT (3)
+   HTS221 0x27..0x2b  status, HUMIDITY_OUT (2), TEMP_OUT (2) */
+int sensehat_sample( struct sensehat *sh, struct sensehat_sample *s ) {
+  if ( sensehat_sample_pressure( sh, s ) == -1 ||
+       sensehat_sample_humidity( sh, s ) == -1 )
+    return -1;
+  return 0;
+}
+
+int sensehat_sample_pressure( struct sensehat *sh, struct sensehat_sample *s ) {
+  __u8 buf[4];
+
+  if ( i2c_bus_read( sh->bus, LPS25H_SAD,
+                     LPS25H_STATUS_REG | LPS25H_reg_auto, buf, 4 ) == -1 )
+    return -1;
+  convert_pressure( s, buf );
+  return 0;
+}
+
+int sensehat_sample_humidity( struct sensehat *sh, struct sensehat_sample *s ) {
+  __u8 buf[5];
+
+  if ( i2c_bus_read( sh->bus, HTS221_SAD,
+                     HTS221_STATUS_REG | HTS221_reg_auto, buf, 5 ) == -1 )
+    return -1;
+  convert_humidity( sh, s, buf );
+  return 0;
+}
+
+/* LPS25H table 18: one-shot, 1, 7, 12.5 and 25 Hz
+   HTS221 table 15: one-shot, 1, 7 and 12.5 Hz */
+__u64 sensehat_lps25h_period_ns( int odr ) {
+  static const __u64 period[] = {
+    0, 1000000000ULL, 142857143ULL, 80000000ULL, 40000000ULL
+  };
+
+  if ( odr < 0 || odr > 4 ) return 0;
+  return period[odr];
+}
+
+__u64 sensehat_hts221_period_ns( int odr ) {
+  if ( odr < 0 || odr > 3 ) return 0;
+  return sensehat_lps25h_period_ns( odr );
+}
+
+const struct sensehat_config *sensehat_config( struct sensehat *sh ) {
+  return &sh->img.cfg;
+}
+
+const struct sensehat_image *sensehat_image( struct sensehat *sh ) {
+  return &sh->img;
+}
+
+const struct hts221_calib *sensehat_calib( struct sensehat *sh ) {
+  return &sh->cal;
+}
+
+struct i2c_bus *sensehat_bus( struct sensehat *sh ) {
+  return sh->bus;
+}
+
+void sensehat_close( struct sensehat *sh ) {
+  if ( sh == NULL ) return;
+  free( sh->cache_dir );
+  free( sh );
+}
@@ -0,0 +1,78 @@
+/*
+ *  sensehat.h
+ *    Driver for the LPS25H pressure and HTS221 humidity/temperature sensors
+ *    on the Raspberry Pi sense-hat
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Every multi-register read is issued as one combined transaction on the
+ *  bus, a pointer write and an auto-increment read, so a full sample of
+ *  both devices is one transaction for each. Errors are reported as -1 (or
+ *  NULL) with errno set.
+ */
+#ifndef _SENSEHAT_H_
+#define _SENSEHAT_H_
+
+#include <asm/types.h>
+
+#include "i2c_bus.h"
+#include "convert.h"
+#include "sensehat_image.h"
+
+struct sensehat_sample {
+  __s32 p_raw;        // LPS25H PRESS_OUT
+  __s16 h_raw;        // HTS221 HUMIDITY_OUT
+  __s16 t_raw;        // HTS221 TEMP_OUT
+  __u8 lps25h_status;
+  __u8 hts221_status;
+  float pressure;     // mbar
+  float temperature;  // deg C
+  float humidity;     // rH
+};
+
+struct sensehat;
+
+/* Probe both devices, configure them and read the HTS221 calibration.
+   cfg may be NULL for the defaults. The bus is not owned by the handle. */
+struct sensehat *sensehat_open( struct i2c_bus *bus,
+                                const struct sensehat_config *cfg );
+
+/* Start up with a prebuilt image: probe both devices, then upload the
+   image. With a cache_dir the HTS221 calibration comes from the cache when
+   present and is stored there after a chip read; without one it costs a
+   transaction of its own. */
+struct sensehat *sensehat_open_image( struct i2c_bus *bus,
+                                      const struct sensehat_image *img,
+                                      const char *cache_dir );
+
+/* Re-read the calibration from the chip, e.g. once the first samples are
+   out, and update the cache if it was stale. Returns 1 if the calibration
+   changed, 0 if the cached one was right, -1 on error. */
+int sensehat_refresh_calib( struct sensehat *sh );
+
+/* Upload another image, or the current one again to return to continuous
+   mode, in one transaction. The calibration is kept. */
+int sensehat_set_image( struct sensehat *sh, const struct sensehat_image *img );
+
+/* Status, pressure, humidity and temperature in one transaction per
+   device */
+int sensehat_sample( struct sensehat *sh, struct sensehat_sample *s );
+
+/* Only the LPS25H (status and pressure) or only the HTS221 fields */
+int sensehat_sample_pressure( struct sensehat *sh, struct sensehat_sample *s );
+int sensehat_sample_humidity( struct sensehat *sh, struct sensehat_sample *s );
+
+/* Output data rate period in nanoseconds for an ODR field value, 0 for the
+   one-shot setting or an invalid value */
+__u64 sensehat_lps25h_period_ns( int odr );
+__u64 sensehat_hts221_period_ns( int odr );
+
+struct i2c_bus *sensehat_bus( struct sensehat *sh );
+const struct hts221_calib *sensehat_calib( struct sensehat *sh );
+const struct sensehat_config *sensehat_config( struct sensehat *sh );
+const struct sensehat_image *sensehat_image( struct sensehat *sh );
+void sensehat_close( struct sensehat *sh );
+
+#endif /* _SENSEHAT_H_ */
@@ -0,0 +1,106 @@
+/*
+ *  sensehat_image.h
+ *    Register images for configuring the LPS25H and HTS221
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  An image holds every register value the driver programs, laid out as
+ *  ready-made i2c write messages (register address first). The registers
+ *  written are the LPS25H RES_CONF, CTRL_REG1 and CTRL_REG2 (one
+ *  auto-increment burst) and FIFO_CTRL, and the HTS221 AV_CONF and
+ *  CTRL_REG1. The whole image is uploaded in a single transaction.
+ *
+ *  SENSEHAT_IMAGE() builds an image at compile time. Unlike the _if()
+ *  macros in LPS25H.h and HTS221.h it range checks every field, so
+ *    static const struct sensehat_image img = SENSEHAT_IMAGE( 5, 3, 3, 3, 3 );
+ *  does not compile (the LPS25H has no ODR setting 5). sensehat_image_build()
+ *  builds the same image from a runtime sensehat_config.
+ */
+#ifndef _SENSEHAT_IMAGE_H_
+#define _SENSEHAT_IMAGE_H_
+
+#include <asm/types.h>
+
+#include "HTS221.h"
+#include "LPS25H.h"
+
+/* Averaging mode and output rate settings, see LPS25H.h and HTS221.h.
+   internal averaging numbers             for mode = 0,  1,   2,   3
+   lps25h_avgp  pressure averaging number            8, 32, 128, 512
+                                   for mode = 0, 1,  2,  3,  4,   5,   6,   7
+   hts221_avgh  humidity averaging number     4, 8, 16, 32, 64, 128, 256, 512
+   hts221_avgt  temperature averaging number  2, 4,  8, 16, 32,  64, 128, 256
+*/
+struct sensehat_config {
+  int lps25h_odr;
+  int lps25h_avgp;
+  int hts221_odr;
+  int hts221_avgt;
+  int hts221_avgh;
+};
+
+#define SENSEHAT_CONFIG_DEFAULT { 3, 3, 3, 3, 3 }
+
+/* Largest valid value of each field */
+#define LPS25H_ODR_MAX   4  // table 18: one-shot, 1, 7, 12.5, 25 Hz
+#define LPS25H_AVGP_MAX  3
+#define HTS221_ODR_MAX   3  // table 15: one-shot, 1, 7, 12.5 Hz
+#define HTS221_AVGT_MAX  7
+#define HTS221_AVGH_MAX  7
+
+struct sensehat_image {
+  struct sensehat_config cfg;
+  __u8 lps25h_res_conf[2];   // RES_CONF
+  __u8 lps25h_ctrl[3];       // CTRL_REG1 | reg_auto, CTRL_REG1, CTRL_REG2
+  __u8 lps25h_fifo_ctrl[2];  // FIFO_CTRL
+  __u8 hts221_av_conf[2];    // AV_CONF
+  __u8 hts221_ctrl[2];       // CTRL_REG1
+};
+
+/* Evaluates to v if 0 <= v <= max, otherwise stops the build with a
+   negative bit-field width. v and max must be constant expressions. */
+#define FIELD_CHECK(v, max) \
+  ((__u8) ((v) + 0 * sizeof(struct { \
+    int field_out_of_range : ((v) >= 0 && (v) <= (max)) ? 1 : -1; })))
+#define FIELD_ASIS(v, max) ((__u8) (v))
+
+/* Settings follow usage in RTIMULibDrive11: both devices powered up with
+   block data update, the LPS25H FIFO enabled in running average mode of
+   2 samples and the LPS25H temperature averaging left at 8 */
+#define SENSEHAT_IMAGE_(CHK, lps_odr, lps_avgp, hts_odr, hts_avgt, hts_avgh) { \
+  .cfg = { (lps_odr), (lps_avgp), (hts_odr), (hts_avgt), (hts_avgh) }, \
+  .lps25h_res_conf = { LPS25H_RES_CONF, \
+    LPS25H_AV_CONF_AVGP_if( CHK( lps_avgp, LPS25H_AVGP_MAX ) ) }, \
+  .lps25h_ctrl = { LPS25H_CTRL_REG1 | LPS25H_reg_auto, \
+    LPS25H_CTRL_REG1_PD_if(1) | \
+    LPS25H_CTRL_REG1_ODR_if( CHK( lps_odr, LPS25H_ODR_MAX ) ) | \
+    LPS25H_CTRL_REG1_DIFF_EN_if(0) | LPS25H_CTRL_REG1_BDU_if(1) | \
+    LPS25H_CTRL_REG1_RESET_AZ_if(0) | LPS25H_CTRL_REG1_SIM_if(0), \
+    LPS25H_CTRL_REG2_BOOT_if(0) | LPS25H_CTRL_REG2_FIFO_EN_if(1) | \
+    LPS25H_CTRL_REG2_WTM_EN_if(0) | LPS25H_CTRL_REG2_FIFO_MEAN_DEC_if(0) | \
+    LPS25H_CTRL_REG2_SWRESET_if(0) | LPS25H_CTRL_REG2_AUTO_ZERO_if(0) | \
+    LPS25H_CTRL_REG2_ONE_SHOT_if(0) }, \
+  .lps25h_fifo_ctrl = { LPS25H_FIFO_CTRL, \
+    LPS25H_FIFO_CTRL_F_MODE_if(6) | LPS25H_FIFO_CTRL_WTM_POINT_if(1) }, \
+  .hts221_av_conf = { HTS221_AV_CONF, \
+    HTS221_AV_CONF_AVGT_if( CHK( hts_avgt, HTS221_AVGT_MAX ) ) | \
+    HTS221_AV_CONF_AVGH_if( CHK( hts_avgh, HTS221_AVGH_MAX ) ) }, \
+  .hts221_ctrl = { HTS221_CTRL_REG1, \
+    HTS221_CTRL_REG1_PD_if(1) | HTS221_CTRL_REG1_BDU_if(1) | \
+    HTS221_CTRL_REG1_ODR_if( CHK( hts_odr, HTS221_ODR_MAX ) ) }, \
+}
+
+#define SENSEHAT_IMAGE( lps_odr, lps_avgp, hts_odr, hts_avgt, hts_avgh ) \
+  SENSEHAT_IMAGE_( FIELD_CHECK, lps_odr, lps_avgp, hts_odr, hts_avgt, \
+                   hts_avgh )
+
+/* The image for SENSEHAT_CONFIG_DEFAULT */
+extern const struct sensehat_image sensehat_default_image;
+
+/* Runtime equivalent of SENSEHAT_IMAGE(), -1 and EINVAL for a bad field */
+int sensehat_image_build( struct sensehat_image *img,
+                          const struct sensehat_config *cfg );
+
+#endif /* _SENSEHAT_IMAGE_H_ */
@@ -0,0 +1,599 @@
+/*
+ *  sensehatd.c
+ *    Acquisition daemon: owns the i2c bus and publishes every sample of the
+ *    sense-hat into shared memory, see sample_shm.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: sensehatd [-s | -b socket | -r trace] [-w trace] [-n shm name]
+ *                   [-c calibration cache dir] [-d history dir]
+ *                   [-a demand file] [-u host:port] [-e events file]
+ *    -s  run against the simulated sense-hat instead of DEVPATH_I2C
+ *    -b  go through the bus-owner daemon i2cd listening at socket, as a
+ *        high priority client
+ *    -r  replay the bus traffic in trace as it was recorded and exit at its
+ *        end, see i2c_trace.h
+ *    -w  record the bus traffic to trace
+ *
+ *  The LPS25H and the HTS221 are read at the rates of their own ODR
+ *  settings. When both are due within a quarter of the shorter period they
+ *  share one wakeup and are read back to back. Wakeups per second and the
+ *  scheduling delay are printed on exit.
+ *    -d  also append every sample to the time-series store in dir, and the
+ *        finished 1 min, 1 h and 1 day rollups to dir/rollups as raw
+ *        struct rollup_bucket records. The open buckets are written out on
+ *        exit too, so after a restart records with the same level and
+ *        start are parts of one bucket and merge like rollup levels do.
+ *        The samples are written on a thread of their own, in batches of a
+ *        sample pool the size of a write of the store, so no second level
+ *        of buffering, see ts_writer.h; while the SD card stalls for longer
+ *        than the pool lasts they are dropped from the store, not from the
+ *        rollups, and counted on exit.
+ *    -a  adapt the averaging and output data rates at runtime, see adapt.h.
+ *        The file holds the latency consumers need from the pressure and
+ *        the humidity readings, "pressure_ms humidity_ms", 0 for the
+ *        default. It is checked once a second and re-read when it changes;
+ *        without it the defaults apply. Every change is logged to stderr.
+ *    -u  also send every sample to linkd on the master at host:port, in
+ *        frames of up to a second of samples, see sample_link.h. While the
+ *        master is unreachable the samples queue up and a new connection
+ *        is tried once a second.
+ *    -e  watch the readings for weather events, see weather.h, and append
+ *        a line to the file for every one that starts or ends:
+ *        "seconds.ns channel rise|fall start|end rate/h value", the time
+ *        as CLOCK_REALTIME.
+ *
+ *  Everything is allocated at startup. Built with -DALLOC_CHECK, see
+ *  alloc_count.h, any heap allocation after it aborts, once the cached
+ *  calibration is checked and the master looked up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "LPS25H.h"
+#include "clock.h"
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "i2c_server.h"
+#include "i2c_trace.h"
+#include "calib_cache.h"
+#include "sample_shm.h"
+#include "ts_store.h"
+#include "rollup.h"
+#include "sched.h"
+#include "metrics.h"
+#include "adapt.h"
+#include "sample_link.h"
+#include "weather.h"
+#include "sample_pool.h"
+#include "ts_writer.h"
+#include "alloc_count.h"
+#include "sensehat.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal( int sig ) {
+  running = 0;
+}
+
+/* The 1 s buckets are left to the rolling ranges, they would outgrow the
+   raw history */
+static void on_bucket( void *arg, const struct rollup_bucket *b ) {
+  int fd = *(int *) arg;
+
+  if ( b->level == ROLLUP_1S ) return;
+  if ( write( fd, b, sizeof(*b) ) != sizeof(*b) ) perror( "rollups" );
+}
+
+/* The store is written on the thread of the writer, the rollups here */
+struct history {
+  struct ts_store *store;
+  struct ts_writer *writer;
+  struct sample_pool *pool;
+  struct sample_batch *batch;  // being filled
+  struct rollup *rollup;
+  int rollup_fd;
+  unsigned long dropped;       // samples there was no batch for
+};
+
+static void record( struct history *h, const struct sensehat_sample *s ) {
+  float v[ROLLUP_CHANNELS] = {
+    [ROLLUP_PRESSURE] = s->pressure,
+    [ROLLUP_TEMPERATURE] = s->temperature,
+    [ROLLUP_HUMIDITY] = s->humidity,
+  };
+  __u64 now = clock_ns( CLOCK_REALTIME );
+
+  if ( h->batch == NULL ) h->batch = sample_batch_get( h->pool );
+  if ( h->batch == NULL ) {
+    // the writer is as far behind as the pool is deep
+    h->dropped++;
+  } else {
+    h->batch->rec[h->batch->count++] = (struct sample_link_rec) { now, *s };
+    if ( h->batch->count == h->batch->size &&
+         ts_writer_hand( h->writer, &h->batch ) == -1 )
+      perror( "ts_writer_hand" );
+  }
+  rollup_add( h->rollup, now, v );
+}
+
+static void report_history( struct history *h ) {
+  struct ts_writer_stats ws;
+  struct sample_pool_stats ps;
+  struct ts_store_stats ss;
+
+  ts_writer_stats( h->writer, &ws );
+  sample_pool_stats( h->pool, &ps );
+  // the writer is stopped, the store is the main thread's again
+  ts_store_stats( h->store, &ss );
+  fprintf( stderr, "history: %lu records in %lu batches, %lu errors, most "
+           "%lu of %lu batches out, %lu dropped, %lu clock steps back\n",
+           ws.records, ws.batches, ws.errors, ps.most_out, ps.batches,
+           h->dropped, ss.steps );
+}
+
+/* One write per event, without the buffer a FILE would allocate */
+static void on_weather( void *arg, const struct weather_event *ev ) {
+  int fd = *(int *) arg;
+  char line[128];
+  int n;
+
+  n = snprintf( line, sizeof(line), "%llu.%09llu %s %s %s %.3f %.3f\n",
+                (unsigned long long) ev->timestamp / 1000000000ULL,
+                (unsigned long long) ev->timestamp % 1000000000ULL,
+                weather_names[ev->channel],
+                ev->kind == WEATHER_RISE ? "rise" : "fall",
+                ev->start ? "start" : "end", ev->rate, ev->value );
+  if ( write( fd, line, n ) != n ) perror( "events" );
+}
+
+/* The channels of the sensors that had new readings */
+static void detect( struct weather *w, const struct sensehat_sample *s,
+                    int fresh ) {
+  float v[WEATHER_CHANNELS] = {
+    [WEATHER_PRESSURE] = s->pressure,
+    [WEATHER_TEMPERATURE] = s->temperature,
+    [WEATHER_HUMIDITY] = s->humidity,
+  };
+  int mask = 0;
+
+  if ( fresh & (1 << ADAPT_LPS25H) ) mask |= 1 << WEATHER_PRESSURE;
+  if ( fresh & (1 << ADAPT_HTS221) )
+    mask |= 1 << WEATHER_TEMPERATURE | 1 << WEATHER_HUMIDITY;
+  weather_add( w, clock_ns( CLOCK_REALTIME ), v, mask );
+}
+
+/* Pass the demands on when the file changed since the last look */
+static void read_demand( struct adapt *adapt, const char *path,
+                         struct timespec *mtime ) {
+  unsigned long p_ms, h_ms;
+  struct stat st;
+  char buf[64];
+  ssize_t n;
+  int fd;
+
+  if ( stat( path, &st ) == -1 ) return;
+  if ( st.st_mtim.tv_sec == mtime->tv_sec &&
+       st.st_mtim.tv_nsec == mtime->tv_nsec )
+    return;
+  *mtime = st.st_mtim;
+  // read without stdio, whose FILE would be allocated on every change
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) {
+    perror( path );
+    return;
+  }
+  n = read( fd, buf, sizeof(buf) - 1 );
+  close( fd );
+  buf[n > 0 ? n : 0] = '\0';
+  if ( sscanf( buf, "%lu %lu", &p_ms, &h_ms ) == 2 ) {
+    adapt_demand( adapt, ADAPT_LPS25H, p_ms * 1000000ULL );
+    adapt_demand( adapt, ADAPT_HTS221, h_ms * 1000000ULL );
+  } else {
+    fprintf( stderr, "%s: expected \"pressure_ms humidity_ms\"\n", path );
+  }
+}
+
+static void report_adapt( struct adapt *adapt ) {
+  struct adapt_report r;
+
+  adapt_report( adapt, &r );
+  fprintf( stderr, "adapt: lps25h odr %d avgp %d, hts221 odr %d avgt %d "
+           "avgh %d, noise %.4f mbar %.4f degC %.3f rH, latency %llu/%llu "
+           "ms, %.1f uA%s%s%s\n", r.cfg.lps25h_odr, r.cfg.lps25h_avgp,
+           r.cfg.hts221_odr, r.cfg.hts221_avgt, r.cfg.hts221_avgh,
+           r.noise[ADAPT_PRESSURE], r.noise[ADAPT_TEMPERATURE],
+           r.noise[ADAPT_HUMIDITY],
+           (unsigned long long) r.latency[ADAPT_LPS25H] / 1000000,
+           (unsigned long long) r.latency[ADAPT_HTS221] / 1000000, r.current,
+           r.over & ADAPT_OVER_LATENCY ? ", over latency" : "",
+           r.over & ADAPT_OVER_NOISE ? ", over noise" : "",
+           r.over & ADAPT_OVER_CURRENT ? ", over current" : "" );
+}
+
+/* Periods of the current settings, a device in one-shot mode is polled
+   once a second */
+static void periods( struct sensehat *sh, __u64 *lps, __u64 *hts ) {
+  *lps = sensehat_lps25h_period_ns( sensehat_config( sh )->lps25h_odr );
+  *hts = sensehat_hts221_period_ns( sensehat_config( sh )->hts221_odr );
+  if ( *lps == 0 ) *lps = 1000000000ULL;
+  if ( *hts == 0 ) *hts = 1000000000ULL;
+}
+
+static void report_trace( struct i2c_bus *bus ) {
+  struct i2c_trace_stats st;
+
+  i2c_trace_stats( bus, &st );
+  fprintf( stderr, "trace: %lu records, %lu lost, %lu skipped, %lu "
+           "unmatched, behind max %llu us\n", st.records, st.lost,
+           st.skipped, st.unmatched,
+           (unsigned long long) st.behind_max / 1000 );
+}
+
+/* The master at host:port. Looking it up allocates, so that is done until
+   it succeeds once, and the address kept for every connection after. */
+struct master {
+  const char *spec;
+  struct sockaddr_storage addr;
+  socklen_t len;  // 0 until looked up
+  int family;
+};
+
+static int master_lookup( struct master *m ) {
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+  char host[256];
+  const char *port;
+  int rc;
+
+  port = strrchr( m->spec, ':' );
+  if ( port == NULL || port - m->spec >= (long) sizeof(host) ) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy( host, m->spec, port - m->spec );
+  host[port - m->spec] = '\0';
+  rc = getaddrinfo( host, port + 1, &hints, &res );
+  if ( rc != 0 ) {
+    errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    return -1;
+  }
+  memcpy( &m->addr, res->ai_addr, res->ai_addrlen );
+  m->len = res->ai_addrlen;
+  m->family = res->ai_family;
+  freeaddrinfo( res );
+  return 0;
+}
+
+/* Start a connection to the master without waiting for it, the first send
+   finds out whether it worked */
+static int uplink_connect( struct master *m ) {
+  int fd, rc;
+
+  if ( m->len == 0 && master_lookup( m ) == -1 ) return -1;
+  fd = socket( m->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if ( fd != -1 && connect( fd, (struct sockaddr *) &m->addr, m->len ) == -1 &&
+       errno != EINPROGRESS ) {
+    rc = errno;
+    close( fd );
+    errno = rc;
+    fd = -1;
+  }
+  return fd;
+}
+
+/* Queue the sample and send what is due, connecting again if need be */
+static void uplink( struct sample_link *link, struct master *m, int *fd,
+                    __u64 *retry, const struct sensehat_sample *s,
+                    __u64 now ) {
+  struct sample_link_rec rec = { clock_ns( CLOCK_REALTIME ), *s };
+
+  sample_link_push( link, &rec, now );
+  if ( *fd == -1 && now >= *retry ) {
+    *retry = now + 1000000000ULL;
+    *fd = uplink_connect( m );
+    sample_link_attach( link, *fd );
+  }
+  if ( *fd != -1 && sample_link_send( link, now ) == -1 ) {
+    perror( m->spec );
+    close( *fd );
+    *fd = -1;
+  }
+}
+
+static void report_link( struct sample_link *link ) {
+  struct sample_link_stats st;
+
+  sample_link_stats( link, &st );
+  fprintf( stderr, "link: %lu records in %lu frames, %lu sends, %lu "
+           "blocked, %lu dropped, %lu refused, %lu failures\n", st.records,
+           st.frames, st.sends, st.blocked, st.dropped, st.refused,
+           st.failures );
+}
+
+static void report( struct sched *sched ) {
+  static const char *names[] = { "lps25h", "hts221" };
+  struct sched_stats st;
+
+  sched_stats( sched, &st );
+  fprintf( stderr, "%.2f wakeups/s, %lu coalesced, late mean %.0f max %llu "
+           "us\n", sched_wakeup_rate( &st ), st.coalesced,
+           st.wakeups ? st.late_sum / 1e3 / st.wakeups : 0.0,
+           (unsigned long long) st.late_max / 1000 );
+  for (int i = 0; i < st.ntasks; i++)
+    fprintf( stderr, "%s: %lu runs, %lu missed, delay mean %.0f max %llu "
+             "us\n", names[i], st.task[i].runs, st.task[i].missed,
+             st.task[i].runs ? st.task[i].delay_sum / 1e3 / st.task[i].runs :
+             0.0, (unsigned long long) st.task[i].delay_max / 1000 );
+}
+
+int main( int argc, char **argv ) {
+  const char *name = SAMPLE_SHM_NAME;
+  const char *cache_dir = CALIB_CACHE_DIR;
+  const char *history = NULL;
+  const char *demand = NULL;
+  struct timespec demand_mtime = { 0, 0 };
+  struct adapt *adapt = NULL;
+  __u64 demand_checked = 0, now;
+  struct history hist = { .rollup_fd = -1 };
+  struct ts_store_config scfg = TS_STORE_CONFIG_DEFAULT;
+  struct sample_pool_config pcfg = SAMPLE_POOL_CONFIG_DEFAULT;
+  char path[PATH_MAX];
+  struct sigaction sa = { .sa_handler = on_signal };
+  struct sensehat_sample s;
+  struct sched *sched;
+  struct sample_shm *shm;
+  struct sensehat *sh;
+  struct i2c_bus *bus;
+  __u64 lps_period, hts_period, slack;
+  const char *server = NULL;
+  const char *replay = NULL, *trace = NULL;
+  struct master master = { NULL };
+  struct sample_link *link = NULL;
+  __u64 link_retry = 0;
+  int link_fd = -1;
+  const char *events = NULL;
+  struct weather *weather = NULL;
+  int events_fd = -1;
+#ifdef ALLOC_CHECK
+  struct alloc_stats as;
+  int steady = 0;
+#endif
+  int sim = 0, opt, refreshed = 0, lps, hts, due, fresh, rc;
+
+  while ( (opt = getopt( argc, argv, "sb:r:w:n:c:d:a:u:e:" )) != -1 ) {
+    switch ( opt ) {
+      case 's': sim = 1; break;
+      case 'b': server = optarg; break;
+      case 'r': replay = optarg; break;
+      case 'w': trace = optarg; break;
+      case 'n': name = optarg; break;
+      case 'c': cache_dir = optarg; break;
+      case 'd': history = optarg; break;
+      case 'a': demand = optarg; break;
+      case 'u': master.spec = optarg; break;
+      case 'e': events = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-s | -b socket | -r trace] [-w trace] "
+                 "[-n shm name] [-c cache dir] [-d history dir] "
+                 "[-a demand file] [-u host:port] [-e events file]\n",
+                 argv[0] );
+        return 1;
+    }
+  }
+
+  // recording costs next to nothing, so it is always on,
+  // from before the devices are probed
+  if ( metrics_open( METRICS_SHM_NAME, "sensehatd" ) == -1 )
+    perror( METRICS_SHM_NAME );
+
+  if ( server != NULL )
+    bus = i2c_server_connect( server, I2C_SERVER_PRIO_HIGH );
+  else if ( replay != NULL )
+    bus = i2c_trace_replay( replay, NULL );
+  else
+    bus = sim ? i2c_sim_open() : i2c_bus_open( DEVPATH_I2C );
+  if ( bus == NULL ) {
+    perror( server ? server : replay ? replay : sim ? "i2c_sim_open" :
+            DEVPATH_I2C );
+    return 1;
+  }
+  if ( trace != NULL && (bus = i2c_trace_record( bus, trace )) == NULL ) {
+    perror( trace );
+    return 1;
+  }
+  sh = sensehat_open_image( bus, &sensehat_default_image, cache_dir );
+  if ( sh == NULL ) {
+    perror( "sensehat_open_image" );
+    return 1;
+  }
+  shm = sample_shm_create( name );
+  if ( shm == NULL ) {
+    perror( name );
+    return 1;
+  }
+
+  if ( history != NULL ) {
+    // a batch of the pool is a write of the store, see ts_writer.h
+    pcfg.records = scfg.batch;
+    hist.store = ts_store_open( history, &scfg );
+    hist.pool = hist.store == NULL ? NULL : sample_pool_new( &pcfg );
+    hist.writer = hist.pool == NULL ? NULL : ts_writer_new( hist.store );
+    if ( hist.writer == NULL ) {
+      perror( history );
+      return 1;
+    }
+    snprintf( path, sizeof(path), "%s/rollups", history );
+    hist.rollup_fd = open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    hist.rollup = hist.rollup_fd == -1 ? NULL :
+                  rollup_new( NULL, on_bucket, &hist.rollup_fd );
+    if ( hist.rollup == NULL ) {
+      perror( path );
+      return 1;
+    }
+  }
+
+  if ( demand != NULL ) {
+    adapt = adapt_new( NULL, sensehat_config( sh ) );
+    if ( adapt == NULL ) {
+      perror( "adapt_new" );
+      return 1;
+    }
+  }
+
+  if ( master.spec != NULL && (link = sample_link_new( NULL )) == NULL ) {
+    perror( "sample_link_new" );
+    return 1;
+  }
+
+  if ( events != NULL ) {
+    events_fd = open( events, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    weather = events_fd == -1 ? NULL : weather_new( NULL, on_weather,
+                                                    &events_fd );
+    if ( weather == NULL ) {
+      perror( events );
+      return 1;
+    }
+  }
+
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+
+  periods( sh, &lps_period, &hts_period );
+  slack = (lps_period < hts_period ? lps_period : hts_period) / 4;
+  sched = sched_new( slack );
+  if ( sched == NULL || (lps = sched_add( sched, lps_period )) == -1 ||
+       (hts = sched_add( sched, hts_period )) == -1 ) {
+    perror( "sched" );
+    return 1;
+  }
+
+  // one read of both sensors before the first deadline, so that the
+  // fields of the device that is not due yet are never stale zeros
+  due = (1 << lps) | (1 << hts);
+  while ( running ) {
+    if ( due == ((1 << lps) | (1 << hts)) )
+      rc = sensehat_sample( sh, &s );
+    else if ( due == 1 << lps )
+      rc = sensehat_sample_pressure( sh, &s );
+    else
+      rc = sensehat_sample_humidity( sh, &s );
+
+    if ( rc == 0 ) {
+      now = clock_ns( CLOCK_MONOTONIC );
+      sample_shm_publish( shm, &s, now );
+      // the first read is not for a deadline
+      if ( sched_fired( sched ) != 0 ) metrics_sample( sched_fired( sched ) );
+      fresh = 0;
+      if ( (due & (1 << lps)) && LPS25H_STATUS_REG_P_DA_ef( s.lps25h_status ) )
+        fresh |= 1 << ADAPT_LPS25H;
+      if ( (due & (1 << hts)) && (s.hts221_status & 3) == 3 )
+        fresh |= 1 << ADAPT_HTS221;
+      if ( fresh != (((due >> lps) & 1) << ADAPT_LPS25H |
+                     ((due >> hts) & 1) << ADAPT_HTS221) )
+        metrics_count( METRICS_STALE, 1 );
+      if ( hist.store != NULL ) record( &hist, &s );
+      if ( weather != NULL ) detect( weather, &s, fresh );
+      if ( link != NULL )
+        uplink( link, &master, &link_fd, &link_retry, &s, now );
+      // now that readers have a value, check the cached calibration
+      if ( !refreshed && sensehat_refresh_calib( sh ) != -1 ) refreshed = 1;
+    } else {
+      // the end of a replayed trace
+      if ( replay != NULL && errno == ENODATA ) running = 0;
+      perror( "sensehat_sample" );
+    }
+
+    if ( adapt != NULL && rc == 0 ) {
+      adapt_add( adapt, &s, fresh );
+      if ( now - demand_checked >= 1000000000ULL ) {
+        read_demand( adapt, demand, &demand_mtime );
+        demand_checked = now;
+      }
+      switch ( adapt_update( adapt, sh ) ) {
+        case -1:
+          perror( "adapt_update" );
+          break;
+        case 1:
+          // the upload restarted the conversions, the grids follow
+          periods( sh, &lps_period, &hts_period );
+          if ( sched_set_period( sched, lps, lps_period ) == -1 ||
+               sched_set_period( sched, hts, hts_period ) == -1 )
+            perror( "sched_set_period" );
+          report_adapt( adapt );
+          break;
+      }
+    }
+
+#ifdef ALLOC_CHECK
+    if ( !steady && refreshed && (link == NULL || master.len != 0) ) {
+      alloc_stats( &as );
+      fprintf( stderr, "steady after %lu allocations, no more from here\n",
+               as.allocs );
+      alloc_forbid( 1 );
+      steady = 1;
+    }
+#endif
+
+    while ( running && (due = sched_wait( sched )) <= 0 ) {
+      if ( due == -1 && errno != EINTR ) {
+        perror( "sched_wait" );
+        running = 0;
+      }
+    }
+  }
+#ifdef ALLOC_CHECK
+  alloc_forbid( 0 );
+#endif
+  report( sched );
+  if ( replay != NULL || trace != NULL ) report_trace( bus );
+  if ( link != NULL ) {
+    // the rest goes out now if the socket takes it, there is no waiting
+    if ( link_fd != -1 ) sample_link_send( link, ~0ULL >> 1 );
+    report_link( link );
+    sample_link_free( link );
+    if ( link_fd != -1 ) close( link_fd );
+  }
+  sched_free( sched );
+  if ( adapt != NULL ) {
+    report_adapt( adapt );
+    adapt_free( adapt );
+  }
+
+  if ( weather != NULL ) {
+    weather_free( weather );
+    close( events_fd );
+  }
+
+  // the segment is left behind so readers keep the last value and its age
+  if ( hist.store != NULL ) {
+    // the batch being filled goes out too
+    if ( hist.batch != NULL && hist.batch->count > 0 &&
+         ts_writer_hand( hist.writer, &hist.batch ) == -1 )
+      perror( "ts_writer_hand" );
+    sample_batch_put( &hist.batch );
+    if ( ts_writer_stop( hist.writer ) == -1 ) perror( "ts_writer_stop" );
+    report_history( &hist );
+    ts_writer_free( hist.writer );
+    sample_pool_free( hist.pool );
+    rollup_flush( hist.rollup );
+    rollup_free( hist.rollup );
+    close( hist.rollup_fd );
+    if ( ts_store_close( hist.store ) == -1 ) perror( "ts_store_close" );
+  }
+  sample_shm_close( shm, 0 );
+  sensehat_close( sh );
+  i2c_bus_close( bus );
+  return 0;
+}
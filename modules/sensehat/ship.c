@@ -0,0 +1,702 @@
+/*
+ *  ship.c
+ *    Archive shipper: streams the recordings picam finishes to a server as
+ *    they close, resuming where an interrupted transfer stopped
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ship.h"
+
+#define MANIFEST_MAGIC   0x4e414d53  // "SMAN"
+#define MANIFEST_VERSION 1
+#define RX_BUF           65536
+
+/* The manifest is the header and a record per file, in the order the
+   files were first seen */
+struct manifest_hdr {
+  __u32 magic;
+  __u32 version;
+};
+
+struct record {
+  char name[SHIP_NAME_MAX];  // empty for a record never written in full
+  __u64 size;                // as it was last sent
+  __u64 offset;              // acked by the receiver
+};
+
+enum { IDLE, HELLO, WAIT, DATA, DRAIN };
+
+struct ship {
+  struct ship_config cfg;
+  char *archive;
+  int dir;             // archive directory fd
+  int ifd;
+  int mfd;
+  int sock;            // -1 while detached
+  struct record *rec;  // the manifest in memory
+  unsigned char *queued;  // per record
+  size_t nrec, maxrec;
+  size_t *queue;       // records to ship, a ring
+  size_t qhead, qlen, qmax;
+  // the file under way, the one at the head of the queue
+  int st;
+  int fd;
+  size_t cur;
+  __u64 off;           // next byte of it to send
+  char out[sizeof(struct ship_hdr) + SHIP_NAME_MAX];
+  size_t out_len, out_sent;
+  struct ship_ack ack;
+  size_t ack_len;
+  __u64 allow;         // bytes the cap lets out now
+  __u64 refilled;      // when allow was last topped up
+  __u64 progress;      // when the link last moved, 0 before it was used
+  struct ship_stats stats;
+};
+
+struct ship_rx {
+  int dir;
+  int sock;
+  int fd;              // of the partial file, -1 between files
+  int resumed;
+  char name[SHIP_NAME_MAX];
+  char part[SHIP_NAME_MAX + 1];
+  __u64 size;
+  __u64 have;          // bytes of the file written
+  __u64 acked;
+  size_t hlen;         // of the header and name so far
+  char hdr[sizeof(struct ship_hdr) + SHIP_NAME_MAX];
+  char buf[RX_BUF];
+  struct ship_rx_stats stats;
+};
+
+static int would_block( void ) {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static int is_recording( const char *name ) {
+  size_t len = strlen( name ), slen = strlen( SHIP_SUFFIX );
+
+  return name[0] != '.' && len > slen &&
+         strcmp( name + len - slen, SHIP_SUFFIX ) == 0;
+}
+
+static int write_all( int fd, const void *buf, size_t len, off_t off ) {
+  const char *p = buf;
+  ssize_t res;
+
+  while ( len > 0 ) {
+    res = off == -1 ? write( fd, p, len ) : pwrite( fd, p, len, off );
+    if ( res == -1 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    p += res;
+    if ( off != -1 ) off += res;
+    len -= res;
+  }
+  return 0;
+}
+
+/* ---------------------------------------------------------------- manifest */
+
+static int grow( struct ship *s, size_t n ) {
+  struct record *rec;
+  unsigned char *queued;
+  size_t max = s->maxrec ? s->maxrec : 64;
+
+  if ( n <= s->maxrec ) return 0;
+  while ( max < n ) max *= 2;
+  rec = realloc( s->rec, max * sizeof(*rec) );
+  if ( rec == NULL ) return -1;
+  s->rec = rec;
+  queued = realloc( s->queued, max );
+  if ( queued == NULL ) return -1;
+  memset( queued + s->maxrec, 0, max - s->maxrec );
+  s->queued = queued;
+  s->maxrec = max;
+  return 0;
+}
+
+/* A lost update costs a question to the receiver, not data, so it is not
+   an error of the link */
+static void save( struct ship *s, size_t i ) {
+  write_all( s->mfd, &s->rec[i], sizeof(struct record),
+             sizeof(struct manifest_hdr) + i * sizeof(struct record) );
+}
+
+static int manifest_open( struct ship *s, const char *path ) {
+  struct manifest_hdr hdr = { MANIFEST_MAGIC, MANIFEST_VERSION };
+  struct stat st;
+  size_t n, len;
+
+  s->mfd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  if ( s->mfd == -1 || fstat( s->mfd, &st ) == -1 ) return -1;
+  if ( st.st_size == 0 ) return write_all( s->mfd, &hdr, sizeof(hdr), 0 );
+  if ( pread( s->mfd, &hdr, sizeof(hdr), 0 ) != sizeof(hdr) ||
+       hdr.magic != MANIFEST_MAGIC || hdr.version != MANIFEST_VERSION ) {
+    errno = EPROTO;
+    return -1;
+  }
+  // a record torn by a crash is dropped, that file is asked about again
+  n = (st.st_size - sizeof(hdr)) / sizeof(struct record);
+  len = n * sizeof(struct record);
+  if ( grow( s, n ) == -1 ) return -1;
+  if ( n > 0 && pread( s->mfd, s->rec, len, sizeof(hdr) ) != (ssize_t) len ) {
+    errno = EIO;
+    return -1;
+  }
+  s->nrec = n;
+  if ( sizeof(hdr) + len != (size_t) st.st_size )
+    return ftruncate( s->mfd, sizeof(hdr) + len );
+  return 0;
+}
+
+/* The newest files are asked for most, they are at the end */
+static long find( struct ship *s, const char *name ) {
+  for (size_t i = s->nrec; i-- > 0;)
+    if ( strcmp( s->rec[i].name, name ) == 0 ) return i;
+  return -1;
+}
+
+static long add( struct ship *s, const char *name ) {
+  struct record *r;
+
+  if ( grow( s, s->nrec + 1 ) == -1 ) return -1;
+  r = &s->rec[s->nrec];
+  memset( r, 0, sizeof(*r) );
+  strcpy( r->name, name );
+  save( s, s->nrec );
+  return s->nrec++;
+}
+
+/* ------------------------------------------------------------------- queue */
+
+static int enqueue( struct ship *s, size_t i ) {
+  size_t *q, max;
+
+  if ( s->queued[i] ) return 0;
+  if ( s->qlen == s->qmax ) {
+    max = s->qmax ? 2 * s->qmax : 64;
+    q = malloc( max * sizeof(*q) );
+    if ( q == NULL ) return -1;
+    for (size_t j = 0; j < s->qlen; j++)
+      q[j] = s->queue[(s->qhead + j) % s->qmax];
+    free( s->queue );
+    s->queue = q;
+    s->qhead = 0;
+    s->qmax = max;
+  }
+  s->queue[(s->qhead + s->qlen++) % s->qmax] = i;
+  s->queued[i] = 1;
+  return 0;
+}
+
+static void pop( struct ship *s ) {
+  s->queued[s->queue[s->qhead]] = 0;
+  s->qhead = (s->qhead + 1) % s->qmax;
+  s->qlen--;
+}
+
+/* Queue the file name closed in the archive */
+static int closed( struct ship *s, const char *name ) {
+  long i;
+
+  if ( !is_recording( name ) ) return 0;
+  if ( strlen( name ) >= SHIP_NAME_MAX ) {
+    s->stats.skipped++;
+    return 0;
+  }
+  i = find( s, name );
+  if ( i == -1 && (i = add( s, name )) == -1 ) return -1;
+  return enqueue( s, i );
+}
+
+static int scan_filter( const struct dirent *d ) {
+  return is_recording( d->d_name );
+}
+
+static int by_name( const void *a, const void *b ) {
+  return strcmp( (*(struct record * const *) a)->name,
+                 (*(struct record * const *) b)->name );
+}
+
+/* Queue what is in the archive and not shipped in full, oldest first as
+   picam names its files by time. The manifest is sorted by name alongside
+   so the two are walked once. */
+static int scan( struct ship *s ) {
+  struct dirent **ents;
+  struct record **sorted = NULL;
+  size_t *idx = NULL, j = 0, nrec = s->nrec;
+  int n, c, rc = -1;
+  long i;
+
+  n = scandir( s->archive, &ents, scan_filter, alphasort );
+  if ( n == -1 ) return -1;
+  sorted = malloc( (nrec ? nrec : 1) * sizeof(*sorted) );
+  idx = malloc( (nrec ? nrec : 1) * sizeof(*idx) );
+  if ( sorted == NULL || idx == NULL ) goto out;
+  for (size_t k = 0; k < nrec; k++) sorted[k] = &s->rec[k];
+  qsort( sorted, nrec, sizeof(*sorted), by_name );
+  // add() moves the records, their numbers stay
+  for (size_t k = 0; k < nrec; k++) idx[k] = sorted[k] - s->rec;
+
+  for (int k = 0; k < n; k++) {
+    if ( strlen( ents[k]->d_name ) >= SHIP_NAME_MAX ) {
+      s->stats.skipped++;
+      continue;
+    }
+    c = 1;
+    while ( j < nrec &&
+            (c = strcmp( s->rec[idx[j]].name, ents[k]->d_name )) < 0 )
+      j++;
+    i = c == 0 ? (long) idx[j] : add( s, ents[k]->d_name );
+    if ( i == -1 ) goto out;
+    if ( c != 0 || s->rec[i].offset < s->rec[i].size ||
+         s->rec[i].size == 0 ) {
+      if ( enqueue( s, i ) == -1 ) goto out;
+    }
+  }
+  rc = 0;
+
+out:
+  for (int k = 0; k < n; k++) free( ents[k] );
+  free( ents );
+  free( sorted );
+  free( idx );
+  return rc;
+}
+
+/* ------------------------------------------------------------------ sender */
+
+struct ship *ship_new( const char *archive, const char *manifest,
+                       const struct ship_config *cfg ) {
+  static const struct ship_config defaults = SHIP_CONFIG_DEFAULT;
+  struct ship *s;
+  int err;
+
+  if ( cfg == NULL ) cfg = &defaults;
+  if ( cfg->chunk == 0 || cfg->stall == 0 ) {
+    errno = EINVAL;
+    return NULL;
+  }
+  s = calloc( 1, sizeof(struct ship) );
+  if ( s == NULL ) return NULL;
+  s->cfg = *cfg;
+  s->dir = s->ifd = s->mfd = s->sock = s->fd = -1;
+  s->archive = strdup( archive );
+  if ( s->archive == NULL ) goto fail;
+
+  s->dir = open( archive, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( s->dir == -1 ) goto fail;
+  // watched before the scan, so nothing closed in between is missed
+  s->ifd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+  if ( s->ifd == -1 ||
+       inotify_add_watch( s->ifd, archive, IN_CLOSE_WRITE | IN_MOVED_TO ) ==
+       -1 )
+    goto fail;
+  if ( manifest_open( s, manifest ) == -1 || scan( s ) == -1 ) goto fail;
+  return s;
+
+fail:
+  err = errno;
+  ship_free( s );
+  errno = err;
+  return NULL;
+}
+
+int ship_fd( struct ship *s ) {
+  return s->ifd;
+}
+
+int ship_handle( struct ship *s ) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t n;
+
+  while ( (n = read( s->ifd, buf, sizeof(buf) )) > 0 )
+    for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      // events were lost, what they were about is in the archive
+      if ( (ev->mask & IN_Q_OVERFLOW) && scan( s ) == -1 ) return -1;
+      if ( ev->len > 0 && closed( s, ev->name ) == -1 ) return -1;
+    }
+  if ( n == -1 && !would_block() ) return -1;
+  return 0;
+}
+
+static void stop_file( struct ship *s ) {
+  if ( s->fd != -1 ) close( s->fd );
+  s->fd = -1;
+  s->st = IDLE;
+}
+
+void ship_attach( struct ship *s, int fd ) {
+  stop_file( s );
+  s->sock = fd;
+  s->ack_len = 0;
+  s->progress = 0;
+}
+
+static void fail( struct ship *s ) {
+  int err = errno;
+
+  s->stats.failures++;
+  ship_attach( s, -1 );
+  errno = err;
+}
+
+/* Open the file at the head of the queue and make its header. One that
+   cannot be read is given up, it is no better the next time round. */
+static void start( struct ship *s ) {
+  struct ship_hdr hdr = { SHIP_MAGIC, SHIP_VERSION };
+  struct record *r;
+  struct stat st;
+
+  s->cur = s->queue[s->qhead];
+  r = &s->rec[s->cur];
+  s->fd = openat( s->dir, r->name, O_RDONLY | O_CLOEXEC );
+  if ( s->fd == -1 || fstat( s->fd, &st ) == -1 ) {
+    s->stats.skipped++;
+    stop_file( s );
+    pop( s );
+    return;
+  }
+  if ( r->size != (__u64) st.st_size ) {
+    r->size = st.st_size;
+    save( s, s->cur );
+  }
+  hdr.name_len = strlen( r->name );
+  hdr.size = r->size;
+  memcpy( s->out, &hdr, sizeof(hdr) );
+  memcpy( s->out + sizeof(hdr), r->name, hdr.name_len );
+  s->out_len = sizeof(hdr) + hdr.name_len;
+  s->out_sent = 0;
+  s->st = HELLO;
+}
+
+static void shipped( struct ship *s ) {
+  stop_file( s );
+  pop( s );
+  s->stats.files++;
+}
+
+static int take_acks( struct ship *s, __u64 now ) {
+  struct record *r;
+  ssize_t n;
+
+  for (;;) {
+    n = recv( s->sock, (char *) &s->ack + s->ack_len,
+              sizeof(s->ack) - s->ack_len, MSG_DONTWAIT );
+    if ( n == -1 ) return would_block() ? 0 : -1;
+    if ( n == 0 ) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    s->ack_len += n;
+    if ( s->ack_len < sizeof(s->ack) ) continue;
+    s->ack_len = 0;
+
+    r = &s->rec[s->cur];
+    if ( s->ack.magic != SHIP_MAGIC || s->st == IDLE || s->st == HELLO ||
+         s->ack.offset > r->size ) {
+      errno = EPROTO;
+      return -1;
+    }
+    s->progress = now;
+    if ( r->offset != s->ack.offset ) {
+      r->offset = s->ack.offset;
+      save( s, s->cur );
+    }
+    if ( s->st == WAIT ) {
+      s->off = s->ack.offset;
+      s->st = DATA;
+      if ( s->off > 0 ) s->stats.resumed++;
+    }
+    if ( s->ack.offset == r->size ) shipped( s );
+  }
+}
+
+/* The bucket holds a tenth of a second at the cap, so a wakeup that comes
+   late is made up for, and a chunk at least */
+static void refill( struct ship *s, __u64 now ) {
+  __u64 dt = now - s->refilled, add, max = s->cfg.rate / 10;
+
+  if ( s->refilled == 0 || dt > 1000000000ULL ) dt = 1000000000ULL;
+  add = dt * s->cfg.rate / 1000000000ULL;
+  // what is lost to rounding stays in dt for the next time
+  if ( add == 0 ) return;
+  s->allow += add;
+  s->refilled = now;
+  if ( max < s->cfg.chunk ) max = s->cfg.chunk;
+  if ( s->allow > max ) s->allow = max;
+}
+
+/* Bytes of the file under way the next sendfile() is for */
+static size_t next_len( struct ship *s ) {
+  __u64 left = s->rec[s->cur].size - s->off;
+
+  return left < s->cfg.chunk ? left : s->cfg.chunk;
+}
+
+static int pump( struct ship *s, __u64 now ) {
+  size_t len;
+  ssize_t n;
+  off_t off;
+
+  for (;;) {
+    switch ( s->st ) {
+      case IDLE:
+        if ( s->qlen == 0 ) return 0;
+        start( s );
+        break;
+      case HELLO:
+        n = send( s->sock, s->out + s->out_sent, s->out_len - s->out_sent,
+                  MSG_DONTWAIT | MSG_NOSIGNAL );
+        if ( n == -1 ) return would_block() ? 0 : -1;
+        s->progress = now;
+        s->out_sent += n;
+        if ( s->out_sent == s->out_len ) s->st = WAIT;
+        break;
+      case DATA:
+        len = next_len( s );
+        if ( s->cfg.rate > 0 ) {
+          refill( s, now );
+          if ( s->allow < len ) {
+            // held back by us, not by the link
+            s->stats.throttled++;
+            s->progress = now;
+            return 0;
+          }
+        }
+        off = s->off;
+        n = sendfile( s->sock, s->fd, &off, len );
+        s->stats.sends++;
+        if ( n == -1 ) {
+          if ( !would_block() ) return -1;
+          s->stats.blocked++;
+          return 0;
+        }
+        if ( n == 0 ) {
+          // cut short under us, the next start sees its new size
+          errno = ENODATA;
+          return -1;
+        }
+        s->off += n;
+        if ( s->cfg.rate > 0 ) s->allow -= n;
+        s->stats.bytes += n;
+        s->progress = now;
+        if ( s->off == s->rec[s->cur].size ) s->st = DRAIN;
+        break;
+      default:
+        // up to the receiver
+        return 0;
+    }
+  }
+}
+
+int ship_send( struct ship *s, __u64 now ) {
+  if ( s->sock == -1 ) return s->st == IDLE && s->qlen == 0;
+  if ( s->progress == 0 ) s->progress = now;
+  if ( take_acks( s, now ) == -1 || pump( s, now ) == -1 ) {
+    fail( s );
+    return -1;
+  }
+  if ( s->st != IDLE && now - s->progress >= s->cfg.stall ) {
+    errno = ETIMEDOUT;
+    fail( s );
+    return -1;
+  }
+  return s->st == IDLE && s->qlen == 0;
+}
+
+short ship_events( struct ship *s ) {
+  if ( s->sock == -1 ) return 0;
+  if ( s->st == HELLO || (s->st == DATA && (s->cfg.rate == 0 ||
+                                            s->allow >= next_len( s ))) )
+    return POLLIN | POLLOUT;
+  return POLLIN;
+}
+
+__u64 ship_due( struct ship *s ) {
+  __u64 due, need, t;
+
+  if ( s->sock == -1 || s->st == IDLE ) return 0;
+  due = s->progress + s->cfg.stall;
+  if ( s->st == DATA && s->cfg.rate > 0 && s->allow < next_len( s ) ) {
+    need = next_len( s ) - s->allow;
+    t = s->refilled + (need * 1000000000ULL + s->cfg.rate - 1) / s->cfg.rate;
+    if ( t < due ) due = t;
+  }
+  return due;
+}
+
+void ship_stats( struct ship *s, struct ship_stats *st ) {
+  s->stats.pending = s->qlen;
+  memcpy( st, &s->stats, sizeof(*st) );
+}
+
+void ship_free( struct ship *s ) {
+  if ( s == NULL ) return;
+  if ( s->fd != -1 ) close( s->fd );
+  if ( s->mfd != -1 ) close( s->mfd );
+  if ( s->ifd != -1 ) close( s->ifd );
+  if ( s->dir != -1 ) close( s->dir );
+  free( s->archive );
+  free( s->rec );
+  free( s->queued );
+  free( s->queue );
+  free( s );
+}
+
+/* ---------------------------------------------------------------- receiver */
+
+struct ship_rx *ship_rx_new( const char *dir, int fd ) {
+  struct ship_rx *rx;
+  int err;
+
+  rx = calloc( 1, sizeof(struct ship_rx) );
+  if ( rx == NULL ) return NULL;
+  rx->sock = fd;
+  rx->fd = -1;
+  rx->dir = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( rx->dir == -1 ) {
+    err = errno;
+    free( rx );
+    errno = err;
+    return NULL;
+  }
+  return rx;
+}
+
+static int send_ack( struct ship_rx *rx, __u64 offset ) {
+  struct ship_ack ack = { SHIP_MAGIC, 0, offset };
+
+  // the sender takes in the acks all along, there is room for one
+  if ( send( rx->sock, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL ) !=
+       sizeof(ack) )
+    return -1;
+  rx->acked = offset;
+  return 0;
+}
+
+/* Synced before it is renamed and acked, the sender forgets it then */
+static int complete( struct ship_rx *rx ) {
+  if ( rx->fd != -1 ) {
+    if ( fdatasync( rx->fd ) == -1 ) return -1;
+    close( rx->fd );
+    rx->fd = -1;
+    if ( renameat( rx->dir, rx->part, rx->dir, rx->name ) == -1 ) return -1;
+    rx->stats.files++;
+    if ( rx->resumed ) rx->stats.resumed++;
+  }
+  return send_ack( rx, rx->size );
+}
+
+/* A whole header is in, answer with what there is of the file already */
+static int begin( struct ship_rx *rx ) {
+  const struct ship_hdr *hdr = (const struct ship_hdr *) rx->hdr;
+  struct stat st;
+
+  memcpy( rx->name, rx->hdr + sizeof(*hdr), hdr->name_len );
+  rx->name[hdr->name_len] = '\0';
+  if ( rx->name[0] == '.' || strchr( rx->name, '/' ) != NULL ||
+       strlen( rx->name ) != hdr->name_len ) {
+    errno = EPROTO;
+    return -1;
+  }
+  rx->size = hdr->size;
+  rx->hlen = 0;
+  snprintf( rx->part, sizeof(rx->part), ".%s", rx->name );
+
+  // in place already, the last ack of it was lost
+  if ( fstatat( rx->dir, rx->name, &st, 0 ) == 0 &&
+       (__u64) st.st_size == rx->size ) {
+    rx->have = rx->size;
+    return complete( rx );
+  }
+  rx->fd = openat( rx->dir, rx->part, O_WRONLY | O_CREAT | O_CLOEXEC, 0644 );
+  if ( rx->fd == -1 || fstat( rx->fd, &st ) == -1 ) return -1;
+  rx->have = st.st_size;
+  if ( rx->have > rx->size ) {
+    if ( ftruncate( rx->fd, 0 ) == -1 ) return -1;
+    rx->have = 0;
+  }
+  if ( lseek( rx->fd, rx->have, SEEK_SET ) == -1 ) return -1;
+  rx->resumed = rx->have > 0;
+  if ( rx->have == rx->size ) return complete( rx );
+  return send_ack( rx, rx->have );
+}
+
+long ship_rx_recv( struct ship_rx *rx ) {
+  const struct ship_hdr *hdr = (const struct ship_hdr *) rx->hdr;
+  __u64 left;
+  size_t want;
+  ssize_t n;
+
+  if ( rx->fd == -1 ) {
+    // the header alone, the data after it is not ours to read yet
+    want = rx->hlen < sizeof(*hdr) ? sizeof(*hdr) - rx->hlen :
+           sizeof(*hdr) + hdr->name_len - rx->hlen;
+    n = recv( rx->sock, rx->hdr + rx->hlen, want, MSG_DONTWAIT );
+  } else {
+    left = rx->size - rx->have;
+    n = recv( rx->sock, rx->buf, left < RX_BUF ? left : RX_BUF,
+              MSG_DONTWAIT );
+  }
+  rx->stats.reads++;
+  if ( n == -1 ) return would_block() ? 0 : -1;
+  if ( n == 0 ) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  if ( rx->fd == -1 ) {
+    rx->hlen += n;
+    if ( rx->hlen == sizeof(*hdr) &&
+         (hdr->magic != SHIP_MAGIC || hdr->version != SHIP_VERSION ||
+          hdr->name_len == 0 || hdr->name_len >= SHIP_NAME_MAX) ) {
+      errno = EPROTO;
+      return -1;
+    }
+    if ( rx->hlen == sizeof(*hdr) + hdr->name_len && begin( rx ) == -1 )
+      return -1;
+    return 0;
+  }
+
+  if ( write_all( rx->fd, rx->buf, n, -1 ) == -1 ) return -1;
+  rx->have += n;
+  rx->stats.bytes += n;
+  if ( rx->have == rx->size ) {
+    if ( complete( rx ) == -1 ) return -1;
+  } else if ( rx->have - rx->acked >= SHIP_ACK_BYTES &&
+              send_ack( rx, rx->have ) == -1 ) {
+    return -1;
+  }
+  return n;
+}
+
+void ship_rx_stats( struct ship_rx *rx, struct ship_rx_stats *st ) {
+  memcpy( st, &rx->stats, sizeof(*st) );
+}
+
+void ship_rx_free( struct ship_rx *rx ) {
+  if ( rx == NULL ) return;
+  if ( rx->fd != -1 ) close( rx->fd );
+  close( rx->dir );
+  free( rx );
+}
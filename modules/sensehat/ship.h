@@ -0,0 +1,145 @@
+/*
+ *  ship.h
+ *    Archive shipper: streams the recordings picam finishes to a server as
+ *    they close, resuming where an interrupted transfer stopped
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The archive directory is watched with inotify, and every SHIP_SUFFIX
+ *  file closed or moved into it is queued, oldest first. Nothing rescans
+ *  the archive but ship_new(), once, for what was closed while no shipper
+ *  ran. The file data goes from the page cache to the socket with
+ *  sendfile(), cfg.chunk bytes per call, never through a buffer of ours.
+ *
+ *  Per file the sender sends a struct ship_hdr and the name, and the
+ *  receiver answers with a struct ship_ack holding how much of the file it
+ *  has already, from which the sender goes on. While the data comes in
+ *  the receiver acks every SHIP_ACK_BYTES, and once more when the file is
+ *  complete and in place under its name.
+ *
+ *  The manifest is a file of fixed size records, one per file ever seen,
+ *  with its size and the offset the receiver last acked. Each ack updates
+ *  its record in place, so after a restart the files shipped in full are
+ *  skipped without asking the server and the rest resume from where they
+ *  were. Where the manifest and the receiver disagree, e.g. after a crash
+ *  lost an update or the server lost a partial file, the answer of the
+ *  receiver wins. The manifest is not synced for the same reason.
+ *
+ *  cfg.rate caps the bytes per second sent, so a live stream sharing the
+ *  link is not starved; the file data is let out cfg.chunk at a time as a
+ *  token bucket fills, in bursts of a tenth of a second at most. A link
+ *  that makes no progress for cfg.stall is given up, as TCP would take
+ *  many minutes to.
+ *
+ *  Both ends run in the byte order of the host. A shipper, as a receiver,
+ *  is for one thread.
+ */
+#ifndef _SHIP_H_
+#define _SHIP_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+#define SHIP_MAGIC     0x50494853  // "SHIP"
+#define SHIP_VERSION   1
+#define SHIP_NAME_MAX  64          // with the terminating NUL
+#define SHIP_ACK_BYTES (1 << 20)
+#define SHIP_SUFFIX    ".ts"
+#define SHIP_PORT      "5402"
+
+struct ship_hdr {
+  __u32 magic;
+  __u16 version;
+  __u16 name_len;  // bytes of name following, no NUL
+  __u64 size;      // of the whole file
+};
+
+struct ship_ack {
+  __u32 magic;
+  __u32 reserved;
+  __u64 offset;    // bytes of the file the receiver has
+};
+
+struct ship_config {
+  __u64 rate;    // bytes per second at most, 0 for no cap
+  size_t chunk;  // bytes per sendfile()
+  __u64 stall;   // ns without progress before the link is given up
+};
+
+#define SHIP_CONFIG_DEFAULT { 0, 65536, 30000000000ULL }
+
+struct ship_stats {
+  unsigned long files;      // shipped in full
+  unsigned long resumed;    // transfers taken up from an offset
+  unsigned long pending;    // queued, the one under way included
+  unsigned long skipped;    // names too long, or gone before they were sent
+  unsigned long sends;      // sendfile() calls
+  unsigned long blocked;    // of those, found the socket full
+  unsigned long throttled;  // times the cap held the data back
+  unsigned long failures;   // links that failed or stalled
+  __u64 bytes;              // file data sent
+};
+
+struct ship;
+
+/* Ship the SHIP_SUFFIX files in the directory archive, keeping track of
+   them in the file manifest, which is created if need be. cfg may be NULL
+   for the defaults. The shipper starts without a socket. */
+struct ship *ship_new( const char *archive, const char *manifest,
+                       const struct ship_config *cfg );
+
+/* Readable when the archive has changed, then call ship_handle() */
+int ship_fd( struct ship *s );
+
+/* Queue the files closed in the archive since the last call */
+int ship_handle( struct ship *s );
+
+/* Send over the stream socket fd from now on, -1 for none. The shipper
+   does not own fd. A file under way starts over by asking the receiver
+   what it has. */
+void ship_attach( struct ship *s, int fd );
+
+/* Send what the cap allows at now (CLOCK_MONOTONIC) and take in the acks.
+   Returns 1 when everything queued is shipped, 0 while there is more, -1
+   and errno if the link failed or stalled (ETIMEDOUT); the socket is then
+   detached, attach a new one to carry on. */
+int ship_send( struct ship *s, __u64 now );
+
+/* The poll() events the socket is waited for with, 0 without one */
+short ship_events( struct ship *s );
+
+/* When ship_send() has something to do even if the socket does not wake
+   us (CLOCK_MONOTONIC), 0 for never */
+__u64 ship_due( struct ship *s );
+
+void ship_stats( struct ship *s, struct ship_stats *st );
+void ship_free( struct ship *s );
+
+/* ---------------------------------------------------------------- receiver */
+
+struct ship_rx_stats {
+  unsigned long files;    // received in full
+  unsigned long resumed;  // of those, taken up from a partial file
+  unsigned long reads;    // recv() calls
+  __u64 bytes;            // file data received
+};
+
+struct ship_rx;
+
+/* Receive into the directory dir from the stream socket fd, which it does
+   not own. A file is written as .name and renamed when complete. */
+struct ship_rx *ship_rx_new( const char *dir, int fd );
+
+/* Read what the socket has and write it out. Returns the bytes of file
+   data written, 0 if there was nothing to read, or -1 and errno:
+   ECONNRESET when the sender has gone, EPROTO for a corrupt header. After
+   either, start over with a new receiver on a new socket; the partial file
+   is kept to resume from. */
+long ship_rx_recv( struct ship_rx *rx );
+
+void ship_rx_stats( struct ship_rx *rx, struct ship_rx_stats *st );
+void ship_rx_free( struct ship_rx *rx );
+
+#endif /* _SHIP_H_ */
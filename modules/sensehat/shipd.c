@@ -0,0 +1,166 @@
+/*
+ *  shipd.c
+ *    Ships the recordings picam finishes in its archive to a server as they
+ *    close, see ship.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: shipd [-a archive dir] [-m manifest] [-r rate] [-c chunk]
+ *               host:port
+ *    -a  ship the SHIP_SUFFIX files in archive dir, ~/picam/archive by
+ *        default
+ *    -m  keep track of them in the file manifest, ~/picam/ship.manifest by
+ *        default
+ *    -r  send at most rate KiB per second, no cap by default
+ *    -c  send chunk KiB per sendfile(), 64 by default
+ *
+ *  This takes over from the rsync of fgmaster:picam/archive run by hand on
+ *  the server. tests/ship_standin.c is a server to try it against. The
+ *  link is connected again a second after it fails; the file under way
+ *  then resumes from what the server has of it. Every file shipped is
+ *  logged to stderr, and the totals on exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "ship.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal( int sig ) {
+  running = 0;
+}
+
+/* Start a connection to host:port without waiting for it, the first send
+   finds out whether it worked */
+static int connect_to( const char *spec ) {
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+  char host[256];
+  const char *port;
+  int fd, rc;
+
+  port = strrchr( spec, ':' );
+  if ( port == NULL || port - spec >= (long) sizeof(host) ) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy( host, spec, port - spec );
+  host[port - spec] = '\0';
+  rc = getaddrinfo( host, port + 1, &hints, &res );
+  if ( rc != 0 ) {
+    errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    return -1;
+  }
+  fd = socket( res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+               SOCK_CLOEXEC, res->ai_protocol );
+  if ( fd != -1 && connect( fd, res->ai_addr, res->ai_addrlen ) == -1 &&
+       errno != EINPROGRESS ) {
+    rc = errno;
+    close( fd );
+    errno = rc;
+    fd = -1;
+  }
+  freeaddrinfo( res );
+  return fd;
+}
+
+static void report( struct ship *s, __u64 elapsed ) {
+  struct ship_stats st;
+
+  ship_stats( s, &st );
+  fprintf( stderr, "%lu files shipped, %lu resumed, %lu pending, %lu "
+           "skipped, %.1f MB at %.2f MB/s\n", st.files, st.resumed,
+           st.pending, st.skipped, st.bytes / 1e6,
+           elapsed ? st.bytes * 1e3 / elapsed : 0.0 );
+  fprintf( stderr, "%lu sends, %lu blocked, %lu throttled, %lu failures\n",
+           st.sends, st.blocked, st.throttled, st.failures );
+}
+
+int main( int argc, char **argv ) {
+  struct ship_config cfg = SHIP_CONFIG_DEFAULT;
+  struct sigaction sa = { .sa_handler = on_signal };
+  const char *home = getenv( "HOME" ), *server;
+  char archive[256], manifest[256];
+  struct ship_stats st;
+  struct pollfd pfd[2];
+  struct ship *s;
+  unsigned long files = 0;
+  int opt, fd = -1, timeout;
+  __u64 now, start, retry = 0, due;
+
+  snprintf( archive, sizeof(archive), "%s/picam/archive", home ? home : "" );
+  snprintf( manifest, sizeof(manifest), "%s/picam/ship.manifest",
+            home ? home : "" );
+  while ( (opt = getopt( argc, argv, "a:m:r:c:" )) != -1 ) {
+    switch ( opt ) {
+      case 'a': snprintf( archive, sizeof(archive), "%s", optarg ); break;
+      case 'm': snprintf( manifest, sizeof(manifest), "%s", optarg ); break;
+      case 'r': cfg.rate = strtoull( optarg, NULL, 10 ) * 1024; break;
+      case 'c': cfg.chunk = strtoul( optarg, NULL, 10 ) * 1024; break;
+      default: goto usage;
+    }
+  }
+  if ( optind != argc - 1 ) goto usage;
+  server = argv[optind];
+
+  s = ship_new( archive, manifest, &cfg );
+  if ( s == NULL ) {
+    perror( archive );
+    return 1;
+  }
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+
+  start = clock_ns( CLOCK_MONOTONIC );
+  while ( running ) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    if ( fd == -1 && now >= retry ) {
+      retry = now + 1000000000ULL;
+      fd = connect_to( server );
+      if ( fd == -1 ) perror( server );
+      ship_attach( s, fd );
+    }
+    if ( fd != -1 && ship_send( s, now ) == -1 ) {
+      perror( server );
+      close( fd );
+      fd = -1;
+    }
+    ship_stats( s, &st );
+    if ( st.files != files )
+      fprintf( stderr, "%lu shipped, %lu pending\n", st.files, st.pending );
+    files = st.files;
+
+    due = fd == -1 ? retry : ship_due( s );
+    timeout = due == 0 ? -1 : due <= now ? 0 :
+              (int) ((due - now + 999999) / 1000000);
+    pfd[0] = (struct pollfd) { ship_fd( s ), POLLIN, 0 };
+    pfd[1] = (struct pollfd) { fd, ship_events( s ), 0 };
+    if ( poll( pfd, fd == -1 ? 1 : 2, timeout ) == -1 && errno != EINTR ) {
+      perror( "poll" );
+      break;
+    }
+    if ( (pfd[0].revents & POLLIN) && ship_handle( s ) == -1 )
+      perror( archive );
+  }
+
+  report( s, clock_ns( CLOCK_MONOTONIC ) - start );
+  ship_free( s );
+  if ( fd != -1 ) close( fd );
+  return 0;
+
+usage:
+  fprintf( stderr, "usage: %s [-a archive dir] [-m manifest] [-r rate] "
+           "[-c chunk] host:port\n", argv[0] );
+  return 1;
+}
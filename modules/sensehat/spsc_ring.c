@@ -0,0 +1,100 @@
+/*
+ *  spsc_ring.c
+ *    Lock-free single producer, single consumer ring of fixed size elements
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spsc_ring.h"
+
+int spsc_ring_init( struct spsc_ring *r, size_t capacity, size_t elem ) {
+  if ( capacity == 0 || (capacity & (capacity - 1)) != 0 || elem == 0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  r->buf = malloc( capacity * elem );
+  if ( r->buf == NULL ) return -1;
+  r->head = 0;
+  r->tail = 0;
+  r->mask = capacity - 1;
+  r->elem = elem;
+  return 0;
+}
+
+void spsc_ring_free( struct spsc_ring *r ) {
+  free( r->buf );
+  r->buf = NULL;
+}
+
+/* Copy n elements between the ring starting at index pos and flat memory,
+   splitting the copy where the ring wraps around */
+static void ring_copy( struct spsc_ring *r, size_t pos, void *flat, size_t n,
+                       int to_ring ) {
+  size_t off = pos & r->mask;
+  size_t first = r->mask + 1 - off;
+  unsigned char *p = flat;
+
+  if ( first > n ) first = n;
+  if ( to_ring ) {
+    memcpy( r->buf + off * r->elem, p, first * r->elem );
+    memcpy( r->buf, p + first * r->elem, (n - first) * r->elem );
+  } else {
+    memcpy( p, r->buf + off * r->elem, first * r->elem );
+    memcpy( p + first * r->elem, r->buf, (n - first) * r->elem );
+  }
+}
+
+size_t spsc_ring_push( struct spsc_ring *r, const void *src, size_t n ) {
+  size_t head = __atomic_load_n( &r->head, __ATOMIC_RELAXED );
+  size_t tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+  size_t space = r->mask + 1 - (head - tail);
+
+  if ( n > space ) n = space;
+  if ( n == 0 ) return 0;
+  ring_copy( r, head, (void *) src, n, 1 );
+  // publish the elements only after they have been written
+  __atomic_store_n( &r->head, head + n, __ATOMIC_RELEASE );
+  return n;
+}
+
+size_t spsc_ring_pop( struct spsc_ring *r, void *dst, size_t n ) {
+  size_t tail = __atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+  size_t head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+  size_t avail = head - tail;
+
+  if ( n > avail ) n = avail;
+  if ( n == 0 ) return 0;
+  ring_copy( r, tail, dst, n, 0 );
+  // hand the slots back to the producer once they have been copied out
+  __atomic_store_n( &r->tail, tail + n, __ATOMIC_RELEASE );
+  return n;
+}
+
+size_t spsc_ring_peek( struct spsc_ring *r, size_t skip, size_t n,
+                       struct iovec iov[2] ) {
+  size_t tail = __atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+  size_t head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+  size_t avail = head - tail, off, first;
+
+  avail = skip < avail ? avail - skip : 0;
+  if ( n > avail ) n = avail;
+  off = (tail + skip) & r->mask;
+  first = r->mask + 1 - off;
+  if ( first > n ) first = n;
+  iov[0].iov_base = r->buf + off * r->elem;
+  iov[0].iov_len = first * r->elem;
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = (n - first) * r->elem;
+  return n;
+}
+
+void spsc_ring_consume( struct spsc_ring *r, size_t n ) {
+  size_t tail = __atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+
+  __atomic_store_n( &r->tail, tail + n, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,58 @@
+/*
+ *  spsc_ring.h
+ *    Lock-free single producer, single consumer ring of fixed size elements
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  One thread may push while another pops without any locking. head is
+ *  only written by the producer and tail only by the consumer; both run
+ *  freely and are masked into the buffer, so the capacity (in elements)
+ *  must be a power of two.
+ */
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SPSC_CACHELINE 64
+
+struct spsc_ring {
+  size_t head __attribute__((aligned(SPSC_CACHELINE)));  // producer
+  size_t tail __attribute__((aligned(SPSC_CACHELINE)));  // consumer
+  size_t mask __attribute__((aligned(SPSC_CACHELINE)));
+  size_t elem;
+  unsigned char *buf;
+};
+
+/* Allocate room for capacity elements of elem bytes, capacity power of two */
+int spsc_ring_init( struct spsc_ring *r, size_t capacity, size_t elem );
+void spsc_ring_free( struct spsc_ring *r );
+
+/* Producer: copy up to n elements in, returns how many fitted */
+size_t spsc_ring_push( struct spsc_ring *r, const void *src, size_t n );
+
+/* Consumer: copy up to n elements out, returns how many were available */
+size_t spsc_ring_pop( struct spsc_ring *r, void *dst, size_t n );
+
+/* Consumer: point iov at elements skip..skip+n-1 in place, as one run or
+   two where the ring wraps, without taking them out. Returns how many of
+   them are there. */
+size_t spsc_ring_peek( struct spsc_ring *r, size_t skip, size_t n,
+                       struct iovec iov[2] );
+
+/* Consumer: take out the first n elements, e.g. once peeked ones are sent */
+void spsc_ring_consume( struct spsc_ring *r, size_t n );
+
+static inline size_t spsc_ring_count( const struct spsc_ring *r ) {
+  return __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) -
+         __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+}
+
+static inline size_t spsc_ring_capacity( const struct spsc_ring *r ) {
+  return r->mask + 1;
+}
+
+#endif /* _SPSC_RING_H_ */
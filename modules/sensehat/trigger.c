@@ -0,0 +1,259 @@
+/*
+ *  trigger.c
+ *    Motion to recording trigger: drives the hooks of picam from PIR edges
+ *    and times how long picam takes to start recording
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "trigger.h"
+
+#define RECORD "record"
+
+enum { START, STOP, HOOKS };
+
+struct hook {
+  const char *name;
+  const char *staged;  // picam acts on known names only
+  int fd;              // of the staged file, -1 while none is staged
+};
+
+struct trigger {
+  struct trigger_config cfg;
+  int hooks;           // directory fds
+  int state;
+  int ifd;
+  int st;
+  int again;           // motion came while stopping
+  __u64 edge;          // that started the recording under way
+  __u64 prev;          // last edge, 0 before the first
+  __u64 last;          // last motion that was not a bounce
+  __u64 sent;          // when the last hook went out
+  struct hook hook[HOOKS];
+  struct trigger_stats stats;
+};
+
+static int stage( struct trigger *t, struct hook *h ) {
+  if ( h->fd != -1 ) return 0;
+  h->fd = openat( t->hooks, h->staged, O_WRONLY | O_CREAT | O_TRUNC |
+                  O_CLOEXEC, 0644 );
+  return h->fd == -1 ? -1 : 0;
+}
+
+static int fire( struct trigger *t, struct hook *h, __u64 now ) {
+  // a failed staging is tried again here, late is better than never
+  if ( stage( t, h ) == -1 ||
+       renameat( t->hooks, h->staged, t->hooks, h->name ) == -1 )
+    return -1;
+  close( h->fd );
+  h->fd = -1;
+  t->sent = now;
+  return 0;
+}
+
+static int start( struct trigger *t, __u64 edge, __u64 now ) {
+  if ( fire( t, &t->hook[START], now ) == -1 ) return -1;
+  t->edge = edge;
+  t->st = TRIGGER_STARTING;
+  t->stats.starts++;
+  metrics_count( METRICS_TRIGGERS, 1 );
+  return 1;
+}
+
+static void started( struct trigger *t, __u64 now ) {
+  __u64 ns = now > t->edge ? now - t->edge : 0;
+  __u64 units = ns >> 10;
+  int i = units == 0 ? 0 : 64 - __builtin_clzll( units );
+
+  t->stats.latency.count[i > METRICS_BUCKETS ? METRICS_BUCKETS : i]++;
+  t->stats.latency.sum += ns;
+  t->stats.latency_last = ns;
+  if ( ns > t->stats.latency_max ) t->stats.latency_max = ns;
+  t->stats.started++;
+  metrics_observe( METRICS_TRIGGER_LATENCY, ns );
+}
+
+/* "true" or "false" as picam wrote it, -1 for anything else */
+static int recording( struct trigger *t ) {
+  char buf[8];
+  ssize_t n;
+  int fd;
+
+  fd = openat( t->state, RECORD, O_RDONLY | O_CLOEXEC );
+  if ( fd == -1 ) return -1;
+  n = read( fd, buf, sizeof(buf) );
+  close( fd );
+  if ( n >= 4 && memcmp( buf, "true", 4 ) == 0 ) return 1;
+  if ( n >= 5 && memcmp( buf, "false", 5 ) == 0 ) return 0;
+  return -1;
+}
+
+struct trigger *trigger_new( const char *hooks, const char *state,
+                             const struct trigger_config *cfg ) {
+  static const struct trigger_config defaults = TRIGGER_CONFIG_DEFAULT;
+  struct trigger *t;
+  int err;
+
+  t = calloc( 1, sizeof(struct trigger) );
+  if ( t == NULL ) return NULL;
+  t->cfg = cfg != NULL ? *cfg : defaults;
+  t->st = TRIGGER_IDLE;
+  t->hook[START] = (struct hook) { "start_record", ".start_record", -1 };
+  t->hook[STOP] = (struct hook) { "stop_record", ".stop_record", -1 };
+  t->state = t->ifd = -1;
+
+  t->hooks = open( hooks, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( t->hooks == -1 ) goto fail;
+  t->state = open( state, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( t->state == -1 ) goto fail;
+  t->ifd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+  if ( t->ifd == -1 ||
+       inotify_add_watch( t->ifd, state, IN_CLOSE_WRITE | IN_MOVED_TO ) == -1 )
+    goto fail;
+  // picam may be recording already, e.g. after a restart of ours
+  if ( recording( t ) == 1 ) t->st = TRIGGER_RECORDING;
+  if ( stage( t, &t->hook[START] ) == -1 ||
+       stage( t, &t->hook[STOP] ) == -1 )
+    goto fail;
+  return t;
+
+fail:
+  err = errno;
+  trigger_free( t );
+  errno = err;
+  return NULL;
+}
+
+int trigger_fd( struct trigger *t ) {
+  return t->ifd;
+}
+
+int trigger_motion( struct trigger *t, __u64 edge ) {
+  t->stats.edges++;
+  if ( t->prev != 0 && edge - t->prev < t->cfg.debounce ) {
+    t->prev = edge;
+    t->stats.bounces++;
+    return 0;
+  }
+  t->prev = edge;
+  t->last = edge;
+  switch ( t->st ) {
+    case TRIGGER_IDLE:
+      return start( t, edge, edge );
+    case TRIGGER_STOPPING:
+      // timed from the first motion picam has to catch up with
+      if ( !t->again ) t->edge = edge;
+      t->again = 1;
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+int trigger_handle( struct trigger *t, __u64 now ) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  int changed = 0, rec, rc;
+  ssize_t n;
+
+  while ( (n = read( t->ifd, buf, sizeof(buf) )) > 0 )
+    for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      if ( (ev->mask & IN_Q_OVERFLOW) ||
+           (ev->len > 0 && strcmp( ev->name, RECORD ) == 0) )
+        changed = 1;
+    }
+  if ( n == -1 && errno != EAGAIN && errno != EINTR ) return -1;
+
+  if ( changed && (rec = recording( t )) != -1 ) {
+    if ( rec == 1 && t->st != TRIGGER_RECORDING ) {
+      if ( t->st == TRIGGER_STARTING ) started( t, now );
+      // started by someone else, it is ours to stop all the same
+      else if ( t->st == TRIGGER_IDLE ) t->last = now;
+      t->st = TRIGGER_RECORDING;
+    } else if ( rec == 0 && t->st != TRIGGER_IDLE &&
+                t->st != TRIGGER_STARTING ) {
+      t->st = TRIGGER_IDLE;
+      if ( t->again ) {
+        t->again = 0;
+        if ( start( t, t->edge, now ) == -1 ) return -1;
+      }
+    }
+  }
+
+  if ( (t->st == TRIGGER_STARTING || t->st == TRIGGER_STOPPING) &&
+       now - t->sent >= t->cfg.timeout ) {
+    // picam is not there; the next motion tries again, a stop after the
+    // next hold
+    t->stats.timeouts++;
+    t->st = t->st == TRIGGER_STARTING ? TRIGGER_IDLE : TRIGGER_RECORDING;
+    t->last = now;
+    t->again = 0;
+  }
+  if ( t->st == TRIGGER_RECORDING && now - t->last >= t->cfg.hold ) {
+    if ( fire( t, &t->hook[STOP], now ) == -1 ) return -1;
+    t->st = TRIGGER_STOPPING;
+    t->stats.stops++;
+  }
+
+  // the trigger has gone out or been answered, get the next one ready
+  rc = 0;
+  if ( t->st != TRIGGER_STARTING ) rc |= stage( t, &t->hook[START] );
+  if ( t->st != TRIGGER_STOPPING ) rc |= stage( t, &t->hook[STOP] );
+  return rc == -1 ? -1 : t->st;
+}
+
+__u64 trigger_due( struct trigger *t ) {
+  switch ( t->st ) {
+    case TRIGGER_STARTING:
+    case TRIGGER_STOPPING:
+      return t->sent + t->cfg.timeout;
+    case TRIGGER_RECORDING:
+      return t->last + t->cfg.hold;
+    default:
+      return 0;
+  }
+}
+
+int trigger_state( struct trigger *t ) {
+  return t->st;
+}
+
+void trigger_stats( struct trigger *t, struct trigger_stats *st ) {
+  memcpy( st, &t->stats, sizeof(*st) );
+}
+
+__u64 trigger_percentile( const struct trigger_stats *st, double p ) {
+  __u64 total = 0, seen = 0;
+  int b;
+
+  for (b = 0; b <= METRICS_BUCKETS; b++) total += st->latency.count[b];
+  if ( total == 0 ) return 0;
+  for (b = 0; b < METRICS_BUCKETS; b++) {
+    seen += st->latency.count[b];
+    if ( seen >= p * total ) break;
+  }
+  // no slower than the slowest actually was
+  return (1024ULL << b) < st->latency_max ? 1024ULL << b : st->latency_max;
+}
+
+void trigger_free( struct trigger *t ) {
+  if ( t == NULL ) return;
+  for (int i = 0; i < HOOKS; i++)
+    if ( t->hook[i].fd != -1 ) {
+      close( t->hook[i].fd );
+      unlinkat( t->hooks, t->hook[i].staged, 0 );
+    }
+  if ( t->ifd != -1 ) close( t->ifd );
+  if ( t->state != -1 ) close( t->state );
+  if ( t->hooks != -1 ) close( t->hooks );
+  free( t );
+}
@@ -0,0 +1,104 @@
+/*
+ *  trigger.h
+ *    Motion to recording trigger: drives the hooks of picam from PIR edges
+ *    and times how long picam takes to start recording
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  picam starts recording when a file named start_record appears in its
+ *  hooks directory and stops on stop_record; it then writes "true" or
+ *  "false" to the file record in its state directory. Both directories are
+ *  in /dev/shm, see INSTALL.md.
+ *
+ *  Nothing is created or looked up when motion is seen. Both hook files are
+ *  staged in the hooks directory ahead of time under names picam ignores,
+ *  created empty and left open, and a trigger is a single rename into
+ *  place through the directory fd, which picam sees as IN_MOVED_TO. The
+ *  staged file is closed right after for watchers of IN_CLOSE_WRITE, and
+ *  the next one is staged once picam has answered, off the path of the
+ *  trigger.
+ *
+ *  The answer is waited for with inotify on the state directory, so it is
+ *  seen the moment picam closes record instead of at the next look. The
+ *  time from the PIR edge to that moment is the trigger latency, kept in
+ *  the stats and in the metrics segment as picam_trigger_latency_seconds.
+ *
+ *  A PIR output bounces and retriggers for as long as something moves.
+ *  Edges closer than cfg.debounce to the previous one are dropped; any
+ *  other edge while recording only pushes the stop back, which comes
+ *  cfg.hold after the last motion. Motion while a stop is under way starts
+ *  a new recording as soon as picam confirms the stop.
+ */
+#ifndef _TRIGGER_H_
+#define _TRIGGER_H_
+
+#include <asm/types.h>
+
+#include "metrics.h"
+
+#define TRIGGER_HOOKS_DIR "/dev/shm/hooks"
+#define TRIGGER_STATE_DIR "/dev/shm/state"
+
+enum {
+  TRIGGER_IDLE,
+  TRIGGER_STARTING,   // start_record is out, picam has not answered
+  TRIGGER_RECORDING,
+  TRIGGER_STOPPING,   // stop_record is out, picam has not answered
+};
+
+struct trigger_config {
+  __u64 debounce;  // ns, edges closer than this to the last are bounces
+  __u64 hold;      // ns the recording goes on after the last motion
+  __u64 timeout;   // ns picam has to answer a hook before it is given up
+};
+
+#define TRIGGER_CONFIG_DEFAULT { 50000000ULL, 10000000000ULL, 5000000000ULL }
+
+struct trigger_stats {
+  unsigned long edges;
+  unsigned long bounces;   // of those, dropped by the debounce
+  unsigned long starts;    // start_record hooks sent
+  unsigned long stops;
+  unsigned long started;   // recordings picam confirmed
+  unsigned long timeouts;  // hooks picam never answered
+  struct metrics_hist latency;  // edge to confirmed recording
+  __u64 latency_last;
+  __u64 latency_max;
+};
+
+struct trigger;
+
+/* Stage the hooks in hooks and watch state, both directories must exist.
+   cfg may be NULL for the defaults. */
+struct trigger *trigger_new( const char *hooks, const char *state,
+                             const struct trigger_config *cfg );
+
+/* Readable when picam has written its state, then call trigger_handle() */
+int trigger_fd( struct trigger *t );
+
+/* A PIR edge at edge (CLOCK_MONOTONIC). Returns 1 if it sent start_record,
+   0 if it did not need to, -1 and errno if the hook could not be sent. */
+int trigger_motion( struct trigger *t, __u64 edge );
+
+/* Take in what picam wrote and do what is due at now: stop a recording
+   whose hold has run out, give up on a hook with no answer. Returns the
+   state afterwards, or -1 and errno. */
+int trigger_handle( struct trigger *t, __u64 now );
+
+/* When trigger_handle() has something to do even without picam writing,
+   0 for never */
+__u64 trigger_due( struct trigger *t );
+
+int trigger_state( struct trigger *t );
+void trigger_stats( struct trigger *t, struct trigger_stats *st );
+
+/* Latency under which fraction p of the confirmed recordings started, in
+   ns: the upper edge of its bucket, or the maximum if that is lower */
+__u64 trigger_percentile( const struct trigger_stats *st, double p );
+
+/* Remove the staged hooks, the recording is left as it is */
+void trigger_free( struct trigger *t );
+
+#endif /* _TRIGGER_H_ */
@@ -0,0 +1,186 @@
+/*
+ *  triggerd.c
+ *    Starts and stops picam recordings on motion from the PIR sensor, see
+ *    trigger.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  usage: triggerd [-g gpio] [-k hooks dir] [-s state dir]
+ *                  [-d debounce ms] [-t hold s]
+ *    -g  the PIR output is on the sysfs GPIO number gpio; it is exported
+ *        and set up for rising edges, each of which is motion. Without it
+ *        only SIGTSTP is, as it was for fagelmatare-core.
+ *    -k  picam's hooks directory, TRIGGER_HOOKS_DIR by default
+ *    -s  picam's state directory, TRIGGER_STATE_DIR by default
+ *    -d  drop edges closer than debounce ms to the previous one, 50 ms by
+ *        default
+ *    -t  stop recording hold s after the last motion, 10 s by default
+ *
+ *  SIGTSTP fakes motion at any time. Every recording is logged to stderr
+ *  with its latency from the edge to picam confirming it, and the latency
+ *  percentiles on exit. The latencies also go to the metrics segment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/signalfd.h>
+
+#include "clock.h"
+#include "trigger.h"
+
+static int write_file( const char *path, const char *s ) {
+  int fd, rc;
+
+  fd = open( path, O_WRONLY | O_CLOEXEC );
+  if ( fd == -1 ) return -1;
+  rc = write( fd, s, strlen( s ) ) == (ssize_t) strlen( s ) ? 0 : -1;
+  close( fd );
+  return rc;
+}
+
+/* The value fd of gpio, set up as an input that wakes poll() with POLLPRI
+   on a rising edge */
+static int gpio_open( int gpio ) {
+  char path[64], num[16];
+
+  snprintf( num, sizeof(num), "%d", gpio );
+  // EBUSY when it is exported already
+  if ( write_file( "/sys/class/gpio/export", num ) == -1 && errno != EBUSY )
+    return -1;
+  snprintf( path, sizeof(path), "/sys/class/gpio/gpio%d/direction", gpio );
+  if ( write_file( path, "in" ) == -1 ) return -1;
+  snprintf( path, sizeof(path), "/sys/class/gpio/gpio%d/edge", gpio );
+  if ( write_file( path, "rising" ) == -1 ) return -1;
+  snprintf( path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio );
+  return open( path, O_RDONLY | O_CLOEXEC );
+}
+
+/* Read the value to clear the edge, 1 if the output is high */
+static int gpio_read( int fd ) {
+  char c = '0';
+
+  if ( lseek( fd, 0, SEEK_SET ) == -1 || read( fd, &c, 1 ) != 1 ) return -1;
+  return c == '1';
+}
+
+static void report( struct trigger *t ) {
+  struct trigger_stats st;
+
+  trigger_stats( t, &st );
+  fprintf( stderr, "%lu edges, %lu bounces, %lu starts, %lu started, %lu "
+           "stops, %lu timeouts\n", st.edges, st.bounces, st.starts,
+           st.started, st.stops, st.timeouts );
+  if ( st.started > 0 )
+    fprintf( stderr, "latency mean %.1f p50 %.1f p99 %.1f max %.1f ms\n",
+             st.latency.sum / 1e6 / st.started,
+             trigger_percentile( &st, 0.5 ) / 1e6,
+             trigger_percentile( &st, 0.99 ) / 1e6, st.latency_max / 1e6 );
+}
+
+int main( int argc, char **argv ) {
+  struct trigger_config cfg = TRIGGER_CONFIG_DEFAULT;
+  const char *hooks = TRIGGER_HOOKS_DIR;
+  const char *state = TRIGGER_STATE_DIR;
+  struct signalfd_siginfo si;
+  struct trigger_stats st;
+  struct pollfd pfd[3];
+  struct trigger *t;
+  unsigned long started = 0;
+  int gpio = -1, gfd = -1, sfd, opt, running = 1, was, now_st, timeout;
+  sigset_t mask;
+  __u64 now, due;
+
+  while ( (opt = getopt( argc, argv, "g:k:s:d:t:" )) != -1 ) {
+    switch ( opt ) {
+      case 'g': gpio = atoi( optarg ); break;
+      case 'k': hooks = optarg; break;
+      case 's': state = optarg; break;
+      case 'd': cfg.debounce = strtoull( optarg, NULL, 10 ) * 1000000ULL;
+                break;
+      case 't': cfg.hold = strtoull( optarg, NULL, 10 ) * 1000000000ULL;
+                break;
+      default:
+        fprintf( stderr, "usage: %s [-g gpio] [-k hooks dir] [-s state dir] "
+                 "[-d debounce ms] [-t hold s]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  if ( metrics_open( METRICS_SHM_NAME, "triggerd" ) == -1 )
+    perror( METRICS_SHM_NAME );
+  t = trigger_new( hooks, state, &cfg );
+  if ( t == NULL ) {
+    perror( "trigger_new" );
+    return 1;
+  }
+  if ( gpio != -1 && (gfd = gpio_open( gpio )) == -1 ) {
+    perror( "gpio" );
+    return 1;
+  }
+  // the first read clears the edge the setup may have left
+  if ( gfd != -1 ) gpio_read( gfd );
+
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGTSTP );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
+  sigprocmask( SIG_BLOCK, &mask, NULL );
+  sfd = signalfd( -1, &mask, SFD_CLOEXEC );
+  if ( sfd == -1 ) {
+    perror( "signalfd" );
+    return 1;
+  }
+
+  pfd[0] = (struct pollfd) { trigger_fd( t ), POLLIN, 0 };
+  pfd[1] = (struct pollfd) { sfd, POLLIN, 0 };
+  pfd[2] = (struct pollfd) { gfd, POLLPRI, 0 };
+  while ( running ) {
+    now = clock_ns( CLOCK_MONOTONIC );
+    due = trigger_due( t );
+    timeout = due == 0 ? -1 : due <= now ? 0 :
+              (int) ((due - now + 999999) / 1000000);
+    if ( poll( pfd, gfd == -1 ? 2 : 3, timeout ) == -1 && errno != EINTR ) {
+      perror( "poll" );
+      break;
+    }
+    // taken before anything else, the edge is what the latency is from
+    now = clock_ns( CLOCK_MONOTONIC );
+    was = trigger_state( t );
+
+    if ( gfd != -1 && (pfd[2].revents & POLLPRI) && gpio_read( gfd ) == 1 &&
+         trigger_motion( t, now ) == -1 )
+      perror( "start_record" );
+    if ( (pfd[1].revents & POLLIN) &&
+         read( sfd, &si, sizeof(si) ) == sizeof(si) ) {
+      if ( si.ssi_signo != SIGTSTP ) running = 0;
+      else if ( trigger_motion( t, now ) == -1 ) perror( "start_record" );
+    }
+
+    now_st = trigger_handle( t, clock_ns( CLOCK_MONOTONIC ) );
+    if ( now_st == -1 ) {
+      perror( "trigger_handle" );
+      continue;
+    }
+    trigger_stats( t, &st );
+    if ( st.started != started )
+      fprintf( stderr, "recording, %.1f ms after the motion\n",
+               st.latency_last / 1e6 );
+    if ( now_st == TRIGGER_IDLE && was != TRIGGER_IDLE )
+      fprintf( stderr, "stopped\n" );
+    started = st.started;
+  }
+
+  report( t );
+  trigger_free( t );
+  if ( gfd != -1 ) close( gfd );
+  close( sfd );
+  return 0;
+}
@@ -0,0 +1,537 @@
+/*
+ *  ts_store.c
+ *    Append-only binary time-series store for raw sense-hat samples
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "ts_store.h"
+
+/* The first record of every block is the keyframe itself, stored with
+   zero deltas so record numbers and index entries line up. Its dt is
+   TS_KEY_DT, which no delta takes, so a keyframe record whose index entry
+   never made it to disk is still recognised and the block dropped. */
+#define TS_KEY_DT 0xffffffffU
+
+struct ts_record {
+  __u32 dt;  // ns since the previous record
+  __s16 dp;
+  __s16 dh;
+  __s16 dtemp;
+  __u8 lps25h_status;
+  __u8 hts221_status;
+};
+
+struct ts_keyframe {
+  __u64 timestamp;
+  __u32 record;  // record number within the segment
+  __s32 p_raw;
+  __s16 h_raw;
+  __s16 t_raw;
+  __u32 reserved;
+};
+
+struct ts_store {
+  char *dir;
+  struct ts_store_config cfg;
+  int dat_fd, idx_fd;
+  __u64 seg_name;          // timestamp the current segment is named by
+  size_t seg_records;      // records in the segment, buffered ones included
+  size_t dat_written;      // records already in the data file
+  size_t idx_written;      // keyframes already in the index file
+  size_t since_key;        // records since the latest keyframe
+  struct ts_sample last;
+  int have_last;
+  struct ts_record *buf;
+  size_t nbuf;
+  struct ts_keyframe *kbuf;
+  size_t nkbuf;
+  __u64 last_sync;
+  int dirty;               // written since the last sync
+  struct ts_store_stats stats;
+};
+
+static int segment_path( char *path, const char *dir, __u64 name,
+                         const char *ext ) {
+  if ( snprintf( path, PATH_MAX, "%s/%016llx.%s", dir,
+                 (unsigned long long) name, ext ) >= PATH_MAX ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+static int is_segment( const struct dirent *d ) {
+  return strlen( d->d_name ) == 20 && strcmp( d->d_name + 16, ".tsd" ) == 0;
+}
+
+/* Names of all segments in time order, the hex names sort by time */
+static int list_segments( const char *dir, __u64 **names ) {
+  struct dirent **ents;
+  int n;
+
+  n = scandir( dir, &ents, is_segment, alphasort );
+  if ( n == -1 ) return -1;
+  *names = malloc( (n ? n : 1) * sizeof(__u64) );
+  for (int i = 0; i < n; i++) {
+    if ( *names != NULL ) (*names)[i] = strtoull( ents[i]->d_name, NULL, 16 );
+    free( ents[i] );
+  }
+  free( ents );
+  if ( *names == NULL ) return -1;
+  return n;
+}
+
+static int write_all( int fd, const void *buf, size_t len, off_t off ) {
+  const char *p = buf;
+  ssize_t res;
+
+  while ( len > 0 ) {
+    res = pwrite( fd, p, len, off );
+    if ( res == -1 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    p += res;
+    off += res;
+    len -= res;
+  }
+  return 0;
+}
+
+/* Cut off whatever part of a failed batch made it to disk, so that the
+   retry writes it again from a record boundary */
+static void rewind_batch( struct ts_store *st ) {
+  int err = errno;
+
+  if ( ftruncate( st->dat_fd,
+                  st->dat_written * sizeof(struct ts_record) ) == 0 &&
+       ftruncate( st->idx_fd,
+                  st->idx_written * sizeof(struct ts_keyframe) ) == 0 )
+    st->dirty = 1;
+  errno = err;
+}
+
+static int write_out( struct ts_store *st ) {
+  size_t rlen = st->nbuf * sizeof(struct ts_record);
+  size_t klen = st->nkbuf * sizeof(struct ts_keyframe);
+
+  // records go out before the keyframes that point at them
+  if ( st->nbuf > 0 ) {
+    if ( write_all( st->dat_fd, st->buf, rlen,
+                    st->dat_written * sizeof(struct ts_record) ) == -1 )
+      goto fail;
+    st->stats.writes++;
+  }
+  if ( st->nkbuf > 0 ) {
+    if ( write_all( st->idx_fd, st->kbuf, klen,
+                    st->idx_written * sizeof(struct ts_keyframe) ) == -1 )
+      goto fail;
+    st->stats.writes++;
+  }
+  st->dat_written += st->nbuf;
+  st->idx_written += st->nkbuf;
+  st->stats.bytes += rlen + klen;
+  st->dirty |= st->nbuf > 0 || st->nkbuf > 0;
+  st->nbuf = 0;
+  st->nkbuf = 0;
+  return 0;
+
+fail:
+  rewind_batch( st );
+  return -1;
+}
+
+static int sync_files( struct ts_store *st ) {
+  st->last_sync = clock_ns( CLOCK_MONOTONIC );
+  if ( !st->dirty ) return 0;
+  if ( fdatasync( st->dat_fd ) == -1 || fdatasync( st->idx_fd ) == -1 )
+    return -1;
+  st->stats.syncs++;
+  st->dirty = 0;
+  return 0;
+}
+
+static void close_segment( struct ts_store *st ) {
+  if ( st->dat_fd != -1 ) close( st->dat_fd );
+  if ( st->idx_fd != -1 ) close( st->idx_fd );
+  st->dat_fd = st->idx_fd = -1;
+}
+
+static int open_segment( struct ts_store *st, __u64 name, int create ) {
+  char path[PATH_MAX];
+  int flags = O_RDWR | (create ? O_CREAT | O_TRUNC : 0);
+  int err;
+
+  if ( segment_path( path, st->dir, name, "tsd" ) == -1 ) return -1;
+  st->dat_fd = open( path, flags, 0644 );
+  if ( st->dat_fd == -1 ) return -1;
+  if ( segment_path( path, st->dir, name, "tsi" ) == -1 ) goto fail;
+  st->idx_fd = open( path, flags | O_CREAT, 0644 );
+  if ( st->idx_fd == -1 ) goto fail;
+  st->seg_name = name;
+  return 0;
+
+fail:
+  err = errno;
+  close_segment( st );
+  errno = err;
+  return -1;
+}
+
+/* Pick up the latest segment after a restart: drop a torn trailing record
+   or keyframe, keyframes whose records never made it to disk, and blocks
+   whose keyframe never made it to the index, then decode the last block
+   to get the values the next delta is taken from.
+   A segment that cannot be continued is left alone and the next append
+   starts a new one. */
+static int recover( struct ts_store *st, __u64 name ) {
+  struct ts_keyframe key;
+  struct ts_record rec;
+  struct stat sd, si;
+  size_t n, m;
+
+  if ( open_segment( st, name, 0 ) == -1 ) return -1;
+  if ( fstat( st->dat_fd, &sd ) == -1 || fstat( st->idx_fd, &si ) == -1 )
+    goto fail;
+  n = sd.st_size / sizeof(struct ts_record);
+  m = si.st_size / sizeof(struct ts_keyframe);
+
+  while ( m > 0 ) {
+    if ( pread( st->idx_fd, &key, sizeof(key),
+                (m - 1) * sizeof(key) ) != sizeof(key) )
+      goto fail;
+    if ( key.record < n ) break;
+    m--;
+  }
+  if ( m == 0 || n == 0 ) {
+    close_segment( st );
+    return 0;
+  }
+  // the records of a batch go out before its keyframes, a crash between
+  // the two leaves blocks that would decode as deltas of the last indexed
+  for (size_t i = key.record + 1; i < n; i++) {
+    if ( pread( st->dat_fd, &rec, sizeof(rec),
+                i * sizeof(rec) ) != sizeof(rec) )
+      goto fail;
+    if ( rec.dt == TS_KEY_DT ) {
+      n = i;
+      break;
+    }
+  }
+  if ( ftruncate( st->dat_fd, n * sizeof(struct ts_record) ) == -1 ||
+       ftruncate( st->idx_fd, m * sizeof(struct ts_keyframe) ) == -1 )
+    goto fail;
+
+  st->last.timestamp = key.timestamp;
+  st->last.p_raw = key.p_raw;
+  st->last.h_raw = key.h_raw;
+  st->last.t_raw = key.t_raw;
+  for (size_t i = key.record; i < n; i++) {
+    if ( pread( st->dat_fd, &rec, sizeof(rec),
+                i * sizeof(rec) ) != sizeof(rec) )
+      goto fail;
+    if ( i != key.record ) {
+      st->last.timestamp += rec.dt;
+      st->last.p_raw += rec.dp;
+      st->last.h_raw += rec.dh;
+      st->last.t_raw += rec.dtemp;
+    }
+    st->last.lps25h_status = rec.lps25h_status;
+    st->last.hts221_status = rec.hts221_status;
+  }
+  st->have_last = 1;
+  st->seg_records = st->dat_written = n;
+  st->idx_written = m;
+  st->since_key = n - key.record;
+  return 0;
+
+fail:
+  close_segment( st );
+  return -1;
+}
+
+struct ts_store *ts_store_open( const char *dir,
+                                const struct ts_store_config *cfg ) {
+  static const struct ts_store_config defaults = TS_STORE_CONFIG_DEFAULT;
+  struct ts_store *st;
+  __u64 *names = NULL;
+  int n, err;
+
+  st = calloc( 1, sizeof(struct ts_store) );
+  if ( st == NULL ) return NULL;
+  st->cfg = cfg != NULL ? *cfg : defaults;
+  st->dat_fd = st->idx_fd = -1;
+  if ( st->cfg.batch == 0 || st->cfg.segment_records == 0 ||
+       st->cfg.index_interval == 0 ) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  st->dir = strdup( dir );
+  st->buf = malloc( st->cfg.batch * sizeof(struct ts_record) );
+  st->kbuf = malloc( st->cfg.batch * sizeof(struct ts_keyframe) );
+  if ( st->dir == NULL || st->buf == NULL || st->kbuf == NULL ) goto fail;
+
+  if ( mkdir( dir, 0755 ) == -1 && errno != EEXIST ) goto fail;
+  n = list_segments( dir, &names );
+  if ( n == -1 ) goto fail;
+  if ( n > 0 && recover( st, names[n - 1] ) == -1 ) goto fail;
+  // a new segment must sort after every existing one
+  if ( st->dat_fd == -1 && n > 0 ) st->seg_name = names[n - 1];
+  free( names );
+  st->last_sync = clock_ns( CLOCK_MONOTONIC );
+  return st;
+
+fail:
+  err = errno;
+  free( names );
+  free( st->kbuf );
+  free( st->buf );
+  free( st->dir );
+  free( st );
+  errno = err;
+  return NULL;
+}
+
+static int roll( struct ts_store *st, __u64 timestamp ) {
+  __u64 name = timestamp;
+
+  if ( st->dat_fd != -1 ) {
+    if ( write_out( st ) == -1 || sync_files( st ) == -1 ) return -1;
+    close_segment( st );
+  }
+  // sort after every segment and every sample written, also when the clock
+  // stepped back
+  if ( st->have_last && name < st->last.timestamp )
+    name = st->last.timestamp;
+  if ( st->seg_name != 0 && name <= st->seg_name ) name = st->seg_name + 1;
+  if ( open_segment( st, name, 1 ) == -1 ) return -1;
+  st->seg_records = st->dat_written = st->idx_written = 0;
+  st->since_key = 0;
+  st->stats.segments++;
+  return 0;
+}
+
+static int fits_s16( __s32 d ) {
+  return d >= -32768 && d <= 32767;
+}
+
+int ts_store_append( struct ts_store *st, const struct ts_sample *s ) {
+  struct ts_record *rec;
+  struct ts_keyframe *key;
+  __u64 dt = 0;
+  __s32 dp = 0, dh = 0, dtemp = 0;
+  int keyframe, back;
+
+  // a batch that failed to go out earlier is retried before taking more
+  if ( st->nbuf == st->cfg.batch && write_out( st ) == -1 ) return -1;
+  back = st->have_last && s->timestamp < st->last.timestamp;
+  if ( st->dat_fd == -1 || back ||
+       st->seg_records >= st->cfg.segment_records ) {
+    if ( roll( st, s->timestamp ) == -1 ) return -1;
+    if ( back ) st->stats.steps++;
+  }
+
+  keyframe = st->seg_records == 0 || st->since_key >= st->cfg.index_interval;
+  if ( !keyframe ) {
+    dt = s->timestamp - st->last.timestamp;
+    dp = s->p_raw - st->last.p_raw;
+    dh = s->h_raw - st->last.h_raw;
+    dtemp = s->t_raw - st->last.t_raw;
+    keyframe = dt >= TS_KEY_DT || !fits_s16( dp ) || !fits_s16( dh ) ||
+               !fits_s16( dtemp );
+  }
+
+  rec = &st->buf[st->nbuf++];
+  if ( keyframe ) {
+    key = &st->kbuf[st->nkbuf++];
+    key->timestamp = s->timestamp;
+    key->record = st->seg_records;
+    key->p_raw = s->p_raw;
+    key->h_raw = s->h_raw;
+    key->t_raw = s->t_raw;
+    key->reserved = 0;
+    dt = TS_KEY_DT;
+    dp = dh = dtemp = 0;
+    st->since_key = 0;
+    st->stats.keyframes++;
+  }
+  rec->dt = dt;
+  rec->dp = dp;
+  rec->dh = dh;
+  rec->dtemp = dtemp;
+  rec->lps25h_status = s->lps25h_status;
+  rec->hts221_status = s->hts221_status;
+
+  st->seg_records++;
+  st->since_key++;
+  st->last = *s;
+  st->have_last = 1;
+  st->stats.records++;
+
+  if ( st->nbuf == st->cfg.batch ) {
+    if ( write_out( st ) == -1 ) return -1;
+    if ( clock_ns( CLOCK_MONOTONIC ) - st->last_sync >= st->cfg.fsync_interval )
+      return sync_files( st );
+  }
+  return 0;
+}
+
+int ts_store_flush( struct ts_store *st, int sync ) {
+  if ( st->dat_fd == -1 ) return 0;
+  if ( write_out( st ) == -1 ) return -1;
+  return sync ? sync_files( st ) : 0;
+}
+
+void ts_store_stats( struct ts_store *st, struct ts_store_stats *stats ) {
+  memcpy( stats, &st->stats, sizeof(struct ts_store_stats) );
+}
+
+int ts_store_close( struct ts_store *st ) {
+  int res;
+
+  if ( st == NULL ) return 0;
+  res = ts_store_flush( st, 1 );
+  close_segment( st );
+  free( st->kbuf );
+  free( st->buf );
+  free( st->dir );
+  free( st );
+  return res;
+}
+
+static void *map_file( const char *path, size_t *size ) {
+  struct stat sb;
+  void *p;
+  int fd;
+
+  *size = 0;
+  fd = open( path, O_RDONLY );
+  if ( fd == -1 ) return NULL;
+  if ( fstat( fd, &sb ) == -1 || sb.st_size == 0 ) {
+    close( fd );
+    return NULL;
+  }
+  p = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( p == MAP_FAILED ) return NULL;
+  *size = sb.st_size;
+  return p;
+}
+
+/* Decode one segment from the last keyframe before t0. Returns the number
+   of samples visited, or -(visited + 1) when fn asked to stop. */
+static long query_segment( const char *dir, __u64 name, __u64 t0, __u64 t1,
+                           ts_store_fn fn, void *arg ) {
+  char path[PATH_MAX];
+  const struct ts_record *recs;
+  const struct ts_keyframe *keys;
+  struct ts_sample s;
+  size_t dsize, isize, n, m, lo, hi, k;
+  long visited = 0;
+  int stop = 0;
+
+  if ( segment_path( path, dir, name, "tsd" ) == -1 ) return 0;
+  recs = map_file( path, &dsize );
+  if ( recs == NULL ) return 0;
+  if ( segment_path( path, dir, name, "tsi" ) == -1 ) {
+    munmap( (void *) recs, dsize );
+    return 0;
+  }
+  keys = map_file( path, &isize );
+  if ( keys == NULL ) {
+    munmap( (void *) recs, dsize );
+    return 0;
+  }
+  n = dsize / sizeof(struct ts_record);
+  m = isize / sizeof(struct ts_keyframe);
+  while ( m > 0 && keys[m - 1].record >= n ) m--;
+  // starts after the range, unless the segment is named for a clock step
+  if ( m > 0 && keys[0].timestamp > t1 ) m = 0;
+
+  // last keyframe strictly before t0, equal timestamps may span blocks
+  lo = 0;
+  hi = m;
+  while ( hi - lo > 1 ) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ( keys[mid].timestamp < t0 ) lo = mid;
+    else hi = mid;
+  }
+
+  for (k = lo; k < m && !stop; k++) {
+    size_t end = k + 1 < m ? keys[k + 1].record : n;
+
+    s.timestamp = keys[k].timestamp;
+    s.p_raw = keys[k].p_raw;
+    s.h_raw = keys[k].h_raw;
+    s.t_raw = keys[k].t_raw;
+    for (size_t i = keys[k].record; i < end; i++) {
+      if ( i != keys[k].record ) {
+        // a block whose keyframe is not in the index yet, or never will be
+        if ( recs[i].dt == TS_KEY_DT ) {
+          stop = 1;
+          break;
+        }
+        s.timestamp += recs[i].dt;
+        s.p_raw += recs[i].dp;
+        s.h_raw += recs[i].dh;
+        s.t_raw += recs[i].dtemp;
+      }
+      s.lps25h_status = recs[i].lps25h_status;
+      s.hts221_status = recs[i].hts221_status;
+      if ( s.timestamp > t1 ) {
+        stop = 1;
+        break;
+      }
+      if ( s.timestamp < t0 ) continue;
+      visited++;
+      if ( fn( arg, &s ) != 0 ) {
+        visited = -(visited + 1);
+        stop = 1;
+        break;
+      }
+    }
+  }
+
+  munmap( (void *) keys, isize );
+  munmap( (void *) recs, dsize );
+  return visited;
+}
+
+long ts_store_query( const char *dir, __u64 t0, __u64 t1, ts_store_fn fn,
+                     void *arg ) {
+  __u64 *names;
+  long total = 0, res;
+  int n;
+
+  n = list_segments( dir, &names );
+  if ( n == -1 ) return -1;
+  for (int i = 0; i < n; i++) {
+    // every sample of segment i is at or before the name of segment i + 1,
+    // but a segment started by a clock step is named after its samples
+    if ( i + 1 < n && names[i + 1] < t0 ) continue;
+    res = query_segment( dir, names[i], t0, t1, fn, arg );
+    if ( res < 0 ) {
+      total += -res - 1;
+      break;
+    }
+    total += res;
+  }
+  free( names );
+  return total;
+}
@@ -0,0 +1,101 @@
+/*
+ *  ts_store.h
+ *    Append-only binary time-series store for raw sense-hat samples
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  A store is a directory of segments. Each segment is a pair of files
+ *  named after the timestamp of its first sample (16 hex digits):
+ *    <ts>.tsd  fixed size 12 byte records, each holding the time and value
+ *              deltas from the previous record and both status bytes
+ *    <ts>.tsi  sparse time index, a keyframe with the absolute timestamp
+ *              and values for every index_interval records, and wherever a
+ *              delta does not fit its field
+ *  A range query maps both files, binary searches the index for the
+ *  keyframe just before the start of the range and decodes forward from
+ *  there, so only the blocks covering the range are touched.
+ *
+ *  The timestamps are CLOCK_REALTIME, which can step back, e.g. when NTP
+ *  first sets the clock of a Pi without an RTC. Records within a segment
+ *  are in time order, so a sample older than the one before it starts a
+ *  new segment. That segment is named after the last sample before the
+ *  step, so the segments still sort in the order they were written.
+ *
+ *  Appends are collected in memory and written batch records at a time.
+ *  The files are fdatasync'd at most once per fsync_interval to spare the
+ *  SD card; a crash loses at most the unsynced tail. The partially
+ *  written record or keyframe it may leave behind is dropped on the next
+ *  open, as are records whose keyframe never reached the index: keyframe
+ *  records are marked in the data file, so such a block is not decoded
+ *  from the keyframe before it. Errors are reported as -1 (or NULL) with
+ *  errno set.
+ */
+#ifndef _TS_STORE_H_
+#define _TS_STORE_H_
+
+#include <stddef.h>
+#include <asm/types.h>
+
+struct ts_sample {
+  __u64 timestamp;  // ns, non-decreasing within a segment (CLOCK_REALTIME)
+  __s32 p_raw;      // LPS25H PRESS_OUT
+  __s16 h_raw;      // HTS221 HUMIDITY_OUT
+  __s16 t_raw;      // HTS221 TEMP_OUT
+  __u8 lps25h_status;
+  __u8 hts221_status;
+};
+
+struct ts_store_config {
+  size_t batch;              // records per write()
+  __u64 fsync_interval;      // ns between fdatasync() calls
+  size_t segment_records;    // records before rolling to a new segment
+  size_t index_interval;     // records between keyframes
+};
+
+/* 64 records per write, sync every minute, a segment per ~23 hours and
+   a keyframe per ~20 seconds at 12.5 Hz */
+#define TS_STORE_CONFIG_DEFAULT { 64, 60000000000ULL, 1 << 20, 256 }
+
+struct ts_store_stats {
+  unsigned long records;    // samples appended
+  unsigned long keyframes;  // index entries written
+  unsigned long writes;     // write calls to the data and index files
+  unsigned long syncs;      // fdatasync calls
+  unsigned long segments;   // segments started
+  unsigned long steps;      // of those, started as the clock went back
+  unsigned long bytes;      // bytes written to both files
+};
+
+struct ts_store;
+
+/* Open the store in dir for appending, continuing its latest segment.
+   cfg may be NULL for the defaults. */
+struct ts_store *ts_store_open( const char *dir,
+                                const struct ts_store_config *cfg );
+
+/* Append one sample. A timestamp before the previous one starts a new
+   segment. If the batch it completes cannot be written the sample is
+   still kept, and the write is retried by the next append or flush. */
+int ts_store_append( struct ts_store *st, const struct ts_sample *s );
+
+/* Write out everything buffered, and fdatasync if sync is set */
+int ts_store_flush( struct ts_store *st, int sync );
+
+void ts_store_stats( struct ts_store *st, struct ts_store_stats *stats );
+
+/* Flush, sync and close */
+int ts_store_close( struct ts_store *st );
+
+/* Called for every sample in the range, return non-zero to stop early */
+typedef int (*ts_store_fn)( void *arg, const struct ts_sample *s );
+
+/* Visit the samples with t0 <= timestamp <= t1 in time order, except that
+   samples from after the clock stepped back come after those from before
+   the step. Returns the number of samples visited. Only data that has been
+   written out is seen, so a reader may run alongside the writer. */
+long ts_store_query( const char *dir, __u64 t0, __u64 t1, ts_store_fn fn,
+                     void *arg );
+
+#endif /* _TS_STORE_H_ */
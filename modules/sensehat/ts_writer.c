@@ -0,0 +1,160 @@
+/*
+ *  ts_writer.c
+ *    Appends the sample batches handed to it to a time-series store on a
+ *    thread of its own, see ts_store.h and sample_pool.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ts_writer.h"
+
+struct ts_writer {
+  struct ts_store *st;
+  int pipe[2];
+  pthread_t thread;
+  int reported;                 // errno last reported, 0 once appends work
+  pthread_mutex_t lock;         // stats, between the two threads
+  struct ts_writer_stats stats;
+};
+
+static void *run( void *arg ) {
+  struct ts_writer *w = arg;
+  struct sample_batch *b;
+  unsigned long errors;
+  int err;
+  ssize_t n;
+
+  // the write end is closed once everything is handed over
+  while ( (n = read( w->pipe[0], &b, sizeof(b) )) != 0 ) {
+    if ( n == -1 ) {
+      if ( errno == EINTR ) continue;
+      perror( "ts_writer" );
+      break;
+    }
+    errors = 0;
+    err = 0;
+    for (size_t i = 0; i < b->count; i++) {
+      const struct sample_link_rec *r = &b->rec[i];
+      struct ts_sample rec = {
+        .timestamp = r->timestamp,
+        .p_raw = r->s.p_raw,
+        .h_raw = r->s.h_raw,
+        .t_raw = r->s.t_raw,
+        .lps25h_status = r->s.lps25h_status,
+        .hts221_status = r->s.hts221_status,
+      };
+
+      if ( ts_store_append( w->st, &rec ) == -1 ) {
+        errors++;
+        err = errno;
+      }
+    }
+    // nothing stays behind in the store once a batch is written, a batch
+    // that straddled a segment roll leaves its tail there otherwise
+    if ( ts_store_flush( w->st, 0 ) == -1 && err == 0 ) err = errno;
+    // once per cause, not once per batch while the card is full
+    if ( err != 0 && err != w->reported )
+      fprintf( stderr, "ts_writer: %s\n", strerror( err ) );
+    w->reported = err;
+
+    pthread_mutex_lock( &w->lock );
+    w->stats.batches++;
+    w->stats.records += b->count;
+    w->stats.errors += errors;
+    w->stats.backlog--;
+    pthread_mutex_unlock( &w->lock );
+    sample_batch_put( &b );
+  }
+  return NULL;
+}
+
+struct ts_writer *ts_writer_new( struct ts_store *st ) {
+  struct ts_writer *w;
+  sigset_t all, old;
+  int rc;
+
+  w = calloc( 1, sizeof(struct ts_writer) );
+  if ( w == NULL ) return NULL;
+  w->st = st;
+  if ( pipe( w->pipe ) == -1 ) {
+    free( w );
+    return NULL;
+  }
+  fcntl( w->pipe[0], F_SETFD, FD_CLOEXEC );
+  fcntl( w->pipe[1], F_SETFD, FD_CLOEXEC );
+  pthread_mutex_init( &w->lock, NULL );
+
+  // signals are for the loop handing batches over, not for the writer
+  sigfillset( &all );
+  pthread_sigmask( SIG_SETMASK, &all, &old );
+  rc = pthread_create( &w->thread, NULL, run, w );
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+  if ( rc != 0 ) {
+    close( w->pipe[0] );
+    close( w->pipe[1] );
+    pthread_mutex_destroy( &w->lock );
+    free( w );
+    errno = rc;
+    return NULL;
+  }
+  return w;
+}
+
+int ts_writer_hand( struct ts_writer *w, struct sample_batch **b ) {
+  struct sample_batch *m = sample_batch_move( b );
+  ssize_t n;
+
+  pthread_mutex_lock( &w->lock );
+  if ( ++w->stats.backlog > w->stats.most_backlog )
+    w->stats.most_backlog = w->stats.backlog;
+  pthread_mutex_unlock( &w->lock );
+
+  // a pointer is far below PIPE_BUF, it goes in whole or not at all
+  while ( (n = write( w->pipe[1], &m, sizeof(m) )) == -1 && errno == EINTR );
+  if ( n != sizeof(m) ) {
+    pthread_mutex_lock( &w->lock );
+    w->stats.backlog--;
+    pthread_mutex_unlock( &w->lock );
+    sample_batch_put( &m );
+    return -1;
+  }
+  return 0;
+}
+
+void ts_writer_stats( struct ts_writer *w, struct ts_writer_stats *stats ) {
+  pthread_mutex_lock( &w->lock );
+  memcpy( stats, &w->stats, sizeof(struct ts_writer_stats) );
+  pthread_mutex_unlock( &w->lock );
+}
+
+int ts_writer_stop( struct ts_writer *w ) {
+  int rc;
+
+  if ( w->pipe[1] == -1 ) return 0;
+  close( w->pipe[1] );
+  w->pipe[1] = -1;
+  rc = pthread_join( w->thread, NULL );
+  if ( rc != 0 ) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+void ts_writer_free( struct ts_writer *w ) {
+  if ( w == NULL ) return;
+  ts_writer_stop( w );
+  close( w->pipe[0] );
+  pthread_mutex_destroy( &w->lock );
+  free( w );
+}
@@ -0,0 +1,57 @@
+/*
+ *  ts_writer.h
+ *    Appends the sample batches handed to it to a time-series store on a
+ *    thread of its own, see ts_store.h and sample_pool.h
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  The write() of a batch and the fdatasync() once a minute can stall for
+ *  as long as the SD card takes, which the acquisition loop should not
+ *  wait for. Here it does not: the loop fills a batch from its pool and
+ *  hands the full batch over, which moves the pointer through a pipe and
+ *  nothing else. The writer appends the records and puts the batch back.
+ *
+ *  While the card stalls the batches pile up in the pipe, as many as the
+ *  pool has. The pipe holds thousands, so handing one over never blocks.
+ *
+ *  The store is flushed after every batch, so the batch being filled is
+ *  all a kill loses. With batches of as many records as the store's batch
+ *  a batch is also one write(). Failed appends are counted, and reported
+ *  on stderr when they start and when their cause changes.
+ */
+#ifndef _TS_WRITER_H_
+#define _TS_WRITER_H_
+
+#include "sample_pool.h"
+#include "ts_store.h"
+
+struct ts_writer_stats {
+  unsigned long batches;   // written
+  unsigned long records;
+  unsigned long errors;    // appends that failed
+  unsigned long backlog;   // batches handed over and not yet written
+  unsigned long most_backlog;
+};
+
+struct ts_writer;
+
+/* Start the thread. The writer does not own st, and nothing else may
+   append to it until ts_writer_free() returns. */
+struct ts_writer *ts_writer_new( struct ts_store *st );
+
+/* Move the batch *b to the writer, which puts it back to its pool once
+   written; *b is cleared. On error the batch is put back unwritten. */
+int ts_writer_hand( struct ts_writer *w, struct sample_batch **b );
+
+void ts_writer_stats( struct ts_writer *w, struct ts_writer_stats *stats );
+
+/* Write everything handed over and stop the thread. Nothing may be handed
+   over after, but the stats are kept. */
+int ts_writer_stop( struct ts_writer *w );
+
+/* Stops the thread first if need be */
+void ts_writer_free( struct ts_writer *w );
+
+#endif /* _TS_WRITER_H_ */
@@ -0,0 +1,198 @@
+/*
+ *  weather.c
+ *    Streaming weather event detector on filtered pressure, temperature
+ *    and humidity derivatives
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "weather.h"
+
+const char *const weather_names[WEATHER_CHANNELS] = {
+  "pressure", "temperature", "humidity"
+};
+
+struct channel {
+  int started;
+  __u64 last;     // timestamp of the last reading
+  __u64 next;     // the next grid point, always after last
+  double ema;     // average at last
+  double ring[WEATHER_MAX_WINDOW];
+  int head;       // oldest point once the window is full
+  int count;
+  double denom;   // sum of k^2 over the window, k from -m to m
+  float rate;     // units per hour as of the newest point
+  int active;
+};
+
+struct weather {
+  struct weather_config cfg;
+  weather_event_fn fn;
+  void *arg;
+  struct channel ch[WEATHER_CHANNELS];
+  struct weather_stats stats;
+};
+
+struct weather *weather_new( const struct weather_config *cfg,
+                             weather_event_fn fn, void *arg ) {
+  static const struct weather_config defaults = WEATHER_CONFIG_DEFAULT;
+  struct weather *w;
+
+  w = calloc( 1, sizeof(struct weather) );
+  if ( w == NULL ) return NULL;
+  w->cfg = cfg != NULL ? *cfg : defaults;
+  w->fn = fn;
+  w->arg = arg;
+  for (int c = 0; c < WEATHER_CHANNELS; c++) {
+    const struct weather_channel_config *cc = &w->cfg.ch[c];
+    double m = cc->window / 2;
+
+    if ( cc->step == 0 || cc->window < 3 || cc->window % 2 == 0 ||
+         cc->window > WEATHER_MAX_WINDOW ) {
+      free( w );
+      errno = EINVAL;
+      return NULL;
+    }
+    w->ch[c].denom = m * (m + 1) * (2 * m + 1) / 3;
+    w->ch[c].active = -1;
+  }
+  return w;
+}
+
+static void emit( struct weather *w, int c, __u64 ts, int kind, int start ) {
+  struct channel *ch = &w->ch[c];
+  const struct weather_channel_config *cc = &w->cfg.ch[c];
+  struct weather_event ev = {
+    .timestamp = ts,
+    .channel = c,
+    .kind = kind,
+    .start = start,
+    .rate = ch->rate,
+    .value = ch->ring[(ch->head + cc->window - 1) % cc->window],
+  };
+
+  ch->active = start ? kind : -1;
+  w->stats.events++;
+  if ( w->fn != NULL ) w->fn( w->arg, &ev );
+}
+
+/* The slope of the least squares line through the window, ring[head] at
+   k = -m up to the newest at k = m */
+static void evaluate( struct weather *w, int c, __u64 ts ) {
+  struct channel *ch = &w->ch[c];
+  const struct weather_channel_config *cc = &w->cfg.ch[c];
+  double sum = 0.0;
+  int i, k = -(cc->window / 2);
+
+  for (i = ch->head; i < cc->window; i++) sum += k++ * ch->ring[i];
+  for (i = 0; i < ch->head; i++) sum += k++ * ch->ring[i];
+  ch->rate = sum / ch->denom * (3600e9 / cc->step);
+
+  if ( ch->active == -1 ) {
+    if ( cc->rise > 0 && ch->rate >= cc->rise )
+      emit( w, c, ts, WEATHER_RISE, 1 );
+    else if ( cc->fall > 0 && ch->rate <= -cc->fall )
+      emit( w, c, ts, WEATHER_FALL, 1 );
+  } else if ( ch->active == WEATHER_RISE ?
+              ch->rate < cc->rise * WEATHER_CLEAR :
+              ch->rate > -cc->fall * WEATHER_CLEAR ) {
+    emit( w, c, ts, ch->active, 0 );
+  }
+}
+
+static void push( struct weather *w, int c, __u64 ts, double y ) {
+  struct channel *ch = &w->ch[c];
+  int window = w->cfg.ch[c].window;
+
+  w->stats.points++;
+  if ( ch->count < window ) {
+    ch->ring[ch->count++] = y;
+    if ( ch->count == window ) evaluate( w, c, ts );
+    return;
+  }
+  ch->ring[ch->head] = y;
+  if ( ++ch->head == window ) ch->head = 0;
+  evaluate( w, c, ts );
+}
+
+static void take( struct weather *w, int c, __u64 t, double v ) {
+  struct channel *ch = &w->ch[c];
+  const struct weather_channel_config *cc = &w->cfg.ch[c];
+  __u64 dt, n;
+  double prev;
+
+  w->stats.readings++;
+  if ( !ch->started ) {
+    ch->started = 1;
+    ch->ema = v;
+    ch->last = t;
+    ch->next = t - t % cc->step + cc->step;
+    return;
+  }
+  if ( t <= ch->last ) {
+    w->stats.late++;
+    return;
+  }
+
+  // the weight of a reading grows with the time it stands for
+  dt = t - ch->last;
+  prev = ch->ema;
+  ch->ema += (v - prev) * dt / (double) (cc->tau + dt);
+
+  if ( t >= ch->next ) {
+    n = (t - ch->next) / cc->step + 1;
+    if ( n > (__u64) cc->window ) {
+      // nothing of the window would be left but made up points
+      ch->count = 0;
+      ch->head = 0;
+      ch->next += (n - 1) * cc->step;
+      n = 1;
+      w->stats.resets++;
+    } else {
+      w->stats.filled += n - 1;
+    }
+    for (; n > 0; n--, ch->next += cc->step)
+      push( w, c, ch->next, prev + (ch->ema - prev) *
+            (ch->next - ch->last) / (double) dt );
+  }
+  ch->last = t;
+}
+
+void weather_add( struct weather *w, __u64 timestamp,
+                  const float v[WEATHER_CHANNELS], int fresh ) {
+  for (int c = 0; c < WEATHER_CHANNELS; c++)
+    if ( fresh & (1 << c) ) take( w, c, timestamp, v[c] );
+}
+
+int weather_reading( struct weather *w, int channel,
+                     struct weather_reading *r ) {
+  struct channel *ch;
+
+  if ( channel < 0 || channel >= WEATHER_CHANNELS ) {
+    errno = EINVAL;
+    return -1;
+  }
+  ch = &w->ch[channel];
+  if ( !ch->started ) {
+    errno = ENODATA;
+    return -1;
+  }
+  r->value = ch->ema;
+  r->rate = ch->rate;
+  r->ready = ch->count == w->cfg.ch[channel].window;
+  r->active = ch->active;
+  return 0;
+}
+
+void weather_stats( struct weather *w, struct weather_stats *stats ) {
+  memcpy( stats, &w->stats, sizeof(struct weather_stats) );
+}
+
+void weather_free( struct weather *w ) {
+  free( w );
+}
@@ -0,0 +1,125 @@
+/*
+ *  weather.h
+ *    Streaming weather event detector on filtered pressure, temperature
+ *    and humidity derivatives
+ *****************************************************************************
+ *  This file is part of Fagelmatare, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Licensed under the GNU General Public License version 3 or later.
+ *****************************************************************************
+ *  Calibrated readings go in one at a time, each channel only when its
+ *  sensor has a fresh one, and events come out through a callback as the
+ *  rate of change of a channel crosses its thresholds: pressure falling
+ *  before rain, humidity shooting up, the temperature drop of a shower.
+ *
+ *  Per channel the readings are low-passed by an exponential moving
+ *  average with time constant cfg.tau, which takes the uneven spacing of
+ *  the readings into account. Every cfg.step the average is sampled onto a
+ *  grid, interpolated between the readings either side, and the rate is
+ *  the Savitzky-Golay first derivative over the last cfg.window points:
+ *  the slope of the least squares line, which for an odd window is the
+ *  same for a fit of degree 1 or 2 at its centre. Only the window is kept,
+ *  so memory is constant, and a reading costs one multiply-add and a
+ *  division; the window is only gone over once per step.
+ *
+ *  An event starts when the rate reaches cfg.rise, or falls to -cfg.fall,
+ *  and ends when it is back under WEATHER_CLEAR of that, so noise around a
+ *  threshold does not chatter. The rate is that of the window, so a change
+ *  is seen some way into it; the window and the thresholds trade that
+ *  delay against false events.
+ *
+ *  A gap in the readings is bridged by the grid points interpolated over
+ *  it. One longer than the window starts the window over. Readings older
+ *  than the last of a channel are dropped.
+ */
+#ifndef _WEATHER_H_
+#define _WEATHER_H_
+
+#include <asm/types.h>
+
+enum {
+  WEATHER_PRESSURE,     // mbar
+  WEATHER_TEMPERATURE,  // deg C
+  WEATHER_HUMIDITY,     // rH
+  WEATHER_CHANNELS
+};
+
+#define WEATHER_ALL        ((1 << WEATHER_CHANNELS) - 1)
+#define WEATHER_MAX_WINDOW 255
+#define WEATHER_CLEAR      0.5f
+
+extern const char *const weather_names[WEATHER_CHANNELS];
+
+enum {
+  WEATHER_RISE,
+  WEATHER_FALL,
+};
+
+struct weather_event {
+  __u64 timestamp;  // of the grid point the rate crossed at
+  int channel;
+  int kind;         // WEATHER_RISE or WEATHER_FALL
+  int start;        // 1 as it starts, 0 as it ends
+  float rate;       // units per hour
+  float value;      // filtered
+};
+
+struct weather_channel_config {
+  __u64 tau;    // ns, time constant of the average
+  __u64 step;   // ns between the points of the window
+  int window;   // points, odd
+  float rise;   // units per hour that start a WEATHER_RISE, 0 for none
+  float fall;   // units per hour down that start a WEATHER_FALL, 0 for none
+};
+
+struct weather_config {
+  struct weather_channel_config ch[WEATHER_CHANNELS];
+};
+
+/* Pressure going 0.5 mbar an hour either way over the last hour, 1.5 mbar
+   over the 3 h a barometric tendency is given for; the temperature falling
+   3 degrees an hour over 10 min, and the humidity rising 20 rH an hour over
+   5 min */
+#define WEATHER_CONFIG_DEFAULT { {                               \
+  { 60000000000ULL, 60000000000ULL, 61, 0.5f, 0.5f },            \
+  { 30000000000ULL, 30000000000ULL, 21, 0.0f, 3.0f },            \
+  { 10000000000ULL, 10000000000ULL, 31, 20.0f, 0.0f } } }
+
+struct weather_stats {
+  unsigned long readings;  // of all channels
+  unsigned long late;      // dropped as older than the last
+  unsigned long points;    // on the grids
+  unsigned long filled;    // of those, interpolated over a gap
+  unsigned long resets;    // windows started over after a longer gap
+  unsigned long events;
+};
+
+/* Where a channel is now */
+struct weather_reading {
+  float value;  // filtered
+  float rate;   // units per hour, once ready
+  int ready;    // the window is full
+  int active;   // the kind of event under way, -1 for none
+};
+
+typedef void (*weather_event_fn)( void *arg, const struct weather_event *ev );
+
+struct weather;
+
+/* cfg may be NULL for the defaults */
+struct weather *weather_new( const struct weather_config *cfg,
+                             weather_event_fn fn, void *arg );
+
+/* Readings at timestamp (ns) of the channels in the mask fresh, e.g.
+   1 << WEATHER_PRESSURE; the others in v are not looked at */
+void weather_add( struct weather *w, __u64 timestamp,
+                  const float v[WEATHER_CHANNELS], int fresh );
+
+/* -1 and ENODATA before the first reading of the channel */
+int weather_reading( struct weather *w, int channel,
+                     struct weather_reading *r );
+
+void weather_stats( struct weather *w, struct weather_stats *stats );
+void weather_free( struct weather *w );
+
+#endif /* _WEATHER_H_ */
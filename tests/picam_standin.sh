@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+#  picam_standin.sh
+#    Plays picam's part in the hooks and state directories, to try
+#    triggerd without a camera
+#
+#  This file is part of Fagelmatare, an embedded project created to learn
+#  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+#  Licensed under the GNU General Public License version 3 or later.
+#
+#  usage: picam_standin.sh [-k hooks dir] [-s state dir] [-d delay]
+#    -k  the hooks directory, /dev/shm/hooks by default
+#    -s  the state directory, /dev/shm/state by default
+#    -d  seconds the camera takes to start recording, 0 by default
+#
+#  As picam does, it acts on start_record and stop_record appearing in
+#  hooks, removes them and writes "true" or "false" to state/record. With
+#  inotifywait from inotify-tools it sees the hooks as they appear, the way
+#  picam does; without it it looks every 10 ms, which then adds up to that
+#  much to the latency triggerd reports.
+#
+#  e.g. in two shells
+#    tests/picam_standin.sh -d 0.2
+#    modules/sensehat/triggerd -t 3 &
+#    kill -TSTP %1
+
+hooks=/dev/shm/hooks
+state=/dev/shm/state
+delay=0
+
+while getopts k:s:d: opt; do
+  case $opt in
+    k) hooks=$OPTARG ;;
+    s) state=$OPTARG ;;
+    d) delay=$OPTARG ;;
+    *) echo "usage: $0 [-k hooks dir] [-s state dir] [-d delay]" >&2
+       exit 1 ;;
+  esac
+done
+
+mkdir -p "$hooks" "$state" || exit 1
+printf false > "$state/record"
+
+hook() {
+  case $1 in
+    start_record)
+      rm -f "$hooks/start_record"
+      sleep "$delay"
+      printf true > "$state/record"
+      echo "start rec" ;;
+    stop_record)
+      rm -f "$hooks/stop_record"
+      printf false > "$state/record"
+      echo "stop rec" ;;
+  esac
+}
+
+if command -v inotifywait > /dev/null; then
+  inotifywait -q -m -e close_write -e moved_to --format %f "$hooks" |
+  while read -r name; do
+    hook "$name"
+  done
+else
+  while sleep 0.01; do
+    for name in start_record stop_record; do
+      [ -e "$hooks/$name" ] && hook $name
+    done
+  done
+fi
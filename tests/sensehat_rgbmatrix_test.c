@@ -1,29 +1,26 @@
+/*
+gcc -g -O -Wall -I../modules/sensehat -o rgbmatrix sensehat_rgbmatrix_test.c \
+    ../modules/sensehat/libsensehat.a -lm
+
+Visualises a quicksort of the palette on the LED matrix. Pass a path as the
+first argument to draw into another framebuffer, e.g. an ordinary file.
+*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <string.h>
 #include <stdint.h>
-#include <math.h>
-#include <poll.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <linux/fb.h>
-#include <linux/input.h>
-
-#define FRAMEBUFFER_PATH "/dev/fb1"
+#include "ledmatrix.h"
+#include "frame_pacer.h"
+
+#define FRAME_RATE 500 // a frame per swap, slow enough to see the sorting
 
 void quicksort( uint8_t *val, size_t len );
-void swap_values( uint8_t *, uint8_t * );
 void shuffle_array( uint8_t * );
 void display_pixels( );
 
 uint8_t val[64];
 
-int pixels[64][3] = {
+uint8_t pixels[64][3] = {
     {255, 0, 0}, {255, 0, 0}, {255, 87, 0}, {255, 196, 0}, {205, 255, 0}, {95, 255, 0}, {0, 255, 13}, {0, 255, 122},
     {255, 0, 0}, {255, 96, 0}, {255, 205, 0}, {196, 255, 0}, {87, 255, 0}, {0, 255, 22}, {0, 255, 131}, {0, 255, 240},
     {255, 105, 0}, {255, 214, 0}, {187, 255, 0}, {78, 255, 0}, {0, 255, 30}, {0, 255, 140}, {0, 255, 248}, {0, 152, 255},
@@ -34,45 +31,31 @@ int pixels[64][3] = {
     {0, 255, 183}, {0, 217, 255}, {0, 109, 255}, {0, 0, 255}, {110, 0, 255}, {218, 0, 255}, {255, 0, 183}, {255, 0, 74}
 };
 
-struct fb_t { uint16_t pixel[8][8]; };
-struct fb_t *fb;
-
-int main(void) {
-  size_t s;
-  int fbfd;
-  struct fb_fix_screeninfo fix_info;
+struct ledmatrix *lm;
+struct led_palette palette;
+struct frame_pacer pacer;
 
-  fbfd = open( FRAMEBUFFER_PATH, O_RDWR );
-  if ( fbfd == -1 ) {
-    perror( "open" );
-    return 1;
-  }
+int main( int argc, char **argv ) {
+  const char *path = argc > 1 ? argv[1] : DEVPATH_FB;
 
-  s = ioctl( fbfd, FBIOGET_FSCREENINFO, &fix_info );
-  if ( s == -1 ) {
-    perror( "FBIOGET_FSCREENINFO" );
+  lm = ledmatrix_open( path );
+  if ( lm == NULL ) {
+    perror( path );
     return 1;
   }
+  led_palette_init( &palette, (const __u8 (*)[3]) pixels, 64 );
+  frame_pacer_init( &pacer, FRAME_RATE );
 
-  fb = mmap( 0, sizeof(struct fb_t),
-             PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0 );
-  close( fbfd );
-  if ( fb == NULL ) {
-    perror( "mmap" );
-    return 1;
-  }
-
-  for (int i = 0; i < 640; i++) {
+  for (int i = 0; i < 64; i++) {
     val[i] = i;
   }
 
   srand(time(NULL));
   shuffle_array( (uint8_t *) val );
-  display_pixels( (uint8_t *) val );
-  usleep( 2000 );
+  display_pixels( );
   quicksort( (uint8_t *) val, 64 );
 
-  munmap( fb, sizeof(struct fb_t) );
+  ledmatrix_close( lm );
   return 0;
 }
 
@@ -99,7 +82,6 @@ void quicksort( uint8_t *val, size_t len ) {
     val[i] = val[j];
     val[j] = t;
     display_pixels( );
-    usleep( 2000 ); // this delay is here to be able to see the sorting
   }
 
   quicksort( val, i );
@@ -107,11 +89,7 @@ void quicksort( uint8_t *val, size_t len ) {
 }
 
 void display_pixels( ) {
-  for (size_t i = 0; i < 64; i++) {
-    uint16_t r = (pixels[val[i]][0] >> 3) & 0x1F;
-    uint16_t g = (pixels[val[i]][1] >> 2) & 0x3F;
-    uint16_t b = (pixels[val[i]][2] >> 3) & 0x1F;
-    uint16_t bits16 = (r << 11) + (g << 5) + b;
-    fb->pixel[i/8][i%8] = bits16;
-  }
+  ledmatrix_draw_indexed( lm, &palette, val );
+  ledmatrix_commit( lm );
+  frame_pacer_wait( &pacer );
 }
@@ -0,0 +1,105 @@
+/*
+gcc -g -O -Wall -I../modules/sensehat -o ship_standin ship_standin.c \
+    ../modules/sensehat/libsensehat.a -lm -lrt -pthread
+
+Stands in for the server shipd sends the archive to, to try it without
+one. The recordings go into the directory given as the first argument.
+  -p port   listen on port, SHIP_PORT by default
+  -k bytes  cut the link after every bytes of file data received, to see
+            shipd take up where it was
+e.g.
+  ./ship_standin -k 3000000 ~/test-videos &
+  ../modules/sensehat/shipd -a ~/picam/archive localhost:5402
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "ship.h"
+
+static int listen_on( const char *port ) {
+  struct addrinfo hints = { .ai_flags = AI_PASSIVE,
+                            .ai_socktype = SOCK_STREAM }, *res;
+  int fd, one = 1;
+
+  if ( getaddrinfo( NULL, port, &hints, &res ) != 0 ) return -1;
+  fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+  if ( fd != -1 ) {
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if ( bind( fd, res->ai_addr, res->ai_addrlen ) == -1 ||
+         listen( fd, 1 ) == -1 ) {
+      close( fd );
+      fd = -1;
+    }
+  }
+  freeaddrinfo( res );
+  return fd;
+}
+
+static void report( struct ship_rx *rx ) {
+  struct ship_rx_stats st;
+
+  ship_rx_stats( rx, &st );
+  printf( "%lu files, %lu resumed, %.1f MB\n", st.files, st.resumed,
+          st.bytes / 1e6 );
+}
+
+int main( int argc, char **argv ) {
+  const char *port = SHIP_PORT;
+  struct ship_rx *rx;
+  struct pollfd pfd;
+  long long cut = 0, got;
+  long n;
+  int opt, lfd, fd;
+
+  while ( (opt = getopt( argc, argv, "p:k:" )) != -1 ) {
+    switch ( opt ) {
+      case 'p': port = optarg; break;
+      case 'k': cut = atoll( optarg ); break;
+      default: optind = argc;
+    }
+  }
+  if ( optind != argc - 1 ) {
+    fprintf( stderr, "usage: %s [-p port] [-k bytes] dir\n", argv[0] );
+    return 1;
+  }
+  // a line per connection, also into a log
+  setvbuf( stdout, NULL, _IOLBF, 0 );
+  lfd = listen_on( port );
+  if ( lfd == -1 ) {
+    perror( port );
+    return 1;
+  }
+
+  // one shipper at a time, the way there is one master
+  while ( (fd = accept( lfd, NULL, NULL )) != -1 ) {
+    rx = ship_rx_new( argv[optind], fd );
+    if ( rx == NULL ) {
+      perror( argv[optind] );
+      return 1;
+    }
+    pfd = (struct pollfd) { fd, POLLIN, 0 };
+    got = 0;
+    while ( poll( &pfd, 1, -1 ) == 1 ) {
+      n = ship_rx_recv( rx );
+      if ( n == -1 ) {
+        if ( errno != ECONNRESET ) perror( "ship_rx_recv" );
+        break;
+      }
+      got += n;
+      if ( cut > 0 && got >= cut ) {
+        printf( "cut after %lld bytes\n", got );
+        break;
+      }
+    }
+    report( rx );
+    ship_rx_free( rx );
+    close( fd );
+  }
+  perror( "accept" );
+  return 1;
+}